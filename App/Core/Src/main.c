@@ -2,6 +2,9 @@
 
 #include "main.h"
 #include "logger.h"
+#include "boot_profile.h"
+#include "image_header.h"
+#include "boot_slot.h"
 #include "FreeRTOS.h"
 #include "task.h"
 
@@ -16,6 +19,25 @@
 #define APP_VER_STRING "Application Version " APP_VERSION " stable release"
 /* Application Version Info end */
 
+#ifdef BL_AB_SLOTS
+#define APP_LOAD_ADDRESS  0x08060000UL      /* A/B slot of the bank mapped at 0x08000000 */
+#else
+#define APP_LOAD_ADDRESS  FLASH_BANK2_BASE
+#endif
+
+/* Image header, Tools/image_stamp fills in the 0xFFFFFFFF fields after the link */
+__attribute__((section(".image_header"), used))
+const imageHeader_t image_header = {
+  .magic          = IMAGE_HEADER_MAGIC,
+  .header_version = IMAGE_HEADER_VERSION,
+  .image_size     = 0xFFFFFFFFU,
+  .load_address   = APP_LOAD_ADDRESS,
+  .image_crc      = 0xFFFFFFFFU,
+  .app_version    = IMAGE_VERSION(Major_VERSION, Minor_VERSION, Patch_VERSION),
+  .reserved       = 0U,
+  .header_crc     = 0xFFFFFFFFU,
+};
+
 UART_HandleTypeDef huart3;
 
 void SystemClock_Config(void);
@@ -42,6 +64,8 @@ void vPortSetupTimerInterrupt( void );
   */
 int main(void)
 {
+  boot_profile_mark(BOOT_MARK_APP_ENTRY);
+
   /* CRITICAL: Set NVIC priority grouping FIRST, before HAL_Init()
    * FreeRTOS requires NVIC_PRIORITYGROUP_4 (4 bits for preemption priority) */
   HAL_NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
@@ -51,6 +75,7 @@ int main(void)
 
   /* Reset of all peripherals, Initializes the Flash interface and the Systick. */
   SystemClock_Config();
+  boot_profile_mark(BOOT_MARK_APP_CLOCK);
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
@@ -73,6 +98,7 @@ int main(void)
 
   LOG_INFO("Starting FreeRTOS scheduler...\r\n");
   LOG_INFO("SystemCoreClock = %lu Hz\r\n", SystemCoreClock);
+  boot_profile_mark(BOOT_MARK_APP_INIT);
 
   // Start the FreeRTOS scheduler (it will reconfigure SysTick)
   vTaskStartScheduler();
@@ -98,6 +124,12 @@ int main(void)
   */
 static void vTaskApplicationMain(void *pvParameters)
 {  
+  boot_profile_mark(BOOT_MARK_APP_TASK);
+  boot_profile_report();
+
+  /* Scheduler and tasks are up: an image on trial after an update keeps its slot */
+  boot_slot_confirm();
+
   /* Simple infinite loop for main task */
   while (1)
   {
@@ -113,6 +145,8 @@ static void vTaskApplicationMain(void *pvParameters)
   */
 static void vTaskGreenBlink(void *pvParameters)
 {
+  boot_profile_mark(BOOT_MARK_APP_TASK); // the first task to run takes it
+
     while (1)
   {
     HAL_GPIO_TogglePin(LED1_GPIO_Port, LED1_Pin);
@@ -127,6 +161,8 @@ static void vTaskGreenBlink(void *pvParameters)
   */
 static void vTaskOrangeBlink(void *pvParameters)
 {
+  boot_profile_mark(BOOT_MARK_APP_TASK); // the first task to run takes it
+
     while (1)
   {
     HAL_GPIO_TogglePin(LED2_GPIO_Port, LED2_Pin);
@@ -140,6 +176,8 @@ static void vTaskOrangeBlink(void *pvParameters)
   * @retval None
   */static void vTaskRedBlink(void *pvParameters)
 {
+  boot_profile_mark(BOOT_MARK_APP_TASK); // the first task to run takes it
+
     while (1)
   {
     HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
@@ -0,0 +1,127 @@
+/**
+  ******************************************************************************
+  * @file    image_stamp.c
+  * @author  Shiddeshwaran-S
+  * @brief   Host tool run after the App link. Fills in the image header the
+  *          App carries at IMAGE_HEADER_OFFSET (size, image CRC, header CRC)
+  *          in the binary, and writes the finished header out on its own so
+  *          the Makefile can put it back into the ELF.
+  *
+  *          usage: image_stamp <app.bin> <header.bin>
+  ******************************************************************************
+  */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_header.h"
+
+#define IMAGE_MAX_SIZE  ( 1024U * 1024U )  // application slot, bank 2
+
+/* zlib CRC32, the one the bootloader's CRC unit computes */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length)
+{
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 1U) ? ((crc >> 1) ^ 0xEDB88320U) : (crc >> 1);
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t value)
+{
+  p[0] = (uint8_t)(value);
+  p[1] = (uint8_t)(value >> 8);
+  p[2] = (uint8_t)(value >> 16);
+  p[3] = (uint8_t)(value >> 24);
+}
+
+static int write_file(const char *path, const uint8_t *data, size_t length)
+{
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "image_stamp: cannot create %s\n", path);
+    return -1;
+  }
+  size_t written = fwrite(data, 1, length, fp);
+  if (fclose(fp) != 0 || written != length) {
+    fprintf(stderr, "image_stamp: cannot write %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <app.bin> <header.bin>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[1], "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "image_stamp: cannot open %s\n", argv[1]);
+    return 1;
+  }
+  uint8_t *image = malloc(IMAGE_MAX_SIZE + 1U);
+  if (image == NULL) {
+    fclose(fp);
+    return 1;
+  }
+  size_t size = fread(image, 1, IMAGE_MAX_SIZE + 1U, fp);
+  fclose(fp);
+
+  if (size > IMAGE_MAX_SIZE) {
+    fprintf(stderr, "image_stamp: %s is larger than %u bytes\n", argv[1], IMAGE_MAX_SIZE);
+    free(image);
+    return 1;
+  }
+  if (size < IMAGE_HEADER_OFFSET + sizeof(imageHeader_t)) {
+    fprintf(stderr, "image_stamp: %s is too short to carry an image header\n", argv[1]);
+    free(image);
+    return 1;
+  }
+
+  uint8_t *header = &image[IMAGE_HEADER_OFFSET];
+  if (get32(&header[offsetof(imageHeader_t, magic)]) != IMAGE_HEADER_MAGIC ||
+      get32(&header[offsetof(imageHeader_t, header_version)]) != IMAGE_HEADER_VERSION) {
+    fprintf(stderr, "image_stamp: no version %u image header at 0x%X in %s\n",
+            IMAGE_HEADER_VERSION, IMAGE_HEADER_OFFSET, argv[1]);
+    free(image);
+    return 1;
+  }
+
+  size_t tail = IMAGE_HEADER_OFFSET + sizeof(imageHeader_t);
+  uint32_t image_crc = crc32_update(0, image, IMAGE_HEADER_OFFSET);
+  image_crc = crc32_update(image_crc, &image[tail], size - tail);
+
+  put32(&header[offsetof(imageHeader_t, image_size)], (uint32_t)size);
+  put32(&header[offsetof(imageHeader_t, image_crc)], image_crc);
+  put32(&header[offsetof(imageHeader_t, header_crc)],
+        crc32_update(0, header, offsetof(imageHeader_t, header_crc)));
+
+  int ret = 0;
+  if (write_file(argv[1], image, size) != 0 ||
+      write_file(argv[2], header, sizeof(imageHeader_t)) != 0) {
+    ret = 1;
+  } else {
+    uint32_t version = get32(&header[offsetof(imageHeader_t, app_version)]);
+    printf("Image header: v%u.%u.%u, %zu bytes at 0x%08X, CRC 0x%08X\n",
+           (unsigned)(version >> 16), (unsigned)((version >> 8) & 0xFFU), (unsigned)(version & 0xFFU),
+           size, (unsigned)get32(&header[offsetof(imageHeader_t, load_address)]), (unsigned)image_crc);
+  }
+
+  free(image);
+  return ret;
+}
@@ -13,10 +13,46 @@ typedef enum {
 } CFG_SAVE_STATUS_;
 
 #define VALID_CONF_MARKER 0xDEADBEEF
+#define CONFIG_FP_SPAN    ( 1024U )  // image bytes the fingerprint covers at each end (vector table, tail)
 
+/*
+ * The config sector is an append-only log of records, each a header and the
+ * ETX_CONFIG_ after it, padded to whole flash words. The last record that
+ * checks out wins; the sector is erased only when no record fits any more.
+ */
+#define CONFIG_RECORD_MAGIC 0xC0F1C0DEU
+
+/*
+ * Boot counters, kept in the record header rather than in ETX_CONFIG_: the
+ * config keeps the layout it had at the sector start before the log
+ */
+typedef struct {
+  uint32_t verify_boots;  // boots since the last full application CRC
+  uint32_t trial_boots;   // A/B slots: boots of the slot on trial
+} CONFIG_COUNTERS_;
+
+typedef struct {
+  uint32_t magic;     // CONFIG_RECORD_MAGIC
+  uint32_t sequence;  // one up per record, carried over a compaction
+  uint32_t length;    // sizeof(ETX_CONFIG_), a layout change starts a fresh log
+  CONFIG_COUNTERS_ counters; // carried over by records that only change the config
+  uint32_t crc;       // CRC32 of sequence, length, counters and the config that follows
+} CONFIG_RECORD_;
+
+#define CONFIG_RECORD_SIZE  ((sizeof(CONFIG_RECORD_) + sizeof(ETX_CONFIG_) + 31U) & ~31U) // whole flash words
+#define CONFIG_LOG_SLOTS    (CONFIG_SIZE / CONFIG_RECORD_SIZE)
+
+bool config_log_read(uint32_t base, ETX_CONFIG_ *etx_config);
+CFG_SAVE_STATUS_ config_log_append(uint32_t base, ETX_CONFIG_ *etx_config);
 void config_get(ETX_CONFIG_ *etx_config);
+void config_get_counters(CONFIG_COUNTERS_ *counters);
+CFG_SAVE_STATUS_ config_save_counters(ETX_CONFIG_ *etx_config, const CONFIG_COUNTERS_ *counters);
 void config_load_defaults(ETX_CONFIG_ *etx_config);
 CFG_SAVE_STATUS_ config_save(ETX_CONFIG_ *etx_config);
+uint32_t config_app_fingerprint(const ETX_CONFIG_ *etx_config);
+bool config_is_app_fingerprint_ok(const ETX_CONFIG_ *etx_config);
+CFG_SAVE_STATUS_ config_revoke_app_fingerprint(void);
+CFG_SAVE_STATUS_ config_store_app_fingerprint(ETX_CONFIG_ *etx_config);
 
 #ifdef __cplusplus
 }
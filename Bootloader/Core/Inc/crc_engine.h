@@ -0,0 +1,49 @@
+#ifndef __CRC_ENGINE_H
+#define __CRC_ENGINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "stm32h7xx_hal.h"
+
+#define CRC_ENGINE_MDMA_BLOCK   ( 65536U )  // largest MDMA block, bytes
+#define CRC_ENGINE_BENCH_ADDR   ( FLASH_BANK1_BASE ) // bench reads bank 1, always programmed
+#define CRC_ENGINE_BENCH_LEN    ( 1024U * 1024U )
+
+/*
+ * CRC32 engine (zlib CRC32, the one compute_crc32() has always produced)
+ *
+ * start() kicks the calculation off, finish() waits for it and returns the
+ * result; a synchronous engine does all the work in start(). crc is the
+ * CRC32 of the data before this part, 0 for none, so parts chain like
+ * accumulate_crc32(). The hardware engines share the CRC unit, one
+ * calculation at a time.
+ */
+typedef struct
+{
+  const char  *name;
+  void        (*start)(CRC_HandleTypeDef *hcrc, uint32_t crc, const uint8_t *data, size_t length);
+  uint32_t    (*finish)(CRC_HandleTypeDef *hcrc);
+}CRC_ENGINE_;
+
+extern const CRC_ENGINE_ crc_engine_hw_byte;   // CRC unit fed through the HAL, byte input format
+extern const CRC_ENGINE_ crc_engine_hw_word;   // CRC unit fed one 32-bit word per write
+extern const CRC_ENGINE_ crc_engine_hw_mdma;   // CRC unit fed by the MDMA, CPU free until finish()
+extern const CRC_ENGINE_ crc_engine_sw_slice8; // slice-by-8 tables in DTCM
+
+extern const CRC_ENGINE_ *crc_engine_default;
+
+void crc_engine_init(void);
+uint32_t crc_engine_run(const CRC_ENGINE_ *engine, CRC_HandleTypeDef *hcrc, uint32_t crc, const void *data, size_t length);
+void crc_engine_bench(CRC_HandleTypeDef *hcrc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CRC_ENGINE_H */
@@ -18,7 +18,10 @@ typedef enum {
 } crc_status_t;
 
 uint32_t compute_crc32(CRC_HandleTypeDef* hcrc, uint32_t* data, size_t length);
+uint32_t accumulate_crc32(CRC_HandleTypeDef* hcrc, uint32_t crc, uint32_t* data, size_t length);
 crc_status_t verify_crc32(CRC_HandleTypeDef* hcrc, uint32_t* data, size_t length, uint32_t expected_crc);
+uint32_t combine_crc32(uint32_t crc1, uint32_t crc2, size_t length2);
+uint32_t tree_root_crc32(const uint32_t* leaves, size_t leaf_size, size_t length);
 
 #ifdef __cplusplus
 }
@@ -14,8 +14,33 @@ extern "C" {
 
 #define ETX_FRAME_DATA_MAX_SIZE ( 10240 )  //Maximum data Size
 #define ETX_FRAME_DATA_OVERHEAD (     9 )  //data overhead
+#define ETX_SUBBLOCK_SIZE       (  1024 )  // sub-block covered by its own CRC (DATA_SB frames)
+#define ETX_SUBBLOCK_MAX        ( ETX_FRAME_DATA_MAX_SIZE / ETX_SUBBLOCK_SIZE ) // sub-blocks per frame
+#define ETX_REPAIR_HDR_SIZE     (     8 )  // REPAIR frame: fragment index + bitmap
+#define ETX_FRAME_PAYLOAD_MAX_SIZE ( ETX_FRAME_DATA_MAX_SIZE + (ETX_SUBBLOCK_MAX * 4) + ETX_REPAIR_HDR_SIZE ) // largest payload on the wire
 #define ETX_FRAME_PACKET_MAX_SIZE sizeof(ETX_DL_FRAME_) // Maximum packet size
 #define ETX_RSPF_PACKET_SIZE sizeof(ETX_DL_RSPF_) // Maximum packet size
+#define ETX_STATUS_PAYLOAD_SIZE ( 5 )  // STATUS frame: N/ACK + fragment index
+#define ETX_STATUS_BITMAP_PAYLOAD_SIZE ( 9 ) // STATUS frame with bad sub-block bitmap
+#define ETX_STATUS_INDEX_FATAL  ( 0xFFFFFFFFU ) // STATUS index: download aborted
+#define ETX_READ_CMD_SIZE       ( 9 )  // READ command: cmd + address + length
+#define ETX_READ_HDR_SIZE       ( 4 )  // READ_DATA frame: offset ahead of the data
+#define ETX_READ_CHUNK_SIZE     ( ETX_FRAME_DATA_MAX_SIZE ) // flash bytes per READ_DATA frame
+#define ETX_STREAM_IDLE_MS      ( 20U ) // line quiet this long ends a drain
+#define ETX_DATA_AT_HDR_SIZE    ( 4 )  // DATA_AT frame: image offset ahead of the data
+#define ETX_ERASE_CMD_SIZE      ( 9 )  // ERASE command: cmd + image offset + length
+#define ETX_DL_CHANNEL_COUNT    ( 2 )  // USART2, USART3 joins it while striping
+#define ETX_DL_MAX_FRAGMENTS    ( (APPLICATION_MAX_SIZE + ETX_FRAME_DATA_MAX_SIZE - 1) / ETX_FRAME_DATA_MAX_SIZE )
+#define ETX_MISSING_BITMAP_SIZE ( (ETX_DL_MAX_FRAGMENTS + 7) / 8 ) // MISSING frame: one bit per fragment
+#define ETX_MISSING_HDR_SIZE    ( 3 )  // MISSING frame: node + fragment count ahead of the bitmap
+#define ETX_BCAST_IDLE_MS       ( 5U ) // broadcast: bus quiet this long ends a drain
+#define ETX_RX_RING_SIZE        ( 32768U ) // USART2 DMA receive ring, power of two (3 full frames)
+#define ETX_RX_RING_HEADROOM    ( (ETX_RX_RING_SIZE / 2U) + 64U ) // free space below this pauses the DMA
+#define ETX_RX_STALL_MS         ( 250U ) // partial frame, line quiet this long: false SOF, hunt on
+#define ETX_STAGE_D1_SIZE       ( 3U * FLASH_SECTOR_SIZE ) // staging in AXI SRAM (RAM_D1), whole sectors
+#define ETX_STAGE_D2_SIZE       ( 2U * FLASH_SECTOR_SIZE ) // staging in D2 SRAM1 + SRAM2
+#define ETX_STAGE_SIZE          ( ETX_STAGE_D1_SIZE + ETX_STAGE_D2_SIZE ) // one chunk: whole sectors, whole fragments
+#define ETX_ERASE_LEAD          ( 2 * ETX_FRAME_DATA_MAX_SIZE ) // writes this close to a sector start its erase
 
 /*
  * ETX DL exit codes
@@ -35,6 +60,7 @@ typedef enum
   ETX_DL_FRAME_EX_OK       = 0,    // Success
   ETX_DL_FRAME_EX_ERR      = 1,    // Failure
   ETX_DL_FRAME_EX_NO_DATA  = 2,    // No Data
+  ETX_DL_FRAME_EX_BAD_CRC  = 3,    // Frame complete, CRC mismatch
 }ETX_DL_FRAME_EX_;
 
 /*
@@ -59,6 +85,14 @@ typedef enum
   ETX_DL_FRAME_TYPE_HEADER    = 0x02,
   ETX_DL_FRAME_TYPE_DATA      = 0x03,
   ETX_DL_FRAME_TYPE_RESPONSE  = 0x04,
+  ETX_DL_FRAME_TYPE_STATUS    = 0x05,   // streaming: async error / final summary
+  ETX_DL_FRAME_TYPE_DATA_SB   = 0x06,   // sub-block CRC table + data
+  ETX_DL_FRAME_TYPE_REPAIR    = 0x07,   // resent sub-blocks of one fragment
+  ETX_DL_FRAME_TYPE_READ_DATA = 0x08,   // read-back chunk, bootloader to host
+  ETX_DL_FRAME_TYPE_DATA_AT   = 0x09,   // data frame carrying its image offset (striping, broadcast, random access)
+  ETX_DL_FRAME_TYPE_POLL      = 0x0A,   // broadcast: host asks one node what it is missing
+  ETX_DL_FRAME_TYPE_MISSING   = 0x0B,   // broadcast: node's missing fragment bitmap
+  ETX_DL_FRAME_TYPE_PROBE     = 0x0C,   // link test, ACKed in IDLE and thrown away
 }ETX_DL_FRAME_TYPE_;
 
 /**
@@ -69,6 +103,15 @@ typedef enum
   ETX_DL_CMD_START      = 0x01,
   ETX_DL_CMD_ABORT      = 0x02,
   ETX_DL_CMD_END        = 0x03,
+  ETX_DL_CMD_START_STREAM = 0x04,   // START, data frames streamed without ACKs
+  ETX_DL_CMD_READ       = 0x05,     // stream a flash range back to the host
+  ETX_DL_CMD_START_STRIPED = 0x06,  // START, DATA_AT frames spread over USART2 + USART3
+  ETX_DL_CMD_START_BROADCAST = 0x07, // START on a shared bus, nothing is ACKed
+  ETX_DL_CMD_SET_NODE   = 0x08,     // store the RS-485 bus address
+  ETX_DL_CMD_START_RANDOM = 0x09,   // START, DATA_AT frames anywhere, the host erases and commits
+  ETX_DL_CMD_ERASE      = 0x0A,     // random access: erase the sectors of an image range
+  ETX_DL_CMD_COMMIT     = 0x0B,     // random access: check the image in flash, ends the download
+  ETX_DL_CMD_START_STAGED = 0x0C,   // START_STREAM, data staged in RAM and flashed once its CRCs check out
 }ETX_DL_CMD_;
 
 /**
@@ -87,13 +130,27 @@ typedef enum
  * | SOF | Type   | Len | LOAD | CRC | EOF |
  * |_____|________|_____|______|_____|_____|
  *   1B      1B     2B   nBytes   4B    1B
+ *
+ * HEADER payload:   | size (4B, big endian) | CRC32 (4B, big endian) | [ staged: CRC32 of each flash sector (4B each) ] |
+ * DATA_SB payload:  | CRC32 of each 1K sub-block (4B each) | data |
+ * REPAIR payload:   | fragment (4B) | bitmap (4B) | { CRC32 (4B) | sub-block } per set bit |
+ * STATUS payload:   | N/ACK (1B) | fragment (4B) | [ bad sub-block bitmap (4B) ] |
+ * READ cmd payload: | READ (1B) | address (4B) | length (4B) |
+ * READ_DATA payload:| offset from address (4B) | data |
+ * DATA_AT payload:  | offset in the image (4B) | data |
+ * ERASE cmd payload:| ERASE (1B) | offset in the image (4B) | length (4B) |
+ * SET_NODE payload: | SET_NODE (1B) | address (1B) |
+ * POLL payload:     | node (1B) |
+ * MISSING payload:  | node (1B) | fragments (2B) | bitmap, bit set = missing (1B per 8 fragments) |
+ * PROBE payload:    | any data, up to ETX_FRAME_DATA_MAX_SIZE |
+ * (multi-byte fields little endian)
  */
 typedef struct
 {
   uint8_t   sof;                                      // Start of Frame (ETX_FRAME_SOF)
   uint8_t   packet_type;                              // Packet Type (ETX_DL_FRAME_TYPE_)
   uint16_t  payload_len;                              // Length of the payload
-  uint8_t   payload[ETX_FRAME_DATA_MAX_SIZE];         // Payload data
+  uint8_t   payload[ETX_FRAME_PAYLOAD_MAX_SIZE];      // Payload data
   uint32_t  crc;                                      // CRC32 of the payload
   uint8_t   eof;                                      // End of Frame (ETX_FRAME_EOF)
 }__attribute__((packed)) ETX_DL_FRAME_;
@@ -114,6 +171,46 @@ typedef struct
   uint8_t   eof;                      // End of Frame (ETX_FRAME_EOF)
 }__attribute__((packed)) ETX_DL_RSPF_;
 
+/*
+ * Lane receive state (striping, interrupt driven)
+ */
+typedef enum
+{
+  ETX_LANE_RX_IDLE      = 0,    // not receiving
+  ETX_LANE_RX_HEADER    = 1,    // SOF, type, len
+  ETX_LANE_RX_PAYLOAD   = 2,    // payload
+  ETX_LANE_RX_TRAILER   = 3,    // CRC, EOF
+  ETX_LANE_RX_READY     = 4,    // frame complete, main loop takes it
+  ETX_LANE_RX_ERROR     = 5,    // bad header, UART error or line stalled
+}ETX_LANE_RX_;
+
+/*
+ * Download channel: one UART and the frame buffers that belong to it
+ */
+typedef struct
+{
+  UART_HandleTypeDef      *huart;                                 // UART of this channel
+  uint8_t                 rx_buffer[ETX_FRAME_PACKET_MAX_SIZE];   // Rx Buffer
+  uint8_t                 rsp_buffer[ETX_RSPF_PACKET_SIZE];       // Response Buffer
+  uint8_t                 nack_sent_count;                        // NACKs sent in a row
+  volatile ETX_LANE_RX_   rx_state;                               // striping: receive progress
+}ETX_DL_CHANNEL_;
+
+/*
+ * USART2 receive ring: circular DMA writes, the frame parser reads.
+ * head and tail are running byte counts, the ring index is count % size.
+ */
+typedef struct
+{
+  uint8_t                 buf[ETX_RX_RING_SIZE];                  // DMA target
+  volatile uint32_t       head;                                   // bytes written by the DMA
+  volatile uint32_t       pos;                                    // DMA write index at the last update
+  volatile uint32_t       tail;                                   // bytes taken by the parser
+  volatile uint32_t       dropped;                                // bytes lost to a restart after an error
+  volatile bool           paused;                                 // DMA request off, RTS holds the host
+  volatile bool           running;                                // reception started
+}ETX_RX_RING_;
+
 ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config);
 
 #ifdef __cplusplus
@@ -7,9 +7,28 @@ extern "C" {
 #include "main.h"
 
 #define HAL_FLASH_OP_TIMEOUT 1000U /* 1 s */
+#define HAL_FLASH_ERASE_TIMEOUT 5000U /* 5 s, one 128 KB sector worst case */
+#define FLASH_WORD_SIZE   ( FLASH_NB_32BITWORD_IN_FLASHWORD * 4U ) // 256-bit flash word
+
+/*
+ * Background (interrupt driven) erase progress
+ */
+typedef enum {
+    FLASH_ERASE_IDLE = 0,     // nothing in flight, the last erase (if any) succeeded
+    FLASH_ERASE_BUSY = 1,     // sectors still being erased
+    FLASH_ERASE_FAILED = 2,   // the last erase stopped on an error
+} FLASH_ERASE_STATE_;
 
 HAL_StatusTypeDef erase_flash(uint32_t bank, uint32_t sector, uint32_t num_sectors);
 HAL_StatusTypeDef write_flash(uint32_t address, uint32_t *data, uint32_t length, uint32_t bank);
+HAL_StatusTypeDef erase_flash_start(uint32_t bank, uint32_t sector, uint32_t num_sectors);
+FLASH_ERASE_STATE_ erase_flash_state(void);
+HAL_StatusTypeDef erase_flash_wait(uint32_t timeout);
+bool is_flash_blank(uint32_t address, uint32_t length);
+HAL_StatusTypeDef flash_session_begin(void);
+HAL_StatusTypeDef flash_session_write(uint32_t address, const void *data, uint32_t length);
+HAL_StatusTypeDef flash_session_flush(void);
+HAL_StatusTypeDef flash_session_end(void);
 
 #ifdef __cplusplus
 }
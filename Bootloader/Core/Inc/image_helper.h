@@ -0,0 +1,33 @@
+#ifndef __IMAGE_HELPER_H
+#define __IMAGE_HELPER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "stm32h7xx_hal.h"
+#include "image_header.h"
+
+typedef enum {
+    IMAGE_OK = 0,
+    IMAGE_ERROR_MAGIC = -1,       // no image header (or an unknown format)
+    IMAGE_ERROR_HEADER_CRC = -2,
+    IMAGE_ERROR_ADDRESS = -3,     // built for another load address
+    IMAGE_ERROR_SIZE = -4,
+    IMAGE_ERROR_VECTORS = -5,     // initial SP / reset handler can not be right
+    IMAGE_ERROR_CRC = -6
+} image_status_t;
+
+image_status_t image_check_header(CRC_HandleTypeDef* hcrc, const uint8_t* image, uint32_t size, imageHeader_t* header);
+image_status_t image_check_vectors(const uint8_t* image, uint32_t size);
+image_status_t image_verify_crc(CRC_HandleTypeDef* hcrc, const uint8_t* image, const imageHeader_t* header);
+const char* image_status_str(image_status_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __IMAGE_HELPER_H */
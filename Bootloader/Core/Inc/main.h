@@ -9,15 +9,54 @@ extern "C" {
 #include <string.h>
 #include <stdbool.h>
 
+#include "image_header.h"
+
 void Error_Handler(void);
 
 #define HAL_DL_UART_RX_TIMEOUT 10000U /* 10 s */
 #define HAL_DL_UART_RX_MAX_TIMEOUT 100000U /* 100 s */
 
+/* Boot break-in: the host sends the magic within this window after reset to enter Download mode */
+#ifndef BL_BREAKIN_MS
+#define BL_BREAKIN_MS          30U  /* ms, make BREAKIN_MS=<ms> to change, 0 turns it off */
+#endif
+#define BL_BREAKIN_MAGIC       "ETX-DL!"
+
+/* Verified-image cache: the full application CRC runs on every Nth boot only, power cycles included */
+#ifndef BL_VERIFY_INTERVAL
+#define BL_VERIFY_INTERVAL     64U  /* boots, make VERIFY_INTERVAL=<n> to change, 0 = full CRC every boot */
+#endif
+#define BL_VERIFY_SAVE_STEP    16U  /* boots after a reset counted in RAM before the count goes to the config */
+
+/* A/B slots: a trial image gets this many boots (power cycles included) to confirm itself before the bootloader rolls back */
+#ifndef BL_TRIAL_BOOTS
+#define BL_TRIAL_BOOTS         3U   /* boots, make TRIAL_BOOTS=<n> to change */
+#endif
+
 /* Flash memory addresses */
+#ifdef BL_AB_SLOTS
+/*
+ * A/B slots (make AB_SLOTS=1): both banks hold a bootloader (sectors 0-1), a
+ * config (sector 2) and an application slot (sectors 3-7). The bank swap
+ * option picks the bank mapped at 0x08000000, its slot runs; a download goes
+ * to the slot of the other bank and flipping the swap activates it.
+ */
+#define APPLICATION_ADDRESS    0x08060000UL
+#define APPLICATION_MAX_SIZE   (640 * 1024)   // 640 KB
+#define APPLICATION_BANK       FLASH_BANK_1
+#define DOWNLOAD_ADDRESS       (APPLICATION_ADDRESS + FLASH_BANK_SIZE) // inactive slot
+#define DOWNLOAD_FIRST_SECTOR  FLASH_SECTOR_3
+#define BOOTLOADER_SIZE        (256 * 1024)   // sectors 0-1, kept the same in both banks
+#define SLOT_CONFIG_ADDR       (CONFIG_FLASH_ADDR + FLASH_BANK_SIZE)   // config of the inactive slot
+#else
 #define APPLICATION_ADDRESS    0x08100000UL
 #define APPLICATION_MAX_SIZE    (1024 * 1024)  // 1024 KB
-#define APPLICATION_CRC_ADDRESS (APPLICATION_ADDRESS + APPLICATION_MAX_SIZE - 4)
+#define APPLICATION_BANK       FLASH_BANK_2
+#define DOWNLOAD_ADDRESS       APPLICATION_ADDRESS // a download replaces the application
+#define DOWNLOAD_FIRST_SECTOR  FLASH_SECTOR_0
+#endif
+#define APPLICATION_HEADER_ADDRESS (APPLICATION_ADDRESS + IMAGE_HEADER_OFFSET) // image_header.h
+#define APPLICATION_SECTORS    (APPLICATION_MAX_SIZE / FLASH_SECTOR_SIZE) // hash tree leaves, one per 128 KB sector
 #define CONFIG_FLASH_ADDR      0x08040000UL
 #define CONFIG_SIZE            (0x20000) // 128KB: 0x08040000 - 0x0805FFFF
 
@@ -29,6 +68,15 @@ void Error_Handler(void);
 #define ETX_DL_REQUEST            ( 0xDEADBEEF )      // Download request go to Download mode
 #define ETX_APP_FAILED            ( 0xBAADF00D )      // Application failed switch slot if available and boot or go to Download mode
 
+/*
+ * A/B slot state
+ */
+#define ETX_SLOT_CONFIRMED        ( 0x600DB007 )      // the application confirmed the image
+#define ETX_SLOT_TRIAL            ( 0x7E57B007 )      // just activated, rolled back unless confirmed within BL_TRIAL_BOOTS
+
+#define ETX_NODE_NONE             ( 0x00 )            // not on a multi-drop bus
+#define ETX_NODE_MAX              ( 0xFE )            // highest bus address
+
 /*
  * Configuration information
  */
@@ -37,9 +85,14 @@ typedef struct
   uint32_t           reboot_reason;               // Reboot reason
   bool               is_app_bootable;             // Is application bootable
   bool               is_app_flashed;              // Is application flashed
-  uint32_t           reserved[10];                // Reserved for future use
-  uint32_t           app_crc;                     // Application CRC
+  uint32_t           node_address;                // RS-485 bus address, ETX_NODE_NONE if point to point
+  uint32_t           app_fingerprint;             // Fingerprint of the last fully verified image, 0 if none
+  uint32_t           app_sector_crc[APPLICATION_SECTORS]; // CRC32 of each sector of the image, 0 past its end (tree leaves)
+  uint32_t           app_crc;                     // Application CRC, the tree root: tree_root_crc32(app_sector_crc)
   uint32_t           app_size;                     // Application Size
+#ifdef BL_AB_SLOTS
+  uint32_t           slot_state;                  // ETX_SLOT_CONFIRMED / ETX_SLOT_TRIAL
+#endif
   uint32_t           config_valid_marker;         // Configuration valid marker always 0xDEADBEEF
   uint32_t           config_crc;                  // Configuration CRC
 }__attribute__((packed)) ETX_CONFIG_;
@@ -47,6 +100,8 @@ typedef struct
 extern CRC_HandleTypeDef hcrc;
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef huart3;
+extern DMA_HandleTypeDef hdma_usart2_rx;     // USART2 receive ring (download)
+extern volatile bool logger_muted;          // USART3 lent to a striped download
 
 // user button 
 #define OTA_BTN_Pin GPIO_PIN_13
@@ -65,6 +120,10 @@ extern UART_HandleTypeDef huart3;
 #define USART2_TX_GPIO_Port GPIOA
 #define USART2_RX_Pin GPIO_PIN_3
 #define USART2_RX_GPIO_Port GPIOA
+#define USART2_CTS_Pin GPIO_PIN_3
+#define USART2_CTS_GPIO_Port GPIOD
+#define USART2_RTS_Pin GPIO_PIN_4
+#define USART2_RTS_GPIO_Port GPIOD
 
 // USART3 for logging
 #define USART3_TX_Pin GPIO_PIN_8
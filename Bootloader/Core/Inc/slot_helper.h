@@ -0,0 +1,27 @@
+#ifndef __SLOT_HELPER_H
+#define __SLOT_HELPER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "main.h"
+#include "conf_helper.h"
+
+#ifdef BL_AB_SLOTS
+
+char slot_active_name(void);
+CFG_SAVE_STATUS_ slot_invalidate_inactive(void);
+CFG_SAVE_STATUS_ slot_store_inactive(const ETX_CONFIG_ *active, uint32_t size, uint32_t crc, const uint32_t *sector_crc);
+bool slot_is_inactive_bootable(void);
+void slot_trial_update(ETX_CONFIG_ *config);
+void slot_rollback(ETX_CONFIG_ *config);
+HAL_StatusTypeDef slot_switch(void);
+
+#endif /* BL_AB_SLOTS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SLOT_HELPER_H */
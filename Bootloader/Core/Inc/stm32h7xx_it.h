@@ -14,6 +14,11 @@ void SVC_Handler(void);
 void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
+void USART2_IRQHandler(void);
+void USART3_IRQHandler(void);
+void FLASH_IRQHandler(void);
+void EXTI15_10_IRQHandler(void);
+void DMA1_Stream0_IRQHandler(void);
 
 #ifdef __cplusplus
 }
@@ -3,6 +3,151 @@
 #include "conf_helper.h"
 #include "flash_editor.h"
 
+/**
+ * @brief  CRC of a config record: sequence, length, counters and the config
+ * @param  record: record header
+ * @param  config: the config that goes with it
+ * @retval CRC32
+ */
+static uint32_t config_record_crc(const CONFIG_RECORD_ *record, const void *config)
+{
+  uint32_t crc = compute_crc32(&hcrc, (uint32_t *)&record->sequence,
+                               (2U * sizeof(uint32_t)) + sizeof(CONFIG_COUNTERS_));
+
+  return accumulate_crc32(&hcrc, crc, (uint32_t *)config, sizeof(ETX_CONFIG_));
+}
+
+/**
+ * @brief  First blank record slot of a config log. Records are only ever
+ *         appended, so the used slots come first and a binary search does.
+ * @param  base: start of the config sector
+ * @retval slot index, CONFIG_LOG_SLOTS if the log is full
+ */
+static uint32_t config_log_free_slot(uint32_t base)
+{
+  uint32_t first = 0;
+  uint32_t last = CONFIG_LOG_SLOTS;
+
+  while (first < last) {
+    uint32_t mid = (first + last) / 2U;
+
+    if (is_flash_blank(base + (mid * CONFIG_RECORD_SIZE), CONFIG_RECORD_SIZE)) {
+      last = mid;
+    } else {
+      first = mid + 1U;
+    }
+  }
+
+  return first;
+}
+
+/**
+ * @brief  Latest valid record of a config log. A record cut short by a
+ *         reset fails its CRC, the one before it counts then.
+ * @param  base: start of the config sector
+ * @param  free_slot: config_log_free_slot(base)
+ * @retval record, NULL if there is none
+ */
+static const CONFIG_RECORD_ *config_log_latest(uint32_t base, uint32_t free_slot)
+{
+  for (uint32_t slot = free_slot; slot > 0U; slot--) {
+    const CONFIG_RECORD_ *record = (const CONFIG_RECORD_ *)(base + ((slot - 1U) * CONFIG_RECORD_SIZE));
+
+    if (record->magic == CONFIG_RECORD_MAGIC && record->length == sizeof(ETX_CONFIG_) &&
+        record->crc == config_record_crc(record, record + 1)) {
+      return record;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief  Read the latest config of a config log
+ * @param  base: start of the config sector
+ * @param  ETX_CONFIG_ *etx_config: Pointer to the configuration structure
+ * @retval true if a record was found; if not, the config is copied from the
+ *         sector start as it was stored before the log (or blank), for
+ *         validate_config() to judge
+ */
+bool config_log_read(uint32_t base, ETX_CONFIG_ *etx_config)
+{
+  const CONFIG_RECORD_ *record = config_log_latest(base, config_log_free_slot(base));
+
+  if (record == NULL) {
+    memcpy(etx_config, (void *)base, sizeof(ETX_CONFIG_));
+    return false;
+  }
+
+  memcpy(etx_config, record + 1, sizeof(ETX_CONFIG_));
+  return true;
+}
+
+/**
+ * @brief  Append a record to a config log: a few flash words, no erase
+ *         unless the sector is full. Nothing is written if the latest
+ *         record holds the same config and counters.
+ * @param  base: start of the config sector (sector 2 of either bank)
+ * @param  ETX_CONFIG_ *etx_config: config to store, its config_crc is set
+ * @param  counters: boot counters to store, NULL keeps those of the latest record
+ * @retval CFG_SAVE_STATUS_: Status of the save operation
+ */
+static CFG_SAVE_STATUS_ config_log_write(uint32_t base, ETX_CONFIG_ *etx_config, const CONFIG_COUNTERS_ *counters)
+{
+  uint32_t buffer[CONFIG_RECORD_SIZE / 4U];
+  CONFIG_RECORD_ *record = (CONFIG_RECORD_ *)buffer;
+  uint32_t bank = (base < FLASH_BANK2_BASE) ? FLASH_BANK_1 : FLASH_BANK_2;
+  uint32_t sector = (base - ((bank == FLASH_BANK_1) ? FLASH_BANK1_BASE : FLASH_BANK2_BASE)) / FLASH_SECTOR_SIZE;
+  uint32_t free_slot = config_log_free_slot(base);
+  const CONFIG_RECORD_ *latest = config_log_latest(base, free_slot);
+  CONFIG_COUNTERS_ kept = {0};
+
+  if (counters == NULL) {
+    counters = (latest != NULL) ? &latest->counters : &kept;
+  }
+  etx_config->config_crc = compute_crc32(&hcrc, (uint32_t *)etx_config, sizeof(ETX_CONFIG_) - 4);
+  if (latest != NULL && memcmp(latest + 1, etx_config, sizeof(ETX_CONFIG_)) == 0 &&
+      memcmp(&latest->counters, counters, sizeof(CONFIG_COUNTERS_)) == 0) {
+    return CFG_SAVE_OK; // unchanged
+  }
+
+  memset(buffer, 0xFF, sizeof(buffer)); // padding stays erased
+  record->magic = CONFIG_RECORD_MAGIC;
+  record->sequence = (latest != NULL) ? latest->sequence + 1U : 0U;
+  record->length = sizeof(ETX_CONFIG_);
+  record->counters = *counters;
+  memcpy(record + 1, etx_config, sizeof(ETX_CONFIG_));
+  record->crc = config_record_crc(record, record + 1);
+
+  if (free_slot == CONFIG_LOG_SLOTS) {
+    // compaction: the record about to be written is all the log needs to keep
+    LOG_INFO("Config log full, compacting...\r\n");
+    if (erase_flash(bank, sector, 1) != HAL_OK) {
+      LOG_ERROR("Failed to erase flash sector\r\n");
+      return CFG_SAVE_ERR;
+    }
+    free_slot = 0;
+  }
+
+  if (write_flash(base + (free_slot * CONFIG_RECORD_SIZE), buffer, CONFIG_RECORD_SIZE, bank) != HAL_OK) {
+    LOG_ERROR("Failed to write Config...\r\n");
+    return CFG_SAVE_ERR;
+  }
+
+  return CFG_SAVE_OK;
+}
+
+/**
+ * @brief  Append a config to a config log, the boot counters carry over
+ * @param  base: start of the config sector (sector 2 of either bank)
+ * @param  ETX_CONFIG_ *etx_config: config to store, its config_crc is set
+ * @retval CFG_SAVE_STATUS_: Status of the save operation
+ */
+CFG_SAVE_STATUS_ config_log_append(uint32_t base, ETX_CONFIG_ *etx_config)
+{
+  return config_log_write(base, etx_config, NULL);
+}
+
 /**
  * @brief  Loads configuration from flash
  * @param  ETX_CONFIG_ *etx_config: Pointer to the configuration structure
@@ -10,8 +155,34 @@
  */
 void config_get(ETX_CONFIG_ *etx_config)
 {
-  // copy flash content to etx_config
-  memcpy(etx_config, (void *)CONFIG_FLASH_ADDR, sizeof(ETX_CONFIG_));
+  (void)config_log_read(CONFIG_FLASH_ADDR, etx_config);
+}
+
+/**
+ * @brief  Boot counters of the latest config record
+ * @param  counters: filled in, all 0 if there is no record yet
+ * @retval None
+ */
+void config_get_counters(CONFIG_COUNTERS_ *counters)
+{
+  const CONFIG_RECORD_ *record = config_log_latest(CONFIG_FLASH_ADDR, config_log_free_slot(CONFIG_FLASH_ADDR));
+
+  if (record == NULL) {
+    memset(counters, 0, sizeof(CONFIG_COUNTERS_));
+  } else {
+    *counters = record->counters;
+  }
+}
+
+/**
+ * @brief  Save new boot counters, with the config as it is now
+ * @param  ETX_CONFIG_ *etx_config: Pointer to the configuration structure
+ * @param  counters: boot counters to store
+ * @retval CFG_SAVE_STATUS_: Status of the save operation
+ */
+CFG_SAVE_STATUS_ config_save_counters(ETX_CONFIG_ *etx_config, const CONFIG_COUNTERS_ *counters)
+{
+  return config_log_write(CONFIG_FLASH_ADDR, etx_config, counters);
 }
 
 /**
@@ -32,10 +203,17 @@ void config_load_defaults(ETX_CONFIG_ *etx_config)
 
   etx_config->app_crc = 0; // Application CRC set to 0
   etx_config->app_size = 0; // Application Size set to 0
+  etx_config->app_fingerprint = 0; // nothing verified yet
+
+  etx_config->node_address = ETX_NODE_NONE; // point to point until a bus address is set
+
+#ifdef BL_AB_SLOTS
+  etx_config->slot_state = ETX_SLOT_CONFIRMED; // nothing on trial
+#endif
 
-  // Reserved space
-  for (int i = 0; i < 10; i++) {
-    etx_config->reserved[i] = 0;
+  // No image, no hash tree
+  for (uint32_t i = 0; i < APPLICATION_SECTORS; i++) {
+    etx_config->app_sector_crc[i] = 0;
   }
 
   // Set valid marker
@@ -56,23 +234,92 @@ CFG_SAVE_STATUS_ config_save(ETX_CONFIG_ *etx_config)
     return CFG_SAVE_ERR;
   }
 
-  // get the CRC of the configuration data
-  uint32_t crc = compute_crc32(&hcrc, (uint32_t *)etx_config, sizeof(ETX_CONFIG_) - 4);
-  etx_config->config_crc = crc;
+  return config_log_append(CONFIG_FLASH_ADDR, etx_config);
+}
+
+/**
+ * @brief  Fingerprint of the flashed image and the flash state it was
+ *         verified in: CRC32 over app_crc, app_size, the write and readout
+ *         protection of the application bank, the bank swap option and the
+ *         first and last CONFIG_FP_SPAN bytes of the image (vector table, tail)
+ * @param  ETX_CONFIG_ *etx_config: configuration describing the image
+ * @retval fingerprint, 0 if the application bank reported an ECC error since reset
+ */
+uint32_t config_app_fingerprint(const ETX_CONFIG_ *etx_config)
+{
+  uint32_t size = etx_config->app_size;
+  uint32_t span = (size < CONFIG_FP_SPAN) ? size : CONFIG_FP_SPAN;
+  uint32_t tail = (size - span) & ~3U;
+  uint32_t state[5] = {
+    etx_config->app_crc,
+    size,
+    (APPLICATION_BANK == FLASH_BANK_1) ? FLASH->WPSN_CUR1 : FLASH->WPSN_CUR2,
+    (APPLICATION_BANK == FLASH_BANK_1) ? FLASH->PRAR_CUR1 : FLASH->PRAR_CUR2,
+    FLASH->OPTSR_CUR & (FLASH_OPTSR_RDP | FLASH_OPTSR_SWAP_BANK_OPT),
+  };
+
+  uint32_t crc = compute_crc32(&hcrc, state, sizeof(state));
+  crc = accumulate_crc32(&hcrc, crc, (uint32_t *)APPLICATION_ADDRESS, span);
+  crc = accumulate_crc32(&hcrc, crc, (uint32_t *)(APPLICATION_ADDRESS + tail), size - tail);
+
+  // a corrected (or worse) ECC error on any application bank read so far: the flash needs the full check
+  uint32_t sr = (APPLICATION_BANK == FLASH_BANK_1) ? FLASH->SR1 : FLASH->SR2;
+  if ((sr & (FLASH_SR_SNECCERR | FLASH_SR_DBECCERR)) != 0U) {
+    LOG_WARN("Bank %lu ECC error at 0x%08lX, no fingerprint\r\n", (uint32_t)APPLICATION_BANK,
+             ((APPLICATION_BANK == FLASH_BANK_1) ? FLASH->ECC_FA1 : FLASH->ECC_FA2) & FLASH_ECC_FA_FAIL_ECC_ADDR);
+    return 0;
+  }
+
+  return (crc != 0U) ? crc : 1U;
+}
 
-  HAL_StatusTypeDef status;
+/**
+ * @brief  Check the stored fingerprint against the flash as it is now
+ * @param  ETX_CONFIG_ *etx_config: configuration describing the image
+ * @retval true if the image was fully verified before and nothing changed
+ */
+bool config_is_app_fingerprint_ok(const ETX_CONFIG_ *etx_config)
+{
+  if (etx_config->app_fingerprint == 0U || etx_config->app_fingerprint == 0xFFFFFFFFU) {
+    return false;
+  }
+  return config_app_fingerprint(etx_config) == etx_config->app_fingerprint;
+}
 
-  status = erase_flash(FLASH_BANK_1, FLASH_SECTOR_2, 1);
-  if (status != HAL_OK) {
-    LOG_ERROR("Failed to erase flash sector\r\n");
-    return CFG_SAVE_ERR;
+/**
+ * @brief  Revoke the stored fingerprint before the application flash is
+ *         written: the config in flash is appended once more, without it
+ * @retval CFG_SAVE_STATUS_: Status of the write
+ */
+CFG_SAVE_STATUS_ config_revoke_app_fingerprint(void)
+{
+  uint32_t buffer[(sizeof(ETX_CONFIG_) + 3U) / 4U];
+  ETX_CONFIG_ *config = (ETX_CONFIG_ *)buffer;
+
+  (void)config_log_read(CONFIG_FLASH_ADDR, config);
+  if (config->config_valid_marker != VALID_CONF_MARKER || config->app_fingerprint == 0U ||
+      compute_crc32(&hcrc, buffer, sizeof(ETX_CONFIG_) - 4) != config->config_crc) {
+    return CFG_SAVE_OK; // nothing trusted to revoke
   }
 
-  status = write_flash(CONFIG_FLASH_ADDR, (uint32_t *)etx_config, sizeof(ETX_CONFIG_), FLASH_BANK_1);
-  if (status != HAL_OK) {
-    LOG_ERROR("Failed to write Config...\r\n");
+  config->app_fingerprint = 0;
+  if (config_log_append(CONFIG_FLASH_ADDR, config) != CFG_SAVE_OK) {
+    LOG_ERROR("Failed to revoke the image fingerprint\r\n");
     return CFG_SAVE_ERR;
   }
 
   return CFG_SAVE_OK;
 }
+
+/**
+ * @brief  Remember the image as verified after a full CRC check. Nothing is
+ *         written if the fingerprint in flash is the same already.
+ * @param  ETX_CONFIG_ *etx_config: configuration describing the image
+ * @retval CFG_SAVE_STATUS_: Status of the save operation
+ */
+CFG_SAVE_STATUS_ config_store_app_fingerprint(ETX_CONFIG_ *etx_config)
+{
+  etx_config->app_fingerprint = config_app_fingerprint(etx_config);
+
+  return config_save(etx_config);
+}
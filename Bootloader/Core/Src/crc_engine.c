@@ -0,0 +1,289 @@
+#include "crc_engine.h"
+#include "logger.h"
+#include "boot_profile.h"
+
+/*
+ * Engine state between start() and finish()
+ */
+typedef struct
+{
+  uint32_t        crc;            // synchronous engines: the result
+  const uint8_t   *rest;          // MDMA: words left for a second transfer
+  size_t          rest_len;
+  const uint8_t   *tail;          // bytes after the last whole word
+  size_t          tail_len;
+}CRC_ENGINE_STATE_;
+
+static CRC_ENGINE_STATE_ engine_state;
+static MDMA_HandleTypeDef hmdma_crc;
+static bool is_mdma_ready;
+
+// 8 KB of tables, zero wait states in DTCM with the caches off
+static uint32_t crc_table[8][256] __attribute__((section(".dtcm_bss"), aligned(4)));
+
+const CRC_ENGINE_ *crc_engine_default = &crc_engine_hw_word;
+
+/* ***** CRC unit - Start ***** */
+
+/* Seed the unit with a previous CRC: the result is read bit-reversed and inverted */
+static void crc_hw_begin(CRC_HandleTypeDef *hcrc, uint32_t crc)
+{
+  WRITE_REG(hcrc->Instance->INIT, __RBIT(~crc));
+  __HAL_CRC_DR_RESET(hcrc);
+}
+
+/* One byte per write, each byte bit-reversed: zlib's byte order */
+static void crc_hw_bytes(CRC_HandleTypeDef *hcrc, const uint8_t *data, size_t length)
+{
+  MODIFY_REG(hcrc->Instance->CR, CRC_CR_REV_IN, CRC_INPUTDATA_INVERSION_BYTE);
+  for (size_t i = 0; i < length; i++) {
+    *(__IO uint8_t *)&hcrc->Instance->DR = data[i];
+  }
+}
+
+/*
+ * Whole words, reversed as a whole: the little endian word b0..b3 goes in
+ * as rev(b0) first, the same stream as four byte writes
+ */
+static void crc_hw_words(CRC_HandleTypeDef *hcrc, const uint32_t *data, size_t words)
+{
+  MODIFY_REG(hcrc->Instance->CR, CRC_CR_REV_IN, CRC_INPUTDATA_INVERSION_WORD);
+  for (size_t i = 0; i < words; i++) {
+    hcrc->Instance->DR = data[i];
+  }
+}
+
+/* Read the result, leave the unit as MX_CRC_Init set it up */
+static uint32_t crc_hw_end(CRC_HandleTypeDef *hcrc)
+{
+  uint32_t crc = ~READ_REG(hcrc->Instance->DR);
+
+  MODIFY_REG(hcrc->Instance->CR, CRC_CR_REV_IN, CRC_INPUTDATA_INVERSION_BYTE);
+  WRITE_REG(hcrc->Instance->INIT, DEFAULT_CRC_INITVALUE);
+
+  return crc;
+}
+
+/* Bytes up to the first word boundary */
+static size_t crc_head_len(const uint8_t *data, size_t length)
+{
+  size_t head = (4U - ((uint32_t)data & 3U)) & 3U;
+
+  return (head > length) ? length : head;
+}
+
+/* ***** CRC unit - End ***** */
+
+static uint32_t crc_engine_result(CRC_HandleTypeDef *hcrc)
+{
+  (void)hcrc;
+  return engine_state.crc;
+}
+
+static void crc_hw_byte_start(CRC_HandleTypeDef *hcrc, uint32_t crc, const uint8_t *data, size_t length)
+{
+  WRITE_REG(hcrc->Instance->INIT, __RBIT(~crc));
+  __HAL_CRC_DR_RESET(hcrc);
+  engine_state.crc = ~HAL_CRC_Accumulate(hcrc, (uint32_t *)data, length);
+  WRITE_REG(hcrc->Instance->INIT, DEFAULT_CRC_INITVALUE);
+}
+
+static void crc_hw_word_start(CRC_HandleTypeDef *hcrc, uint32_t crc, const uint8_t *data, size_t length)
+{
+  size_t head = crc_head_len(data, length);
+  size_t words = (length - head) / 4U;
+
+  crc_hw_begin(hcrc, crc);
+  crc_hw_bytes(hcrc, data, head);
+  crc_hw_words(hcrc, (const uint32_t *)&data[head], words);
+  crc_hw_bytes(hcrc, &data[head + (words * 4U)], length - head - (words * 4U));
+  engine_state.crc = crc_hw_end(hcrc);
+}
+
+static HAL_StatusTypeDef crc_mdma_init(void)
+{
+  if (is_mdma_ready) {
+    return HAL_OK;
+  }
+
+  __HAL_RCC_MDMA_CLK_ENABLE();
+
+  hmdma_crc.Instance = MDMA_Channel0;
+  hmdma_crc.Init.Request = MDMA_REQUEST_SW;
+  hmdma_crc.Init.TransferTriggerMode = MDMA_FULL_TRANSFER;
+  hmdma_crc.Init.Priority = MDMA_PRIORITY_HIGH;
+  hmdma_crc.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+  hmdma_crc.Init.SourceInc = MDMA_SRC_INC_WORD;
+  hmdma_crc.Init.DestinationInc = MDMA_DEST_INC_DISABLE;    // always DR
+  hmdma_crc.Init.SourceDataSize = MDMA_SRC_DATASIZE_WORD;
+  hmdma_crc.Init.DestDataSize = MDMA_DEST_DATASIZE_WORD;
+  hmdma_crc.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+  hmdma_crc.Init.BufferTransferLength = 128;
+  hmdma_crc.Init.SourceBurst = MDMA_SOURCE_BURST_32BEATS;   // 128 bytes per flash read burst
+  hmdma_crc.Init.DestBurst = MDMA_DEST_BURST_SINGLE;
+  hmdma_crc.Init.SourceBlockAddressOffset = 0;
+  hmdma_crc.Init.DestBlockAddressOffset = 0;
+
+  if (HAL_MDMA_Init(&hmdma_crc) != HAL_OK) {
+    return HAL_ERROR;
+  }
+  is_mdma_ready = true;
+
+  return HAL_OK;
+}
+
+/* Start the MDMA on a word run: whole 64 KB blocks first, the rest is left for finish() */
+static HAL_StatusTypeDef crc_mdma_transfer(CRC_HandleTypeDef *hcrc, const uint8_t *data, size_t length)
+{
+  uint32_t block = (length >= CRC_ENGINE_MDMA_BLOCK) ? CRC_ENGINE_MDMA_BLOCK : length;
+  uint32_t blocks = length / block;
+
+  engine_state.rest = &data[blocks * block];
+  engine_state.rest_len = length - (blocks * block);
+
+  return HAL_MDMA_Start(&hmdma_crc, (uint32_t)data, (uint32_t)&hcrc->Instance->DR, block, blocks);
+}
+
+static void crc_hw_mdma_start(CRC_HandleTypeDef *hcrc, uint32_t crc, const uint8_t *data, size_t length)
+{
+  size_t head = crc_head_len(data, length);
+  size_t words = (length - head) / 4U;
+
+  crc_hw_begin(hcrc, crc);
+  crc_hw_bytes(hcrc, data, head);
+  engine_state.tail = &data[head + (words * 4U)];
+  engine_state.tail_len = length - head - (words * 4U);
+  engine_state.rest_len = 0;
+
+  MODIFY_REG(hcrc->Instance->CR, CRC_CR_REV_IN, CRC_INPUTDATA_INVERSION_WORD);
+  if (words == 0) {
+    return;
+  }
+  if (crc_mdma_init() != HAL_OK || crc_mdma_transfer(hcrc, &data[head], words * 4U) != HAL_OK) {
+    // no MDMA: feed the words by hand, finish() finds nothing in flight
+    LOG_ERROR("MDMA CRC transfer failed to start, feeding the CRC unit directly\r\n");
+    crc_hw_words(hcrc, (const uint32_t *)&data[head], words);
+    engine_state.rest_len = 0;
+    is_mdma_ready = false;
+  }
+}
+
+static uint32_t crc_hw_mdma_finish(CRC_HandleTypeDef *hcrc)
+{
+  if (is_mdma_ready && HAL_MDMA_GetState(&hmdma_crc) == HAL_MDMA_STATE_BUSY) {
+    HAL_MDMA_PollForTransfer(&hmdma_crc, HAL_MDMA_FULL_TRANSFER, HAL_MAX_DELAY);
+    if (engine_state.rest_len != 0) {
+      const uint8_t *rest = engine_state.rest;
+      crc_mdma_transfer(hcrc, rest, engine_state.rest_len);
+      HAL_MDMA_PollForTransfer(&hmdma_crc, HAL_MDMA_FULL_TRANSFER, HAL_MAX_DELAY);
+    }
+  }
+
+  crc_hw_bytes(hcrc, engine_state.tail, engine_state.tail_len);
+  return crc_hw_end(hcrc);
+}
+
+static void crc_sw_slice8_start(CRC_HandleTypeDef *hcrc, uint32_t crc, const uint8_t *data, size_t length)
+{
+  (void)hcrc;
+
+  crc = ~crc;
+  while (length != 0 && ((uint32_t)data & 3U) != 0) {
+    crc = crc_table[0][(crc ^ *data++) & 0xFFU] ^ (crc >> 8);
+    length--;
+  }
+  while (length >= 8U) {
+    uint32_t one = *(const uint32_t *)data ^ crc;
+    uint32_t two = *(const uint32_t *)(data + 4);
+
+    crc = crc_table[7][one & 0xFFU] ^ crc_table[6][(one >> 8) & 0xFFU] ^
+          crc_table[5][(one >> 16) & 0xFFU] ^ crc_table[4][one >> 24] ^
+          crc_table[3][two & 0xFFU] ^ crc_table[2][(two >> 8) & 0xFFU] ^
+          crc_table[1][(two >> 16) & 0xFFU] ^ crc_table[0][two >> 24];
+    data += 8;
+    length -= 8U;
+  }
+  while (length != 0) {
+    crc = crc_table[0][(crc ^ *data++) & 0xFFU] ^ (crc >> 8);
+    length--;
+  }
+
+  engine_state.crc = ~crc;
+}
+
+const CRC_ENGINE_ crc_engine_hw_byte   = { "hw-byte",   crc_hw_byte_start,   crc_engine_result };
+const CRC_ENGINE_ crc_engine_hw_word   = { "hw-word",   crc_hw_word_start,   crc_engine_result };
+const CRC_ENGINE_ crc_engine_hw_mdma   = { "hw-mdma",   crc_hw_mdma_start,   crc_hw_mdma_finish };
+const CRC_ENGINE_ crc_engine_sw_slice8 = { "sw-slice8", crc_sw_slice8_start, crc_engine_result };
+
+/**
+ * @brief  Build the slice-by-8 tables (DTCM is not zeroed or loaded at reset)
+ * @retval None
+ */
+void crc_engine_init(void)
+{
+  for (uint32_t i = 0; i < 256U; i++) {
+    uint32_t crc = i;
+    for (uint32_t bit = 0; bit < 8U; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1U)));
+    }
+    crc_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256U; i++) {
+    for (uint32_t slice = 1; slice < 8U; slice++) {
+      crc_table[slice][i] = (crc_table[slice - 1][i] >> 8) ^ crc_table[0][crc_table[slice - 1][i] & 0xFFU];
+    }
+  }
+}
+
+/**
+ * @brief  CRC32 of data with one engine, blocking
+ * @param  engine: engine to use
+ * @param  hcrc: CRC unit (hardware engines)
+ * @param  crc: CRC32 of the data before this part, 0 for none
+ * @param  data: data, any alignment
+ * @param  length: length in bytes
+ * @retval CRC32 of everything so far
+ */
+uint32_t crc_engine_run(const CRC_ENGINE_ *engine, CRC_HandleTypeDef *hcrc, uint32_t crc, const void *data, size_t length)
+{
+  if (data == NULL || length == 0) {
+    return crc;
+  }
+
+  engine->start(hcrc, crc, (const uint8_t *)data, length);
+  return engine->finish(hcrc);
+}
+
+/**
+ * @brief  Time every engine over 1 MB of bank 1 and log MB/s (build with
+ *         make CRC_BENCH=1, runs at boot)
+ * @param  hcrc: CRC unit
+ * @retval None
+ */
+void crc_engine_bench(CRC_HandleTypeDef *hcrc)
+{
+  const CRC_ENGINE_ *engines[] = { &crc_engine_hw_byte, &crc_engine_hw_word, &crc_engine_hw_mdma, &crc_engine_sw_slice8 };
+  const uint8_t *data = (const uint8_t *)CRC_ENGINE_BENCH_ADDR;
+  uint32_t reference = 0;
+
+  cycle_counter_enable();
+
+  LOG_INFO("CRC engine bench: %lu KB at 0x%08lX, %lu MHz\r\n", CRC_ENGINE_BENCH_LEN / 1024U,
+           (uint32_t)CRC_ENGINE_BENCH_ADDR, SystemCoreClock / 1000000U);
+
+  for (uint32_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    uint32_t start_cycles = DWT->CYCCNT;
+    uint32_t crc = crc_engine_run(engines[i], hcrc, 0, data, CRC_ENGINE_BENCH_LEN);
+    uint32_t cycles = DWT->CYCCNT - start_cycles;
+    uint32_t us = cycles / (SystemCoreClock / 1000000U);
+    // bytes per us is MB/s (10^6), hundredths for the slow ones
+    uint32_t mbps_x100 = (us != 0) ? (uint32_t)(((uint64_t)CRC_ENGINE_BENCH_LEN * 100ULL) / us) : 0;
+
+    if (i == 0) {
+      reference = crc;
+    }
+    LOG_INFO("  %-10s %8lu us %5lu.%02lu MB/s  CRC 0x%08lX%s\r\n", engines[i]->name, us,
+             mbps_x100 / 100U, mbps_x100 % 100U, crc, (crc == reference) ? "" : "  MISMATCH");
+  }
+}
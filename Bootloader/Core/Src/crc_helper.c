@@ -1,7 +1,11 @@
 #include "crc_helper.h"
+#include "crc_engine.h"
+
+#define CRC32_POLY_REFLECTED 0xEDB88320UL  // zlib CRC32 polynomial, bit reversed
 
 /**
- * @brief  Compute CRC32 over given data using STM32 hardware CRC peripheral
+ * @brief  Compute CRC32 over given data with the default CRC engine
+ *         (STM32 hardware CRC peripheral, fed a word at a time)
  * @param  hcrc: Pointer to CRC handle
  * @param  data: Pointer to data buffer
  * @param  length: Length of data in bytes
@@ -12,9 +16,24 @@ uint32_t compute_crc32(CRC_HandleTypeDef* hcrc, uint32_t* data, size_t length) {
         return 0; // Invalid parameters
     }
 
-    uint32_t crc = HAL_CRC_Calculate(hcrc, data, length);
+    return crc_engine_run(crc_engine_default, hcrc, 0, data, length);
+}
 
-    return ~crc;
+/**
+ * @brief  Continue a CRC32 over more data, as if both parts had been given
+ *         to compute_crc32() in one piece
+ * @param  hcrc: Pointer to CRC handle
+ * @param  crc: CRC32 of the data so far (0 for none)
+ * @param  data: Pointer to the next part
+ * @param  length: Length of the next part in bytes
+ * @retval CRC32 of everything so far
+ */
+uint32_t accumulate_crc32(CRC_HandleTypeDef* hcrc, uint32_t crc, uint32_t* data, size_t length) {
+    if (hcrc == NULL || data == NULL || length == 0) {
+        return crc; // Nothing to add
+    }
+
+    return crc_engine_run(crc_engine_default, hcrc, crc, data, length);
 }
 
 /**
@@ -36,4 +55,89 @@ crc_status_t verify_crc32(CRC_HandleTypeDef* hcrc, uint32_t* data, size_t length
     }
 
     return CRC_OK;      // CRC matches
-}
\ No newline at end of file
+}
+
+/* ***** GF(2) matrix helpers for combine_crc32 (zlib's crc32_combine) ***** */
+
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    while (vec != 0) {
+        if (vec & 1U) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+/**
+ * @brief  CRC32 of two parts joined, from the CRC32 of each part, without
+ *         reading the data again
+ * @param  crc1: CRC32 of the first part
+ * @param  crc2: CRC32 of the second part
+ * @param  length2: Length of the second part in bytes
+ * @retval CRC32 of the first part followed by the second
+ */
+uint32_t combine_crc32(uint32_t crc1, uint32_t crc2, size_t length2) {
+    uint32_t even[32];    // operator for 2^n zero bits, even n
+    uint32_t odd[32];     // operator for 2^n zero bits, odd n
+    uint32_t row = 1;
+
+    if (length2 == 0) {
+        return crc1;
+    }
+
+    // operator for one zero bit
+    odd[0] = CRC32_POLY_REFLECTED;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);   // two zero bits
+    gf2_matrix_square(odd, even);   // four zero bits
+
+    // shift crc1 over length2 zero bytes, one bit of length2 at a time
+    do {
+        gf2_matrix_square(even, odd);
+        if (length2 & 1U) {
+            crc1 = gf2_matrix_times(even, crc1);
+        }
+        length2 >>= 1;
+        if (length2 == 0) {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if (length2 & 1U) {
+            crc1 = gf2_matrix_times(odd, crc1);
+        }
+        length2 >>= 1;
+    } while (length2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+/**
+ * @brief  Root of a CRC32 hash tree: the CRC32 of the whole data, combined
+ *         from the CRC32 of each leaf_size block (the last one may be short)
+ * @param  leaves: CRC32 of each block, in order
+ * @param  leaf_size: Block size in bytes
+ * @param  length: Length of the whole data in bytes
+ * @retval CRC32 of the whole data
+ */
+uint32_t tree_root_crc32(const uint32_t* leaves, size_t leaf_size, size_t length) {
+    uint32_t root = 0;
+
+    for (size_t offset = 0; offset < length; offset += leaf_size) {
+        size_t block = (length - offset < leaf_size) ? (length - offset) : leaf_size;
+        root = combine_crc32(root, *leaves++, block);
+    }
+    return root;
+}
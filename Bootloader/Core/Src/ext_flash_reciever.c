@@ -2,13 +2,12 @@
 #include "flash_editor.h"
 #include "conf_helper.h"
 #include "crc_helper.h"
+#include "image_helper.h"
+#include "slot_helper.h"
 #include "logger.h"
 
-/* Rx Buffer */
-static uint8_t rx_buffer[ETX_FRAME_PACKET_MAX_SIZE];
-
-/* Response Buffer */
-static uint8_t rsp_buffer[ETX_RSPF_PACKET_SIZE];
+/* Download channels: USART2, plus USART3 while striping */
+static ETX_DL_CHANNEL_ dl_channels[ETX_DL_CHANNEL_COUNT];
 
 /* Download Status */
 static ETX_DL_STATE_ dl_state;
@@ -17,27 +16,93 @@ static uint32_t total_data_size;
 static uint16_t total_data_fragments;
 static uint16_t received_data_fragments;
 static uint32_t expected_crc;
+static uint32_t erase_sectors;            // sectors the image covers
+static uint32_t erased_sectors;           // sectors from the first one known to be erased
+static bool is_erase_pending;             // erase of sector erased_sectors in flight
+static uint32_t image_sector_crc[APPLICATION_SECTORS]; // CRC of each sector of the flashed image so far, read back from flash
+static uint16_t image_crc_fragments;      // fragments image_sector_crc covers, in image order
 static bool is_data_transfer_complete;
 static bool is_flash_write_started;
-static uint8_t nack_sent_count = 0;
+static bool is_image_rejected;            // image header failed, nothing was erased
+static bool is_streaming;
+static bool is_striped;
+static bool is_broadcast;
+static bool is_random;                    // random access: DATA_AT anywhere, the host erases and commits
+static bool is_staged;                    // streaming into RAM, flashed a chunk at a time once its CRCs check out
+static uint8_t node_address;
 static const uint8_t max_nack_retries = 3;
 
+/* USART2 receive ring (AXI SRAM, DMA1 reaches it; the D-cache is off in the bootloader) */
+static ETX_RX_RING_ rx_ring __attribute__((aligned(32)));
+
+/* Striping, broadcast: fragments flashed so far, they may arrive in any order */
+static uint32_t fragment_map[(ETX_DL_MAX_FRAGMENTS + 31) / 32];
+
+/* Random access: sectors erased or programmed so far, and the image the slot held before */
+static uint32_t random_dirty;             // bit per sector
+static uint32_t base_sector_crc[APPLICATION_SECTORS]; // its sector CRCs
+static uint32_t base_size;                // its size, 0 if its sector CRCs can not be used
+static UART_InitTypeDef usart3_log_init;
+
+/* Staging: one chunk of the image in AXI SRAM then D2 SRAM (D-cache off, never initialized) */
+static uint8_t stage_d1[ETX_STAGE_D1_SIZE] __attribute__((section(".stage_d1"), aligned(32)));
+static uint8_t stage_d2[ETX_STAGE_D2_SIZE] __attribute__((section(".stage_d2"), aligned(32)));
+static uint32_t staged_sector_crc[APPLICATION_SECTORS]; // from the header, their root is the image CRC
+static uint32_t stage_base;               // image offset of the chunk being staged
+
+/* Fragment waiting for a REPAIR frame (DATA_SB with bad sub-blocks) */
+static uint32_t sb_data[ETX_FRAME_DATA_MAX_SIZE / 4];
+static uint32_t sb_crc[ETX_SUBBLOCK_MAX];
+static uint32_t sb_data_len;
+static uint32_t sb_bad_bitmap;
+
 /* Hardware CRC handle */
 extern CRC_HandleTypeDef hcrc;
 
 // Internal Function prototypes
-static ETX_DL_FRAME_EX_ etx_receive_data(uint8_t *buffer);
-static ETX_DL_FRAME_EX_ etx_receive_response(uint8_t *rsp);
-static ETX_DL_FRAME_EX_ etx_send_data(ETX_DL_FRAME_ *buffer);
-static ETX_DL_FRAME_EX_ etx_send_response(ETX_DL_RSP_ rsp);
-static HAL_StatusTypeDef etx_tx_data(ETX_DL_FRAME_ *buffer);
-static HAL_StatusTypeDef etx_rx_data(uint8_t *buffer);
-static HAL_StatusTypeDef etx_tx_rsp(ETX_DL_RSPF_ *buffer);
+static ETX_DL_FRAME_EX_ etx_receive_data(ETX_DL_CHANNEL_ *channel);
+static ETX_DL_FRAME_EX_ etx_receive_response(ETX_DL_CHANNEL_ *channel);
+static ETX_DL_FRAME_EX_ etx_send_data(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *buffer);
+static ETX_DL_FRAME_EX_ etx_send_response(ETX_DL_CHANNEL_ *channel, ETX_DL_RSP_ rsp);
+static ETX_DL_FRAME_EX_ etx_send_status(ETX_DL_CHANNEL_ *channel, ETX_DL_RSP_ rsp, uint32_t index, uint32_t bitmap);
+static void etx_stream_nack(ETX_DL_CHANNEL_ *channel, uint32_t bitmap);
+static bool etx_subblock_check(ETX_DL_FRAME_ *frame, uint8_t **data, uint32_t *length);
+static bool etx_subblock_repair(ETX_DL_FRAME_ *frame, uint8_t **data, uint32_t *length);
+static void etx_subblock_nack(ETX_DL_CHANNEL_ *channel);
+static void etx_read_back(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame);
+static void etx_image_crc_update(void);
+static bool etx_image_crc_ok(void);
+static HAL_StatusTypeDef etx_image_header_ok(const uint8_t *image);
+static HAL_StatusTypeDef etx_data_at_begin(void);
+static bool etx_data_at_check(ETX_DL_FRAME_ *frame, uint32_t *offset, uint32_t *length);
+static HAL_StatusTypeDef etx_data_at_flash(ETX_DL_FRAME_ *frame, uint32_t offset, uint32_t length);
+static HAL_StatusTypeDef etx_random_begin(void);
+static ETX_DL_STATE_ etx_random_frame(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame);
+static HAL_StatusTypeDef etx_staged_begin(ETX_DL_FRAME_ *frame);
+static ETX_DL_STATE_ etx_staged_frame(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame);
+static HAL_StatusTypeDef etx_stripe_begin(void);
+static ETX_DL_STATE_ etx_stripe_receive(void);
+static HAL_StatusTypeDef etx_bus_init(void);
+static void etx_bus_drain(void);
+static ETX_DL_FRAME_EX_ etx_send_missing(ETX_DL_CHANNEL_ *channel);
+static ETX_DL_STATE_ etx_broadcast_receive(ETX_DL_CHANNEL_ *channel);
+static HAL_StatusTypeDef etx_tx_data(UART_HandleTypeDef *huart, ETX_DL_FRAME_ *buffer);
+static HAL_StatusTypeDef etx_rx_data(uint8_t *buffer, uint32_t *skipped);
+static HAL_StatusTypeDef etx_tx_rsp(UART_HandleTypeDef *huart, ETX_DL_RSPF_ *buffer);
 static HAL_StatusTypeDef etx_rx_rsp(ETX_DL_RSPF_ *buffer);
+static HAL_StatusTypeDef etx_ring_start(void);
+static void etx_ring_stop(void);
+static void etx_ring_update(void);
+static uint32_t etx_ring_level(void);
+static void etx_ring_skip(uint32_t length);
+static void etx_ring_drain(uint32_t idle_ms);
 
 // Flash operation prototypes
 static HAL_StatusTypeDef flash_application_data(uint32_t address, uint32_t *data, uint32_t length);
-static HAL_StatusTypeDef flash_erase_application();
+static HAL_StatusTypeDef flash_retire_application(void);
+static HAL_StatusTypeDef flash_erase_application(void);
+static HAL_StatusTypeDef etx_erase_pump(uint32_t end);
+static HAL_StatusTypeDef etx_erase_wait(uint32_t end);
 
 /**
  * @brief  Download the application from UART and flash it.
@@ -47,6 +112,10 @@ static HAL_StatusTypeDef flash_erase_application();
 ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config) {
   ETX_DL_EX_ ret_val = ETX_DL_EX_ERR;
   ETX_DL_FRAME_EX_ received_status = ETX_DL_FRAME_EX_NO_DATA;
+  ETX_DL_CHANNEL_ *channel = &dl_channels[0];
+  uint8_t *fragment_data;
+  uint32_t fragment_len;
+  bool fragment_valid;
 
   if (config == NULL) {
     LOG_ERROR("Invalid configuration pointer\r\n");
@@ -59,43 +128,147 @@ ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config) {
   received_data_fragments = 0;
   is_data_transfer_complete = false;
   is_flash_write_started = false;
+  is_image_rejected = false;
+  is_streaming = false;
+  is_striped = false;
+  is_broadcast = false;
+  is_random = false;
+  is_staged = false;
+  sb_bad_bitmap = 0;
   expected_crc = 0;
 
+  memset(dl_channels, 0, sizeof(dl_channels));
+  dl_channels[0].huart = &huart2;
+  dl_channels[1].huart = &huart3;
+
+  // on a multi-drop bus USART2 drives the RS-485 transceiver
+  node_address = (config->node_address <= ETX_NODE_MAX) ? config->node_address : ETX_NODE_NONE;
+  if (node_address != ETX_NODE_NONE) {
+    if (etx_bus_init() != HAL_OK) {
+      LOG_ERROR("Failed to set up RS-485 on USART2\r\n");
+      return ret_val;
+    }
+    LOG_INFO("RS-485 bus node %u\r\n", node_address);
+  }
+
+  // from here on USART2 receives by DMA, also while flash is being written
+  memset(&rx_ring, 0, sizeof(rx_ring));
+  if (etx_ring_start() != HAL_OK) {
+    LOG_ERROR("Failed to start USART2 reception\r\n");
+    return ret_val;
+  }
+
   LOG_INFO("Waiting ETX APP download to start [State: IDLE]...\r\n");
 
   do {
-    if (nack_sent_count >= max_nack_retries) {
+    if (is_striped && dl_state == ETX_DL_STATE_DATA) {
+      // both lanes until every fragment is in, END then comes on USART2
+      dl_state = etx_stripe_receive();
+      if (dl_state != ETX_DL_STATE_FAILED) {
+        continue;
+      }
+    } else if (is_broadcast && dl_state == ETX_DL_STATE_DATA) {
+      // nothing is ACKed, the host polls for missing fragments, until END
+      dl_state = etx_broadcast_receive(channel);
+    } else if (dl_state != ETX_DL_STATE_IDLE && channel->nack_sent_count >= max_nack_retries) {
       LOG_ERROR("Maximum NACK retries reached. Aborting download...\r\n");
       dl_state = ETX_DL_STATE_FAILED;
     } else if (!is_data_transfer_complete) {
-      received_status = etx_receive_data(rx_buffer);
+      received_status = etx_receive_data(channel);
 
       if (received_status == ETX_DL_FRAME_EX_NO_DATA) {
         continue; // No data received, continue waiting
-      } else if (received_status == ETX_DL_FRAME_EX_ERR) {
+      } else if (received_status == ETX_DL_FRAME_EX_BAD_CRC &&
+                 dl_state == ETX_DL_STATE_DATA &&
+                 ((ETX_DL_FRAME_ *)channel->rx_buffer)->packet_type == ETX_DL_FRAME_TYPE_DATA_SB) {
+        // the sub-block CRCs tell which part of the fragment is damaged
+      } else if (received_status != ETX_DL_FRAME_EX_OK) {
+        if (is_broadcast || (node_address != ETX_NODE_NONE && dl_state == ETX_DL_STATE_IDLE)) {
+          etx_bus_drain(); // never answer on a shared bus unless asked
+          continue;
+        }
+        if (is_streaming && dl_state == ETX_DL_STATE_DATA) {
+          etx_stream_nack(channel, 0); // host resends from this fragment
+          continue;
+        }
+        if (is_random && dl_state == ETX_DL_STATE_DATA) {
+          // random access frames are safe to write twice, the host sends it again
+          etx_bus_drain();
+          etx_send_response(channel, ETX_DL_RSP_NACK);
+          continue;
+        }
+        if (dl_state == ETX_DL_STATE_IDLE) {
+          // nothing started yet: line noise or a host probing the link, wait for the next frame
+          etx_bus_drain();
+          etx_send_response(channel, ETX_DL_RSP_NACK);
+          continue;
+        }
         LOG_ERROR("Error receiving data\r\n");
         dl_state = ETX_DL_STATE_FAILED;
       }
     }
 
-    ETX_DL_FRAME_ *received_frame = (ETX_DL_FRAME_ *)rx_buffer;
+    ETX_DL_FRAME_ *received_frame = (ETX_DL_FRAME_ *)channel->rx_buffer;
 
     switch (dl_state) {
       case ETX_DL_STATE_IDLE:
         if (received_frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
             received_frame->payload_len == 1 &&
-            received_frame->payload[0] == ETX_DL_CMD_START) {
-          LOG_INFO("Received DL start command. Transitioning to HEADER state...\r\n");
+            (received_frame->payload[0] == ETX_DL_CMD_START ||
+             received_frame->payload[0] == ETX_DL_CMD_START_STREAM ||
+             received_frame->payload[0] == ETX_DL_CMD_START_STRIPED ||
+             received_frame->payload[0] == ETX_DL_CMD_START_RANDOM ||
+             received_frame->payload[0] == ETX_DL_CMD_START_STAGED)) {
+          is_staged = (received_frame->payload[0] == ETX_DL_CMD_START_STAGED);
+          is_streaming = (received_frame->payload[0] == ETX_DL_CMD_START_STREAM) || is_staged;
+          is_striped = (received_frame->payload[0] == ETX_DL_CMD_START_STRIPED);
+          is_random = (received_frame->payload[0] == ETX_DL_CMD_START_RANDOM);
+          LOG_INFO("Received DL start command%s. Transitioning to HEADER state...\r\n",
+                   is_staged ? " (staged in RAM)" : (is_streaming ? " (streaming)" :
+                   (is_striped ? " (striped)" : (is_random ? " (random access)" : ""))));
           dl_state = ETX_DL_STATE_HEADER;
-          etx_send_response(ETX_DL_RSP_ACK);
-        } else {
-          etx_send_response(ETX_DL_RSP_NACK);
+          etx_send_response(channel, ETX_DL_RSP_ACK);
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
+                   received_frame->payload_len == ETX_READ_CMD_SIZE &&
+                   received_frame->payload[0] == ETX_DL_CMD_READ) {
+          etx_read_back(channel, received_frame); // stays in IDLE afterwards
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
+                   received_frame->payload_len == 1 &&
+                   received_frame->payload[0] == ETX_DL_CMD_START_BROADCAST) {
+          if (node_address != ETX_NODE_NONE) {
+            LOG_INFO("Received DL start command (broadcast). Transitioning to HEADER state...\r\n");
+            is_broadcast = true;
+            dl_state = ETX_DL_STATE_HEADER;
+          }
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
+                   received_frame->payload_len == 2 &&
+                   received_frame->payload[0] == ETX_DL_CMD_SET_NODE) {
+          // takes effect the next time the bootloader enters download mode
+          if (received_frame->payload[1] <= ETX_NODE_MAX) {
+            config->node_address = received_frame->payload[1];
+            if (config_save(config) == CFG_SAVE_OK) {
+              LOG_INFO("Bus address set to %u\r\n", received_frame->payload[1]);
+              etx_send_response(channel, ETX_DL_RSP_ACK);
+              break;
+            }
+          }
+          etx_send_response(channel, ETX_DL_RSP_NACK);
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_POLL &&
+                   received_frame->payload_len == 1 &&
+                   received_frame->payload[0] == node_address) {
+          etx_send_missing(channel); // no download running: reports 0 fragments
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_PROBE &&
+                   received_frame->payload_len <= ETX_FRAME_DATA_MAX_SIZE &&
+                   node_address == ETX_NODE_NONE) {
+          etx_send_response(channel, ETX_DL_RSP_ACK); // host measuring the link (tune)
+        } else if (node_address == ETX_NODE_NONE) {
+          etx_send_response(channel, ETX_DL_RSP_NACK);
         }
         break;
       
       case ETX_DL_STATE_HEADER:
         if (received_frame->packet_type == ETX_DL_FRAME_TYPE_HEADER &&
-            received_frame->payload_len == 8) {
+            (received_frame->payload_len == 8 || (is_staged && received_frame->payload_len > 8))) {
           total_data_size = (received_frame->payload[0] << 24) |
                             (received_frame->payload[1] << 16) |
                             (received_frame->payload[2] << 8)  |
@@ -107,53 +280,171 @@ ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config) {
           
           LOG_INFO("Received header: Total Size = %lu bytes, Expected CRC = 0x%08lX\r\n", total_data_size, expected_crc);
 
+          if (total_data_size == 0 || total_data_size > APPLICATION_MAX_SIZE) {
+            LOG_ERROR("Image of %lu bytes does not fit the application area\r\n", total_data_size);
+            if (!is_broadcast) {
+              etx_send_response(channel, ETX_DL_RSP_NACK);
+            }
+            dl_state = ETX_DL_STATE_FAILED; // nothing erased yet
+            break;
+          }
+
           total_data_fragments = (total_data_size / ETX_FRAME_DATA_MAX_SIZE) + (total_data_size % ETX_FRAME_DATA_MAX_SIZE != 0);
           received_data_fragments = 0;
+          memset(image_sector_crc, 0, sizeof(image_sector_crc));
+          image_crc_fragments = 0;
+
+          // broadcast: erase now, the host polls until every node reports the image size
+          if (is_broadcast) {
+            if (etx_data_at_begin() != HAL_OK) {
+              dl_state = ETX_DL_STATE_FAILED;
+              break;
+            }
+            LOG_INFO("Application area erased. Receiving broadcast as node %u...\r\n", node_address);
+            dl_state = ETX_DL_STATE_DATA;
+            break;
+          }
+
+          // staging: the sector CRCs must add up to the image CRC, nothing is erased yet
+          if (is_staged && etx_staged_begin(received_frame) != HAL_OK) {
+            etx_send_response(channel, ETX_DL_RSP_NACK);
+            dl_state = ETX_DL_STATE_FAILED;
+            break;
+          }
+
+          // random access: nothing is erased until the host asks
+          if (is_random && etx_random_begin() != HAL_OK) {
+            LOG_ERROR("Failed to start random access download\r\n");
+            etx_send_response(channel, ETX_DL_RSP_NACK);
+            dl_state = ETX_DL_STATE_FAILED;
+            break;
+          }
+
+          // striping: erase and bring up both lanes before the host starts sending
+          if (is_striped && etx_stripe_begin() != HAL_OK) {
+            LOG_ERROR("Failed to start striped download\r\n");
+            etx_send_response(channel, ETX_DL_RSP_NACK);
+            dl_state = ETX_DL_STATE_FAILED;
+            break;
+          }
 
-          etx_send_response(ETX_DL_RSP_ACK);
+          etx_send_response(channel, ETX_DL_RSP_ACK);
           LOG_INFO("Transitioning to DATA state...\r\n");
           dl_state = ETX_DL_STATE_DATA;
+        } else if (is_broadcast) {
+          if (received_frame->packet_type == ETX_DL_FRAME_TYPE_POLL &&
+              received_frame->payload_len == 1 &&
+              received_frame->payload[0] == node_address) {
+            etx_send_missing(channel); // header missed: host sends it again
+          }
         } else {
-          etx_send_response(ETX_DL_RSP_NACK);
+          etx_send_response(channel, ETX_DL_RSP_NACK);
         }
         break;
 
       case ETX_DL_STATE_DATA:
-        if (received_frame->packet_type == ETX_DL_FRAME_TYPE_DATA && received_frame->payload_len > 0) {
+        if (is_staged) {
+          dl_state = etx_staged_frame(channel, received_frame);
+          break;
+        }
+        if (is_random) {
+          dl_state = etx_random_frame(channel, received_frame);
+          is_data_transfer_complete = (dl_state == ETX_DL_STATE_SUCCESS);
+          break;
+        }
+
+        fragment_data = NULL;
+        fragment_len = 0;
+        fragment_valid = false;
+
+        if (received_frame->packet_type == ETX_DL_FRAME_TYPE_DATA &&
+            received_frame->payload_len > 0 &&
+            received_frame->payload_len <= ETX_FRAME_DATA_MAX_SIZE) {
+          fragment_data = received_frame->payload;
+          fragment_len = received_frame->payload_len;
+          fragment_valid = true;
+          sb_bad_bitmap = 0;
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_DATA_SB) {
+          fragment_valid = etx_subblock_check(received_frame, &fragment_data, &fragment_len);
+        } else if (received_frame->packet_type == ETX_DL_FRAME_TYPE_REPAIR) {
+          fragment_valid = etx_subblock_repair(received_frame, &fragment_data, &fragment_len);
+        }
+
+        if (fragment_valid && fragment_data == NULL) {
+          etx_subblock_nack(channel); // host resends only the bad sub-blocks
+        } else if (fragment_valid) {
 
           if (!is_flash_write_started) {
-            // Erase the application area before starting to flash
+            // the first fragment carries the image header: a wrong image is turned away before the erase
+            if (etx_image_header_ok(fragment_data) != HAL_OK) {
+              is_image_rejected = true;
+              dl_state = ETX_DL_STATE_FAILED;
+              break;
+            }
+            // Sector 0 now, the rest shortly before the writes reach them
             if (flash_erase_application() != HAL_OK) {
               LOG_ERROR("Failed to erase application area\r\n");
               dl_state = ETX_DL_STATE_FAILED;
               break;
             }
             is_flash_write_started = true;
-            LOG_INFO("Application area erased. Starting to flash data...\r\n");
+            LOG_INFO("Erasing the application area ahead of the writes. Starting to flash data...\r\n");
           }
           
           HAL_StatusTypeDef status;
+          bool is_last_fragment = (received_data_fragments + 1U >= total_data_fragments);
+
+          // ACK before programming: the host sends the next fragment into the DMA ring
+          // meanwhile. A failure from here on is reported on the next response (FAILED).
+          // The last fragment is ACKed once it is in flash, that ACK stands for the image.
+          if (!is_streaming && !is_last_fragment) {
+            etx_send_response(channel, ETX_DL_RSP_ACK);
+          }
 
           // Flash the received data
-          status = flash_application_data((APPLICATION_ADDRESS + (received_data_fragments * ETX_FRAME_DATA_MAX_SIZE)),
-                                    (uint32_t *)received_frame->payload,
-                                    (uint32_t)received_frame->payload_len);
+          status = flash_application_data((DOWNLOAD_ADDRESS + (received_data_fragments * ETX_FRAME_DATA_MAX_SIZE)),
+                                    (uint32_t *)fragment_data,
+                                    fragment_len);
           if (status != HAL_OK) {
-            LOG_ERROR("Failed to flash data at address 0x%08lX\r\n", APPLICATION_ADDRESS + (received_data_fragments * ETX_FRAME_DATA_MAX_SIZE));
+            LOG_ERROR("Failed to flash data at address 0x%08lX\r\n", DOWNLOAD_ADDRESS + (received_data_fragments * ETX_FRAME_DATA_MAX_SIZE));
             dl_state = ETX_DL_STATE_FAILED;
             break;
           }
 
           received_data_fragments++;
+          etx_image_crc_update();
+
+          // the next sector erases while the last fragments of this one come in
+          // (after the CRC read-back, the bank can not be read while it erases)
+          if (etx_erase_pump((received_data_fragments * ETX_FRAME_DATA_MAX_SIZE) + ETX_ERASE_LEAD) != HAL_OK) {
+            dl_state = ETX_DL_STATE_FAILED;
+            break;
+          }
           LOG_INFO("Received and flashed fragment %u/%u\r\n", received_data_fragments, total_data_fragments);
 
           if (received_data_fragments >= total_data_fragments) {
+            if (!etx_image_crc_ok()) {
+              dl_state = ETX_DL_STATE_FAILED; // the last ACK/summary is never sent
+              break;
+            }
             dl_state = ETX_DL_STATE_DATA_COMPLETE;
             LOG_INFO("All data fragments received. Transitioning to Data Complete state...\r\n");
           }
-          etx_send_response(ETX_DL_RSP_ACK);
+
+          if (!is_streaming) {
+            if (is_last_fragment) {
+              etx_send_response(channel, ETX_DL_RSP_ACK);
+            }
+          } else {
+            channel->nack_sent_count = 0;
+            if (dl_state == ETX_DL_STATE_DATA_COMPLETE) {
+              etx_send_status(channel, ETX_DL_RSP_ACK, received_data_fragments, 0); // summary
+            }
+          }
+        } else if (is_streaming) {
+          etx_stream_nack(channel, 0);
         } else {
-          etx_send_response(ETX_DL_RSP_NACK);
+          etx_send_response(channel, ETX_DL_RSP_NACK);
         }
         break;
 
@@ -164,29 +455,56 @@ ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config) {
           LOG_INFO("Received DL end command. Transitioning to SUCCESS state...\r\n");
           is_data_transfer_complete = true;
           dl_state = ETX_DL_STATE_SUCCESS;
-          etx_send_response(ETX_DL_RSP_ACK);
+          etx_send_response(channel, ETX_DL_RSP_ACK);
         } else {
-          etx_send_response(ETX_DL_RSP_NACK);
+          etx_send_response(channel, ETX_DL_RSP_NACK);
         }
         break;
 
       case ETX_DL_STATE_FAILED:
+        if (is_streaming || ((is_flash_write_started || is_image_rejected) && !is_broadcast)) {
+          // streaming: the host is not waiting for an ACK; otherwise the fragment that failed
+          // may have been ACKed already and the host takes this as the answer to its next frame
+          etx_send_status(channel, ETX_DL_RSP_NACK, ETX_STATUS_INDEX_FATAL, 0);
+        }
+
+#ifndef BL_AB_SLOTS
         if (is_flash_write_started) {
           config->is_app_bootable = false;
           config->is_app_flashed = false;
           config->reboot_reason = ETX_APP_FAILED;
         }
+#endif
 
+        erase_flash_wait(HAL_FLASH_ERASE_TIMEOUT); // leave the flash to the config save idle
+        flash_session_end();
+        etx_ring_stop();
         LOG_INFO("Download failed. Exiting...\r\n");
         return ETX_DL_EX_ERR;
 
       case ETX_DL_STATE_SUCCESS:
+        if (!etx_image_crc_ok()) {
+          dl_state = ETX_DL_STATE_FAILED;
+          break;
+        }
+#ifdef BL_AB_SLOTS
+        // the active slot's config stays as it is, the new image goes live with the switch
+        if (slot_store_inactive(config, total_data_size, expected_crc, image_sector_crc) != CFG_SAVE_OK) {
+          dl_state = ETX_DL_STATE_FAILED;
+          break;
+        }
+#else
         config->is_app_bootable = false;
         config->is_app_flashed = true;
         config->reboot_reason = ETX_NORMAL_BOOT;
         config->app_crc = expected_crc;
         config->app_size = total_data_size;
+        memcpy(config->app_sector_crc, image_sector_crc, sizeof(config->app_sector_crc));
+        config->app_fingerprint = config_app_fingerprint(config); // CRC over flash checked above
         config_save(config);
+#endif
+        flash_session_end();
+        etx_ring_stop();
         LOG_INFO("Download successful. Exiting...\r\n");
         return ETX_DL_EX_OK;
 
@@ -201,18 +519,17 @@ ETX_DL_EX_ etx_app_download_and_flash(ETX_CONFIG_ *config) {
   return ret_val;
 }
 
-static ETX_DL_FRAME_EX_ etx_receive_data(uint8_t *buffer)
+static ETX_DL_FRAME_EX_ etx_receive_data(ETX_DL_CHANNEL_ *channel)
 {
-  if (buffer == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
-  }
+  uint8_t *buffer = channel->rx_buffer;
 
   //clear the buffer
   memset( buffer, 0, ETX_FRAME_PACKET_MAX_SIZE );
 
   HAL_StatusTypeDef status;
+  uint32_t skipped = 0;
 
-  status = etx_rx_data(buffer);
+  status = etx_rx_data(buffer, &skipped);
 
   if (status != HAL_OK) {
     if (status == HAL_TIMEOUT) {
@@ -222,22 +539,27 @@ static ETX_DL_FRAME_EX_ etx_receive_data(uint8_t *buffer)
     return ETX_DL_FRAME_EX_ERR;
   }
 
+  if (skipped != 0) {
+    LOG_WARN("Skipped %lu bytes ahead of the frame\r\n", skipped);
+    if (is_streaming && dl_state == ETX_DL_STATE_DATA) {
+      return ETX_DL_FRAME_EX_ERR; // a whole fragment may have gone with them, the host resends in order
+    }
+  }
+
   ETX_DL_FRAME_ *received_frame = (ETX_DL_FRAME_ *)buffer;
   uint32_t computed_crc = compute_crc32(&hcrc, (uint32_t *)&received_frame->sof, (received_frame->payload_len + 4));
 
   if (computed_crc != received_frame->crc) {
     LOG_ERROR("CRC mismatch: Computed = 0x%08lX, Received = 0x%08lX\r\n", computed_crc, received_frame->crc);
-    return ETX_DL_FRAME_EX_ERR;
+    return ETX_DL_FRAME_EX_BAD_CRC;
   }
 
   return ETX_DL_FRAME_EX_OK;
 }
 
-static ETX_DL_FRAME_EX_ etx_receive_response(uint8_t *buffer)
+static ETX_DL_FRAME_EX_ etx_receive_response(ETX_DL_CHANNEL_ *channel)
 {
-  if (buffer == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
-  }
+  uint8_t *buffer = channel->rsp_buffer;
 
   //clear the buffer
   memset( buffer, 0, ETX_RSPF_PACKET_SIZE );
@@ -266,7 +588,7 @@ static ETX_DL_FRAME_EX_ etx_receive_response(uint8_t *buffer)
   return ETX_DL_FRAME_EX_ERR; // Max retries reached without ACK
 }
 
-static ETX_DL_FRAME_EX_ etx_send_data(ETX_DL_FRAME_ *buffer)
+static ETX_DL_FRAME_EX_ etx_send_data(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *buffer)
 {
   if (buffer == NULL) {
     return ETX_DL_FRAME_EX_ERR;
@@ -274,25 +596,25 @@ static ETX_DL_FRAME_EX_ etx_send_data(ETX_DL_FRAME_ *buffer)
 
   HAL_StatusTypeDef status;
 
-  status = etx_tx_data(buffer);
+  status = etx_tx_data(channel->huart, buffer);
   if (status != HAL_OK) {
     return ETX_DL_FRAME_EX_ERR;
   }
 
-  return etx_receive_response(rsp_buffer);
+  return etx_receive_response(channel);
 }
 
-static ETX_DL_FRAME_EX_ etx_send_response(ETX_DL_RSP_ rsp)
+static ETX_DL_FRAME_EX_ etx_send_response(ETX_DL_CHANNEL_ *channel, ETX_DL_RSP_ rsp)
 {
   //clear the buffer
-  memset( rsp_buffer, 0, ETX_RSPF_PACKET_SIZE );
+  memset( channel->rsp_buffer, 0, ETX_RSPF_PACKET_SIZE );
 
-  ETX_DL_RSPF_ *response_frame = (ETX_DL_RSPF_ *)rsp_buffer;
+  ETX_DL_RSPF_ *response_frame = (ETX_DL_RSPF_ *)channel->rsp_buffer;
 
   if (rsp == ETX_DL_RSP_NACK) {
-    nack_sent_count++;
+    channel->nack_sent_count++;
   } else {
-    nack_sent_count = 0; // Reset on ACK
+    channel->nack_sent_count = 0; // Reset on ACK
   }
 
   response_frame->sof = ETX_FRAME_SOF;
@@ -300,112 +622,1614 @@ static ETX_DL_FRAME_EX_ etx_send_response(ETX_DL_RSP_ rsp)
   response_frame->packet_type = ETX_DL_FRAME_TYPE_RESPONSE;
   response_frame->payload = rsp;
 
-  return etx_tx_rsp(response_frame);
+  return etx_tx_rsp(channel->huart, response_frame);
 }
 
-static HAL_StatusTypeDef etx_tx_data(ETX_DL_FRAME_ *buffer)
+static ETX_DL_FRAME_EX_ etx_send_status(ETX_DL_CHANNEL_ *channel, ETX_DL_RSP_ rsp, uint32_t index, uint32_t bitmap)
 {
-  if (buffer == NULL) {
-    return HAL_ERROR;
+  uint8_t status_frame[ETX_STATUS_BITMAP_PAYLOAD_SIZE + ETX_FRAME_DATA_OVERHEAD];
+  uint16_t payload_len = (bitmap != 0) ? ETX_STATUS_BITMAP_PAYLOAD_SIZE : ETX_STATUS_PAYLOAD_SIZE;
+  uint32_t crc;
+
+  status_frame[0] = ETX_FRAME_SOF;
+  status_frame[1] = ETX_DL_FRAME_TYPE_STATUS;
+  status_frame[2] = payload_len;
+  status_frame[3] = 0;
+  status_frame[4] = rsp;
+  memcpy(&status_frame[5], &index, sizeof(index));
+  memcpy(&status_frame[9], &bitmap, sizeof(bitmap));
+
+  // calculate crc for (SOF + packet_type + payload_len + payload)
+  crc = compute_crc32(&hcrc, (uint32_t *)status_frame, payload_len + 4);
+  memcpy(&status_frame[payload_len + 4], &crc, sizeof(crc));
+  status_frame[payload_len + 8] = ETX_FRAME_EOF;
+
+  if (HAL_UART_Transmit(channel->huart, status_frame, payload_len + ETX_FRAME_DATA_OVERHEAD, HAL_DL_UART_RX_TIMEOUT) != HAL_OK) {
+    return ETX_DL_FRAME_EX_ERR;
   }
 
-  HAL_StatusTypeDef status;
+  return ETX_DL_FRAME_EX_OK;
+}
 
-  // calculate crc for (SOF + packet_type + payload_len + payload)
-  buffer->crc = compute_crc32(&hcrc, (uint32_t *)&buffer, (buffer->payload_len + 4)); 
+/**
+ * @brief  Streaming: report a bad frame and throw away what the host still
+ *         has in flight. The STATUS NACK carries the fragment to resume from,
+ *         the host goes quiet when it sees it and resends from there.
+ * @param  bitmap: bad sub-blocks of the fragment (host sends a REPAIR
+ *         frame first), 0 to resend whole frames
+ * @retval None
+ */
+static void etx_stream_nack(ETX_DL_CHANNEL_ *channel, uint32_t bitmap)
+{
+  channel->nack_sent_count++;
+  LOG_WARN("Stream error at fragment %u, requesting resend (%u/%u)\r\n", received_data_fragments, channel->nack_sent_count, max_nack_retries);
+  etx_send_status(channel, ETX_DL_RSP_NACK, received_data_fragments, bitmap);
 
-  // send (SOF + packet_type + payload_len + payload)
-  status = HAL_UART_Transmit(&huart2, (uint8_t *)&buffer->sof, (buffer->payload_len + 4), HAL_DL_UART_RX_TIMEOUT);
-  if (status != HAL_OK) return status;
+  etx_ring_drain(ETX_STREAM_IDLE_MS);
+}
 
-  // send (CRC + EOF)
-  status = HAL_UART_Transmit(&huart2, (uint8_t *)&buffer->crc, 5, HAL_DL_UART_RX_TIMEOUT);
-  if (status != HAL_OK) return status;
+static uint32_t etx_subblock_count(uint32_t data_len)
+{
+  return (data_len + ETX_SUBBLOCK_SIZE - 1) / ETX_SUBBLOCK_SIZE;
+}
 
-  return HAL_OK;
+static uint32_t etx_subblock_len(uint32_t data_len, uint32_t index)
+{
+  uint32_t left = data_len - (index * ETX_SUBBLOCK_SIZE);
+  return (left > ETX_SUBBLOCK_SIZE) ? ETX_SUBBLOCK_SIZE : left;
 }
 
-static HAL_StatusTypeDef etx_tx_rsp(ETX_DL_RSPF_ *buffer)
+/**
+ * @brief  Check the sub-block CRCs of a DATA_SB frame. A fragment with bad
+ *         sub-blocks is kept in sb_data until the host repairs them.
+ * @param  frame: received frame, its frame CRC may have failed
+ * @param  data: set to the fragment data, NULL while sub-blocks are bad
+ * @param  length: set to the fragment length
+ * @retval false if the frame layout is invalid
+ */
+static bool etx_subblock_check(ETX_DL_FRAME_ *frame, uint8_t **data, uint32_t *length)
 {
-  if (buffer == NULL) {
-    return HAL_ERROR;
+  uint32_t count = (frame->payload_len + ETX_SUBBLOCK_SIZE + 3) / (ETX_SUBBLOCK_SIZE + 4);
+  uint32_t data_len = frame->payload_len - (count * 4);
+  uint8_t *frame_data = &frame->payload[count * 4];
+  uint32_t bad = 0;
+  uint32_t crc;
+
+  sb_bad_bitmap = 0; // a new frame replaces any pending repair
+
+  if (count == 0 || count > ETX_SUBBLOCK_MAX || etx_subblock_count(data_len) != count) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(&crc, &frame->payload[i * 4], sizeof(crc));
+    if (compute_crc32(&hcrc, (uint32_t *)&frame_data[i * ETX_SUBBLOCK_SIZE], etx_subblock_len(data_len, i)) != crc) {
+      bad |= (1UL << i);
+    }
+  }
+
+  *length = data_len;
+  if (bad == 0) {
+    // only the CRC table or frame CRC was hit, the data itself is good
+    *data = frame_data;
+    return true;
   }
 
-  return HAL_UART_Transmit(&huart2, (uint8_t *)&buffer->sof, ETX_RSPF_PACKET_SIZE, HAL_DL_UART_RX_TIMEOUT);
+  memcpy(sb_crc, frame->payload, count * 4);
+  memcpy(sb_data, frame_data, data_len);
+  sb_data_len = data_len;
+  sb_bad_bitmap = bad;
+  *data = NULL;
+
+  LOG_WARN("Fragment %u: bad sub-blocks 0x%08lX\r\n", received_data_fragments, sb_bad_bitmap);
+  return true;
 }
 
-static HAL_StatusTypeDef etx_rx_data(uint8_t *buffer)
+/**
+ * @brief  Patch the pending fragment with the sub-blocks of a REPAIR frame
+ * @param  frame: received frame (frame CRC verified)
+ * @param  data: set to the fragment data, NULL while sub-blocks are bad
+ * @param  length: set to the fragment length
+ * @retval false if no repair is pending or the frame does not match it
+ */
+static bool etx_subblock_repair(ETX_DL_FRAME_ *frame, uint8_t **data, uint32_t *length)
 {
-  if (buffer == NULL) {
-    return HAL_ERROR;
+  uint32_t index, bitmap;
+  uint32_t pos = ETX_REPAIR_HDR_SIZE;
+
+  if (sb_bad_bitmap == 0 || frame->payload_len < ETX_REPAIR_HDR_SIZE) {
+    return false;
+  }
+
+  memcpy(&index, &frame->payload[0], sizeof(index));
+  memcpy(&bitmap, &frame->payload[4], sizeof(bitmap));
+  if (index != received_data_fragments || bitmap != sb_bad_bitmap) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < etx_subblock_count(sb_data_len); i++) {
+    if ((bitmap & (1UL << i)) == 0) {
+      continue;
+    }
+
+    uint32_t sb_len = etx_subblock_len(sb_data_len, i);
+    if (pos + 4 + sb_len > frame->payload_len) {
+      return false;
+    }
+
+    memcpy(&sb_crc[i], &frame->payload[pos], 4);
+    memcpy(&((uint8_t *)sb_data)[i * ETX_SUBBLOCK_SIZE], &frame->payload[pos + 4], sb_len);
+    if (compute_crc32(&hcrc, &sb_data[(i * ETX_SUBBLOCK_SIZE) / 4], sb_len) == sb_crc[i]) {
+      sb_bad_bitmap &= ~(1UL << i);
+    }
+    pos += 4 + sb_len;
   }
 
-  uint32_t index = 0;
+  if (pos != frame->payload_len) {
+    return false;
+  }
+
+  *length = sb_data_len;
+  *data = (sb_bad_bitmap == 0) ? (uint8_t *)sb_data : NULL;
+  return true;
+}
+
+/* NACK the pending fragment with its bad sub-block bitmap */
+static void etx_subblock_nack(ETX_DL_CHANNEL_ *channel)
+{
+  if (is_streaming) {
+    etx_stream_nack(channel, sb_bad_bitmap);
+    return;
+  }
+
+  channel->nack_sent_count++;
+  LOG_WARN("Requesting repair of fragment %u (%u/%u)\r\n", received_data_fragments, channel->nack_sent_count, max_nack_retries);
+  etx_send_status(channel, ETX_DL_RSP_NACK, received_data_fragments, sb_bad_bitmap);
+}
+
+/**
+ * @brief  Stream a flash range to the host in READ_DATA frames. Each frame
+ *         carries its offset and CRC and waits for the host's ACK before the
+ *         next one goes out; a NACK (or garbage) resends it. CTS still holds
+ *         the transmitter off if the host wires RTS.
+ * @param  frame: READ command (address, length), reused as the tx frame
+ * @retval None
+ */
+static void etx_read_back(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame)
+{
+  ETX_DL_RSPF_ *rsp_frame = (ETX_DL_RSPF_ *)channel->rsp_buffer;
+  uint32_t address, length;
+
+  memcpy(&address, &frame->payload[1], sizeof(address));
+  memcpy(&length, &frame->payload[5], sizeof(length));
+
+  if (length == 0 || address < FLASH_BANK1_BASE || address > FLASH_END || length > (FLASH_END - address + 1)) {
+    LOG_ERROR("Invalid read range 0x%08lX + %lu bytes\r\n", address, length);
+    etx_send_response(channel, ETX_DL_RSP_NACK);
+    return;
+  }
+
+  LOG_INFO("Reading %lu bytes from 0x%08lX...\r\n", length, address);
+  etx_send_response(channel, ETX_DL_RSP_ACK);
+
+  for (uint32_t offset = 0; offset < length; ) {
+    uint32_t chunk = ((length - offset) > ETX_READ_CHUNK_SIZE) ? ETX_READ_CHUNK_SIZE : (length - offset);
+    uint8_t retries = 0;
+
+    frame->sof = ETX_FRAME_SOF;
+    frame->eof = ETX_FRAME_EOF;
+    frame->packet_type = ETX_DL_FRAME_TYPE_READ_DATA;
+    frame->payload_len = ETX_READ_HDR_SIZE + chunk;
+    memcpy(frame->payload, &offset, sizeof(offset));
+    memcpy(&frame->payload[ETX_READ_HDR_SIZE], (const void *)(address + offset), chunk);
+
+    do {
+      if (etx_tx_data(channel->huart, frame) != HAL_OK) {
+        LOG_ERROR("Read-back send failed at offset %lu\r\n", offset);
+        return;
+      }
+
+      HAL_StatusTypeDef status = etx_rx_rsp(rsp_frame);
+      if (status == HAL_OK && rsp_frame->payload == ETX_DL_RSP_ACK) {
+        break;
+      } else if (status == HAL_TIMEOUT || ++retries >= max_nack_retries) {
+        LOG_ERROR("Read-back aborted at offset %lu\r\n", offset);
+        return;
+      }
+      LOG_WARN("Host NACKed offset %lu, resending (%u/%u)\r\n", offset, retries, max_nack_retries);
+    } while (true);
+
+    offset += chunk;
+  }
+
+  LOG_INFO("Read-back of %lu bytes complete\r\n", length);
+}
+
+/**
+ * @brief  Striping: hand USART3 over to the download (or back to the logger).
+ *         The logger is muted while USART3 runs at the download baud rate.
+ * @param  enable: true to make USART3 the second lane
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_usart3_lane(bool enable)
+{
   HAL_StatusTypeDef status;
 
-  // Receive SOF
-  status = HAL_UART_Receive(&huart2, &buffer[index], 4, HAL_DL_UART_RX_MAX_TIMEOUT);
-  if (status != HAL_OK) {
-    return status;
-  } else if (buffer[index] != ETX_FRAME_SOF) {
-    return HAL_ERROR; // Invalid SOF
+  if (enable) {
+    usart3_log_init = huart3.Init;
+    logger_muted = true;
+    huart3.Init.BaudRate = huart2.Init.BaudRate;
+    huart3.Init.OverSampling = huart2.Init.OverSampling;
+  } else {
+    huart3.Init = usart3_log_init;
   }
 
-  index += 1;
-  uint16_t payload_len = (buffer[index + 2] << 8) | buffer[index + 1];
-  if (payload_len > ETX_FRAME_DATA_MAX_SIZE) {
-    return HAL_ERROR; // Payload length exceeds maximum
+  status = HAL_UART_Init(&huart3);
+
+  if (!enable) {
+    logger_muted = false;
   }
 
-  // Receive payload
-  index += 3;
-  status = HAL_UART_Receive(&huart2, &buffer[index], payload_len, HAL_DL_UART_RX_MAX_TIMEOUT);
-  if (status != HAL_OK) {
-    return status;
+  return status;
+}
+
+/**
+ * @brief  Striping: arm a lane for the next frame header.
+ * @param  lane: lane to arm
+ * @retval None
+ */
+static void etx_lane_arm(ETX_DL_CHANNEL_ *lane)
+{
+  // the receiver timeout only runs inside a frame, an idle lane may stay quiet
+  CLEAR_BIT(lane->huart->Instance->CR2, USART_CR2_RTOEN);
+  lane->rx_state = ETX_LANE_RX_HEADER;
+
+  if (HAL_UART_Receive_IT(lane->huart, lane->rx_buffer, 4) != HAL_OK) {
+    lane->rx_state = ETX_LANE_RX_ERROR;
   }
+}
 
-  // Receive CRC and EOF
-  index += ETX_FRAME_DATA_MAX_SIZE;
-  status = HAL_UART_Receive(&huart2, &buffer[index], 5, HAL_DL_UART_RX_TIMEOUT);
-  if (status != HAL_OK) {
-    return status;
-  } else if (buffer[index + 4] != ETX_FRAME_EOF) {
-    return HAL_ERROR; // Invalid EOF
+/**
+ * @brief  Striping: throw away the rest of a broken frame on a lane.
+ * @param  lane: lane to drain
+ * @retval None
+ */
+static void etx_lane_drain(ETX_DL_CHANNEL_ *lane)
+{
+  uint8_t byte;
+
+  HAL_UART_AbortReceive(lane->huart);
+  CLEAR_BIT(lane->huart->Instance->CR2, USART_CR2_RTOEN);
+
+  // drain until the line has been quiet for ETX_STREAM_IDLE_MS
+  while (HAL_UART_Receive(lane->huart, &byte, 1, ETX_STREAM_IDLE_MS) == HAL_OK);
+  __HAL_UART_CLEAR_FLAG(lane->huart, UART_CLEAR_OREF | UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_RTOF);
+}
+
+/**
+ * @brief  Striping: stop both lanes and give USART2 back to the receive ring.
+ * @retval None
+ */
+static void etx_stripe_stop(void)
+{
+  HAL_NVIC_DisableIRQ(USART2_IRQn);
+  HAL_NVIC_DisableIRQ(USART3_IRQn);
+
+  for (uint32_t i = 0; i < ETX_DL_CHANNEL_COUNT; i++) {
+    HAL_UART_AbortReceive(dl_channels[i].huart);
+    CLEAR_BIT(dl_channels[i].huart->Instance->CR2, USART_CR2_RTOEN);
+    dl_channels[i].rx_state = ETX_LANE_RX_IDLE;
+  }
+
+  // END (or the host's next START) follows on USART2
+  if (etx_ring_start() != HAL_OK) {
+    LOG_ERROR("Failed to restart USART2 reception\r\n");
+  }
+}
+
+/**
+ * @brief  Offset-addressed download (striping, broadcast): erase the
+ *         sectors the image covers up front, fragments may then arrive in
+ *         any order.
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_data_at_begin(void)
+{
+  if (total_data_fragments == 0 || total_data_fragments > ETX_DL_MAX_FRAGMENTS) {
+    LOG_ERROR("Image of %lu bytes does not fit the application area\r\n", total_data_size);
+    return HAL_ERROR;
+  }
+
+  is_flash_write_started = true;
+  if (flash_erase_application() != HAL_OK || etx_erase_wait(total_data_size) != HAL_OK) {
+    LOG_ERROR("Failed to erase application area\r\n");
+    return HAL_ERROR;
   }
+  memset(fragment_map, 0, sizeof(fragment_map));
 
   return HAL_OK;
 }
 
-static HAL_StatusTypeDef etx_rx_rsp(ETX_DL_RSPF_ *buffer)
+/**
+ * @brief  Offset-addressed download: check a DATA_AT frame (CRC already
+ *         checked by the caller).
+ * @param  frame: received frame
+ * @param  offset: image offset of the data
+ * @param  length: data length
+ * @retval true if the frame fits the image
+ */
+static bool etx_data_at_check(ETX_DL_FRAME_ *frame, uint32_t *offset, uint32_t *length)
 {
-  if (buffer == NULL) {
+  uint32_t expected;
+
+  if (frame->packet_type != ETX_DL_FRAME_TYPE_DATA_AT ||
+      frame->payload_len <= ETX_DATA_AT_HDR_SIZE) {
+    return false;
+  }
+
+  memcpy(offset, frame->payload, sizeof(*offset));
+  *length = frame->payload_len - ETX_DATA_AT_HDR_SIZE;
+
+  if ((*offset % ETX_FRAME_DATA_MAX_SIZE) != 0 || *offset >= total_data_size) {
+    return false;
+  }
+
+  expected = total_data_size - *offset;
+  if (expected > ETX_FRAME_DATA_MAX_SIZE) {
+    expected = ETX_FRAME_DATA_MAX_SIZE;
+  }
+
+  return (*length == expected);
+}
+
+/**
+ * @brief  Offset-addressed download: flash a DATA_AT fragment unless it is
+ *         already in (the host resent it).
+ * @param  frame: checked DATA_AT frame
+ * @param  offset: image offset of the data
+ * @param  length: data length
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_data_at_flash(ETX_DL_FRAME_ *frame, uint32_t offset, uint32_t length)
+{
+  uint32_t index = offset / ETX_FRAME_DATA_MAX_SIZE;
+
+  if ((fragment_map[index / 32] & (1UL << (index % 32))) != 0) {
+    return HAL_OK;
+  }
+  if (offset == 0 && etx_image_header_ok(&frame->payload[ETX_DATA_AT_HDR_SIZE]) != HAL_OK) {
+    return HAL_ERROR; // erased already, but nothing of a wrong image is programmed or CRCed
+  }
+
+  if (flash_application_data(DOWNLOAD_ADDRESS + offset, (uint32_t *)&frame->payload[ETX_DATA_AT_HDR_SIZE], length) != HAL_OK) {
     return HAL_ERROR;
   }
+  fragment_map[index / 32] |= (1UL << (index % 32));
+  received_data_fragments++;
+  etx_image_crc_update();
 
-  HAL_StatusTypeDef status;
+  return HAL_OK;
+}
 
-  status = HAL_UART_Receive(&huart2, (uint8_t *)&buffer->sof, ETX_RSPF_PACKET_SIZE, HAL_DL_UART_RX_MAX_TIMEOUT);
-  if (status != HAL_OK) {
-    return status;
-  } else {
-    if (buffer->sof != ETX_FRAME_SOF 
-      || buffer->eof != ETX_FRAME_EOF
-      || buffer->packet_type != ETX_DL_FRAME_TYPE_RESPONSE
-      || buffer->payload < ETX_DL_RSP_ACK
-      || buffer->payload > ETX_DL_RSP_NACK) {
-      return HAL_ERROR;
+/**
+ * @brief  Extend the sector CRCs (the image's hash tree leaves) over
+ *         fragments now in flash. It runs over the flash contents, not the
+ *         frame buffer, so a bad write shows up in it; fragments that came
+ *         out of order are added once the ones ahead of them are in.
+ * @retval None
+ */
+static void etx_image_crc_update(void)
+{
+  while (image_crc_fragments < total_data_fragments) {
+    uint32_t index = image_crc_fragments;
+    uint32_t offset = index * ETX_FRAME_DATA_MAX_SIZE;
+    uint32_t length = total_data_size - offset;
+
+    if ((is_striped || is_broadcast) ? ((fragment_map[index / 32] & (1UL << (index % 32))) == 0)
+                                     : (index >= received_data_fragments)) {
+      break;
     }
+    if (length > ETX_FRAME_DATA_MAX_SIZE) {
+      length = ETX_FRAME_DATA_MAX_SIZE;
+    }
+
+    // a fragment can straddle a sector boundary
+    while (length > 0) {
+      uint32_t sector = offset / FLASH_SECTOR_SIZE;
+      uint32_t chunk = ((sector + 1U) * FLASH_SECTOR_SIZE) - offset;
+
+      if (chunk > length) {
+        chunk = length;
+      }
+      image_sector_crc[sector] = accumulate_crc32(&hcrc, image_sector_crc[sector],
+                                                  (uint32_t *)(DOWNLOAD_ADDRESS + offset), chunk);
+      offset += chunk;
+      length -= chunk;
+    }
+    image_crc_fragments++;
   }
+}
 
-  return HAL_OK;
+/**
+ * @brief  Check the image CRC, the root of the sector CRCs, against the
+ *         header's before the image counts as flashed.
+ * @retval true if every fragment is in and the CRC matches
+ */
+static bool etx_image_crc_ok(void)
+{
+  uint32_t image_crc = tree_root_crc32(image_sector_crc, FLASH_SECTOR_SIZE, total_data_size);
+
+  if (image_crc_fragments != total_data_fragments || image_crc != expected_crc) {
+    LOG_ERROR("Image CRC mismatch: Flashed = 0x%08lX (%u/%u fragments), Expected = 0x%08lX\r\n",
+              image_crc, image_crc_fragments, total_data_fragments, expected_crc);
+    return false;
+  }
+  return true;
 }
 
-static HAL_StatusTypeDef flash_application_data(uint32_t address, uint32_t *data, uint32_t length)
+/**
+ * @brief  Check the image header in the first fragment against the download
+ *         header: right magic and load address, the size the host announced
+ *         and a plausible vector table, before any of it is programmed.
+ * @param  image: first fragment (image offset 0)
+ * @retval HAL_OK if the image may be flashed
+ */
+static HAL_StatusTypeDef etx_image_header_ok(const uint8_t *image)
 {
-  return write_flash(address, data, length, FLASH_BANK_2);
+  imageHeader_t header;
+  image_status_t status = image_check_header(&hcrc, image, total_data_size, &header);
+
+  if (status != IMAGE_OK) {
+    LOG_ERROR("Image rejected: %s\r\n", image_status_str(status));
+    return HAL_ERROR;
+  }
+  LOG_INFO("Image header: v%lu.%lu.%lu, %lu bytes for 0x%08lX\r\n",
+           header.app_version >> 16, (header.app_version >> 8) & 0xFFU, header.app_version & 0xFFU,
+           header.image_size, header.load_address);
+
+  return HAL_OK;
 }
 
-static HAL_StatusTypeDef flash_erase_application()
+/**
+ * @brief  Staging: take the sector CRCs from the header. Their root has to
+ *         be the image CRC, each chunk is checked against them in RAM.
+ * @param  frame: HEADER frame, size and CRC already taken
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_staged_begin(ETX_DL_FRAME_ *frame)
 {
-  return erase_flash(FLASH_BANK_2, FLASH_SECTOR_0, FLASH_SECTOR_TOTAL);
+  uint32_t sectors = (total_data_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+
+  if (frame->payload_len != 8U + (sectors * 4U)) {
+    LOG_ERROR("Staged header carries %u bytes, %lu sector CRCs expected\r\n", frame->payload_len, sectors);
+    return HAL_ERROR;
+  }
+
+  memset(staged_sector_crc, 0, sizeof(staged_sector_crc));
+  memcpy(staged_sector_crc, &frame->payload[8], sectors * 4U);
+  if (tree_root_crc32(staged_sector_crc, FLASH_SECTOR_SIZE, total_data_size) != expected_crc) {
+    LOG_ERROR("Sector CRCs do not add up to the image CRC\r\n");
+    return HAL_ERROR;
+  }
+
+  // D2 SRAM1 + SRAM2 hold the second part of each chunk
+  __HAL_RCC_D2SRAM1_CLK_ENABLE();
+  __HAL_RCC_D2SRAM2_CLK_ENABLE();
+
+  stage_base = 0;
+  erase_sectors = 0;
+  erased_sectors = 0;
+  is_erase_pending = false;
+  LOG_INFO("Staging in RAM, %lu KB per chunk\r\n", (uint32_t)(ETX_STAGE_SIZE / 1024U));
+
+  return HAL_OK;
+}
+
+/* Staging: where an offset into the chunk lives, D1 first then D2 */
+static uint8_t *etx_stage_ptr(uint32_t offset)
+{
+  return (offset < ETX_STAGE_D1_SIZE) ? &stage_d1[offset] : &stage_d2[offset - ETX_STAGE_D1_SIZE];
+}
+
+/**
+ * @brief  Staging: check the sectors of the chunk in RAM against the
+ *         header's sector CRCs. Sectors never straddle D1 and D2.
+ * @param  end: image offset where the chunk ends
+ * @param  bad_sector: set to the first sector that does not match
+ * @retval true if every sector matches
+ */
+static bool etx_staged_check(uint32_t end, uint32_t *bad_sector)
+{
+  for (uint32_t start = stage_base; start < end; start += FLASH_SECTOR_SIZE) {
+    uint32_t length = ((end - start) < FLASH_SECTOR_SIZE) ? (end - start) : FLASH_SECTOR_SIZE;
+    uint32_t sector = start / FLASH_SECTOR_SIZE;
+
+    if (compute_crc32(&hcrc, (uint32_t *)etx_stage_ptr(start - stage_base), length) != staged_sector_crc[sector]) {
+      *bad_sector = sector;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief  Staging: flash a checked chunk in one pass. The sectors were
+ *         erased in the background while the chunk came in, unless it is
+ *         the first; each sector is read back and must match its CRC.
+ * @param  end: image offset where the chunk ends
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_staged_flash(uint32_t end)
+{
+  uint32_t length = end - stage_base;
+  uint32_t d1_length = (length < ETX_STAGE_D1_SIZE) ? length : ETX_STAGE_D1_SIZE;
+
+  // a background erase that failed is done again below
+  if (erase_flash_wait(HAL_FLASH_ERASE_TIMEOUT * (ETX_STAGE_SIZE / FLASH_SECTOR_SIZE)) == HAL_TIMEOUT) {
+    return HAL_ERROR;
+  }
+  for (uint32_t start = stage_base; start < end; start += FLASH_SECTOR_SIZE) {
+    if (!is_flash_blank(DOWNLOAD_ADDRESS + start, FLASH_SECTOR_SIZE) &&
+        erase_flash(FLASH_BANK_2, DOWNLOAD_FIRST_SECTOR + (start / FLASH_SECTOR_SIZE), 1) != HAL_OK) {
+      return HAL_ERROR;
+    }
+  }
+
+  if (flash_session_begin() != HAL_OK ||
+      flash_session_write(DOWNLOAD_ADDRESS + stage_base, stage_d1, d1_length) != HAL_OK ||
+      flash_session_write(DOWNLOAD_ADDRESS + stage_base + d1_length, stage_d2, length - d1_length) != HAL_OK ||
+      flash_session_flush() != HAL_OK) {
+    LOG_ERROR("Failed to flash the chunk at 0x%08lX\r\n", DOWNLOAD_ADDRESS + stage_base);
+    return HAL_ERROR;
+  }
+
+  for (uint32_t start = stage_base; start < end; start += FLASH_SECTOR_SIZE) {
+    uint32_t sector = start / FLASH_SECTOR_SIZE;
+    uint32_t sector_len = ((end - start) < FLASH_SECTOR_SIZE) ? (end - start) : FLASH_SECTOR_SIZE;
+
+    image_sector_crc[sector] = compute_crc32(&hcrc, (uint32_t *)(DOWNLOAD_ADDRESS + start), sector_len);
+    if (image_sector_crc[sector] != staged_sector_crc[sector]) {
+      LOG_ERROR("Sector %lu reads back wrong\r\n", sector);
+      return HAL_ERROR;
+    }
+  }
+  image_crc_fragments = received_data_fragments;
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Staging: one frame in the DATA state. Fragments come in order,
+ *         as in streaming, and are copied into the chunk. A full chunk (or
+ *         the end of the image) is checked in RAM, a bad sector is sent
+ *         again from its first fragment; only a chunk that checks out is
+ *         flashed. The summary goes out before the last chunk is flashed,
+ *         the host is done once it has sent the last byte.
+ * @param  frame: received frame (CRC checked)
+ * @retval next state
+ */
+static ETX_DL_STATE_ etx_staged_frame(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame)
+{
+  uint32_t offset = received_data_fragments * ETX_FRAME_DATA_MAX_SIZE;
+  uint32_t length = ((total_data_size - offset) < ETX_FRAME_DATA_MAX_SIZE) ? (total_data_size - offset) : ETX_FRAME_DATA_MAX_SIZE;
+  uint32_t end = ((total_data_size - stage_base) < ETX_STAGE_SIZE) ? total_data_size : (stage_base + ETX_STAGE_SIZE);
+  uint32_t into = offset - stage_base;
+  uint32_t bad_sector;
+
+  if (frame->packet_type != ETX_DL_FRAME_TYPE_DATA || frame->payload_len != length) {
+    etx_stream_nack(channel, 0);
+    return ETX_DL_STATE_DATA;
+  }
+
+  // a fragment can straddle D1 and D2
+  uint32_t d1_part = (into < ETX_STAGE_D1_SIZE) ? (ETX_STAGE_D1_SIZE - into) : 0;
+  d1_part = (d1_part < length) ? d1_part : length;
+  memcpy(etx_stage_ptr(into), frame->payload, d1_part);
+  memcpy(etx_stage_ptr(into + d1_part), &frame->payload[d1_part], length - d1_part);
+
+  received_data_fragments++;
+  channel->nack_sent_count = 0;
+  if ((offset + length) < end) {
+    return ETX_DL_STATE_DATA;
+  }
+
+  if (!etx_staged_check(end, &bad_sector)) {
+    // the CRC of each frame passed, so it was sent wrong: again from that sector on
+    received_data_fragments = (bad_sector * FLASH_SECTOR_SIZE) / ETX_FRAME_DATA_MAX_SIZE;
+    LOG_WARN("Sector %lu does not match its CRC in RAM\r\n", bad_sector);
+    etx_stream_nack(channel, 0);
+    return ETX_DL_STATE_DATA;
+  }
+  LOG_INFO("Chunk checked in RAM, %u/%u fragments\r\n", received_data_fragments, total_data_fragments);
+
+  if (stage_base == 0) {
+    // the image header is in the first chunk: a wrong image is turned away before anything is erased
+    if (etx_image_header_ok(stage_d1) != HAL_OK) {
+      is_image_rejected = true;
+      return ETX_DL_STATE_FAILED;
+    }
+    if (flash_retire_application() != HAL_OK) {
+      return ETX_DL_STATE_FAILED;
+    }
+    is_flash_write_started = true;
+  }
+
+  if (end == total_data_size) {
+    etx_send_status(channel, ETX_DL_RSP_ACK, received_data_fragments, 0); // summary, END waits in the ring
+  }
+
+  // the host is held off by RTS while the chunk is flashed
+  if (etx_staged_flash(end) != HAL_OK) {
+    return ETX_DL_STATE_FAILED;
+  }
+  stage_base = end;
+
+  if (end == total_data_size) {
+    LOG_INFO("All chunks flashed. Transitioning to Data Complete state...\r\n");
+    return ETX_DL_STATE_DATA_COMPLETE;
+  }
+
+  // the next chunk's sectors erase while it comes in
+  uint32_t next_end = ((total_data_size - end) < ETX_STAGE_SIZE) ? total_data_size : (end + ETX_STAGE_SIZE);
+  if (erase_flash_start(FLASH_BANK_2, DOWNLOAD_FIRST_SECTOR + (end / FLASH_SECTOR_SIZE),
+                        (next_end - end + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) != HAL_OK) {
+    return ETX_DL_STATE_FAILED;
+  }
+
+  return ETX_DL_STATE_DATA;
+}
+
+/**
+ * @brief  Random access download: remember the sector CRCs of the image the
+ *         slot holds now, they stand for the sectors the host leaves alone,
+ *         then take that image out of service. Nothing is erased. The
+ *         leaves count only for an image known to be intact: with A/B slots
+ *         the inactive slot's config is erased before its image is touched,
+ *         otherwise the fingerprint has to match (an interrupted download
+ *         revokes it but leaves is_app_flashed and the old leaves behind).
+ * @param  None
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_random_begin(void)
+{
+  uint32_t buffer[(sizeof(ETX_CONFIG_) + 3U) / 4U];
+  const ETX_CONFIG_ *base = (const ETX_CONFIG_ *)buffer;
+
+#ifdef BL_AB_SLOTS
+  (void)config_log_read(SLOT_CONFIG_ADDR, (ETX_CONFIG_ *)buffer); // the download goes to the other slot
+#else
+  (void)config_log_read(CONFIG_FLASH_ADDR, (ETX_CONFIG_ *)buffer); // not the copy from boot, a revoke since then counts
+#endif
+  bool is_base_valid = (base->config_valid_marker == VALID_CONF_MARKER &&
+                        compute_crc32(&hcrc, buffer, sizeof(ETX_CONFIG_) - 4) == base->config_crc);
+#ifndef BL_AB_SLOTS
+  is_base_valid = is_base_valid && config_is_app_fingerprint_ok(base);
+#endif
+
+  base_size = 0;
+  if (is_base_valid && base->is_app_flashed && base->app_size <= APPLICATION_MAX_SIZE) {
+    memcpy(base_sector_crc, base->app_sector_crc, sizeof(base_sector_crc));
+    if (tree_root_crc32(base_sector_crc, FLASH_SECTOR_SIZE, base->app_size) == base->app_crc) {
+      base_size = base->app_size; // an image from before the hash tree has no leaves to reuse
+    }
+  }
+
+  random_dirty = 0;
+  erase_sectors = 0;
+  erased_sectors = 0;
+  is_erase_pending = false;
+
+  return flash_retire_application();
+}
+
+/**
+ * @brief  Random access download: erase the sectors an ERASE command covers
+ * @param  frame: ERASE command
+ * @retval HAL_OK, HAL_ERROR if the range is invalid (nothing erased),
+ *         HAL_TIMEOUT if an erase failed
+ */
+static HAL_StatusTypeDef etx_random_erase(ETX_DL_FRAME_ *frame)
+{
+  uint32_t offset, length;
+
+  memcpy(&offset, &frame->payload[1], sizeof(offset));
+  memcpy(&length, &frame->payload[5], sizeof(length));
+
+  if (length == 0 || (offset % FLASH_SECTOR_SIZE) != 0 ||
+      offset >= APPLICATION_MAX_SIZE || length > (APPLICATION_MAX_SIZE - offset)) {
+    LOG_ERROR("Invalid erase range +0x%08lX, %lu bytes\r\n", offset, length);
+    return HAL_ERROR;
+  }
+
+  is_flash_write_started = true;
+  for (uint32_t sector = offset / FLASH_SECTOR_SIZE; (sector * FLASH_SECTOR_SIZE) < (offset + length); sector++) {
+    random_dirty |= (1UL << sector);
+    if (is_flash_blank(DOWNLOAD_ADDRESS + (sector * FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE)) {
+      continue;
+    }
+    if (erase_flash(FLASH_BANK_2, DOWNLOAD_FIRST_SECTOR + sector, 1) != HAL_OK) {
+      return HAL_TIMEOUT;
+    }
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Random access download: check a DATA_AT frame. Any offset and
+ *         length inside the image, as long as no flash word is shared with
+ *         another write: offset on a flash word, length whole flash words
+ *         unless the data ends the image.
+ * @param  frame: received frame
+ * @param  offset: image offset of the data
+ * @param  length: data length
+ * @retval true if the frame may be written
+ */
+static bool etx_random_check(ETX_DL_FRAME_ *frame, uint32_t *offset, uint32_t *length)
+{
+  if (frame->payload_len <= ETX_DATA_AT_HDR_SIZE) {
+    return false;
+  }
+
+  memcpy(offset, frame->payload, sizeof(*offset));
+  *length = frame->payload_len - ETX_DATA_AT_HDR_SIZE;
+
+  return ((*offset % FLASH_WORD_SIZE) == 0 && *offset < total_data_size &&
+          *length <= (total_data_size - *offset) &&
+          ((*length % FLASH_WORD_SIZE) == 0 || (*offset + *length) == total_data_size));
+}
+
+/**
+ * @brief  Random access download: program a checked DATA_AT frame. Flash
+ *         words that hold the data already are left alone (a frame sent
+ *         again, data the host did not change), the others must be erased.
+ * @param  frame: checked DATA_AT frame
+ * @param  offset: image offset of the data
+ * @param  length: data length
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_random_write(ETX_DL_FRAME_ *frame, uint32_t offset, uint32_t length)
+{
+  const uint8_t *data = &frame->payload[ETX_DATA_AT_HDR_SIZE];
+  uint32_t words = (length + FLASH_WORD_SIZE - 1) / FLASH_WORD_SIZE;
+  uint32_t run = 0;
+  uint32_t run_len = 0;
+
+  is_flash_write_started = true;
+  for (uint32_t word = 0; word <= words; word++) {
+    uint32_t pos = word * FLASH_WORD_SIZE;
+    uint32_t address = DOWNLOAD_ADDRESS + offset + pos;
+    uint32_t chunk = ((length - pos) > FLASH_WORD_SIZE) ? FLASH_WORD_SIZE : (length - pos);
+    bool is_same = (word == words) || (memcmp((const void *)address, &data[pos], chunk) == 0); // one past the end flushes the run
+
+    if (!is_same) {
+      if (!is_flash_blank(address, FLASH_WORD_SIZE)) {
+        LOG_ERROR("Flash at 0x%08lX not erased\r\n", address);
+        return HAL_ERROR;
+      }
+      if (run_len == 0) {
+        run = pos;
+      }
+      run_len += chunk;
+      continue;
+    }
+
+    // program the run of words that differ in one go
+    if (run_len != 0) {
+      if (flash_application_data(DOWNLOAD_ADDRESS + offset + run, (uint32_t *)&data[run], run_len) != HAL_OK) {
+        return HAL_ERROR;
+      }
+      for (uint32_t sector = (offset + run) / FLASH_SECTOR_SIZE; (sector * FLASH_SECTOR_SIZE) < (offset + run + run_len); sector++) {
+        random_dirty |= (1UL << sector);
+      }
+      run_len = 0;
+    }
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Random access download: the host is done. Sectors erased or
+ *         programmed in this download are read back for their CRCs, the
+ *         others keep the CRC of the image the slot held when it covers the
+ *         same bytes. The root of them all must be the header's CRC.
+ * @retval true if the flash holds the announced image
+ */
+static bool etx_random_commit(void)
+{
+  uint32_t sectors = (total_data_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  uint32_t read_back = 0;
+
+  memset(image_sector_crc, 0, sizeof(image_sector_crc));
+  for (uint32_t sector = 0; sector < sectors; sector++) {
+    uint32_t start = sector * FLASH_SECTOR_SIZE;
+    uint32_t end = ((start + FLASH_SECTOR_SIZE) < total_data_size) ? (start + FLASH_SECTOR_SIZE) : total_data_size;
+    bool is_same_span = (base_size == total_data_size) ||
+                        (end == (start + FLASH_SECTOR_SIZE) && base_size >= end);
+
+    if ((random_dirty & (1UL << sector)) == 0 && base_size > start && is_same_span) {
+      image_sector_crc[sector] = base_sector_crc[sector];
+      continue;
+    }
+    image_sector_crc[sector] = compute_crc32(&hcrc, (uint32_t *)(DOWNLOAD_ADDRESS + start), end - start);
+    read_back++;
+  }
+  image_crc_fragments = total_data_fragments; // the sector CRCs cover the whole image
+  LOG_INFO("Commit: %lu of %lu sectors read back\r\n", read_back, sectors);
+
+  if (etx_image_header_ok((const uint8_t *)DOWNLOAD_ADDRESS) != HAL_OK) {
+    return false;
+  }
+
+  return etx_image_crc_ok();
+}
+
+/**
+ * @brief  Random access download: one frame in the DATA state. DATA_AT
+ *         frames go to their offset, ERASE clears sectors and COMMIT checks
+ *         the image and ends the download; each is ACKed once done. A frame
+ *         that does not fit is NACKed, a flash failure fails the download.
+ * @param  frame: received frame (CRC checked)
+ * @retval next state
+ */
+static ETX_DL_STATE_ etx_random_frame(ETX_DL_CHANNEL_ *channel, ETX_DL_FRAME_ *frame)
+{
+  uint32_t offset, length;
+  HAL_StatusTypeDef status;
+
+  if (frame->packet_type == ETX_DL_FRAME_TYPE_DATA_AT && etx_random_check(frame, &offset, &length)) {
+    if (etx_random_write(frame, offset, length) != HAL_OK) {
+      return ETX_DL_STATE_FAILED;
+    }
+    LOG_DEBUG("Wrote %lu bytes at +0x%08lX\r\n", length, offset);
+  } else if (frame->packet_type == ETX_DL_FRAME_TYPE_CMD && frame->payload_len == ETX_ERASE_CMD_SIZE &&
+             frame->payload[0] == ETX_DL_CMD_ERASE) {
+    status = etx_random_erase(frame);
+    if (status == HAL_TIMEOUT) {
+      return ETX_DL_STATE_FAILED;
+    } else if (status != HAL_OK) {
+      etx_send_response(channel, ETX_DL_RSP_NACK);
+      return ETX_DL_STATE_DATA;
+    }
+  } else if (frame->packet_type == ETX_DL_FRAME_TYPE_CMD && frame->payload_len == 1 &&
+             frame->payload[0] == ETX_DL_CMD_COMMIT) {
+    if (!etx_random_commit()) {
+      is_image_rejected = true; // the host gets a STATUS NACK, written or not
+      return ETX_DL_STATE_FAILED;
+    }
+    LOG_INFO("Image committed. Transitioning to SUCCESS state...\r\n");
+    etx_send_response(channel, ETX_DL_RSP_ACK);
+    return ETX_DL_STATE_SUCCESS;
+  } else {
+    etx_send_response(channel, ETX_DL_RSP_NACK);
+    return ETX_DL_STATE_DATA;
+  }
+
+  etx_send_response(channel, ETX_DL_RSP_ACK);
+  return ETX_DL_STATE_DATA;
+}
+
+/**
+ * @brief  Striping: erase the application area and start receiving on
+ *         USART2 and USART3. Called before the header is ACKed so both lanes
+ *         are listening when the host starts sending.
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_stripe_begin(void)
+{
+  if (etx_data_at_begin() != HAL_OK) {
+    return HAL_ERROR;
+  }
+
+  LOG_INFO("Application area erased. Striping over USART2 + USART3, log paused...\r\n");
+  if (etx_usart3_lane(true) != HAL_OK) {
+    etx_usart3_lane(false);
+    return HAL_ERROR;
+  }
+
+  // USART2 leaves the receive ring, both lanes receive frame by frame
+  etx_ring_stop();
+
+  for (uint32_t i = 0; i < ETX_DL_CHANNEL_COUNT; i++) {
+    ETX_DL_CHANNEL_ *lane = &dl_channels[i];
+
+    lane->nack_sent_count = 0;
+    HAL_UART_ReceiverTimeout_Config(lane->huart, (lane->huart->Init.BaudRate / 1000U) * ETX_STREAM_IDLE_MS);
+    etx_lane_arm(lane);
+  }
+
+  HAL_NVIC_SetPriority(USART2_IRQn, 5, 0);
+  HAL_NVIC_SetPriority(USART3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART2_IRQn);
+  HAL_NVIC_EnableIRQ(USART3_IRQn);
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Striping: take DATA_AT frames from both lanes until every fragment
+ *         is flashed. The lanes receive by interrupt into their own buffers,
+ *         so one lane's frame is flashed while the other keeps receiving.
+ *         Each frame is ACKed on the lane it came in on; a duplicate (the
+ *         host missed our ACK) is ACKed again without flashing it twice.
+ * @retval ETX_DL_STATE_DATA_COMPLETE or ETX_DL_STATE_FAILED
+ */
+static ETX_DL_STATE_ etx_stripe_receive(void)
+{
+  uint32_t last_rx_tick = HAL_GetTick();
+
+  do {
+    for (uint32_t i = 0; i < ETX_DL_CHANNEL_COUNT; i++) {
+      ETX_DL_CHANNEL_ *lane = &dl_channels[i];
+      ETX_DL_FRAME_ *frame = (ETX_DL_FRAME_ *)lane->rx_buffer;
+      ETX_DL_RSP_ rsp = ETX_DL_RSP_NACK;
+      uint32_t offset, length;
+
+      if (lane->rx_state == ETX_LANE_RX_ERROR) {
+        etx_lane_drain(lane);
+      } else if (lane->rx_state != ETX_LANE_RX_READY) {
+        continue;
+      } else if (frame->eof == ETX_FRAME_EOF &&
+                 compute_crc32(&hcrc, (uint32_t *)&frame->sof, frame->payload_len + 4) == frame->crc &&
+                 etx_data_at_check(frame, &offset, &length)) {
+        if (etx_data_at_flash(frame, offset, length) != HAL_OK) {
+          etx_stripe_stop();
+          etx_usart3_lane(false);
+          LOG_ERROR("Failed to flash data at address 0x%08lX\r\n", DOWNLOAD_ADDRESS + offset);
+          return ETX_DL_STATE_FAILED;
+        }
+        rsp = ETX_DL_RSP_ACK;
+      }
+
+      last_rx_tick = HAL_GetTick();
+
+      if (rsp == ETX_DL_RSP_ACK && received_data_fragments >= total_data_fragments) {
+        // last one: stop the lanes, END comes on USART2 the usual way
+        etx_stripe_stop();
+        if (!etx_image_crc_ok()) {
+          etx_usart3_lane(false);   // FAILED reports it, resending would not help
+          return ETX_DL_STATE_FAILED;
+        }
+        etx_send_response(lane, rsp);
+        etx_usart3_lane(false);
+        LOG_INFO("All %u fragments received over both lanes. Transitioning to Data Complete state...\r\n", received_data_fragments);
+        return ETX_DL_STATE_DATA_COMPLETE;
+      }
+
+      // re-arm before answering, the host sends the next frame as soon as it has the ACK
+      etx_lane_arm(lane);
+      etx_send_response(lane, rsp);
+
+      if (lane->nack_sent_count >= max_nack_retries) {
+        etx_stripe_stop();
+        etx_usart3_lane(false);
+        LOG_ERROR("Maximum NACK retries reached on lane %lu. Aborting download...\r\n", i + 1);
+        return ETX_DL_STATE_FAILED;
+      }
+    }
+  } while ((HAL_GetTick() - last_rx_tick) < HAL_DL_UART_RX_MAX_TIMEOUT);
+
+  etx_stripe_stop();
+  etx_usart3_lane(false);
+  LOG_ERROR("Striped download timed out at %u/%u fragments\r\n", received_data_fragments, total_data_fragments);
+  return ETX_DL_STATE_FAILED;
+}
+
+/**
+ * @brief  Broadcast: run USART2 as a half duplex RS-485 node. Flow control
+ *         is off and PD4 (RTS) becomes the transceiver's driver enable,
+ *         asserted by the UART only while it transmits.
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_bus_init(void)
+{
+  huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+
+  // DE asserted 2 bits ahead of the start bit and released 2 bits after the stop bit
+  return HAL_RS485Ex_Init(&huart2, UART_DE_POLARITY_HIGH, 16, 16);
+}
+
+/**
+ * @brief  Broadcast: throw away the rest of a broken frame, or traffic that
+ *         is not for this node, without answering. The bus is always
+ *         USART2, read through the receive ring.
+ * @param  None
+ * @retval None
+ */
+static void etx_bus_drain(void)
+{
+  etx_ring_drain(ETX_BCAST_IDLE_MS);
+}
+
+/**
+ * @brief  Broadcast: answer a POLL with the fragments still missing. Before
+ *         the header is in the fragment count is 0, so the host knows to
+ *         send START/HEADER again.
+ * @param  channel: download channel
+ * @retval ETX_DL_FRAME_EX_
+ */
+static ETX_DL_FRAME_EX_ etx_send_missing(ETX_DL_CHANNEL_ *channel)
+{
+  uint8_t missing_frame[ETX_MISSING_HDR_SIZE + ETX_MISSING_BITMAP_SIZE + ETX_FRAME_DATA_OVERHEAD];
+  uint16_t fragments = (dl_state == ETX_DL_STATE_DATA) ? total_data_fragments : 0;
+  uint16_t payload_len = ETX_MISSING_HDR_SIZE + ((fragments + 7) / 8);
+  uint32_t crc;
+
+  memset(missing_frame, 0, sizeof(missing_frame));
+  missing_frame[0] = ETX_FRAME_SOF;
+  missing_frame[1] = ETX_DL_FRAME_TYPE_MISSING;
+  missing_frame[2] = payload_len;
+  missing_frame[3] = 0;
+  missing_frame[4] = node_address;
+  memcpy(&missing_frame[5], &fragments, sizeof(fragments));
+
+  for (uint32_t i = 0; i < fragments; i++) {
+    if ((fragment_map[i / 32] & (1UL << (i % 32))) == 0) {
+      missing_frame[7 + (i / 8)] |= (1U << (i % 8));
+    }
+  }
+
+  // calculate crc for (SOF + packet_type + payload_len + payload)
+  crc = compute_crc32(&hcrc, (uint32_t *)missing_frame, payload_len + 4);
+  memcpy(&missing_frame[payload_len + 4], &crc, sizeof(crc));
+  missing_frame[payload_len + 8] = ETX_FRAME_EOF;
+
+  if (HAL_UART_Transmit(channel->huart, missing_frame, payload_len + ETX_FRAME_DATA_OVERHEAD, HAL_DL_UART_RX_TIMEOUT) != HAL_OK) {
+    return ETX_DL_FRAME_EX_ERR;
+  }
+
+  return ETX_DL_FRAME_EX_OK;
+}
+
+/**
+ * @brief  Broadcast: take DATA_AT frames off the bus until END. Nothing is
+ *         ACKed, damaged frames are dropped and the host resends whatever
+ *         this node lists in its answer to a POLL. Frames already in are
+ *         not flashed twice.
+ * @param  channel: download channel
+ * @retval ETX_DL_STATE_SUCCESS or ETX_DL_STATE_FAILED
+ */
+static ETX_DL_STATE_ etx_broadcast_receive(ETX_DL_CHANNEL_ *channel)
+{
+  ETX_DL_FRAME_ *frame = (ETX_DL_FRAME_ *)channel->rx_buffer;
+  ETX_DL_FRAME_EX_ status;
+  uint32_t offset, length;
+
+  do {
+    status = etx_receive_data(channel);
+
+    if (status == ETX_DL_FRAME_EX_NO_DATA) {
+      LOG_ERROR("Broadcast timed out at %u/%u fragments\r\n", received_data_fragments, total_data_fragments);
+      return ETX_DL_STATE_FAILED;
+    } else if (status != ETX_DL_FRAME_EX_OK) {
+      etx_bus_drain();
+    } else if (etx_data_at_check(frame, &offset, &length)) {
+      if (etx_data_at_flash(frame, offset, length) != HAL_OK) {
+        LOG_ERROR("Failed to flash data at address 0x%08lX\r\n", DOWNLOAD_ADDRESS + offset);
+        return ETX_DL_STATE_FAILED;
+      }
+    } else if (frame->packet_type == ETX_DL_FRAME_TYPE_POLL &&
+               frame->payload_len == 1 &&
+               frame->payload[0] == node_address) {
+      etx_send_missing(channel);
+    } else if (frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
+               frame->payload_len == 1 &&
+               frame->payload[0] == ETX_DL_CMD_END) {
+      if (received_data_fragments < total_data_fragments) {
+        LOG_ERROR("Broadcast ended at %u/%u fragments\r\n", received_data_fragments, total_data_fragments);
+        return ETX_DL_STATE_FAILED;
+      }
+      if (!etx_image_crc_ok()) {
+        return ETX_DL_STATE_FAILED;
+      }
+      LOG_INFO("All %u fragments received. Transitioning to SUCCESS state...\r\n", received_data_fragments);
+      is_data_transfer_complete = true;
+      return ETX_DL_STATE_SUCCESS;
+    } else if (frame->packet_type == ETX_DL_FRAME_TYPE_CMD &&
+               frame->payload_len == 1 &&
+               frame->payload[0] == ETX_DL_CMD_ABORT) {
+      LOG_ERROR("Broadcast aborted by the host\r\n");
+      return ETX_DL_STATE_FAILED;
+    }
+    // anything else (a repeated START/HEADER, other nodes' answers) is not for us
+  } while (true);
+}
+
+static ETX_DL_CHANNEL_ *etx_lane_of(UART_HandleTypeDef *huart)
+{
+  for (uint32_t i = 0; i < ETX_DL_CHANNEL_COUNT; i++) {
+    if (dl_channels[i].huart == huart && dl_channels[i].rx_state != ETX_LANE_RX_IDLE) {
+      return &dl_channels[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief  Striping: a lane finished receiving the part of the frame it was
+ *         armed for (interrupt context).
+ * @param  huart: UART handle
+ * @retval None
+ */
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  ETX_DL_CHANNEL_ *lane = etx_lane_of(huart);
+  HAL_StatusTypeDef status = HAL_OK;
+
+  if (lane == NULL) {
+    return;
+  }
+
+  ETX_DL_FRAME_ *frame = (ETX_DL_FRAME_ *)lane->rx_buffer;
+
+  switch (lane->rx_state) {
+    case ETX_LANE_RX_HEADER:
+      if (frame->sof != ETX_FRAME_SOF || frame->payload_len > ETX_FRAME_PAYLOAD_MAX_SIZE) {
+        lane->rx_state = ETX_LANE_RX_ERROR;
+        break;
+      }
+
+      // a frame has started: a stalled line from here on is an error
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+      SET_BIT(huart->Instance->CR2, USART_CR2_RTOEN);
+
+      if (frame->payload_len > 0) {
+        lane->rx_state = ETX_LANE_RX_PAYLOAD;
+        status = HAL_UART_Receive_IT(huart, frame->payload, frame->payload_len);
+        break;
+      }
+      /* fall through */
+
+    case ETX_LANE_RX_PAYLOAD:
+      lane->rx_state = ETX_LANE_RX_TRAILER;
+      status = HAL_UART_Receive_IT(huart, (uint8_t *)&frame->crc, 5);
+      break;
+
+    case ETX_LANE_RX_TRAILER:
+      CLEAR_BIT(huart->Instance->CR2, USART_CR2_RTOEN);
+      lane->rx_state = ETX_LANE_RX_READY;
+      break;
+
+    default:
+      break;
+  }
+
+  if (status != HAL_OK) {
+    lane->rx_state = ETX_LANE_RX_ERROR;
+  }
+}
+
+/**
+ * @brief  Receive ring: half/full transfer or idle line on USART2
+ *         (interrupt context). Keeps the byte count current while the main
+ *         loop is busy writing flash.
+ * @param  huart: UART handle
+ * @param  Size: DMA write index (unused, read back from the stream)
+ * @retval None
+ */
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+  (void)Size; // the ring head comes from the DMA NDTR register, not from Size
+  if (huart == &huart2 && rx_ring.running) {
+    etx_ring_update();
+  }
+}
+
+/**
+ * @brief  Striping: UART error or receiver timeout on a lane (interrupt
+ *         context), or a DMA error on the receive ring. The main loop
+ *         drains the lane and NACKs.
+ * @param  huart: UART handle
+ * @retval None
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  ETX_DL_CHANNEL_ *lane = etx_lane_of(huart);
+
+  if (huart == &huart2 && rx_ring.running) {
+    // only a DMA transfer error gets here (line errors are masked), HAL has stopped the ring
+    rx_ring.dropped += (rx_ring.head - rx_ring.tail) + 1U;
+    etx_ring_start();
+    return;
+  }
+
+  if (lane != NULL && lane->rx_state != ETX_LANE_RX_READY) {
+    lane->rx_state = ETX_LANE_RX_ERROR;
+  }
+}
+
+static HAL_StatusTypeDef etx_tx_data(UART_HandleTypeDef *huart, ETX_DL_FRAME_ *buffer)
+{
+  if (buffer == NULL) {
+    return HAL_ERROR;
+  }
+
+  HAL_StatusTypeDef status;
+
+  // calculate crc for (SOF + packet_type + payload_len + payload)
+  buffer->crc = compute_crc32(&hcrc, (uint32_t *)&buffer->sof, (buffer->payload_len + 4));
+
+  // send (SOF + packet_type + payload_len + payload)
+  status = HAL_UART_Transmit(huart, (uint8_t *)&buffer->sof, (buffer->payload_len + 4), HAL_DL_UART_RX_TIMEOUT);
+  if (status != HAL_OK) return status;
+
+  // send (CRC + EOF)
+  status = HAL_UART_Transmit(huart, (uint8_t *)&buffer->crc, 5, HAL_DL_UART_RX_TIMEOUT);
+  if (status != HAL_OK) return status;
+
+  return HAL_OK;
+}
+
+static HAL_StatusTypeDef etx_tx_rsp(UART_HandleTypeDef *huart, ETX_DL_RSPF_ *buffer)
+{
+  if (buffer == NULL) {
+    return HAL_ERROR;
+  }
+
+  return HAL_UART_Transmit(huart, (uint8_t *)&buffer->sof, ETX_RSPF_PACKET_SIZE, HAL_DL_UART_RX_TIMEOUT);
+}
+
+/**
+ * @brief  Receive ring: start circular DMA reception on USART2, from the
+ *         start of the ring. Whatever was left in it is gone.
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_ring_start(void)
+{
+  rx_ring.head = 0;
+  rx_ring.pos = 0;
+  rx_ring.tail = 0;
+  rx_ring.paused = false;
+
+  if (HAL_UARTEx_ReceiveToIdle_DMA(&huart2, rx_ring.buf, ETX_RX_RING_SIZE) != HAL_OK) {
+    rx_ring.running = false;
+    return HAL_ERROR;
+  }
+
+  // a framing or noise error must not stop the ring, the damaged frame fails its CRC instead
+  CLEAR_BIT(huart2.Instance->CR3, USART_CR3_EIE);
+  rx_ring.running = true;
+
+  HAL_NVIC_SetPriority(USART2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART2_IRQn);
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Receive ring: stop reception on USART2 (striping, leaving
+ *         download mode).
+ * @retval None
+ */
+static void etx_ring_stop(void)
+{
+  rx_ring.running = false;
+  HAL_NVIC_DisableIRQ(USART2_IRQn);
+  HAL_UART_AbortReceive(&huart2);
+}
+
+/**
+ * @brief  Receive ring: account for what the DMA wrote since the last
+ *         update. Called on every DMA/idle event and when polled, with
+ *         interrupts masked.
+ *
+ *         Events come at least every half ring, so keeping half a ring
+ *         free means the DMA never laps the parser. Below that the DMA
+ *         request is switched off: the UART holds the next byte, RTS drops
+ *         and the host waits, as it did with blocking reception.
+ * @retval None
+ */
+static void etx_ring_update(void)
+{
+  uint32_t pos = (ETX_RX_RING_SIZE - __HAL_DMA_GET_COUNTER(huart2.hdmarx)) & (ETX_RX_RING_SIZE - 1U);
+
+  rx_ring.head += (pos - rx_ring.pos) & (ETX_RX_RING_SIZE - 1U);
+  rx_ring.pos = pos;
+
+  if (ETX_RX_RING_SIZE - (rx_ring.head - rx_ring.tail) < ETX_RX_RING_HEADROOM) {
+    if (!rx_ring.paused) {
+      rx_ring.paused = true;
+      CLEAR_BIT(huart2.Instance->CR1, USART_CR1_IDLEIE);
+      CLEAR_BIT(huart2.Instance->CR3, USART_CR3_DMAR);
+    }
+  } else if (rx_ring.paused) {
+    rx_ring.paused = false;
+    __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_IDLEF);
+    SET_BIT(huart2.Instance->CR3, USART_CR3_DMAR);
+    SET_BIT(huart2.Instance->CR1, USART_CR1_IDLEIE);
+  }
+}
+
+/**
+ * @brief  Receive ring: bytes waiting for the parser.
+ * @retval byte count
+ */
+static uint32_t etx_ring_level(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  uint32_t level;
+
+  __disable_irq();
+  etx_ring_update();
+  level = rx_ring.head - rx_ring.tail;
+  __set_PRIMASK(primask);
+
+  return level;
+}
+
+static uint8_t etx_ring_peek(uint32_t offset)
+{
+  return rx_ring.buf[(rx_ring.tail + offset) & (ETX_RX_RING_SIZE - 1U)];
+}
+
+static void etx_ring_copy(uint8_t *dest, uint32_t offset, uint32_t length)
+{
+  uint32_t index = (rx_ring.tail + offset) & (ETX_RX_RING_SIZE - 1U);
+  uint32_t first = ETX_RX_RING_SIZE - index;
+
+  if (first > length) {
+    first = length;
+  }
+  memcpy(dest, &rx_ring.buf[index], first);
+  memcpy(&dest[first], rx_ring.buf, length - first);
+}
+
+/**
+ * @brief  Receive ring: hand bytes back to the DMA (resumes it if it was
+ *         paused).
+ * @param  length: bytes consumed
+ * @retval None
+ */
+static void etx_ring_skip(uint32_t length)
+{
+  rx_ring.tail += length;
+  etx_ring_level();
+}
+
+/**
+ * @brief  Receive ring: throw away everything until the line has been
+ *         quiet for a while.
+ * @param  idle_ms: quiet time that ends the drain
+ * @retval None
+ */
+static void etx_ring_drain(uint32_t idle_ms)
+{
+  uint32_t last_rx_tick = HAL_GetTick();
+
+  do {
+    uint32_t level = etx_ring_level();
+
+    if (level != 0) {
+      etx_ring_skip(level);
+      last_rx_tick = HAL_GetTick();
+    }
+  } while ((HAL_GetTick() - last_rx_tick) < idle_ms);
+
+  rx_ring.dropped = 0;
+}
+
+/**
+ * @brief  Take the next frame out of the receive ring.
+ *
+ *         The parser hunts for SOF and only consumes a frame once its
+ *         length is sane, all of it is in and EOF sits where the length
+ *         says; anything else costs one byte and the hunt goes on from the
+ *         next. A partial frame the line has left quiet for ETX_RX_STALL_MS
+ *         was a stray SOF. The CRC is the caller's: a frame that is intact
+ *         apart from it is consumed and reported (DATA_SB repair, NACK).
+ * @param  buffer: frame buffer (ETX_DL_FRAME_ layout)
+ * @param  skipped: bytes thrown away ahead of the frame, including any
+ *         lost to a ring restart
+ * @retval HAL_OK, HAL_TIMEOUT if no frame came in HAL_DL_UART_RX_MAX_TIMEOUT
+ */
+static HAL_StatusTypeDef etx_rx_data(uint8_t *buffer, uint32_t *skipped)
+{
+  uint32_t start_tick = HAL_GetTick();
+  uint32_t last_rx_tick = start_tick;
+  uint32_t last_head = rx_ring.head;
+
+  if (buffer == NULL) {
+    return HAL_ERROR;
+  }
+  if (!rx_ring.running) {
+    return HAL_ERROR;
+  }
+
+  do {
+    uint32_t level = etx_ring_level();
+    uint16_t payload_len;
+
+    if (rx_ring.head != last_head) {
+      last_head = rx_ring.head;
+      last_rx_tick = HAL_GetTick();
+    }
+
+    if (level == 0) {
+      continue;
+    } else if (etx_ring_peek(0) != ETX_FRAME_SOF) {
+      etx_ring_skip(1);
+      (*skipped)++;
+      continue;
+    }
+
+    payload_len = (level >= 4) ? (etx_ring_peek(2) | (etx_ring_peek(3) << 8)) : 0;
+
+    if (payload_len > ETX_FRAME_PAYLOAD_MAX_SIZE) {
+      etx_ring_skip(1);
+      (*skipped)++;
+      continue;
+    } else if (level < 4 || level < (uint32_t)payload_len + ETX_FRAME_DATA_OVERHEAD) {
+      // the rest has not arrived yet, give up on it once the line has gone quiet
+      if ((HAL_GetTick() - last_rx_tick) >= ETX_RX_STALL_MS) {
+        etx_ring_skip(1);
+        (*skipped)++;
+      }
+      continue;
+    } else if (etx_ring_peek(payload_len + 8) != ETX_FRAME_EOF) {
+      etx_ring_skip(1);
+      (*skipped)++;
+      continue;
+    }
+
+    // SOF, type, len, payload; then CRC and EOF where ETX_DL_FRAME_ keeps them
+    etx_ring_copy(buffer, 0, payload_len + 4);
+    etx_ring_copy(&buffer[4 + ETX_FRAME_PAYLOAD_MAX_SIZE], payload_len + 4, 5);
+    etx_ring_skip(payload_len + ETX_FRAME_DATA_OVERHEAD);
+
+    *skipped += rx_ring.dropped;
+    rx_ring.dropped = 0;
+    return HAL_OK;
+  } while ((HAL_GetTick() - start_tick) < HAL_DL_UART_RX_MAX_TIMEOUT);
+
+  return HAL_TIMEOUT;
+}
+
+static HAL_StatusTypeDef etx_rx_rsp(ETX_DL_RSPF_ *buffer)
+{
+  uint32_t start_tick = HAL_GetTick();
+
+  if (buffer == NULL) {
+    return HAL_ERROR;
+  }
+
+  do {
+    uint32_t level = etx_ring_level();
+
+    if (level != 0 && etx_ring_peek(0) != ETX_FRAME_SOF) {
+      etx_ring_skip(1); // leftovers of an earlier frame
+    } else if (level >= ETX_RSPF_PACKET_SIZE) {
+      etx_ring_copy((uint8_t *)&buffer->sof, 0, ETX_RSPF_PACKET_SIZE);
+      etx_ring_skip(ETX_RSPF_PACKET_SIZE);
+
+      if (buffer->sof != ETX_FRAME_SOF 
+        || buffer->eof != ETX_FRAME_EOF
+        || buffer->packet_type != ETX_DL_FRAME_TYPE_RESPONSE
+        || buffer->payload < ETX_DL_RSP_ACK
+        || buffer->payload > ETX_DL_RSP_NACK) {
+        return HAL_ERROR;
+      }
+      return HAL_OK;
+    }
+  } while ((HAL_GetTick() - start_tick) < HAL_DL_UART_RX_MAX_TIMEOUT);
+
+  return HAL_TIMEOUT;
+}
+
+static HAL_StatusTypeDef flash_application_data(uint32_t address, uint32_t *data, uint32_t length)
+{
+  uint32_t end = address - DOWNLOAD_ADDRESS + length;
+
+  if (etx_erase_wait(end) != HAL_OK) {
+    return HAL_ERROR;
+  }
+  // one unlock for the whole download, the tail of the image is padded on flush
+  if (flash_session_begin() != HAL_OK || flash_session_write(address, data, length) != HAL_OK) {
+    return HAL_ERROR;
+  }
+  // flushed per fragment: the CRC reads it back and the next erase needs PG clear
+  return flash_session_flush();
+}
+
+/**
+ * @brief  Take the image in the download slot out of service before any of
+ *         it is erased or written
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef flash_retire_application(void)
+{
+  if (erase_flash_wait(HAL_FLASH_ERASE_TIMEOUT) == HAL_TIMEOUT) {
+    return HAL_ERROR; // an earlier session's erase still running
+  }
+#ifdef BL_AB_SLOTS
+  if (slot_invalidate_inactive() != CFG_SAVE_OK) {
+    return HAL_ERROR; // a rollback could land on the half written slot
+  }
+#else
+  if (config_revoke_app_fingerprint() != CFG_SAVE_OK) {
+    return HAL_ERROR; // a later boot could trust the old image's fingerprint
+  }
+#endif
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Start erasing the sectors the image covers, just in time: the
+ *         first one now, each later one once the writes get within
+ *         ETX_ERASE_LEAD of it. Sectors already blank are skipped.
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef flash_erase_application(void)
+{
+  if (flash_retire_application() != HAL_OK) {
+    return HAL_ERROR;
+  }
+  erase_sectors = (total_data_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+  erased_sectors = 0;
+  is_erase_pending = false;
+
+  return etx_erase_pump(ETX_ERASE_LEAD);
+}
+
+/**
+ * @brief  Erase scheduler: account for a finished erase and, with the bank
+ *         idle, start erasing the next sector if it starts below end.
+ * @param  end: image offset the writes are about to reach
+ * @retval HAL status, HAL_ERROR once an erase failed
+ */
+static HAL_StatusTypeDef etx_erase_pump(uint32_t end)
+{
+  FLASH_ERASE_STATE_ state = erase_flash_state();
+
+  if (state == FLASH_ERASE_BUSY) {
+    return HAL_OK;
+  }
+  if (is_erase_pending) {
+    if (state != FLASH_ERASE_IDLE) {
+      LOG_ERROR("Failed to erase sector %lu of bank 2\r\n", erased_sectors);
+      return HAL_ERROR;
+    }
+    is_erase_pending = false;
+    erased_sectors++;
+  }
+
+  while (erased_sectors < erase_sectors && (erased_sectors * FLASH_SECTOR_SIZE) < end) {
+    if (!is_flash_blank(DOWNLOAD_ADDRESS + (erased_sectors * FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE)) {
+      is_erase_pending = true;
+      return erase_flash_start(FLASH_BANK_2, DOWNLOAD_FIRST_SECTOR + erased_sectors, 1);
+    }
+    erased_sectors++; // already blank
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Wait until the image range up to end is erased and the bank is
+ *         free for programming.
+ * @param  end: image offset
+ * @retval HAL status
+ */
+static HAL_StatusTypeDef etx_erase_wait(uint32_t end)
+{
+  uint32_t start_tick = HAL_GetTick();
+  uint32_t erased = erased_sectors;
+
+  do {
+    if (etx_erase_pump(end) != HAL_OK) {
+      return HAL_ERROR;
+    }
+    if (!is_erase_pending && (erased_sectors >= erase_sectors || (erased_sectors * FLASH_SECTOR_SIZE) >= end)) {
+      return HAL_OK;
+    }
+    if (erased_sectors != erased) {
+      erased = erased_sectors; // one more sector done, the timeout is per sector
+      start_tick = HAL_GetTick();
+    }
+  } while ((HAL_GetTick() - start_tick) < HAL_FLASH_ERASE_TIMEOUT);
+
+  LOG_ERROR("Timed out erasing sector %lu of bank 2\r\n", erased_sectors);
+  return HAL_TIMEOUT;
 }
@@ -1,5 +1,118 @@
 #include "flash_editor.h"
 #include "logger.h"
+#include "boot_profile.h"
+
+/*
+ * Programming session: flash unlocked once, one flash word being assembled
+ */
+typedef struct {
+  uint32_t  word[FLASH_NB_32BITWORD_IN_FLASHWORD]; // flash word being assembled
+  uint32_t  word_addr;                             // its flash address
+  uint32_t  fill;                                  // bit per byte of word written
+  uint32_t  bank;                                  // bank last programmed, 0 = none yet
+  uint32_t  words;                                 // flash words programmed
+  uint32_t  cycles;                                // CPU cycles spent programming
+  bool      is_open;
+} FLASH_SESSION_;
+
+static volatile FLASH_ERASE_STATE_ erase_state = FLASH_ERASE_IDLE;
+static FLASH_SESSION_ flash_session __attribute__((aligned(32)));
+
+static HAL_StatusTypeDef flash_wait_queue(void)
+{
+  __IO uint32_t *sr = (flash_session.bank == FLASH_BANK_2) ? &FLASH->SR2 : &FLASH->SR1;
+  uint32_t errors;
+  uint32_t start_tick = 0;
+  uint32_t spins = 0;
+
+  if (flash_session.bank == 0) {
+    return HAL_OK;
+  }
+
+  // a flash word takes some us: spin on the register, read the tick only every 256 spins
+  while ((*sr & FLASH_SR_QW) != 0) {
+    if (spins == 0) {
+      start_tick = HAL_GetTick();
+    }
+    if ((++spins & 0xFFU) == 0 && (HAL_GetTick() - start_tick) >= HAL_FLASH_OP_TIMEOUT) {
+      return HAL_TIMEOUT;
+    }
+  }
+
+  errors = *sr & FLASH_FLAG_ALL_ERRORS_BANK1; // same bits in SR1 and SR2
+  if (errors != 0) {
+    if (flash_session.bank == FLASH_BANK_2) {
+      FLASH->CCR2 = errors;
+    } else {
+      FLASH->CCR1 = errors;
+    }
+    LOG_ERROR("Flash programming error: SR = 0x%08lX\r\n", errors);
+    return HAL_ERROR;
+  }
+
+  return HAL_OK;
+}
+
+/* Wait for the queue to empty and clear PG, so an erase may follow */
+static HAL_StatusTypeDef flash_end_program(void)
+{
+  HAL_StatusTypeDef status = flash_wait_queue();
+
+  if (flash_session.bank == FLASH_BANK_2) {
+    CLEAR_BIT(FLASH->CR2, FLASH_CR_PG);
+  } else if (flash_session.bank == FLASH_BANK_1) {
+    CLEAR_BIT(FLASH->CR1, FLASH_CR_PG);
+  }
+
+  return status;
+}
+
+/*
+ * Program one flash word. PG stays set and the word is left in the queue:
+ * the next one is written as soon as the flash takes this one, the final
+ * wait is flash_end_program's.
+ */
+static HAL_StatusTypeDef flash_program_word(uint32_t address, const uint32_t *src)
+{
+  __IO uint32_t *dst = (__IO uint32_t *)address;
+  uint32_t bank = IS_FLASH_PROGRAM_ADDRESS_BANK2(address) ? FLASH_BANK_2 : FLASH_BANK_1;
+  HAL_StatusTypeDef status;
+
+  if (bank != flash_session.bank) {
+    status = flash_end_program();
+    if (status != HAL_OK) {
+      return status;
+    }
+    flash_session.bank = bank;
+  } else {
+    status = flash_wait_queue();
+    if (status != HAL_OK) {
+      return status;
+    }
+  }
+
+  if (bank == FLASH_BANK_2) {
+    SET_BIT(FLASH->CR2, FLASH_CR_PG);
+  } else {
+    SET_BIT(FLASH->CR1, FLASH_CR_PG);
+  }
+  __ISB();
+  __DSB();
+  for (uint32_t i = 0; i < FLASH_NB_32BITWORD_IN_FLASHWORD; i++) {
+    dst[i] = src[i];
+  }
+  __ISB();
+  __DSB();
+
+  flash_session.words++;
+  return HAL_OK;
+}
+
+/* Lock the flash again, unless a programming session still needs it unlocked */
+static HAL_StatusTypeDef flash_lock_idle(void)
+{
+  return flash_session.is_open ? HAL_OK : HAL_FLASH_Lock();
+}
 
 HAL_StatusTypeDef erase_flash(uint32_t bank, uint32_t sector, uint32_t num_sectors)
 {
@@ -34,7 +147,7 @@ HAL_StatusTypeDef erase_flash(uint32_t bank, uint32_t sector, uint32_t num_secto
     __HAL_FLASH_CLEAR_FLAG_BANK2(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR | FLASH_FLAG_WRPERR);
   } else {
     LOG_ERROR("Invalid flash bank specified\r\n");
-    HAL_FLASH_Lock();
+    flash_lock_idle();
     return HAL_ERROR;
   }
 
@@ -42,12 +155,12 @@ HAL_StatusTypeDef erase_flash(uint32_t bank, uint32_t sector, uint32_t num_secto
   if (status != HAL_OK)
   {
     LOG_ERROR("Failed to erase flash sector\r\n");
-    HAL_FLASH_Lock();
+    flash_lock_idle();
     return status;
   }
 
-  // Lock the FLASH memory
-  status = HAL_FLASH_Lock();
+  // Lock the FLASH memory, unless a programming session still needs it
+  status = flash_lock_idle();
   if (status != HAL_OK)
   {
     LOG_ERROR("Failed to lock flash memory\r\n");
@@ -62,40 +175,298 @@ HAL_StatusTypeDef erase_flash(uint32_t bank, uint32_t sector, uint32_t num_secto
 HAL_StatusTypeDef write_flash(uint32_t address, uint32_t *data, uint32_t length, uint32_t bank)
 {
   HAL_StatusTypeDef status;
-  
-  // Unlock the FLASH memory
-  status = HAL_FLASH_Unlock();
-  if (status != HAL_OK)
-  {
-    LOG_ERROR("Failed to unlock flash memory\r\n");
-    return status;
-  }
+  bool is_own_session = !flash_session.is_open;
 
-  LOG_INFO("Writing data[size: %lu] to flash memory...\r\n", length);
+  (void)bank; // the engine picks the bank by address
 
-  // Program the configuration data to FLASH memory
-  for (uint32_t i = 0; i < length; i += 32)
-  {
-    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, address + i, (uint32_t)(data) + i);
+  if (is_own_session) {
+    status = flash_session_begin();
     if (status != HAL_OK) {
-      LOG_ERROR("Failed to write to flash memory\r\n");
-      HAL_FLASH_Lock();
       return status;
     }
   }
 
-  //Check if the FLASH_FLAG_BSY.
-  FLASH_WaitForLastOperation(HAL_FLASH_OP_TIMEOUT, bank);
+  LOG_INFO("Writing data[size: %lu] to flash memory...\r\n", length);
 
-  LOG_INFO("Data written to flash memory\r\n");
+  status = flash_session_write(address, data, length);
+  if (status == HAL_OK) {
+    status = flash_session_flush();
+  }
+  if (status != HAL_OK) {
+    LOG_ERROR("Failed to write to flash memory\r\n");
+  } else {
+    LOG_INFO("Data written to flash memory\r\n");
+  }
 
-  // Lock the FLASH memory
-  status = HAL_FLASH_Lock();
-  if (status != HAL_OK)
-  {
+  if (is_own_session) {
+    flash_session_end();
+  }
+
+  return status;
+}
+
+/**
+ * @brief  Open a programming session: unlock once, later writes go
+ *         straight to the flash word registers
+ * @retval HAL status
+ */
+HAL_StatusTypeDef flash_session_begin(void)
+{
+  if (flash_session.is_open) {
+    return HAL_OK;
+  }
+  if (HAL_FLASH_Unlock() != HAL_OK) {
+    LOG_ERROR("Failed to unlock flash memory\r\n");
+    return HAL_ERROR;
+  }
+
+  memset(&flash_session, 0, sizeof(flash_session));
+  flash_session.is_open = true;
+
+  // cycle counter for the throughput figure flash_session_end logs
+  cycle_counter_enable();
+
+  return HAL_OK;
+}
+
+/**
+ * @brief  Queue data for programming. Bytes gather in a 256-bit flash word
+ *         buffer that is programmed once full or once a write lands in
+ *         another flash word; aligned runs skip the buffer. The target range
+ *         must be erased and stay unprogrammed until flushed.
+ * @param  address: flash address, any alignment
+ * @param  data: source, any alignment
+ * @param  length: bytes
+ * @retval HAL status
+ */
+HAL_StatusTypeDef flash_session_write(uint32_t address, const void *data, uint32_t length)
+{
+  const uint8_t *src = (const uint8_t *)data;
+  uint32_t start_cycles = DWT->CYCCNT;
+  HAL_StatusTypeDef status = HAL_OK;
+
+  if (!flash_session.is_open || erase_state == FLASH_ERASE_BUSY) {
+    return HAL_ERROR;
+  }
+
+  while (length > 0 && status == HAL_OK) {
+    uint32_t word_addr = address & ~(FLASH_WORD_SIZE - 1U);
+    uint32_t word_pos = address - word_addr;
+    uint32_t chunk = FLASH_WORD_SIZE - word_pos;
+
+    if (chunk > length) {
+      chunk = length;
+    }
+
+    if (flash_session.fill != 0 && flash_session.word_addr != word_addr) {
+      status = flash_session_flush(); // moved to another flash word
+      if (status != HAL_OK) {
+        break;
+      }
+    }
+
+    if (chunk == FLASH_WORD_SIZE && ((uint32_t)src & 3U) == 0) {
+      status = flash_program_word(word_addr, (const uint32_t *)src);
+    } else {
+      if (flash_session.fill == 0) {
+        memset(flash_session.word, 0xFF, FLASH_WORD_SIZE);
+        flash_session.word_addr = word_addr;
+      }
+      memcpy(&((uint8_t *)flash_session.word)[word_pos], src, chunk);
+      flash_session.fill |= (chunk == FLASH_WORD_SIZE) ? 0xFFFFFFFFUL : (((1UL << chunk) - 1UL) << word_pos);
+      if (flash_session.fill == 0xFFFFFFFFUL) {
+        status = flash_session_flush();
+      }
+    }
+
+    address += chunk;
+    src += chunk;
+    length -= chunk;
+  }
+
+  // words still in the queue finish while the caller gets on with the next write
+  flash_session.cycles += DWT->CYCCNT - start_cycles;
+
+  return status;
+}
+
+/**
+ * @brief  Program the buffered flash word, bytes not written padded with
+ *         0xFF, and wait for the flash to take it
+ * @retval HAL status
+ */
+HAL_StatusTypeDef flash_session_flush(void)
+{
+  uint32_t start_cycles = DWT->CYCCNT;
+  HAL_StatusTypeDef status = HAL_OK;
+
+  if (flash_session.fill != 0) {
+    status = flash_program_word(flash_session.word_addr, flash_session.word);
+    flash_session.fill = 0;
+  }
+  if (flash_end_program() != HAL_OK) {
+    status = HAL_ERROR;
+  }
+
+  flash_session.cycles += DWT->CYCCNT - start_cycles;
+  return status;
+}
+
+/**
+ * @brief  Close the session: flush the tail and lock the flash again
+ * @retval HAL status
+ */
+HAL_StatusTypeDef flash_session_end(void)
+{
+  HAL_StatusTypeDef status;
+
+  if (!flash_session.is_open) {
+    return HAL_OK;
+  }
+  status = flash_session_flush();
+  flash_session.is_open = false;
+
+  if (flash_session.words != 0) {
+    uint32_t us = flash_session.cycles / (SystemCoreClock / 1000000U);
+    LOG_INFO("Programmed %lu bytes in %lu us (%lu KB/s)\r\n", flash_session.words * FLASH_WORD_SIZE, us,
+             (us != 0) ? (uint32_t)(((uint64_t)flash_session.words * FLASH_WORD_SIZE * 1000000ULL) / ((uint64_t)us * 1024ULL)) : 0);
+  }
+
+  if (erase_state != FLASH_ERASE_BUSY && HAL_FLASH_Lock() != HAL_OK) {
     LOG_ERROR("Failed to lock flash memory\r\n");
+    return HAL_ERROR;
+  }
+
+  return status;
+}
+
+/**
+ * @brief  Start erasing sectors in the background (HAL_FLASHEx_Erase_IT).
+ *         The flash stays unlocked until the last sector is done; nothing
+ *         else may program or erase until erase_flash_state() is no longer
+ *         FLASH_ERASE_BUSY.
+ * @param  bank: FLASH_BANK_1 or FLASH_BANK_2
+ * @param  sector: first sector
+ * @param  num_sectors: sectors to erase
+ * @retval HAL status
+ */
+HAL_StatusTypeDef erase_flash_start(uint32_t bank, uint32_t sector, uint32_t num_sectors)
+{
+  HAL_StatusTypeDef status;
+  FLASH_EraseInitTypeDef EraseInitStruct;
+
+  if (erase_state == FLASH_ERASE_BUSY) {
+    return HAL_BUSY;
+  }
+
+  EraseInitStruct.TypeErase = FLASH_TYPEERASE_SECTORS;
+  EraseInitStruct.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+  EraseInitStruct.Sector = sector;
+  EraseInitStruct.NbSectors = num_sectors;
+  EraseInitStruct.Banks = bank;
+
+  LOG_INFO("Erasing flash sectors in background: Bank %lu, Sector %lu, Number of Sectors %lu\r\n", bank, sector, num_sectors);
+
+  status = HAL_FLASH_Unlock();
+  if (status != HAL_OK) {
+    LOG_ERROR("Failed to unlock flash memory\r\n");
     return status;
   }
 
-  return HAL_OK;
-}
\ No newline at end of file
+  if (bank == FLASH_BANK_1) {
+    __HAL_FLASH_CLEAR_FLAG_BANK1(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
+  } else if (bank == FLASH_BANK_2) {
+    __HAL_FLASH_CLEAR_FLAG_BANK2(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGSERR);
+  } else {
+    LOG_ERROR("Invalid flash bank specified\r\n");
+    flash_lock_idle();
+    return HAL_ERROR;
+  }
+
+  HAL_NVIC_SetPriority(FLASH_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+  erase_state = FLASH_ERASE_BUSY;
+  status = HAL_FLASHEx_Erase_IT(&EraseInitStruct);
+  if (status != HAL_OK) {
+    LOG_ERROR("Failed to start flash erase\r\n");
+    erase_state = FLASH_ERASE_FAILED;
+    flash_lock_idle();
+  }
+
+  return status;
+}
+
+/**
+ * @brief  Progress of the background erase
+ * @retval FLASH_ERASE_STATE_
+ */
+FLASH_ERASE_STATE_ erase_flash_state(void)
+{
+  return erase_state;
+}
+
+/**
+ * @brief  Wait for the background erase to finish
+ * @param  timeout: ms
+ * @retval HAL_OK once idle, HAL_ERROR if it failed, HAL_TIMEOUT
+ */
+HAL_StatusTypeDef erase_flash_wait(uint32_t timeout)
+{
+  uint32_t start_tick = HAL_GetTick();
+
+  while (erase_state == FLASH_ERASE_BUSY) {
+    if ((HAL_GetTick() - start_tick) >= timeout) {
+      return HAL_TIMEOUT;
+    }
+  }
+
+  return (erase_state == FLASH_ERASE_IDLE) ? HAL_OK : HAL_ERROR;
+}
+
+/**
+ * @brief  Blank check: a range that reads all ones needs no erase
+ * @param  address: start, word aligned
+ * @param  length: bytes, multiple of 4
+ * @retval true if every word is 0xFFFFFFFF
+ */
+bool is_flash_blank(uint32_t address, uint32_t length)
+{
+  const uint32_t *word = (const uint32_t *)address;
+
+  for (uint32_t i = 0; i < length / 4U; i++) {
+    if (word[i] != 0xFFFFFFFFU) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief  End of a background erase step (HAL_FLASH_IRQHandler)
+ * @param  ReturnValue: sector just erased, 0xFFFFFFFF once all are done
+ * @retval None
+ */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+  if (erase_state == FLASH_ERASE_BUSY && ReturnValue == 0xFFFFFFFFU) {
+    flash_lock_idle();
+    erase_state = FLASH_ERASE_IDLE;
+  }
+}
+
+/**
+ * @brief  Background erase stopped on an error (HAL_FLASH_IRQHandler)
+ * @param  ReturnValue: sector that failed
+ * @retval None
+ */
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+  (void)ReturnValue;
+
+  if (erase_state == FLASH_ERASE_BUSY) {
+    flash_lock_idle();
+    erase_state = FLASH_ERASE_FAILED;
+  }
+}
@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "image_helper.h"
+#include "crc_helper.h"
+#include "main.h"
+
+#define IMAGE_HEADER_END  ( IMAGE_HEADER_OFFSET + sizeof(imageHeader_t) )
+
+/* Where the App may put its initial stack: DTCM or AXI SRAM */
+#define IMAGE_STACK_IN(sp, base, len)  ( (sp) > (base) && (sp) <= ((base) + (len)) )
+
+/**
+ * @brief  Check the header an image carries, without reading the rest of it:
+ *         magic, header CRC, load address, size and the vector table
+ * @param  hcrc: Pointer to CRC handle
+ * @param  image: start of the image, in flash or the first fragment of a
+ *         download (at least IMAGE_HEADER_END bytes when size is given)
+ * @param  size: image size the caller expects, 0 to take the header's
+ * @param  header: filled in with the header if not NULL
+ * @retval IMAGE_OK if the image can be the application, error code otherwise
+ */
+image_status_t image_check_header(CRC_HandleTypeDef* hcrc, const uint8_t* image, uint32_t size, imageHeader_t* header) {
+    imageHeader_t hdr;
+
+    if (size != 0 && (size < IMAGE_HEADER_END || size > APPLICATION_MAX_SIZE)) {
+        return IMAGE_ERROR_SIZE;
+    }
+
+    memcpy(&hdr, &image[IMAGE_HEADER_OFFSET], sizeof(hdr)); // fragment buffers need not be aligned
+    if (header != NULL) {
+        memcpy(header, &hdr, sizeof(hdr));
+    }
+
+    if (hdr.magic != IMAGE_HEADER_MAGIC || hdr.header_version != IMAGE_HEADER_VERSION) {
+        return IMAGE_ERROR_MAGIC;
+    }
+    if (compute_crc32(hcrc, (uint32_t*)&hdr, offsetof(imageHeader_t, header_crc)) != hdr.header_crc) {
+        return IMAGE_ERROR_HEADER_CRC;
+    }
+    if (hdr.load_address != APPLICATION_ADDRESS) {
+        return IMAGE_ERROR_ADDRESS;
+    }
+    if (hdr.image_size < IMAGE_HEADER_END || hdr.image_size > APPLICATION_MAX_SIZE ||
+        (size != 0 && hdr.image_size != size)) {
+        return IMAGE_ERROR_SIZE;
+    }
+
+    return image_check_vectors(image, hdr.image_size);
+}
+
+/**
+ * @brief  Sanity check of the first two vectors, for images with and without
+ *         a header: the initial SP must be in RAM, the reset handler a Thumb
+ *         address inside the image
+ * @param  image: start of the image
+ * @param  size: image size in bytes
+ * @retval IMAGE_OK or IMAGE_ERROR_VECTORS
+ */
+image_status_t image_check_vectors(const uint8_t* image, uint32_t size) {
+    uint32_t vectors[2];
+
+    memcpy(vectors, image, sizeof(vectors));
+
+    if ((vectors[0] & 0x3U) != 0 ||
+        !(IMAGE_STACK_IN(vectors[0], D1_DTCMRAM_BASE, 128U * 1024U) ||
+          IMAGE_STACK_IN(vectors[0], D1_AXISRAM_BASE, 512U * 1024U))) {
+        return IMAGE_ERROR_VECTORS;
+    }
+    if ((vectors[1] & 0x1U) == 0 ||
+        (vectors[1] & ~0x1UL) < APPLICATION_ADDRESS ||
+        (vectors[1] & ~0x1UL) >= APPLICATION_ADDRESS + size) {
+        return IMAGE_ERROR_VECTORS;
+    }
+
+    return IMAGE_OK;
+}
+
+/**
+ * @brief  Check the image CRC the header records (whole image, header left out)
+ * @param  hcrc: Pointer to CRC handle
+ * @param  image: start of the image in flash
+ * @param  header: its header, already checked by image_check_header()
+ * @retval IMAGE_OK or IMAGE_ERROR_CRC
+ */
+image_status_t image_verify_crc(CRC_HandleTypeDef* hcrc, const uint8_t* image, const imageHeader_t* header) {
+    uint32_t crc = compute_crc32(hcrc, (uint32_t*)image, IMAGE_HEADER_OFFSET);
+
+    crc = accumulate_crc32(hcrc, crc, (uint32_t*)&image[IMAGE_HEADER_END], header->image_size - IMAGE_HEADER_END);
+    if (crc != header->image_crc) {
+        return IMAGE_ERROR_CRC;
+    }
+
+    return IMAGE_OK;
+}
+
+/**
+ * @brief  Name of an image status, for the log
+ * @param  status: image status
+ * @retval constant string
+ */
+const char* image_status_str(image_status_t status) {
+    switch (status) {
+        case IMAGE_OK:               return "ok";
+        case IMAGE_ERROR_MAGIC:      return "no image header";
+        case IMAGE_ERROR_HEADER_CRC: return "header CRC mismatch";
+        case IMAGE_ERROR_ADDRESS:    return "wrong load address";
+        case IMAGE_ERROR_SIZE:       return "wrong image size";
+        case IMAGE_ERROR_VECTORS:    return "bad vector table";
+        case IMAGE_ERROR_CRC:        return "image CRC mismatch";
+        default:                     return "?";
+    }
+}
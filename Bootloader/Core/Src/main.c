@@ -4,7 +4,11 @@
 #include <string.h>
 
 #include "logger.h"
+#include "boot_profile.h"
 #include "crc_helper.h"
+#include "crc_engine.h"
+#include "image_helper.h"
+#include "slot_helper.h"
 #include "conf_helper.h"
 #include "ext_flash_reciever.h"
 
@@ -25,6 +29,18 @@ ETX_CONFIG_ *etx_config;
 CRC_HandleTypeDef hcrc;
 UART_HandleTypeDef huart2;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart2_rx;
+volatile bool logger_muted = false;
+
+/* OTA button pressed since reset, set by the EXTI callback */
+static volatile bool is_ota_btn_latched = false;
+
+/* Boots since the last full application CRC, kept across resets; the config log holds it over power cycles */
+#define BL_VERIFY_COUNT_MAGIC  0x5AFEB007U
+static struct {
+  uint32_t magic;
+  uint32_t boots;
+} verify_count __attribute__((section(".boot_noinit")));
 
 void SystemClock_Config(void);
 void SystemClock_DeInit(void);
@@ -43,6 +59,10 @@ static void goto_application( void );
 static uint32_t get_application_crc( void );
 static uint32_t verify_application_crc(uint32_t crc_value);
 static void validate_config( void );
+static bool uart_break_in( uint32_t window_ms );
+static bool is_full_verify_due( ETX_CONFIG_ *etx_config );
+static image_status_t check_application_image( void );
+static bool adopt_application_image( void );
 
 /**
   * @brief  The Bootloader entry point.
@@ -50,25 +70,37 @@ static void validate_config( void );
   */
 int main(void)
 {
+  boot_profile_start();
+
   /* Reset of all peripherals, Initializes the Flash interface and the Systick. */
   HAL_Init();
   SystemClock_Config();
+  boot_profile_mark(BOOT_MARK_CLOCK);
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
   MX_USART2_UART_Init();
   MX_USART3_UART_Init();
   MX_CRC_Init();
+  crc_engine_init();
+  boot_profile_mark(BOOT_MARK_INIT);
 
   LOG_INFO("%s\r\n", BL_VER_STRING);
 
+#ifdef CRC_BENCH
+  crc_engine_bench(&hcrc);
+#endif
+
   etx_config = (ETX_CONFIG_ *)malloc(sizeof(ETX_CONFIG_));
   config_get(etx_config);
+  boot_profile_mark(BOOT_MARK_CONFIG);
 
   validate_config(); // Validate and load configuration
 
-  GPIO_PinState ota_pin_state;
-  uint32_t timeout = HAL_GetTick() + 5000; // 5 seconds timeout
+#ifdef BL_AB_SLOTS
+  LOG_INFO("Running from slot %c\r\n", slot_active_name());
+  slot_trial_update(etx_config);
+#endif
 
   /*
    * crc_check_status values: 
@@ -80,12 +112,19 @@ int main(void)
    * 2nd - application failed
    * 3rd - download requested from app
    * 4th - button pressed for Download mode
+   * 5th - host break-in on USART2
    * others - not in use
    */
   uint8_t etx_app_download_required = 0;
+  bool is_app_verified = false;  // the image CRC over flash has been checked already
 
   /************************** Check if APP DL required - START *************************/
 
+  /* An image that came without a download (debugger) describes itself in its header */
+  if (!etx_config->is_app_flashed && etx_config->reboot_reason != ETX_DL_REQUEST) {
+    is_app_verified = adopt_application_image();
+  }
+
   if (etx_config->reboot_reason == ETX_FIRST_TIME_BOOT) {
     LOG_INFO("First time boot detected...\r\n");
     etx_app_download_required |= 0x01; // Set 1st bit to indicate first time boot
@@ -94,27 +133,30 @@ int main(void)
     etx_app_download_required |= 0x04; // Set 3rd bit to indicate download requested from app
   } else if (etx_config->reboot_reason == ETX_APP_FAILED) {
     LOG_INFO("Application failure detected...\r\n");
+#ifdef BL_AB_SLOTS
+    slot_rollback(etx_config); // returns only without a bootable image in the other slot
+#endif
     etx_app_download_required |= 0x02; // Set 2nd bit to indicate application failure
   } else {
     etx_app_download_required = 0;
   }
 
-  if (etx_app_download_required == 0) {
-    LOG_INFO("Press the USER Button to switch to Download Mode...\r\n");
-
-    do {
-      ota_pin_state = HAL_GPIO_ReadPin(OTA_BTN_GPIO_Port, OTA_BTN_Pin);
+  /* A press any time since reset latched the EXTI, one still held is read here */
+  if (HAL_GPIO_ReadPin(OTA_BTN_GPIO_Port, OTA_BTN_Pin) == GPIO_PIN_SET) {
+    is_ota_btn_latched = true;
+  }
 
-      if (ota_pin_state == GPIO_PIN_SET || HAL_GetTick() > timeout) {
-        break;
-      }
-    } while (1);
+  if (etx_app_download_required == 0 && uart_break_in(BL_BREAKIN_MS)) {
+    LOG_INFO("Host break-in received. Entering Download Mode...\r\n");
+    etx_app_download_required |= 0x10; // Set 5th bit to indicate host break-in on USART2
+  }
 
-    if (ota_pin_state == GPIO_PIN_SET) {
-      LOG_INFO("USER Button Pressed. Entering Download Mode...\r\n");
-      etx_app_download_required |= 0x08; // Set 4th bit to indicate button pressed for Download mode
-    }
+  if (etx_app_download_required == 0 && is_ota_btn_latched) {
+    LOG_INFO("USER Button Pressed. Entering Download Mode...\r\n");
+    etx_app_download_required |= 0x08; // Set 4th bit to indicate button pressed for Download mode
   }
+  HAL_NVIC_DisableIRQ(EXTI15_10_IRQn);
+  boot_profile_mark(BOOT_MARK_DL_CHECK);
 
   /*************************** Check if APP DL required - END **************************/
 
@@ -124,12 +166,22 @@ int main(void)
     ETX_DL_EX_ dl_status = etx_app_download_and_flash(etx_config);
     if (dl_status == ETX_DL_EX_ERR) {
       LOG_ERROR("ETX APP Download failed...\r\n");
-      etx_config->is_app_bootable = false;
+#ifndef BL_AB_SLOTS
+      etx_config->is_app_bootable = false; // A/B: the download went to the other slot
+#endif
     } else if (dl_status == ETX_DL_EX_ABORT) {
       LOG_INFO("ETX APP Download aborted before writing to flash...\r\n");
     } else {
       LOG_INFO("ETX APP Download successful...\r\n");
+#ifdef BL_AB_SLOTS
+      boot_profile_mark(BOOT_MARK_DOWNLOAD);
+      slot_switch(); // activates the new image, returns only if the swap failed
+      LOG_ERROR("Staying on slot %c\r\n", slot_active_name());
+#else
+      is_app_verified = true;
+#endif
     }
+    boot_profile_mark(BOOT_MARK_DOWNLOAD);
   }
 
   /********************* Initiate ETX APP DL through USART2 - END **********************/
@@ -143,8 +195,23 @@ int main(void)
       etx_config->is_app_bootable = false;
     } else {
       LOG_INFO("Application CRC: 0x%08lX\r\n", app_crc);
-      LOG_INFO("Verifying application CRC...\r\n");
-      int verify_status = verify_application_crc((uint32_t)app_crc);
+      int verify_status = 0;
+      image_status_t image_status = check_application_image();
+      if (image_status != IMAGE_OK) {
+        LOG_ERROR("Application image rejected: %s\r\n", image_status_str(image_status));
+        verify_status = image_status;
+      } else if (!is_app_verified) {
+        if (!is_full_verify_due(etx_config) && config_is_app_fingerprint_ok(etx_config)) {
+          LOG_INFO("Image fingerprint matches, full CRC skipped...\r\n");
+        } else {
+          LOG_INFO("Verifying application CRC...\r\n");
+          verify_status = verify_application_crc((uint32_t)app_crc);
+          if (verify_status == 0 && config_store_app_fingerprint(etx_config) != CFG_SAVE_OK) {
+            LOG_ERROR("Failed to save the image fingerprint\r\n");
+          }
+        }
+        boot_profile_mark(BOOT_MARK_CRC);
+      }
       if (verify_status == 0) {
         LOG_INFO("CRC verified successfully...\r\n");
         LOG_INFO("Loading application...\r\n");
@@ -153,11 +220,16 @@ int main(void)
       } else {
         LOG_ERROR("CRC verification failed. Error code: %d\r\n", verify_status);
         etx_config->is_app_bootable = false;
+        etx_config->app_fingerprint = 0;
+#ifdef BL_AB_SLOTS
+        slot_rollback(etx_config); // returns only without a bootable image in the other slot
+#endif
       }
     }
     if (config_save(etx_config) != CFG_SAVE_OK) {
       LOG_ERROR("Failed to save updated configuration\r\n");
     }
+    boot_profile_mark(BOOT_MARK_CONFIG_SAVE);
   }
 
   /************************ Initiate Jump to application - END *************************/
@@ -171,6 +243,169 @@ int main(void)
   }
 }
 
+/**
+ * @brief  Give the host a short window to ask for Download mode on USART2
+ * @param  window_ms: how long to listen, 0 skips it
+ * @retval true if the break-in magic arrived (it has been ACKed)
+ */
+static bool uart_break_in( uint32_t window_ms )
+{
+  static const char magic[] = BL_BREAKIN_MAGIC;
+  const uint32_t magic_len = sizeof(magic) - 1U;
+  uint32_t start = HAL_GetTick();
+  uint32_t matched = 0;
+  uint8_t byte;
+
+  if (window_ms == 0U) {
+    return false;
+  }
+
+  /* whatever the host sent while we were in reset overran the receiver */
+  __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_FEF);
+  __HAL_UART_FLUSH_DRREGISTER(&huart2);
+
+  while ((HAL_GetTick() - start) < window_ms) {
+    uint32_t remaining = window_ms - (HAL_GetTick() - start);
+
+    if (HAL_UART_Receive(&huart2, &byte, 1, remaining) != HAL_OK) {
+      __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_FEF);
+      continue;
+    }
+    if (byte == (uint8_t)magic[matched]) {
+      matched++;
+    } else {
+      matched = (byte == (uint8_t)magic[0]) ? 1U : 0U;
+    }
+    if (matched == magic_len) {
+      ETX_DL_RSPF_ rsp = {
+        .sof         = ETX_FRAME_SOF,
+        .packet_type = ETX_DL_FRAME_TYPE_RESPONSE,
+        .payload     = ETX_DL_RSP_ACK,
+        .eof         = ETX_FRAME_EOF,
+      };
+      HAL_UART_Transmit(&huart2, (uint8_t *)&rsp, sizeof(rsp), HAL_MAX_DELAY);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief  Count the boot and tell whether the full application CRC is due
+ *         anyway, fingerprint or not (every BL_VERIFY_INTERVAL boots). The
+ *         count goes to the config on every power-on boot, where the RAM copy
+ *         is lost, and every BL_VERIFY_SAVE_STEP boots after resets; a power
+ *         loss forgets fewer than that many reset boots.
+ * @param  ETX_CONFIG_ *etx_config: configuration, saved with the count
+ * @retval true to run the full CRC
+ */
+static bool is_full_verify_due( ETX_CONFIG_ *etx_config )
+{
+  bool is_power_on = (verify_count.magic != BL_VERIFY_COUNT_MAGIC);
+  bool is_due = false;
+  CONFIG_COUNTERS_ counters;
+
+  if (BL_VERIFY_INTERVAL == 0U) {
+    return true;
+  }
+  config_get_counters(&counters);
+  if (is_power_on) {
+    verify_count.magic = BL_VERIFY_COUNT_MAGIC; // RAM content is random, take the saved count
+    verify_count.boots = counters.verify_boots;
+  }
+  if (++verify_count.boots >= BL_VERIFY_INTERVAL) {
+    verify_count.boots = 0;
+    is_due = true;
+  }
+
+  if (is_power_on || is_due || (verify_count.boots % BL_VERIFY_SAVE_STEP) == 0U) {
+    counters.verify_boots = verify_count.boots;
+    if (config_save_counters(etx_config, &counters) != CFG_SAVE_OK) {
+      LOG_ERROR("Failed to save the boot count\r\n");
+    }
+  }
+
+  return is_due;
+}
+
+/**
+ * @brief  Constant-time checks of the flashed application before its CRC:
+ *         header (magic, load address, size) and vector table. An image from
+ *         before the header only gets the vector table checked.
+ * @param  None
+ * @retval IMAGE_OK if the image is worth a CRC / a jump
+ */
+static image_status_t check_application_image( void )
+{
+  image_status_t status = image_check_header(&hcrc, (const uint8_t *)APPLICATION_ADDRESS, etx_config->app_size, NULL);
+
+  if (status == IMAGE_ERROR_MAGIC) {
+    status = image_check_vectors((const uint8_t *)APPLICATION_ADDRESS, etx_config->app_size);
+  }
+
+  return status;
+}
+
+/**
+ * @brief  Take over an application that was not downloaded (debugger,
+ *         production programmer): size and CRC come from its header, the
+ *         CRC is checked once and the config filled in as a download would
+ * @param  None
+ * @retval true if the image was adopted, its CRC checked and the config saved
+ */
+static bool adopt_application_image( void )
+{
+  imageHeader_t header;
+  uint32_t sector_crc[APPLICATION_SECTORS] = {0};
+
+  image_status_t status = image_check_header(&hcrc, (const uint8_t *)APPLICATION_ADDRESS, 0, &header);
+  if (status != IMAGE_OK) {
+    LOG_INFO("No application image to adopt: %s\r\n", image_status_str(status));
+    return false;
+  }
+  if (image_verify_crc(&hcrc, (const uint8_t *)APPLICATION_ADDRESS, &header) != IMAGE_OK) {
+    LOG_ERROR("Application v%lu.%lu.%lu in flash fails its CRC\r\n",
+              header.app_version >> 16, (header.app_version >> 8) & 0xFFU, header.app_version & 0xFFU);
+    return false;
+  }
+
+  for (uint32_t offset = 0, i = 0; offset < header.image_size; offset += FLASH_SECTOR_SIZE, i++) {
+    uint32_t length = header.image_size - offset;
+    sector_crc[i] = compute_crc32(&hcrc, (uint32_t *)(APPLICATION_ADDRESS + offset),
+                                  (length < FLASH_SECTOR_SIZE) ? length : FLASH_SECTOR_SIZE);
+  }
+
+  etx_config->is_app_flashed = true;
+  etx_config->is_app_bootable = false;
+  etx_config->reboot_reason = ETX_NORMAL_BOOT;
+  etx_config->app_size = header.image_size;
+  etx_config->app_crc = tree_root_crc32(sector_crc, FLASH_SECTOR_SIZE, header.image_size);
+  memcpy(etx_config->app_sector_crc, sector_crc, sizeof(sector_crc));
+  etx_config->app_fingerprint = config_app_fingerprint(etx_config);
+  if (config_save(etx_config) != CFG_SAVE_OK) {
+    LOG_ERROR("Failed to save the adopted application\r\n");
+    return false;
+  }
+  boot_profile_mark(BOOT_MARK_CONFIG_SAVE);
+
+  LOG_INFO("Adopted application v%lu.%lu.%lu, %lu bytes\r\n",
+           header.app_version >> 16, (header.app_version >> 8) & 0xFFU, header.app_version & 0xFFU, header.image_size);
+  return true;
+}
+
+/**
+ * @brief  EXTI line detection callback
+ * @param  GPIO_Pin: pin that fired
+ * @retval None
+ */
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  if (GPIO_Pin == OTA_BTN_Pin) {
+    is_ota_btn_latched = true;
+  }
+}
+
 /*************************************************************
  * Application Verification and Jump functions
  *************************************************************/
@@ -221,6 +456,9 @@ static void goto_application( void )
     NVIC->ICPR[i] = 0xFFFFFFFF; // Clear all pending flags
   }
 
+  /* Last bootloader stamp, the App takes the timeline from here */
+  boot_profile_mark(BOOT_MARK_JUMP);
+
   /* Set the application's Vector Table */
   SCB->VTOR = APPLICATION_ADDRESS;
 
@@ -259,26 +497,54 @@ static uint32_t get_application_crc( void )
 }
 
 /**
- * @brief  Verify the application CRC against computed CRC
+ * @brief  Verify the application CRC against computed CRC. Every sector is
+ *         checked on its own and the results combined into the image CRC;
+ *         with a stored hash tree a mismatch names the corrupt sectors, a
+ *         config without one (older bootloader) gets it filled in.
  * @param  crc_value: The expected CRC value to compare against
  * @retval 0 if CRC matches, negative values on error
  */
 static uint32_t verify_application_crc(uint32_t crc_value)
 {
+  uint32_t sector_crc[APPLICATION_SECTORS] = {0};
+  uint32_t stored_crc[APPLICATION_SECTORS];
+
   if (crc_value == 0xFFFFFFFF || crc_value == 0x00000000) {
     return -2; // Invalid CRC value
   }
 
   // Calculate CRC over application data using STM32 hardware CRC peripheral
   uint32_t data_size_bytes = etx_config->app_size; 
-  
-  uint32_t computed_crc = compute_crc32(&hcrc, (uint32_t *)APPLICATION_ADDRESS, data_size_bytes);
+  if (data_size_bytes > APPLICATION_MAX_SIZE) {
+    return -2; // Invalid size
+  }
+  memcpy(stored_crc, etx_config->app_sector_crc, sizeof(stored_crc)); // config is packed
+  bool is_tree_valid = tree_root_crc32(stored_crc, FLASH_SECTOR_SIZE, data_size_bytes) == crc_value;
+
+  for (uint32_t offset = 0, i = 0; offset < data_size_bytes; offset += FLASH_SECTOR_SIZE, i++) {
+    uint32_t length = data_size_bytes - offset;
+    sector_crc[i] = compute_crc32(&hcrc, (uint32_t *)(APPLICATION_ADDRESS + offset),
+                                  (length < FLASH_SECTOR_SIZE) ? length : FLASH_SECTOR_SIZE);
+  }
+  uint32_t computed_crc = tree_root_crc32(sector_crc, FLASH_SECTOR_SIZE, data_size_bytes);
 
   if (computed_crc != crc_value) {
     LOG_ERROR("Computed CRC: 0x%08lX, Expected CRC: 0x%08lX\r\n", computed_crc, crc_value);
+    for (uint32_t i = 0; is_tree_valid && i < APPLICATION_SECTORS; i++) {
+      if (sector_crc[i] != stored_crc[i]) {
+        LOG_ERROR("Sector %lu (0x%08lX) corrupt: CRC 0x%08lX, expected 0x%08lX\r\n", i,
+                  APPLICATION_ADDRESS + (i * FLASH_SECTOR_SIZE), sector_crc[i], stored_crc[i]);
+      }
+    }
     return -3; // CRC mismatch
   }
 
+  if (!is_tree_valid) {
+    LOG_INFO("Storing the sector CRCs of the verified image...\r\n");
+    memcpy(etx_config->app_sector_crc, sector_crc, sizeof(sector_crc));
+    etx_config->app_fingerprint = 0; // the fingerprint store below saves the config
+  }
+
   return 0; // CRC matches
 }
 
@@ -295,6 +561,7 @@ void validate_config( void )
     if (config_save(etx_config) != CFG_SAVE_OK) {
       LOG_ERROR("Failed to save default configuration\r\n");
     }
+    boot_profile_mark(BOOT_MARK_CONFIG_SAVE);
     return;
   }
 
@@ -304,6 +571,7 @@ void validate_config( void )
     if (config_save(etx_config) != CFG_SAVE_OK) {
       LOG_ERROR("Failed to save default configuration\r\n");
     }
+    boot_profile_mark(BOOT_MARK_CONFIG_SAVE);
     return;
   }
 }
@@ -389,6 +657,8 @@ void SystemClock_DeInit(void)
   /* Turn off the PLLs, HSE, and CSS */
   RCC->CR &= ~(RCC_CR_PLL1ON | RCC_CR_PLL2ON | RCC_CR_PLL3ON);
   RCC->CR &= ~(RCC_CR_HSEON | RCC_CR_HSEON);
+
+  SystemCoreClockUpdate();
 }
 
 /**
@@ -405,7 +675,7 @@ static void MX_USART2_UART_Init(void)
   huart2.Init.StopBits = UART_STOPBITS_1;
   huart2.Init.Parity = UART_PARITY_NONE;
   huart2.Init.Mode = UART_MODE_TX_RX;
-  huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  huart2.Init.HwFlowCtl = UART_HWCONTROL_RTS_CTS;  // RTS holds the host off while flash is busy
   huart2.Init.OverSampling = UART_OVERSAMPLING_8;  // Reduce oversampling for higher speeds
   huart2.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
   huart2.Init.ClockPrescaler = UART_PRESCALER_DIV1;
@@ -514,10 +784,14 @@ static void MX_GPIO_Init(void)
 
   /*Configure GPIO pin : OTA_BTN_Pin */
   GPIO_InitStruct.Pin = OTA_BTN_Pin;
-  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING;
   GPIO_InitStruct.Pull = GPIO_NOPULL;
   HAL_GPIO_Init(OTA_BTN_GPIO_Port, &GPIO_InitStruct);
 
+  /* EXTI interrupt init: latch a press while the boot runs */
+  HAL_NVIC_SetPriority(EXTI15_10_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+
   /*Configure GPIO pins : LED1_Pin and LED3_Pin */
   GPIO_InitStruct.Pin = LED1_Pin | LED3_Pin;
   GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
@@ -569,7 +843,9 @@ int __io_putchar(int ch)
 int fputc(int ch, FILE *f)
 #endif /* __GNUC__ */
 {
-  HAL_UART_Transmit(&huart3, (uint8_t *)&ch, 1, HAL_MAX_DELAY);
+  if (!logger_muted) {
+    HAL_UART_Transmit(&huart3, (uint8_t *)&ch, 1, HAL_MAX_DELAY);
+  }
   return ch;
 }
 
@@ -0,0 +1,215 @@
+#include "slot_helper.h"
+#include "flash_editor.h"
+#include "crc_helper.h"
+#include "image_helper.h"
+#include "boot_slot.h"
+#include "logger.h"
+
+#ifdef BL_AB_SLOTS
+
+/*
+ * A/B slots. Each bank is a whole boot set: bootloader, config, application
+ * slot. The bank mapped at 0x08000000 is the active one; FLASH_BANK_1 and
+ * addresses below FLASH_BANK2_BASE always mean it, whichever physical bank
+ * the swap option selected. Activating or rolling back flips the option and
+ * resets, nothing is copied but the bootloader, and that only when the other
+ * bank's copy differs.
+ */
+
+/**
+ * @brief  Name of the physical bank that is active
+ * @retval 'A' (bank 1) or 'B' (bank 2)
+ */
+char slot_active_name(void)
+{
+  return ((FLASH->OPTSR_CUR & FLASH_OPTSR_SWAP_BANK_OPT) != 0U) ? 'B' : 'A';
+}
+
+/**
+ * @brief  Take the inactive slot out of service before its image is
+ *         rewritten, so a rollback can not land on half an image
+ * @retval CFG_SAVE_STATUS_
+ */
+CFG_SAVE_STATUS_ slot_invalidate_inactive(void)
+{
+  if (is_flash_blank(SLOT_CONFIG_ADDR, sizeof(ETX_CONFIG_))) {
+    return CFG_SAVE_OK;
+  }
+  if (erase_flash(FLASH_BANK_2, FLASH_SECTOR_2, 1) != HAL_OK) {
+    LOG_ERROR("Failed to erase the inactive slot's config\r\n");
+    return CFG_SAVE_ERR;
+  }
+
+  return CFG_SAVE_OK;
+}
+
+/**
+ * @brief  Write the config of the inactive slot once its image is in and
+ *         checked: the active config with the new image, on trial
+ * @param  active: config of the active slot (bus address etc. carry over)
+ * @param  size: image size in bytes
+ * @param  crc: image CRC, the hash tree root
+ * @param  sector_crc: APPLICATION_SECTORS tree leaves
+ * @retval CFG_SAVE_STATUS_
+ */
+CFG_SAVE_STATUS_ slot_store_inactive(const ETX_CONFIG_ *active, uint32_t size, uint32_t crc, const uint32_t *sector_crc)
+{
+  uint32_t buffer[(sizeof(ETX_CONFIG_) + 3U) / 4U];
+  ETX_CONFIG_ *slot = (ETX_CONFIG_ *)buffer;
+
+  memcpy(slot, active, sizeof(ETX_CONFIG_));
+  slot->reboot_reason = ETX_NORMAL_BOOT;
+  slot->is_app_bootable = false;
+  slot->is_app_flashed = true;
+  slot->app_fingerprint = 0; // the first boot of the slot runs the full CRC
+  memcpy(slot->app_sector_crc, sector_crc, sizeof(slot->app_sector_crc));
+  slot->app_crc = crc;
+  slot->app_size = size;
+  slot->slot_state = ETX_SLOT_TRIAL;
+  slot->config_valid_marker = VALID_CONF_MARKER;
+
+  if (slot_invalidate_inactive() != CFG_SAVE_OK ||
+      config_log_append(SLOT_CONFIG_ADDR, slot) != CFG_SAVE_OK) {
+    LOG_ERROR("Failed to write the inactive slot's config\r\n");
+    return CFG_SAVE_ERR;
+  }
+
+  return CFG_SAVE_OK;
+}
+
+/**
+ * @brief  Can the inactive slot take over? Its config must be valid and
+ *         describe a flashed image that has not failed, and the image must
+ *         pass the constant-time header checks
+ * @retval true if a switch would boot an image
+ */
+bool slot_is_inactive_bootable(void)
+{
+  uint32_t buffer[(sizeof(ETX_CONFIG_) + 3U) / 4U];
+  ETX_CONFIG_ *slot = (ETX_CONFIG_ *)buffer;
+
+  (void)config_log_read(SLOT_CONFIG_ADDR, slot);
+  if (slot->config_valid_marker != VALID_CONF_MARKER ||
+      compute_crc32(&hcrc, buffer, sizeof(ETX_CONFIG_) - 4) != slot->config_crc) {
+    return false;
+  }
+  if (!slot->is_app_flashed || slot->reboot_reason == ETX_APP_FAILED) {
+    return false;
+  }
+
+  return image_check_header(&hcrc, (const uint8_t *)DOWNLOAD_ADDRESS, slot->app_size, NULL) == IMAGE_OK;
+}
+
+/**
+ * @brief  Trial bookkeeping, every boot before anything else looks at the
+ *         config: a confirmation from the application ends the trial, too
+ *         many boots without one fail the slot (ETX_APP_FAILED). The count
+ *         goes to the config log on every trial boot, so a trial image that
+ *         hangs is rolled back through power cycles, too.
+ * @param  config: config of the active slot
+ * @retval None
+ */
+void slot_trial_update(ETX_CONFIG_ *config)
+{
+  bool is_confirmed = boot_slot_take_confirm(); // always taken, a stale one must not reach a later trial
+  CONFIG_COUNTERS_ counters;
+
+  if (config->slot_state != ETX_SLOT_TRIAL) {
+    return;
+  }
+
+  config_get_counters(&counters);
+  if (is_confirmed) {
+    LOG_INFO("Slot %c confirmed by the application\r\n", slot_active_name());
+    config->slot_state = ETX_SLOT_CONFIRMED;
+    counters.trial_boots = 0;
+    if (config_save_counters(config, &counters) != CFG_SAVE_OK) {
+      LOG_ERROR("Failed to save the confirmed slot\r\n");
+    }
+    return;
+  }
+
+  if (++counters.trial_boots > BL_TRIAL_BOOTS) {
+    LOG_ERROR("Slot %c not confirmed after %lu boots\r\n", slot_active_name(), (uint32_t)BL_TRIAL_BOOTS);
+    counters.trial_boots = 0;
+    config->reboot_reason = ETX_APP_FAILED;
+  } else {
+    LOG_INFO("Slot %c on trial, boot %lu of %lu\r\n", slot_active_name(), counters.trial_boots, (uint32_t)BL_TRIAL_BOOTS);
+  }
+  if (config_save_counters(config, &counters) != CFG_SAVE_OK) {
+    LOG_ERROR("Failed to save the trial boot count\r\n");
+  }
+}
+
+/**
+ * @brief  The active slot failed: record it and switch back to the other
+ *         slot if that one can boot. Returns only if it can not.
+ * @param  config: config of the active slot
+ * @retval None
+ */
+void slot_rollback(ETX_CONFIG_ *config)
+{
+  if (!slot_is_inactive_bootable()) {
+    LOG_INFO("No bootable image in the other slot to roll back to\r\n");
+    return;
+  }
+
+  config->reboot_reason = ETX_APP_FAILED;
+  config->is_app_bootable = false;
+  if (config_save(config) != CFG_SAVE_OK) {
+    LOG_ERROR("Failed to save the failed slot's state\r\n"); // the switch is what matters
+  }
+
+  LOG_INFO("Rolling back from slot %c...\r\n", slot_active_name());
+  if (slot_switch() != HAL_OK) {
+    LOG_ERROR("Rollback failed\r\n");
+  }
+}
+
+/**
+ * @brief  Make the inactive slot the active one: bring its bootloader up to
+ *         date if needed, flip the bank swap option and reset. Returns only
+ *         on failure, the active slot is untouched then.
+ * @retval HAL_ERROR
+ */
+HAL_StatusTypeDef slot_switch(void)
+{
+  FLASH_OBProgramInitTypeDef ob = {0};
+  char next = (slot_active_name() == 'A') ? 'B' : 'A'; // OPTSR_CUR shows the new swap once launched
+
+  // the other bank starts at 0x08000000 after the swap, it has to boot the same bootloader
+  if (memcmp((const void *)FLASH_BANK1_BASE, (const void *)FLASH_BANK2_BASE, BOOTLOADER_SIZE) != 0) {
+    LOG_INFO("Copying the bootloader to the other bank...\r\n");
+    if (erase_flash(FLASH_BANK_2, FLASH_SECTOR_0, BOOTLOADER_SIZE / FLASH_SECTOR_SIZE) != HAL_OK ||
+        write_flash(FLASH_BANK2_BASE, (uint32_t *)FLASH_BANK1_BASE, BOOTLOADER_SIZE, FLASH_BANK_2) != HAL_OK ||
+        memcmp((const void *)FLASH_BANK1_BASE, (const void *)FLASH_BANK2_BASE, BOOTLOADER_SIZE) != 0) {
+      LOG_ERROR("Failed to copy the bootloader\r\n");
+      return HAL_ERROR;
+    }
+  }
+
+  ob.OptionType = OPTIONBYTE_USER;
+  ob.USERType = OB_USER_SWAP_BANK;
+  ob.USERConfig = ((FLASH->OPTSR_CUR & FLASH_OPTSR_SWAP_BANK_OPT) != 0U) ? OB_SWAP_BANK_DISABLE : OB_SWAP_BANK_ENABLE;
+
+  (void)boot_slot_take_confirm(); // the new slot's application confirms for itself
+
+  HAL_FLASH_Unlock();
+  HAL_FLASH_OB_Unlock();
+  if (HAL_FLASHEx_OBProgram(&ob) != HAL_OK || HAL_FLASH_OB_Launch() != HAL_OK) {
+    HAL_FLASH_OB_Lock();
+    HAL_FLASH_Lock();
+    LOG_ERROR("Failed to program the bank swap option\r\n");
+    return HAL_ERROR;
+  }
+  HAL_FLASH_OB_Lock();
+  HAL_FLASH_Lock();
+
+  LOG_INFO("Slot %c active after reset...\r\n", next);
+  HAL_Delay(100); // let the log drain
+  NVIC_SystemReset();
+
+  return HAL_ERROR; // not reached
+}
+
+#endif /* BL_AB_SLOTS */
@@ -40,6 +40,41 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
     GPIO_InitStruct.Alternate = GPIO_AF7_USART2;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+    __HAL_RCC_GPIOD_CLK_ENABLE();
+    /**USART2 GPIO Configuration
+    PD3     ------> USART2_CTS
+    PD4     ------> USART2_RTS
+    */
+    GPIO_InitStruct.Pin = USART2_RTS_Pin;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    HAL_GPIO_Init(USART2_RTS_GPIO_Port, &GPIO_InitStruct);
+
+    // CTS is active low: pulled down so a host without flow control wiring still receives
+    GPIO_InitStruct.Pin = USART2_CTS_Pin;
+    GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+    HAL_GPIO_Init(USART2_CTS_GPIO_Port, &GPIO_InitStruct);
+
+    /* USART2 DMA Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    /* USART2_RX Init: circular, the download receive ring */
+    hdma_usart2_rx.Instance = DMA1_Stream0;
+    hdma_usart2_rx.Init.Request = DMA_REQUEST_USART2_RX;
+    hdma_usart2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart2_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    hdma_usart2_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart2_rx) != HAL_OK) Error_Handler();
+
+    __HAL_LINKDMA(huart, hdmarx, hdma_usart2_rx);
+
+    /* DMA1_Stream0_IRQn interrupt configuration */
+    HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
   }
   else if(huart->Instance==USART3)
   {
@@ -99,6 +134,16 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     PA3     ------> USART2_RX
     */
     HAL_GPIO_DeInit(GPIOA, USART2_TX_Pin|USART2_RX_Pin);
+
+    /**USART2 GPIO Configuration
+    PD3     ------> USART2_CTS
+    PD4     ------> USART2_RTS
+    */
+    HAL_GPIO_DeInit(GPIOD, USART2_CTS_Pin|USART2_RTS_Pin);
+
+    /* USART2 DMA DeInit */
+    HAL_DMA_DeInit(huart->hdmarx);
+    HAL_NVIC_DisableIRQ(DMA1_Stream0_IRQn);
   }
   else if(huart->Instance==USART3)
   {
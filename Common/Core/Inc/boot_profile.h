@@ -0,0 +1,58 @@
+/**
+  ******************************************************************************
+  * @file    boot_profile.h
+  * @author  Shiddeshwaran-S
+  * @brief   Boot phase timeline, DWT cycle counter stamps kept in no-init RAM
+  *          so the application can report what the bootloader spent.
+  ******************************************************************************
+  */
+
+#ifndef __BOOT_PROFILE_H__
+#define __BOOT_PROFILE_H__
+
+#include <stdint.h>
+
+#define BOOT_PROFILE_MAGIC      ( 0xB0071A1EU )   // record was started by the bootloader on this boot
+#define BOOT_PROFILE_MAX_MARKS  ( 16U )
+
+/*
+ * Phase boundaries. A mark closes the phase that ends there and the timeline
+ * lists them in the order they were taken; the ones that are not on every
+ * boot (download, config save) are simply missing when they did not happen.
+ */
+typedef enum {
+  BOOT_MARK_RESET = 0,      // bootloader main()
+  BOOT_MARK_CLOCK,          // SystemClock_Config
+  BOOT_MARK_INIT,           // peripherals
+  BOOT_MARK_CONFIG,         // config_get
+  BOOT_MARK_DL_CHECK,       // validate_config, reboot reason, break-in window, button
+  BOOT_MARK_DOWNLOAD,       // download and flash
+  BOOT_MARK_CRC,            // application CRC verification
+  BOOT_MARK_CONFIG_SAVE,    // config_save
+  BOOT_MARK_JUMP,           // goto_application teardown
+  BOOT_MARK_APP_ENTRY,      // application main(), first application mark
+  BOOT_MARK_APP_CLOCK,      // application HAL_Init + SystemClock_Config
+  BOOT_MARK_APP_INIT,       // application peripherals, task creation
+  BOOT_MARK_APP_TASK,       // scheduler start up to the first task run
+  BOOT_MARK_COUNT
+} bootMark_t;
+
+typedef struct {
+  uint32_t mark;            // bootMark_t
+  uint32_t cycles;          // DWT->CYCCNT
+  uint32_t hz;              // SystemCoreClock, times the phase that starts here
+  uint32_t tick;            // HAL_GetTick(), for phases longer than the counter wraps
+} bootProfileMark_t;
+
+typedef struct {
+  uint32_t          magic;                          // BOOT_PROFILE_MAGIC
+  uint32_t          count;                          // marks taken
+  bootProfileMark_t marks[BOOT_PROFILE_MAX_MARKS];
+} bootProfile_t;
+
+void cycle_counter_enable(void);
+void boot_profile_start(void);
+void boot_profile_mark(bootMark_t mark);
+void boot_profile_report(void);
+
+#endif /* __BOOT_PROFILE_H__ */
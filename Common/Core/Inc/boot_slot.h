@@ -0,0 +1,22 @@
+/**
+  ******************************************************************************
+  * @file    boot_slot.h
+  * @author  Shiddeshwaran-S
+  * @brief   Trial boot confirmation. An image the bootloader activated in the
+  *          other bank runs on trial until the application confirms it, the
+  *          word lives in no-init RAM at the same place in both images.
+  ******************************************************************************
+  */
+
+#ifndef __BOOT_SLOT_H__
+#define __BOOT_SLOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BOOT_SLOT_CONFIRM_MAGIC  ( 0xC0F1A4EDU )  // application is up, keep its slot
+
+void boot_slot_confirm(void);
+bool boot_slot_take_confirm(void);
+
+#endif /* __BOOT_SLOT_H__ */
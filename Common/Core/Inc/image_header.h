@@ -0,0 +1,42 @@
+/**
+  ******************************************************************************
+  * @file    image_header.h
+  * @author  Shiddeshwaran-S
+  * @brief   Application image header, shared by the App (which carries it),
+  *          the bootloader (which checks it) and App/Tools/image_stamp (which
+  *          fills it in after the link).
+  ******************************************************************************
+  */
+
+#ifndef __IMAGE_HEADER_H__
+#define __IMAGE_HEADER_H__
+
+#include <stdint.h>
+
+#define IMAGE_HEADER_MAGIC    ( 0x49585445U )  // "ETXI"
+#define IMAGE_HEADER_VERSION  ( 1U )
+#define IMAGE_HEADER_OFFSET   ( 0x400U )       // from the image start, right after the vector table
+#define IMAGE_VERSION(major, minor, patch) ( ((uint32_t)(major) << 16) | ((uint32_t)(minor) << 8) | (uint32_t)(patch) )
+
+/*
+ * Image header, little endian, at IMAGE_HEADER_OFFSET in the image. The App
+ * builds it with image_size, image_crc and header_crc left at 0xFFFFFFFF;
+ * image_stamp fills them in, in the .bin and the .elf alike, so an image
+ * flashed by a debugger describes itself too.
+ *
+ * image_crc:  CRC32 (zlib) of the image_size bytes of the image with the
+ *             header left out
+ * header_crc: CRC32 (zlib) of the header up to header_crc
+ */
+typedef struct {
+  uint32_t magic;           // IMAGE_HEADER_MAGIC
+  uint32_t header_version;  // IMAGE_HEADER_VERSION
+  uint32_t image_size;      // bytes, header included
+  uint32_t load_address;    // where the image runs from (vector table)
+  uint32_t image_crc;       // see above
+  uint32_t app_version;     // IMAGE_VERSION(major, minor, patch)
+  uint32_t reserved;        // 0
+  uint32_t header_crc;      // see above
+} imageHeader_t;
+
+#endif /* __IMAGE_HEADER_H__ */
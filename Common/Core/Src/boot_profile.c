@@ -0,0 +1,141 @@
+/**
+  ******************************************************************************
+  * @file    boot_profile.c
+  * @author  Shiddeshwaran-S
+  * @brief   Boot phase timeline. The bootloader starts the record at reset and
+  *          stamps its phases, the application adds its own and reports the
+  *          whole boot. The record lives in .boot_profile, a NOLOAD section
+  *          both linker scripts put at the start of RAM_D3, so neither image's
+  *          startup code clears it.
+  ******************************************************************************
+  */
+
+#include "boot_profile.h"
+#include "logger.h"
+#include "stm32h7xx_hal.h"
+#include <stdbool.h>
+
+static bootProfile_t boot_profile __attribute__((section(".boot_profile")));
+
+static const char *BOOT_MARK_NAMES[BOOT_MARK_COUNT] = {
+    "reset",          /* BOOT_MARK_RESET */
+    "clock",          /* BOOT_MARK_CLOCK */
+    "init",           /* BOOT_MARK_INIT */
+    "config",         /* BOOT_MARK_CONFIG */
+    "dl check",       /* BOOT_MARK_DL_CHECK */
+    "download",       /* BOOT_MARK_DOWNLOAD */
+    "crc",            /* BOOT_MARK_CRC */
+    "config save",    /* BOOT_MARK_CONFIG_SAVE */
+    "jump",           /* BOOT_MARK_JUMP */
+    "app entry",      /* BOOT_MARK_APP_ENTRY */
+    "app clock",      /* BOOT_MARK_APP_CLOCK */
+    "app init",       /* BOOT_MARK_APP_INIT */
+    "app task",       /* BOOT_MARK_APP_TASK */
+};
+
+/*
+ * Length of the phase between two marks in us, timed at the clock it started
+ * with. The cycle counter wraps after 2^32 cycles (10.7 s at 400 MHz), so a
+ * phase that long (a download) is taken from the HAL tick instead, when both
+ * marks were taken by the same image.
+ */
+static uint32_t boot_profile_phase_us(const bootProfileMark_t *from, const bootProfileMark_t *to)
+{
+  bool is_same_image = (from->mark < BOOT_MARK_APP_ENTRY) == (to->mark < BOOT_MARK_APP_ENTRY);
+  uint32_t mhz = from->hz / 1000000U;
+
+  if (mhz == 0U) {
+    return 0;
+  }
+  if (is_same_image) {
+    uint32_t ms = to->tick - from->tick;
+    uint32_t wrap_ms = (uint32_t)((0x100000000ULL * 1000ULL) / from->hz);
+    if (ms >= wrap_ms / 2U) {
+      return ms * 1000U;
+    }
+  }
+  return (to->cycles - from->cycles) / mhz;
+}
+
+/**
+ * @brief  Start the DWT cycle counter (leaves the count as it is)
+ * @retval None
+ */
+void cycle_counter_enable(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55U;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * @brief  Start a new timeline: zero the cycle counter, take the reset mark.
+ *         Bootloader only, first thing in main().
+ * @retval None
+ */
+void boot_profile_start(void)
+{
+  cycle_counter_enable();
+  DWT->CYCCNT = 0;
+
+  boot_profile.magic = BOOT_PROFILE_MAGIC;
+  boot_profile.count = 0;
+  boot_profile_mark(BOOT_MARK_RESET);
+}
+
+/**
+ * @brief  Stamp the end of a phase. Does nothing if the bootloader did not
+ *         start a timeline on this boot, if the mark was taken already, or
+ *         once the record is full.
+ * @param  mark: phase that ends here
+ * @retval None
+ */
+void boot_profile_mark(bootMark_t mark)
+{
+  if (boot_profile.magic != BOOT_PROFILE_MAGIC || boot_profile.count >= BOOT_PROFILE_MAX_MARKS) {
+    return;
+  }
+  for (uint32_t i = 0; i < boot_profile.count; i++) {
+    if (boot_profile.marks[i].mark == (uint32_t)mark) {
+      return;
+    }
+  }
+
+  bootProfileMark_t *entry = &boot_profile.marks[boot_profile.count];
+  entry->mark = (uint32_t)mark;
+  entry->cycles = DWT->CYCCNT;
+  entry->hz = SystemCoreClock;
+  entry->tick = HAL_GetTick();
+  boot_profile.count++;
+}
+
+/**
+ * @brief  Log the timeline, one line per phase with its length and the time
+ *         since reset, then retire the record so a later boot without the
+ *         bootloader does not report it again.
+ * @retval None
+ */
+void boot_profile_report(void)
+{
+  uint32_t elapsed_us = 0;
+
+  if (boot_profile.magic != BOOT_PROFILE_MAGIC || boot_profile.count == 0U) {
+    LOG_INFO("Boot timeline: not started by the bootloader\r\n");
+    return;
+  }
+
+  LOG_INFO("Boot timeline (us, phase / since reset):\r\n");
+  for (uint32_t i = 1; i < boot_profile.count; i++) {
+    const bootProfileMark_t *from = &boot_profile.marks[i - 1U];
+    const bootProfileMark_t *to = &boot_profile.marks[i];
+    uint32_t us = boot_profile_phase_us(from, to);
+
+    elapsed_us += us;
+    LOG_INFO("  %-12s %9lu %9lu  @ %lu MHz\r\n",
+             (to->mark < BOOT_MARK_COUNT) ? BOOT_MARK_NAMES[to->mark] : "?",
+             us, elapsed_us, from->hz / 1000000U);
+  }
+  LOG_INFO("Boot time: %lu.%03lu ms\r\n", elapsed_us / 1000U, elapsed_us % 1000U);
+
+  boot_profile.magic = 0;
+}
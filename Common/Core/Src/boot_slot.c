@@ -0,0 +1,36 @@
+/**
+  ******************************************************************************
+  * @file    boot_slot.c
+  * @author  Shiddeshwaran-S
+  * @brief   Trial boot confirmation word, in .boot_slot: a NOLOAD section both
+  *          linker scripts put right after the boot timeline, so neither
+  *          image's startup code clears it and both find it at one address.
+  ******************************************************************************
+  */
+
+#include "boot_slot.h"
+
+static volatile uint32_t boot_slot_confirmed __attribute__((section(".boot_slot")));
+
+/**
+ * @brief  Application: the image is up and working. Harmless without A/B
+ *         slots, nobody reads it then.
+ * @retval None
+ */
+void boot_slot_confirm(void)
+{
+  boot_slot_confirmed = BOOT_SLOT_CONFIRM_MAGIC;
+}
+
+/**
+ * @brief  Bootloader: did the application confirm its image since the last
+ *         call? Clears the word, each confirmation is taken once.
+ * @retval true if confirmed
+ */
+bool boot_slot_take_confirm(void)
+{
+  bool is_confirmed = (boot_slot_confirmed == BOOT_SLOT_CONFIRM_MAGIC);
+
+  boot_slot_confirmed = 0;
+  return is_confirmed;
+}
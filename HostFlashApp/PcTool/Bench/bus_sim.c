@@ -0,0 +1,250 @@
+/**
+  ******************************************************************************
+  * @file    bus_sim.c
+  * @author  Shiddeshwaran-S
+  * @brief   Bus simulator: broadcast bootloaders behind one libetxflash transport
+  ******************************************************************************/
+
+#include "bus_sim.h"
+
+#define BUS_SIM_MAX_NODES     ( ETX_BCAST_MAX_NODES )
+#define BUS_SIM_RX_SIZE       ( 4096 )    // MISSING answers waiting for the host
+
+/*
+ * Node state, as in the bootloader
+ */
+typedef enum
+{
+  BUS_NODE_IDLE     = 0,
+  BUS_NODE_HEADER   = 1,
+  BUS_NODE_DATA     = 2,
+  BUS_NODE_SUCCESS  = 3,
+  BUS_NODE_FAILED   = 4,
+}BUS_NODE_STATE_;
+
+typedef struct
+{
+  uint8_t             address;
+  BUS_NODE_STATE_     state;
+  ETX_FRAME_PARSER_   parser;
+  uint8_t            *flash;                            // application area
+  uint32_t            size;                             // image size from the header
+  uint32_t            fragments;
+  uint32_t            received;
+  uint8_t             map[ETX_MISSING_BITMAP_SIZE];     // bit set = fragment flashed
+  uint32_t            heard;                            // DATA_AT frames seen, for the loss pattern
+}BUS_NODE_;
+
+static BUS_NODE_ *nodes = NULL;
+static uint32_t nodes_count = 0;
+static uint32_t loss = 0;
+static uint64_t tx_count = 0;
+static uint8_t rx_buf[BUS_SIM_RX_SIZE];
+static uint32_t rx_len = 0;
+static uint32_t rx_pos = 0;
+
+/* Scramble frame and node number, so losses do not line up with resends */
+static uint32_t bus_sim_mix(uint32_t heard, uint32_t index)
+{
+  uint32_t x = (heard * 0x9E3779B1U) + (index * 0x85EBCA77U);
+  x ^= x >> 15;
+  x *= 0x2C1B3C6DU;
+  x ^= x >> 12;
+  return x;
+}
+
+/* Queue a MISSING frame for the host */
+static void bus_node_answer(BUS_NODE_ *node)
+{
+  ETX_DL_FRAME_ frame;
+  uint16_t count = (node->state == BUS_NODE_DATA) ? (uint16_t)node->fragments : 0;
+  uint32_t bitmap_len = (count + 7U) / 8U;
+
+  frame.sof = ETX_FRAME_SOF;
+  frame.eof = ETX_FRAME_EOF;
+  frame.packet_type = ETX_DL_FRAME_TYPE_MISSING;
+  frame.payload[0] = node->address;
+  memcpy(&frame.payload[1], &count, 2);
+  for (uint32_t i = 0; i < bitmap_len; i++) {
+    frame.payload[ETX_MISSING_HDR_SIZE + i] = (uint8_t)~node->map[i];
+  }
+  if ((count % 8U) != 0) {
+    frame.payload[ETX_MISSING_HDR_SIZE + bitmap_len - 1] &= (uint8_t)((1U << (count % 8U)) - 1U);
+  }
+  frame.payload_len = (uint16_t)(ETX_MISSING_HDR_SIZE + bitmap_len);
+
+  if (rx_len + ETX_FRAME_WIRE_SIZE(frame.payload_len) <= sizeof(rx_buf)) {
+    rx_len += etx_encode_frame(&frame, &rx_buf[rx_len]);
+  }
+}
+
+/* A complete, CRC checked frame arrived at a node */
+static void bus_node_frame(BUS_NODE_ *node, uint32_t index, const ETX_DL_FRAME_ *frame)
+{
+  bool is_cmd = (frame->packet_type == ETX_DL_FRAME_TYPE_CMD && frame->payload_len == 1);
+
+  if (frame->packet_type == ETX_DL_FRAME_TYPE_POLL && frame->payload_len == 1 && frame->payload[0] == node->address) {
+    bus_node_answer(node);
+    return;
+  }
+
+  switch (node->state)
+  {
+  case BUS_NODE_IDLE:
+    if (is_cmd && frame->payload[0] == ETX_DL_CMD_START_BROADCAST) {
+      node->state = BUS_NODE_HEADER;
+    }
+    break;
+
+  case BUS_NODE_HEADER:
+    if (frame->packet_type == ETX_DL_FRAME_TYPE_HEADER && frame->payload_len == 8) {
+      node->size = ((uint32_t)frame->payload[0] << 24) | ((uint32_t)frame->payload[1] << 16) |
+                   ((uint32_t)frame->payload[2] << 8) | frame->payload[3];
+      node->fragments = (node->size + ETX_FRAME_DATA_MAX_SIZE - 1) / ETX_FRAME_DATA_MAX_SIZE;
+      if (node->size == 0 || node->size > ETX_DL_MAX_FW_SIZE) {
+        node->state = BUS_NODE_FAILED;
+        break;
+      }
+      memset(node->flash, 0xFF, ETX_DL_MAX_FW_SIZE);
+      node->state = BUS_NODE_DATA;
+    }
+    break;
+
+  case BUS_NODE_DATA:
+    if (frame->packet_type == ETX_DL_FRAME_TYPE_DATA_AT && frame->payload_len > ETX_DATA_AT_HDR_SIZE) {
+      uint32_t offset, length = frame->payload_len - ETX_DATA_AT_HDR_SIZE;
+      memcpy(&offset, frame->payload, 4);
+
+      if (loss != 0 && (bus_sim_mix(++node->heard, index) % loss) == 0) {
+        break;   // lost on the bus
+      }
+      if ((offset % ETX_FRAME_DATA_MAX_SIZE) != 0 || offset >= node->size || length > node->size - offset) {
+        break;
+      }
+      uint32_t f = offset / ETX_FRAME_DATA_MAX_SIZE;
+      if ((node->map[f / 8] & (1U << (f % 8))) == 0) {
+        memcpy(&node->flash[offset], &frame->payload[ETX_DATA_AT_HDR_SIZE], length);
+        node->map[f / 8] |= (uint8_t)(1U << (f % 8));
+        node->received++;
+      }
+    } else if (is_cmd && frame->payload[0] == ETX_DL_CMD_END) {
+      node->state = (node->received == node->fragments) ? BUS_NODE_SUCCESS : BUS_NODE_FAILED;
+    } else if (is_cmd && frame->payload[0] == ETX_DL_CMD_ABORT) {
+      node->state = BUS_NODE_FAILED;
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+static int bus_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+  (void)ctx;
+
+  uint32_t n = rx_len - rx_pos;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buf, &rx_buf[rx_pos], n);
+  rx_pos += n;
+  if (rx_pos == rx_len) {
+    rx_pos = rx_len = 0;
+  }
+
+  return (int)n;
+}
+
+static int bus_write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+  (void)ctx;
+
+  for (uint32_t i = 0; i < nodes_count; i++) {
+    BUS_NODE_ *node = &nodes[i];
+    uint32_t pos = 0;
+
+    while (pos < len) {
+      uint32_t consumed;
+      if (etx_frame_parse(&node->parser, &buf[pos], len - pos, &consumed) == ETX_DL_FRAME_EX_OK) {
+        bus_node_frame(node, i, &node->parser.frame);
+      }
+      pos += consumed;
+    }
+  }
+  tx_count += len;
+
+  return (int)len;
+}
+
+void bus_sim_reset(void)
+{
+  for (uint32_t i = 0; i < nodes_count; i++) {
+    BUS_NODE_ *node = &nodes[i];
+
+    node->address = (uint8_t)(i + 1);
+    node->state = BUS_NODE_IDLE;
+    node->size = 0;
+    node->fragments = 0;
+    node->received = 0;
+    node->heard = 0;
+    memset(node->map, 0, sizeof(node->map));
+    etx_frame_parser_reset(&node->parser);
+  }
+  rx_len = rx_pos = 0;
+  tx_count = 0;
+}
+
+bool bus_sim_init(uint32_t node_count, uint32_t loss_every)
+{
+  if (node_count == 0 || node_count > BUS_SIM_MAX_NODES) {
+    return false;
+  }
+
+  nodes = calloc(node_count, sizeof(BUS_NODE_));
+  if (nodes == NULL) {
+    return false;
+  }
+  nodes_count = node_count;
+  for (uint32_t i = 0; i < node_count; i++) {
+    nodes[i].flash = malloc(ETX_DL_MAX_FW_SIZE);
+    if (nodes[i].flash == NULL) {
+      bus_sim_deinit();
+      return false;
+    }
+  }
+  loss = loss_every;
+  bus_sim_reset();
+
+  return true;
+}
+
+void bus_sim_deinit(void)
+{
+  for (uint32_t i = 0; i < nodes_count; i++) {
+    free(nodes[i].flash);
+  }
+  free(nodes);
+  nodes = NULL;
+  nodes_count = 0;
+}
+
+bool bus_sim_node_ok(uint32_t index, const uint8_t *bin, uint32_t size)
+{
+  return index < nodes_count
+      && nodes[index].state == BUS_NODE_SUCCESS
+      && nodes[index].size == size
+      && memcmp(nodes[index].flash, bin, size) == 0;
+}
+
+uint64_t bus_sim_tx_count(void)
+{
+  return tx_count;
+}
+
+void bus_sim_transport(ETX_TRANSPORT_ *transport)
+{
+  transport->write = bus_write;
+  transport->read = bus_read;
+  transport->ctx = NULL;
+}
@@ -0,0 +1,46 @@
+/**
+  ******************************************************************************
+  * @file    bus_sim.h
+  * @author  Shiddeshwaran-S
+  * @brief   Simulated RS-485 bus of broadcast bootloaders for the host benchmarks
+  ******************************************************************************/
+
+#ifndef __BUS_SIM_H
+#define __BUS_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "etx_flash_lib.h"
+
+/*
+ * Every byte the host writes reaches all nodes at once, each one decodes it
+ * the way the bootloader does in broadcast mode (START_BROADCAST, header,
+ * DATA_AT, POLL, END) and answers a POLL for its own address with a MISSING
+ * frame, which the read callback hands back to the host. Node i has address
+ * i + 1 and drops about one in loss_every DATA_AT frames it hears, in a
+ * fixed pseudo-random pattern that differs per node, 0 for a clean bus.
+ */
+bool bus_sim_init(uint32_t node_count, uint32_t loss_every);
+void bus_sim_deinit(void);
+
+/* Back to power-on: every node waiting in IDLE, flash and counters cleared */
+void bus_sim_reset(void);
+
+/* Node index got END with the whole image and its flash matches bin */
+bool bus_sim_node_ok(uint32_t index, const uint8_t *bin, uint32_t size);
+
+/* Total number of bytes the host put on the bus */
+uint64_t bus_sim_tx_count(void);
+
+void bus_sim_transport(ETX_TRANSPORT_ *transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BUS_SIM_H */
@@ -0,0 +1,501 @@
+/**
+  ******************************************************************************
+  * @file    etx_bench.c
+  * @author  Shiddeshwaran-S
+  * @brief   Microbenchmarks for the host flash tool hot paths.
+  *          libetxflash runs against Bench/null_transport.c instead of a
+  *          serial port.
+  ******************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "etx_flash_lib.h"
+#include "null_transport.h"
+#include "bus_sim.h"
+
+#define BENCH_DEFAULT_WARMUP      ( 2 )     // warm-up repetitions (discarded)
+#define BENCH_DEFAULT_REPS        ( 7 )     // measured repetitions (median reported)
+#define BENCH_DEFAULT_MIN_TIME_MS ( 100 )   // minimum wall time of one repetition
+#define BENCH_DEFAULT_THRESHOLD   ( 10.0 )  // regression threshold in percent
+#define BENCH_IMAGE_SIZE          ( ETX_DL_MAX_FW_SIZE )
+#define BENCH_BCAST_NODES         ( 8 )     // boards on the simulated RS-485 bus
+#define BENCH_BCAST_LOSS          ( 40 )    // each node drops every 40th data frame
+
+/*
+ * Bench case
+ */
+typedef struct
+{
+  const char  *name;                    // stable identifier, used as diff key
+  uint32_t     bytes_per_op;            // payload bytes processed by one op
+  void       (*run)(void);              // one op
+}BENCH_CASE_;
+
+/*
+ * Bench result
+ */
+typedef struct
+{
+  uint64_t  iterations;                 // ops per repetition
+  double    ns_per_op;                  // median over the measured repetitions
+  double    bytes_per_sec;              // derived from ns_per_op
+  double    allocs_per_op;              // heap allocations per op
+}BENCH_RESULT_;
+
+/* ***** Allocation counting (-Wl,--wrap=malloc,...) - Start ***** */
+
+static uint64_t alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  alloc_count++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  alloc_count++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  alloc_count++;
+  return __real_realloc(ptr, size);
+}
+
+/* ***** Allocation counting - End ***** */
+
+/* ***** Fixtures - Start ***** */
+
+static uint8_t CRC_BUF[ETX_FRAME_DATA_MAX_SIZE];
+static uint8_t APP_BIN[BENCH_IMAGE_SIZE];
+static uint8_t FRAME_BUF[ETX_FRAME_PACKET_MAX_SIZE];
+static uint8_t WIRE_OUT[ETX_FRAME_PACKET_MAX_SIZE];
+static uint8_t WIRE_FRAME[ETX_FRAME_PACKET_MAX_SIZE];
+static uint32_t wire_frame_len = 0;
+static ETX_FRAME_PARSER_ parser;
+static ETX_IMAGE_ bench_image_at;
+static ETX_SESSION_CFG_ session_cfg;
+static ETX_SESSION_CFG_ bcast_cfg;
+static uint8_t bcast_nodes[BENCH_BCAST_NODES];
+static char image_path[] = "/tmp/etx_bench_image_XXXXXX";
+
+static const uint8_t ACK_RSP[ETX_RSPF_PACKET_SIZE] = {
+  ETX_FRAME_SOF, ETX_DL_FRAME_TYPE_RESPONSE, ETX_DL_RSP_ACK, ETX_FRAME_EOF
+};
+
+static void fill_pattern(uint8_t *buf, uint32_t len, uint32_t seed)
+{
+  // xorshift32: deterministic so every run hashes identical data
+  uint32_t x = seed ? seed : 0x12345678U;
+  for (uint32_t i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = (uint8_t)x;
+  }
+}
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// image header as the App build stamps it, so the loader takes the file
+static void stamp_image_header(uint8_t *bin, uint32_t size)
+{
+  uint8_t *header = &bin[ETX_IMAGE_HEADER_OFFSET];
+
+  memset(header, 0, ETX_IMAGE_HEADER_SIZE);
+  put_le32(&header[0], ETX_IMAGE_HEADER_MAGIC);
+  put_le32(&header[4], 1);
+  put_le32(&header[8], size);
+  put_le32(&header[12], ETX_APP_LOAD_ADDRESS);
+  put_le32(&header[ETX_IMAGE_HEADER_SIZE - 4], CalcCRC(header, ETX_IMAGE_HEADER_SIZE - 4));
+}
+
+static void build_data_frame(ETX_DL_FRAME_ *frame)
+{
+  memset(frame, 0, ETX_FRAME_PACKET_MAX_SIZE);
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_DATA;
+  frame->payload_len = ETX_FRAME_DATA_MAX_SIZE;
+  memcpy(frame->payload, CRC_BUF, ETX_FRAME_DATA_MAX_SIZE);
+}
+
+static bool fixtures_init(void)
+{
+  fill_pattern(CRC_BUF, sizeof(CRC_BUF), 1);
+  fill_pattern(APP_BIN, BENCH_IMAGE_SIZE, 2);
+  stamp_image_header(APP_BIN, BENCH_IMAGE_SIZE);
+
+  // Encode one full data frame exactly as it appears on the wire
+  ETX_DL_FRAME_ *frame = (ETX_DL_FRAME_ *)FRAME_BUF;
+  build_data_frame(frame);
+  wire_frame_len = etx_encode_frame(frame, WIRE_FRAME);
+
+  // DATA_AT image and a bus of lossy nodes for the broadcast bench
+  if (!etx_image_build(&bench_image_at, APP_BIN, BENCH_IMAGE_SIZE, ETX_IMAGE_FLAG_OFFSET_ADDR)
+    || !bus_sim_init(BENCH_BCAST_NODES, BENCH_BCAST_LOSS)) {
+    fprintf(stderr, "bench: failed to set up the broadcast bus\n");
+    return false;
+  }
+  for (uint32_t i = 0; i < BENCH_BCAST_NODES; i++) {
+    bcast_nodes[i] = (uint8_t)(i + 1);
+  }
+  bus_sim_transport(&bcast_cfg.transport);
+  bcast_cfg.nodes = bcast_nodes;
+  bcast_cfg.node_count = BENCH_BCAST_NODES;
+
+  // Image file for the loader bench
+  int fd = mkstemp(image_path);
+  if (fd < 0) {
+    fprintf(stderr, "bench: mkstemp failed: %s\n", strerror(errno));
+    return false;
+  }
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == NULL || fwrite(APP_BIN, 1, BENCH_IMAGE_SIZE, fp) != BENCH_IMAGE_SIZE) {
+    fprintf(stderr, "bench: failed to write %s\n", image_path);
+    if (fp) fclose(fp);
+    return false;
+  }
+  fclose(fp);
+
+  null_transport(&session_cfg.transport);
+  session_cfg.tx_gap_us = ETX_TX_BYTE_GAP_US; // paced like a plain download, on a virtual clock
+  return true;
+}
+
+static void fixtures_deinit(void)
+{
+  etx_image_free(&bench_image_at);
+  bus_sim_deinit();
+  remove(image_path);
+}
+
+/* ***** Fixtures - End ***** */
+
+/* ***** Bench cases - Start ***** */
+
+static volatile uint32_t sink;
+
+static void bench_crc_frame(void)
+{
+  sink = CalcCRC(CRC_BUF, ETX_FRAME_DATA_MAX_SIZE);
+}
+
+static void bench_crc_image(void)
+{
+  sink = CalcCRC(APP_BIN, BENCH_IMAGE_SIZE);
+}
+
+static void bench_frame_encode(void)
+{
+  // payload is left untouched between ops, only the CRC/header is redone
+  sink = etx_encode_frame((ETX_DL_FRAME_ *)FRAME_BUF, WIRE_OUT);
+}
+
+static void bench_frame_decode(void)
+{
+  uint32_t consumed;
+  etx_frame_parser_reset(&parser);
+  sink = etx_frame_parse(&parser, WIRE_FRAME, wire_frame_len, &consumed);
+}
+
+static void bench_image_load(void)
+{
+  ETX_IMAGE_ image = {0};
+  sink = etx_image_load_file(&image, image_path, 0);
+  etx_image_free(&image);
+}
+
+static void bench_image_load_subblock(void)
+{
+  ETX_IMAGE_ image = {0};
+  sink = etx_image_load_file(&image, image_path, ETX_IMAGE_FLAG_SUBBLOCK_CRC);
+  etx_image_free(&image);
+}
+
+static void bench_session_flash(void)
+{
+  static bool reported = false;
+  ETX_IMAGE_ image = {0};
+  uint64_t now_us = 0;
+
+  null_transport_set_rx(ACK_RSP, sizeof(ACK_RSP));
+
+  // the whole host side of a download: framing and CRCs, then every paced write
+  if (!etx_image_build(&image, APP_BIN, BENCH_IMAGE_SIZE, 0)) {
+    fprintf(stderr, "bench: failed to frame the bench image\n");
+    abort();
+  }
+
+  // virtual clock: jump straight to the session's next deadline (the next paced write)
+  ETX_SESSION_ *session = etx_session_start(&session_cfg, &image, now_us);
+  while (!etx_session_done(session)) {
+    etx_session_io(session, ETX_IO_READ | ETX_IO_WRITE, now_us);
+    now_us += etx_session_timeout_us(session, now_us);
+  }
+  if (etx_session_result(session) != ETX_DL_EX_OK) {
+    fprintf(stderr, "bench: session ended with %d before flashing the image\n", etx_session_result(session));
+    abort();
+  }
+  if (!reported) {
+    fprintf(stderr, "bench: paced download of %u bytes takes %.1f s on the link\n",
+            BENCH_IMAGE_SIZE, (double)now_us / 1000000.0);
+    reported = true;
+  }
+
+  sink = etx_session_result(session);
+  etx_session_free(session);
+  etx_image_free(&image);
+}
+
+static void bench_session_broadcast(void)
+{
+  static bool reported = false;
+  uint64_t now_us = 0;
+
+  bus_sim_reset();
+
+  // virtual clock: jump straight to the session's next deadline (frame gaps, POLL timeouts)
+  ETX_SESSION_ *session = etx_session_start(&bcast_cfg, &bench_image_at, now_us);
+  while (!etx_session_done(session)) {
+    etx_session_io(session, ETX_IO_READ | ETX_IO_WRITE, now_us);
+    now_us += etx_session_timeout_us(session, now_us);
+  }
+
+  for (uint32_t i = 0; i < BENCH_BCAST_NODES; i++) {
+    if (etx_session_node_result(session, i) != ETX_NODE_RESULT_OK || !bus_sim_node_ok(i, APP_BIN, BENCH_IMAGE_SIZE)) {
+      fprintf(stderr, "bench: broadcast node %u did not get the image\n", i + 1);
+      abort();
+    }
+  }
+  if (!reported) {
+    fprintf(stderr, "bench: broadcast to %u nodes put %.2fx the image size on the bus\n",
+            BENCH_BCAST_NODES, (double)bus_sim_tx_count() / BENCH_IMAGE_SIZE);
+    reported = true;
+  }
+
+  sink = etx_session_result(session);
+  etx_session_free(session);
+}
+
+static const BENCH_CASE_ bench_cases[] = {
+  { "crc32.frame_10240",      ETX_FRAME_DATA_MAX_SIZE, bench_crc_frame    },
+  { "crc32.image_1MiB",       BENCH_IMAGE_SIZE,        bench_crc_image    },
+  { "frame.encode_10240",     ETX_FRAME_DATA_MAX_SIZE, bench_frame_encode },
+  { "frame.decode_10240",     ETX_FRAME_DATA_MAX_SIZE, bench_frame_decode },
+  { "image.load_1MiB",        BENCH_IMAGE_SIZE,        bench_image_load   },
+  { "image.load_sb_1MiB",     BENCH_IMAGE_SIZE,        bench_image_load_subblock },
+  { "session.flash_paced_1MiB", BENCH_IMAGE_SIZE,      bench_session_flash },
+  { "session.broadcast_8x1MiB", BENCH_BCAST_NODES * BENCH_IMAGE_SIZE, bench_session_broadcast },
+};
+
+#define BENCH_CASE_COUNT (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+/* ***** Bench cases - End ***** */
+
+/* ***** Runner - Start ***** */
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static void bench_run(const BENCH_CASE_ *bc, int warmup, int reps, uint32_t min_time_ms, BENCH_RESULT_ *res)
+{
+  double samples[64];
+  uint64_t iters = 1;
+  uint64_t min_ns = (uint64_t)min_time_ms * 1000000ULL;
+
+  // Calibrate: grow the iteration count until one repetition takes min_time
+  while (true) {
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < iters; i++) bc->run();
+    uint64_t dt = now_ns() - t0;
+    if (dt >= min_ns || iters >= (1ULL << 30)) break;
+    iters = (dt == 0) ? iters * 10 : (iters * min_ns) / dt + 1;
+  }
+
+  for (int w = 0; w < warmup; w++) {
+    for (uint64_t i = 0; i < iters; i++) bc->run();
+  }
+
+  uint64_t allocs = 0;
+  for (int r = 0; r < reps; r++) {
+    uint64_t a0 = alloc_count;
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < iters; i++) bc->run();
+    uint64_t dt = now_ns() - t0;
+    allocs += alloc_count - a0;
+    samples[r] = (double)dt / (double)iters;
+  }
+
+  qsort(samples, reps, sizeof(double), cmp_double);
+  res->iterations = iters;
+  res->ns_per_op = samples[reps / 2];
+  res->bytes_per_sec = res->ns_per_op > 0 ? (bc->bytes_per_op * 1e9) / res->ns_per_op : 0;
+  res->allocs_per_op = (double)allocs / (double)(iters * (uint64_t)reps);
+}
+
+static void bench_write(FILE *fp, int warmup, int reps, uint32_t min_time_ms,
+                        const BENCH_CASE_ *bc, const BENCH_RESULT_ *res, size_t count)
+{
+  fprintf(fp, "# etx_bench warmup=%d reps=%d min_time_ms=%u (median of reps)\n", warmup, reps, min_time_ms);
+  fprintf(fp, "# %-22s %10s %14s %16s %10s\n", "name", "bytes/op", "ns/op", "bytes/s", "allocs/op");
+  for (size_t i = 0; i < count; i++) {
+    if (bc[i].run == NULL) continue;
+    fprintf(fp, "%-24s %10u %14.1f %16.0f %10.2f\n",
+            bc[i].name, bc[i].bytes_per_op, res[i].ns_per_op, res[i].bytes_per_sec, res[i].allocs_per_op);
+  }
+}
+
+/*
+ * Compare against a previous results file. Returns the number of cases
+ * whose ns/op grew by more than threshold percent.
+ */
+static int bench_compare(const char *baseline, const BENCH_CASE_ *bc, const BENCH_RESULT_ *res,
+                         size_t count, double threshold)
+{
+  FILE *fp = fopen(baseline, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "bench: can not open baseline %s\n", baseline);
+    return -1;
+  }
+
+  int regressions = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char name[64];
+    unsigned bytes;
+    double ns;
+    if (line[0] == '#' || sscanf(line, "%63s %u %lf", name, &bytes, &ns) != 3) continue;
+
+    for (size_t i = 0; i < count; i++) {
+      if (bc[i].run == NULL || strcmp(bc[i].name, name) != 0) continue;
+      double delta = ns > 0 ? ((res[i].ns_per_op - ns) * 100.0) / ns : 0;
+      bool regressed = delta > threshold;
+      fprintf(stderr, "%-24s %14.1f -> %14.1f ns/op  %+7.1f%%%s\n",
+              name, ns, res[i].ns_per_op, delta, regressed ? "  REGRESSION" : "");
+      regressions += regressed;
+    }
+  }
+  fclose(fp);
+
+  return regressions;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [-w warmup] [-r reps] [-t min_time_ms] [-f filter] [-o out] [-b baseline [-x pct]]\n"
+    "  -w  warm-up repetitions, discarded (default %d)\n"
+    "  -r  measured repetitions, median is reported (default %d, max 64)\n"
+    "  -t  minimum duration of one repetition in ms (default %d)\n"
+    "  -f  only run cases whose name contains this string\n"
+    "  -o  write results to this file (default stdout)\n"
+    "  -b  compare against a previous results file\n"
+    "  -x  regression threshold in percent for -b (default %.0f)\n",
+    prog, BENCH_DEFAULT_WARMUP, BENCH_DEFAULT_REPS, BENCH_DEFAULT_MIN_TIME_MS, BENCH_DEFAULT_THRESHOLD);
+}
+
+/* ***** Runner - End ***** */
+
+int main(int argc, char *argv[])
+{
+  int warmup = BENCH_DEFAULT_WARMUP;
+  int reps = BENCH_DEFAULT_REPS;
+  uint32_t min_time_ms = BENCH_DEFAULT_MIN_TIME_MS;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  const char *filter = NULL;
+  const char *out_path = NULL;
+  const char *baseline = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:r:t:f:o:b:x:h")) != -1) {
+    switch (opt) {
+      case 'w': warmup = atoi(optarg); break;
+      case 'r': reps = atoi(optarg); break;
+      case 't': min_time_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+      case 'f': filter = optarg; break;
+      case 'o': out_path = optarg; break;
+      case 'b': baseline = optarg; break;
+      case 'x': threshold = atof(optarg); break;
+      default:  usage(argv[0]); return (opt == 'h') ? 0 : 2;
+    }
+  }
+
+  if (warmup < 0 || reps < 1 || reps > 64) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // Keep the results stream clean; the code under test logs to stdout
+  FILE *out = stdout;
+  if (out_path != NULL) {
+    out = fopen(out_path, "w");
+    if (out == NULL) {
+      fprintf(stderr, "bench: can not open %s\n", out_path);
+      return 2;
+    }
+  } else {
+    int fd = dup(fileno(stdout));
+    out = fdopen(fd, "w");
+  }
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "bench: can not silence stdout\n");
+  }
+
+  if (!fixtures_init()) {
+    return 1;
+  }
+
+  BENCH_CASE_ cases[BENCH_CASE_COUNT];
+  BENCH_RESULT_ results[BENCH_CASE_COUNT];
+  memcpy(cases, bench_cases, sizeof(cases));
+  memset(results, 0, sizeof(results));
+
+  for (size_t i = 0; i < BENCH_CASE_COUNT; i++) {
+    if (filter != NULL && strstr(cases[i].name, filter) == NULL) {
+      cases[i].run = NULL;
+      continue;
+    }
+    fprintf(stderr, "bench: %s...\n", cases[i].name);
+    bench_run(&cases[i], warmup, reps, min_time_ms, &results[i]);
+  }
+
+  fixtures_deinit();
+
+  bench_write(out, warmup, reps, min_time_ms, cases, results, BENCH_CASE_COUNT);
+  fclose(out);
+
+  if (baseline != NULL) {
+    int regressions = bench_compare(baseline, cases, results, BENCH_CASE_COUNT, threshold);
+    if (regressions != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
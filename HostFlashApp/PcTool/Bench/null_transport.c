@@ -0,0 +1,64 @@
+/**
+  ******************************************************************************
+  * @file    null_transport.c
+  * @author  Shiddeshwaran-S
+  * @brief   Null transport: libetxflash I/O without a serial port behind it
+  ******************************************************************************/
+
+#include "null_transport.h"
+
+static const uint8_t *rx_data = NULL;
+static size_t rx_len = 0;
+static size_t rx_pos = 0;
+static uint64_t tx_count = 0;
+
+void null_transport_set_rx(const uint8_t *data, size_t len)
+{
+  rx_data = data;
+  rx_len = len;
+  rx_pos = 0;
+}
+
+uint64_t null_transport_tx_count(void)
+{
+  return tx_count;
+}
+
+static int null_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+  (void)ctx;
+
+  if (rx_data == NULL || rx_len == 0) {
+    return -1; // nothing armed, report a port error instead of spinning
+  }
+
+  uint32_t n = 0;
+  while (n < len) {
+    size_t chunk = rx_len - rx_pos;
+    if (chunk > (size_t)(len - n)) {
+      chunk = (size_t)(len - n);
+    }
+    memcpy(&buf[n], &rx_data[rx_pos], chunk);
+    n += (uint32_t)chunk;
+    rx_pos += chunk;
+    if (rx_pos == rx_len) {
+      rx_pos = 0;
+    }
+  }
+
+  return (int)n;
+}
+
+static int null_write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+  (void)ctx; (void)buf;
+  tx_count += len;
+  return (int)len;
+}
+
+void null_transport(ETX_TRANSPORT_ *transport)
+{
+  transport->write = null_write;
+  transport->read = null_read;
+  transport->ctx = NULL;
+}
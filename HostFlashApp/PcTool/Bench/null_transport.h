@@ -0,0 +1,36 @@
+/**
+  ******************************************************************************
+  * @file    null_transport.h
+  * @author  Shiddeshwaran-S
+  * @brief   Null libetxflash transport for the host benchmarks
+  ******************************************************************************/
+
+#ifndef __NULL_TRANSPORT_H
+#define __NULL_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "etx_flash_lib.h"
+
+/*
+ * Reads are served from this buffer and it wraps around once exhausted, so
+ * a single ACK response can be replayed for as many frames as the bench
+ * needs. Writes are counted and dropped.
+ */
+void null_transport_set_rx(const uint8_t *data, size_t len);
+
+/* Total number of bytes accepted by the write callback */
+uint64_t null_transport_tx_count(void);
+
+void null_transport(ETX_TRANSPORT_ *transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NULL_TRANSPORT_H */
@@ -0,0 +1,235 @@
+#ifndef __ETX_FLASH_LIB_H
+#define __ETX_FLASH_LIB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "etx_flash_update.h"
+
+/*
+ * libetxflash
+ *
+ * Reentrant host side of the ETX download protocol. All state lives in the
+ * session handle, nothing blocks: the caller owns the event loop, tells the
+ * session when its transport is readable/writable and passes the current
+ * time. Any number of sessions can be driven from one thread.
+ *
+ *   session = etx_session_start(&cfg, &image, etx_time_us());
+ *   while (!etx_session_done(session)) {
+ *     wait for I/O or etx_session_timeout_us(session, now)
+ *     etx_session_io(session, ETX_IO_READ | ETX_IO_WRITE, etx_time_us());
+ *   }
+ *   etx_session_free(session);
+ *
+ * Streaming (cfg.stream): the session asks for START_STREAM and, once the
+ * header is acknowledged, writes all data frames back to back, paced only by
+ * RTS/CTS. The bootloader answers with STATUS frames: a NACK carries the
+ * fragment to resume from, the final ACK confirms the whole image. A
+ * bootloader without streaming support NACKs START_STREAM and the session
+ * falls back to one ACK per frame.
+ *
+ * Sub-block CRCs (ETX_IMAGE_FLAG_SUBBLOCK_CRC): data frames carry a CRC per
+ * 1K sub-block. When only part of a frame is damaged the bootloader NACKs
+ * with a bitmap of the bad sub-blocks and the session sends a REPAIR frame
+ * holding just those instead of the whole frame, in both modes.
+ *
+ * Read-back (etx_read_start): the same session handle, driven the same way,
+ * asks the bootloader for a flash range. Every READ_DATA chunk is checked
+ * and ACKed before the bootloader sends the next one, a NACK (bad CRC or
+ * silence) gets the chunk again.
+ *
+ * Striping (cfg.lane2, ETX_IMAGE_FLAG_OFFSET_ADDR): the session asks for
+ * START_STRIPED and, once the header is acknowledged, keeps one DATA_AT frame
+ * in flight on each port. DATA_AT frames carry their offset in the image, so
+ * the bootloader flashes them in whatever order they complete. Every frame is
+ * ACKed on the port it came in on and resent there on a NACK; END goes out on
+ * cfg.transport once all of them are in. Readiness passed to etx_session_io
+ * covers both ports while striping, their read/write just return 0 when idle.
+ *
+ * Broadcast (cfg.nodes, ETX_IMAGE_FLAG_OFFSET_ADDR): for bootloaders sharing
+ * one RS-485 bus, each with its own node address (etx_node_start). Nothing is
+ * ACKed: START_BROADCAST and the header go out once, the session polls every
+ * node until it has erased, then sends every DATA_AT frame once for all of
+ * them. Each node is then polled for a bitmap of the fragments it is
+ * missing, the union is sent again and the nodes re-polled, up to
+ * cfg.max_retries rounds. END goes out last; etx_session_node_result tells
+ * which nodes got the whole image, the session succeeds only if all did.
+ *
+ * Staged (cfg.staged): streaming, but the session asks for START_STAGED and
+ * its header also carries the CRC of every 128 KB flash sector. The
+ * bootloader receives into RAM as fast as the line goes, checks each chunk
+ * (up to 640 KB) against those CRCs and only then erases and flashes it;
+ * a sector that does not match is NACKed like a bad frame and sent again.
+ * RTS holds the stream while a chunk that is not the last is flashed. The
+ * summary ACK comes once the last chunk checks out in RAM, before it is
+ * flashed, so the session ends as soon as the last byte is out. A
+ * bootloader without staging NACKs START_STAGED and the session streams.
+ *
+ * Random access (cfg.random, ETX_IMAGE_FLAG_OFFSET_ADDR): the session asks
+ * for START_RANDOM and, once the header is acknowledged, decides what to
+ * send itself. With cfg.base, the image the slot holds now, only the flash
+ * sectors whose contents change are erased (ERASE, one per run of sectors)
+ * and only the DATA_AT frames that touch them are sent; frames that are all
+ * 0xFF are skipped, erased flash holds them already. Without cfg.base every
+ * sector is erased and every frame sent. COMMIT goes out last: the
+ * bootloader checks the whole image against the header's CRC and ACKs it,
+ * or answers with a STATUS NACK if the flash does not hold it (cfg.base
+ * was not what the slot held, for instance).
+ *
+ * Probe (etx_probe_start, ETX_IMAGE_FLAG_PROBE): the image's frames go out
+ * as PROBE frames, one ACK each, and nothing is flashed. Used to measure a
+ * link: etx_session_stats counts the frames, NACKs and the slowest answer.
+ */
+
+#define ETX_IO_READ             ( 0x01 )    // transport has data to read
+#define ETX_IO_WRITE            ( 0x02 )    // transport accepts data
+
+#define ETX_RSP_TIMEOUT_MS      ( 10000 )   // default wait for ACK/NACK
+#define ETX_MAX_NACK_RETRIES    ( 3 )       // default resends per frame
+#define ETX_IMAGE_HASH_LEN      ( 16 )      // hex digits of the 64-bit image hash
+#define ETX_STREAM_RESUME_GAP_MS ( 100 )    // silence before resending after a STATUS NACK
+#define ETX_STAGED_FLASH_MS     ( 30000 )   // staged: RTS may hold the stream this long while a chunk is flashed
+
+#define ETX_BCAST_MAX_NODES     ( 32 )      // broadcast: nodes per session
+#define ETX_BCAST_FRAME_GAP_MS  ( 10 )      // broadcast: bus idle after each frame, nodes flash meanwhile
+#define ETX_BCAST_POLL_MS       ( 50 )      // broadcast: wait for a node's answer to a POLL
+
+#define ETX_IMAGE_FLAG_SUBBLOCK_CRC ( 0x01 ) // frame data as DATA_SB (per sub-block CRCs)
+#define ETX_IMAGE_FLAG_OFFSET_ADDR  ( 0x02 ) // frame data as DATA_AT (image offset in every frame)
+#define ETX_IMAGE_FLAG_PROBE        ( 0x04 ) // frame data as PROBE (link test, etx_probe_start)
+
+/*
+ * Transport: non-blocking byte stream supplied by the caller
+ */
+typedef struct
+{
+  int   (*write)(void *ctx, const uint8_t *buf, uint32_t len);  // bytes taken, 0 = would block, <0 = error
+  int   (*read)(void *ctx, uint8_t *buf, uint32_t len);         // bytes read, 0 = none, <0 = error
+  void   *ctx;
+}ETX_TRANSPORT_;
+
+/*
+ * Broadcast: outcome per node
+ */
+typedef enum
+{
+  ETX_NODE_RESULT_PENDING = 0,      // still being served
+  ETX_NODE_RESULT_OK      = 1,      // reported the whole image
+  ETX_NODE_RESULT_FAILED  = 2,      // silent, lost the download or out of retries
+}ETX_NODE_RESULT_;
+
+/*
+ * Link statistics of a session
+ */
+typedef struct
+{
+  uint32_t  frames;                       // data frames / read chunks ACKed
+  uint32_t  nacks;                        // NACKs received or sent
+  uint64_t  max_rsp_us;                   // longest wait for an ACK/NACK after a frame
+}ETX_SESSION_STATS_;
+
+typedef struct ETX_SESSION_ ETX_SESSION_;
+
+typedef void (*ETX_PROGRESS_CB_)(ETX_SESSION_ *session, uint32_t bytes_done, uint32_t bytes_total, void *user);
+typedef void (*ETX_COMPLETE_CB_)(ETX_SESSION_ *session, ETX_DL_EX_ result, void *user);
+
+/*
+ * Session configuration
+ */
+typedef struct
+{
+  ETX_TRANSPORT_    transport;
+  ETX_PROGRESS_CB_  on_progress;          // after every ACKed data frame / read chunk (optional)
+  ETX_COMPLETE_CB_  on_complete;          // once, on success or failure (optional)
+  void             *user;                 // passed back to the callbacks
+  uint32_t          tx_gap_us;            // gap between paced writes, 0 = unpaced
+  uint32_t          tx_chunk;             // bytes per paced write, 0 = 1
+  uint32_t          rsp_timeout_ms;       // 0 = ETX_RSP_TIMEOUT_MS
+  uint32_t          ack_timeout_ms;       // data frames after the first, read chunks; 0 = rsp_timeout_ms
+  uint8_t           max_retries;          // 0 = ETX_MAX_NACK_RETRIES
+  uint32_t          start_retries;        // START resends on timeout, 0 = until answered
+  bool              stream;               // stream data frames (needs RTS/CTS on the port)
+  bool              staged;               // stream into the bootloader's RAM, flashed once checked (needs RTS/CTS)
+  ETX_TRANSPORT_    lane2;                // second port for striping, write == NULL for one port
+  const uint8_t    *nodes;                // broadcast: bus addresses, NULL for point to point
+  uint32_t          node_count;           // up to ETX_BCAST_MAX_NODES
+  bool              random;               // random access download: erase and send only what changed
+  const uint8_t    *base;                 // random access: image in the slot now, NULL if unknown
+  uint32_t          base_size;            // its size in bytes
+}ETX_SESSION_CFG_;
+
+/*
+ * Application image, framed once
+ *
+ * wire holds the FW_INFO header frame followed by every data frame exactly
+ * as they go out on the serial line (CRC and EOF included). Images are
+ * read-only once built and can be shared by any number of sessions.
+ */
+typedef struct
+{
+  char      hash[ETX_IMAGE_HASH_LEN + 1];   // FNV-1a 64 of the image, hex
+  uint32_t  size;                           // image size in bytes
+  uint32_t  crc;                            // CRC32 of the image (CalcCRC)
+  uint32_t  flags;                          // ETX_IMAGE_FLAG_*
+  uint8_t  *wire;                           // pre-encoded frames, back to back
+  uint32_t  wire_len;                       // total bytes in wire
+  uint32_t  header_len;                     // FW_INFO frame at wire[0]
+  uint32_t  frame_count;                    // number of data frames
+  uint32_t *frame_offset;                   // frame_count + 1 offsets into wire
+}ETX_IMAGE_;
+
+/*
+ * Incremental frame decoder, for frames sent by the bootloader
+ */
+typedef struct
+{
+  ETX_DL_FRAME_ frame;                      // decoded frame once complete
+  uint32_t      pos;                        // wire bytes consumed for this frame
+}ETX_FRAME_PARSER_;
+
+/* Frames and CRC */
+uint32_t CalcCRC(const uint8_t * pData, uint32_t DataLength);
+uint64_t etx_hash64(const uint8_t *data, uint32_t len);
+uint32_t etx_encode_frame(ETX_DL_FRAME_ *frame, uint8_t *wire);
+void etx_fill_cmd_frame(ETX_DL_FRAME_ *frame, ETX_DL_CMD_ cmd);
+void etx_fill_fw_info(ETX_DL_FRAME_ *frame, uint32_t size, uint32_t crc);
+void etx_fill_data_frame(ETX_DL_FRAME_ *frame, const uint8_t *data, uint16_t len);
+void etx_fill_subblock_frame(ETX_DL_FRAME_ *frame, const uint8_t *data, uint16_t len);
+void etx_fill_data_at_frame(ETX_DL_FRAME_ *frame, uint32_t offset, const uint8_t *data, uint16_t len);
+void etx_fill_read_cmd(ETX_DL_FRAME_ *frame, uint32_t address, uint32_t length);
+void etx_fill_erase_cmd(ETX_DL_FRAME_ *frame, uint32_t offset, uint32_t length);
+void etx_frame_parser_reset(ETX_FRAME_PARSER_ *parser);
+ETX_DL_FRAME_EX_ etx_frame_parse(ETX_FRAME_PARSER_ *parser, const uint8_t *data, uint32_t len, uint32_t *consumed);
+
+/* Images */
+bool etx_image_build(ETX_IMAGE_ *image, const uint8_t *bin, uint32_t size, uint32_t flags);
+bool etx_image_load_file(ETX_IMAGE_ *image, const char *file_path, uint32_t flags);
+bool etx_image_check_header(const uint8_t *bin, uint32_t size);
+uint32_t etx_image_frame_data_len(const ETX_IMAGE_ *image, uint32_t index);
+void etx_image_free(ETX_IMAGE_ *image);
+
+/* Sessions */
+ETX_SESSION_ *etx_session_start(const ETX_SESSION_CFG_ *cfg, const ETX_IMAGE_ *image, uint64_t now_us);
+ETX_SESSION_ *etx_read_start(const ETX_SESSION_CFG_ *cfg, uint32_t address, uint32_t length, uint8_t *buf, uint64_t now_us);
+ETX_SESSION_ *etx_node_start(const ETX_SESSION_CFG_ *cfg, uint8_t address, uint64_t now_us);
+ETX_SESSION_ *etx_probe_start(const ETX_SESSION_CFG_ *cfg, const ETX_IMAGE_ *image, uint64_t now_us);
+void etx_session_io(ETX_SESSION_ *session, int ready, uint64_t now_us);
+int etx_session_io_wanted(const ETX_SESSION_ *session);
+uint64_t etx_session_timeout_us(const ETX_SESSION_ *session, uint64_t now_us);
+bool etx_session_done(const ETX_SESSION_ *session);
+ETX_DL_EX_ etx_session_result(const ETX_SESSION_ *session);
+ETX_DL_STATE_ etx_session_state(const ETX_SESSION_ *session);
+const ETX_IMAGE_ *etx_session_image(const ETX_SESSION_ *session);          // NULL for read-back
+ETX_NODE_RESULT_ etx_session_node_result(const ETX_SESSION_ *session, uint32_t index); // broadcast, index into cfg.nodes
+void etx_session_stats(const ETX_SESSION_ *session, ETX_SESSION_STATS_ *stats);
+void etx_session_free(ETX_SESSION_ *session);
+
+/* Monotonic clock in microseconds, for callers without one */
+uint64_t etx_time_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ETX_FLASH_LIB_H */
@@ -9,6 +9,7 @@ extern "C" {
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #if defined(__linux__)
 #include <unistd.h>
@@ -16,8 +17,6 @@ extern "C" {
 #include <Windows.h>
 #endif
 
-#include "rs232.h"
-
 #define ETX_FRAME_SOF  0xAAU    // Start of Frame
 #define ETX_FRAME_EOF  0xBBU    // End of Frame
 #define ETX_FRAME_ACK  0x00U    // ACK
@@ -25,9 +24,38 @@ extern "C" {
 
 #define ETX_FRAME_DATA_MAX_SIZE ( 10240 )  //Maximum data Size
 #define ETX_FRAME_DATA_OVERHEAD (     9 )  //data overhead
+#define ETX_SUBBLOCK_SIZE       (  1024 )  // sub-block covered by its own CRC (DATA_SB frames)
+#define ETX_SUBBLOCK_MAX        ( ETX_FRAME_DATA_MAX_SIZE / ETX_SUBBLOCK_SIZE ) // sub-blocks per frame
+#define ETX_REPAIR_HDR_SIZE     (     8 )  // REPAIR frame: fragment index + bitmap
+#define ETX_FRAME_PAYLOAD_MAX_SIZE ( ETX_FRAME_DATA_MAX_SIZE + (ETX_SUBBLOCK_MAX * 4) + ETX_REPAIR_HDR_SIZE ) // largest payload on the wire
 #define ETX_FRAME_PACKET_MAX_SIZE sizeof(ETX_DL_FRAME_) // Maximum packet size
 #define ETX_RSPF_PACKET_SIZE sizeof(ETX_DL_RSPF_) // Maximum packet size
 #define ETX_DL_MAX_FW_SIZE ( 1024 * 1024 ) // 1MB
+#define ETX_FLASH_SECTOR_SIZE ( 128 * 1024 ) // bootloader erases one sector at a time, just ahead of the writes
+#define ETX_TX_BYTE_GAP_US (  1500 )  // default inter-byte gap in us
+#define ETX_FRAME_WIRE_SIZE(len) ((len) + ETX_FRAME_DATA_OVERHEAD) // bytes on the wire
+#define ETX_STATUS_PAYLOAD_SIZE ( 5 )      // STATUS frame: N/ACK + fragment index
+#define ETX_STATUS_BITMAP_PAYLOAD_SIZE ( 9 ) // STATUS frame with bad sub-block bitmap
+#define ETX_STATUS_INDEX_FATAL  ( 0xFFFFFFFFU ) // STATUS index: download aborted
+#define ETX_READ_CMD_SIZE       ( 9 )      // READ command: cmd + address + length
+#define ETX_READ_HDR_SIZE       ( 4 )      // READ_DATA frame: offset ahead of the data
+#define ETX_READ_CHUNK_SIZE     ( ETX_FRAME_DATA_MAX_SIZE ) // flash bytes per READ_DATA frame
+#define ETX_DATA_AT_HDR_SIZE    ( 4 )      // DATA_AT frame: image offset ahead of the data
+#define ETX_ERASE_CMD_SIZE      ( 9 )      // ERASE command: cmd + image offset + length
+#define ETX_STAGED_MAX_SECTORS  ( ETX_DL_MAX_FW_SIZE / ETX_FLASH_SECTOR_SIZE ) // staged header: sector CRCs at most
+#define ETX_DL_MAX_FRAGMENTS    ( (ETX_DL_MAX_FW_SIZE + ETX_FRAME_DATA_MAX_SIZE - 1) / ETX_FRAME_DATA_MAX_SIZE )
+#define ETX_MISSING_BITMAP_SIZE ( (ETX_DL_MAX_FRAGMENTS + 7) / 8 ) // MISSING frame: one bit per fragment
+#define ETX_MISSING_HDR_SIZE    ( 3 )      // MISSING frame: node + fragment count ahead of the bitmap
+#define ETX_NODE_NONE           ( 0x00 )   // bootloader not on a multi-drop bus
+#define ETX_NODE_MAX            ( 0xFE )   // highest bus address
+#define ETX_BREAKIN_MAGIC       "ETX-DL!"  // sent at reset, bootloader ACKs it and enters Download mode
+#define ETX_BREAKIN_PERIOD_MS   ( 5 )      // resend period, well inside the bootloader's listen window
+#define ETX_BREAKIN_TIMEOUT_MS  ( 30000 )  // how long to wait for the board to be reset
+#define ETX_IMAGE_HEADER_OFFSET ( 0x400 )  // image header in the App binary (Common/Core/Inc/image_header.h)
+#define ETX_IMAGE_HEADER_SIZE   ( 32 )
+#define ETX_IMAGE_HEADER_MAGIC  ( 0x49585445U ) // "ETXI"
+#define ETX_APP_LOAD_ADDRESS    ( 0x08100000U ) // application slot the bootloader accepts
+#define ETX_APP_LOAD_ADDRESS_AB ( 0x08060000U ) // the same with A/B slots (App built with AB_SLOTS=1)
 
 /*
  * ETX DL exit codes
@@ -71,6 +99,14 @@ typedef enum
   ETX_DL_FRAME_TYPE_HEADER    = 0x02,
   ETX_DL_FRAME_TYPE_DATA      = 0x03,
   ETX_DL_FRAME_TYPE_RESPONSE  = 0x04,
+  ETX_DL_FRAME_TYPE_STATUS    = 0x05,   // streaming: async error / final summary
+  ETX_DL_FRAME_TYPE_DATA_SB   = 0x06,   // sub-block CRC table + data
+  ETX_DL_FRAME_TYPE_REPAIR    = 0x07,   // resent sub-blocks of one fragment
+  ETX_DL_FRAME_TYPE_READ_DATA = 0x08,   // read-back chunk, bootloader to host
+  ETX_DL_FRAME_TYPE_DATA_AT   = 0x09,   // data frame carrying its image offset (striping, broadcast)
+  ETX_DL_FRAME_TYPE_POLL      = 0x0A,   // broadcast: host asks one node what it is missing
+  ETX_DL_FRAME_TYPE_MISSING   = 0x0B,   // broadcast: node's missing fragment bitmap
+  ETX_DL_FRAME_TYPE_PROBE     = 0x0C,   // link test, ACKed in IDLE and thrown away
 }ETX_DL_FRAME_TYPE_;
 
 /**
@@ -81,6 +117,15 @@ typedef enum
   ETX_DL_CMD_START      = 0x01,
   ETX_DL_CMD_ABORT      = 0x02,
   ETX_DL_CMD_END        = 0x03,
+  ETX_DL_CMD_START_STREAM = 0x04,   // START, data frames streamed without ACKs
+  ETX_DL_CMD_READ       = 0x05,     // stream a flash range back to the host
+  ETX_DL_CMD_START_STRIPED = 0x06,  // START, DATA_AT frames spread over two ports
+  ETX_DL_CMD_START_BROADCAST = 0x07, // START on a shared bus, nothing is ACKed
+  ETX_DL_CMD_SET_NODE   = 0x08,     // store the RS-485 bus address
+  ETX_DL_CMD_START_RANDOM = 0x09,   // START, DATA_AT frames anywhere, the host erases and commits
+  ETX_DL_CMD_ERASE      = 0x0A,     // random access: erase the sectors of an image range
+  ETX_DL_CMD_COMMIT     = 0x0B,     // random access: check the image in flash, ends the download
+  ETX_DL_CMD_START_STAGED = 0x0C,   // START_STREAM, data staged in RAM and flashed once its CRCs check out
 }ETX_DL_CMD_;
 
 /**
@@ -99,13 +144,27 @@ typedef enum
  * | SOF | Type   | Len | LOAD | CRC | EOF |
  * |_____|________|_____|______|_____|_____|
  *   1B      1B     2B   nBytes   4B    1B
+ *
+ * HEADER payload:   | size (4B, big endian) | CRC32 (4B, big endian) | [ staged: CRC32 of each flash sector (4B each) ] |
+ * DATA_SB payload:  | CRC32 of each 1K sub-block (4B each) | data |
+ * REPAIR payload:   | fragment (4B) | bitmap (4B) | { CRC32 (4B) | sub-block } per set bit |
+ * STATUS payload:   | N/ACK (1B) | fragment (4B) | [ bad sub-block bitmap (4B) ] |
+ * READ cmd payload: | READ (1B) | address (4B) | length (4B) |
+ * READ_DATA payload:| offset from address (4B) | data |
+ * DATA_AT payload:  | offset in the image (4B) | data |
+ * ERASE cmd payload:| ERASE (1B) | offset in the image (4B) | length (4B) |
+ * SET_NODE payload: | SET_NODE (1B) | address (1B) |
+ * POLL payload:     | node (1B) |
+ * MISSING payload:  | node (1B) | fragments (2B) | bitmap, bit set = missing (1B per 8 fragments) |
+ * PROBE payload:    | any data, up to ETX_FRAME_DATA_MAX_SIZE |
+ * (multi-byte fields little endian)
  */
 typedef struct
 {
   uint8_t   sof;                                      // Start of Frame (ETX_FRAME_SOF)
   uint8_t   packet_type;                              // Packet Type (ETX_DL_FRAME_TYPE_)
   uint16_t  payload_len;                              // Length of the payload
-  uint8_t   payload[ETX_FRAME_DATA_MAX_SIZE];         // Payload data
+  uint8_t   payload[ETX_FRAME_PAYLOAD_MAX_SIZE];      // Payload data
   uint32_t  crc;                                      // CRC32 of the payload
   uint8_t   eof;                                      // End of Frame (ETX_FRAME_EOF)
 }__attribute__((packed)) ETX_DL_FRAME_;
@@ -126,6 +185,16 @@ typedef struct
   uint8_t   eof;                      // End of Frame (ETX_FRAME_EOF)
 }__attribute__((packed)) ETX_DL_RSPF_;
 
+void delay(uint32_t us);
+
+#if defined(__linux__)
+#define ETX_DAEMON_SOCKET_PATH "/tmp/etx_flash.sock"
+#define ETX_WATCH_DIR "/dev/serial/by-id"
+int etx_flash_daemon(const char *socket_path, int bdrate);
+int etx_flash_watch(const char *image_path, const char *dir, int bdrate);
+int etx_flash_tune(const char *port, const int *bdrates, uint32_t bdrate_count, uint32_t read_addr);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,33 @@
+#ifndef __ETX_IMAGE_CACHE_H
+#define __ETX_IMAGE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "etx_flash_lib.h"
+
+#define ETX_IMAGE_CACHE_SIZE  ( 4 )    // images kept in memory (LRU)
+
+/*
+ * Cached application image, framed once at load time so a flash job only
+ * has to write spans of image.wire and wait for the ACKs.
+ */
+typedef struct
+{
+  ETX_IMAGE_  image;                        // framed image (libetxflash)
+  char        path[1024];                   // where it was loaded from
+  uint64_t    last_used;                    // LRU stamp
+  uint32_t    refs;                         // running sessions, never evicted while > 0
+}ETX_CACHED_IMAGE_;
+
+ETX_CACHED_IMAGE_ *etx_image_cache_load(const char *file_path);
+ETX_CACHED_IMAGE_ *etx_image_cache_find(const char *hash);
+void etx_image_cache_foreach(void (*fn)(const ETX_CACHED_IMAGE_ *cached, void *arg), void *arg);
+void etx_image_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ETX_IMAGE_CACHE_H */
@@ -0,0 +1,39 @@
+#ifndef __ETX_LINK_PROFILE_H
+#define __ETX_LINK_PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "etx_flash_lib.h"
+
+#define ETX_LINK_PROFILE_FILE   ".etx_flash_profiles"   // in $HOME, one line per adapter
+#define ETX_LINK_ID_LEN         ( 256 )                 // by-id link name
+
+/*
+ * Link settings that worked best for one USB-serial adapter (tune)
+ *
+ * Keyed by the adapter's /dev/serial/by-id name, which carries its serial
+ * number and stays the same whichever ttyUSBn it enumerates as.
+ */
+typedef struct
+{
+  char      id[ETX_LINK_ID_LEN];        // by-id link name
+  int       bdrate;                     // port baud rate
+  uint32_t  tx_chunk;                   // bytes per paced write
+  uint32_t  tx_gap_us;                  // gap between paced writes, 0 = unpaced
+  uint32_t  ack_timeout_ms;             // wait for a data frame's ACK
+  uint32_t  goodput;                    // measured, bytes/s
+}ETX_LINK_PROFILE_;
+
+bool etx_link_profile_id(const char *tty, char *id, size_t id_len);
+bool etx_link_profile_load(const char *id, ETX_LINK_PROFILE_ *profile);
+bool etx_link_profile_save(const ETX_LINK_PROFILE_ *profile);
+bool etx_link_profile_for_port(const char *tty, ETX_LINK_PROFILE_ *profile);
+void etx_link_profile_apply(const ETX_LINK_PROFILE_ *profile, ETX_SESSION_CFG_ *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ETX_LINK_PROFILE_H */
@@ -0,0 +1,17 @@
+#ifndef __ETX_RS232_TRANSPORT_H
+#define __ETX_RS232_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "etx_flash_lib.h"
+#include "rs232.h"
+
+void etx_rs232_transport(ETX_TRANSPORT_ *transport, int comport_number);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ETX_RS232_TRANSPORT_H */
@@ -0,0 +1,456 @@
+/**
+  ******************************************************************************
+  * @file    etx_flash_daemon.c
+  * @author  Shiddeshwaran-S
+  * @brief   Long running flash service on a local Unix socket (Linux only).
+  *
+  *          Line based protocol, one command per line:
+  *            LOAD <image_path>          -> OK <hash> <size> <crc>
+  *            FLASH <tty> <hash|path> [stream] -> OK <tty> <hash> <ms> (when done)
+  *            STATUS                     -> IMAGE ... / JOB ... lines, then OK
+  *            SHUTDOWN                   -> OK
+  *          Errors are reported as "ERR <reason>".
+  *
+  *          Images stay cached with their frames and CRCs pre-computed and
+  *          serial ports stay open between jobs. Every FLASH is a libetxflash
+  *          session driven from the same event loop, so jobs on different
+  *          ports run concurrently and share the cached frames. A port
+  *          is opened with the link profile tune stored for its adapter.
+  ******************************************************************************/
+
+#if defined(__linux__)
+
+#define _DEFAULT_SOURCE
+
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "etx_flash_update.h"
+#include "etx_image_cache.h"
+#include "etx_rs232_transport.h"
+#include "etx_link_profile.h"
+
+#define ETX_DAEMON_MAX_CLIENTS  ( 32 )
+#define ETX_DAEMON_MAX_JOBS     ( 16 )
+#define ETX_DAEMON_MAX_PORTS    ( 16 )
+#define ETX_DAEMON_LINE_MAX     ( 1200 )
+#define ETX_DAEMON_JOB_POLL_MS  ( 1 )     // while sessions are running, idle the loop blocks
+
+/*
+ * Client connection
+ */
+typedef struct
+{
+  int     fd;                               // -1 when unused
+  char    line[ETX_DAEMON_LINE_MAX];        // partial command line
+  size_t  line_len;
+}ETX_DAEMON_CLIENT_;
+
+/*
+ * Flash job, one download session
+ */
+typedef struct
+{
+  ETX_SESSION_       *session;              // NULL when unused
+  ETX_CACHED_IMAGE_  *cached;               // pinned while the job runs
+  int                 client_fd;            // where the result goes
+  int                 comport_number;
+  char                tty[32];
+  uint64_t            start_ms;
+}ETX_DAEMON_JOB_;
+
+/*
+ * Serial port kept open across jobs
+ */
+typedef struct
+{
+  int                 comport_number;       // -1 when unused
+  bool                busy;                 // a job is running on it
+  bool                flow_ctrl;            // opened with RTS/CTS (stream jobs)
+  bool                have_profile;         // profile below stored by tune
+  ETX_LINK_PROFILE_   profile;
+}ETX_DAEMON_PORT_;
+
+static ETX_DAEMON_CLIENT_ clients[ETX_DAEMON_MAX_CLIENTS];
+static ETX_DAEMON_JOB_ jobs[ETX_DAEMON_MAX_JOBS];
+static ETX_DAEMON_PORT_ ports[ETX_DAEMON_MAX_PORTS];
+static int listen_fd = -1;
+static int port_bdrate = 0;
+static volatile sig_atomic_t daemon_running = 1;
+
+/* ***** Utility Functions - Start ***** */
+
+static uint64_t daemon_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+static void daemon_on_signal(int sig)
+{
+  (void)sig;
+  daemon_running = 0;
+}
+
+/* Open port, or the one kept open, with the baud rate of its link profile; reopened if the flow control changes */
+static ETX_DAEMON_PORT_ *daemon_port_get(const char *tty, int comport_number, bool flow_ctrl)
+{
+  ETX_DAEMON_PORT_ *port = NULL;
+  char mode[] = {'8','N','1',0};
+
+  for (int i = 0; i < ETX_DAEMON_MAX_PORTS && port == NULL; i++) {
+    if (ports[i].comport_number == comport_number) {
+      port = &ports[i];
+    }
+  }
+
+  if (port != NULL) {
+    if (port->busy || port->flow_ctrl == flow_ctrl) {
+      return port;
+    }
+    RS232_CloseComport(comport_number);
+    port->comport_number = -1;
+  } else {
+    for (int i = 0; i < ETX_DAEMON_MAX_PORTS && port == NULL; i++) {
+      if (ports[i].comport_number < 0) {
+        port = &ports[i];
+      }
+    }
+    if (port == NULL) {
+      return NULL;
+    }
+    port->have_profile = etx_link_profile_for_port(tty, &port->profile);
+  }
+
+  if (RS232_OpenComport(comport_number, port->have_profile ? port->profile.bdrate : port_bdrate, mode, flow_ctrl ? 1 : 0)) {
+    return NULL;
+  }
+
+  port->comport_number = comport_number;
+  port->busy = false;
+  port->flow_ctrl = flow_ctrl;
+  return port;
+}
+
+static void daemon_port_release(int comport_number)
+{
+  for (int i = 0; i < ETX_DAEMON_MAX_PORTS; i++) {
+    if (ports[i].comport_number == comport_number) {
+      ports[i].busy = false;
+    }
+  }
+}
+
+/* ***** Utility Functions - End ***** */
+
+/* ***** Command Handlers - Start ***** */
+
+static void daemon_cmd_load(int fd, const char *path)
+{
+  ETX_CACHED_IMAGE_ *cached = etx_image_cache_load(path);
+  if (cached == NULL) {
+    dprintf(fd, "ERR can not load %s\n", path);
+    return;
+  }
+  dprintf(fd, "OK %s %u 0x%08X\n", cached->image.hash, cached->image.size, cached->image.crc);
+}
+
+static void daemon_cmd_flash(int fd, const char *tty, const char *image_ref, bool stream)
+{
+  ETX_CACHED_IMAGE_ *cached = etx_image_cache_find(image_ref);
+  if (cached == NULL) {
+    // not a known hash, accept a path as well
+    cached = etx_image_cache_load(image_ref);
+  }
+  if (cached == NULL) {
+    dprintf(fd, "ERR unknown image %s\n", image_ref);
+    return;
+  }
+
+  int comport_number = RS232_GetPortnr(tty);
+  if (comport_number < 0) {
+    dprintf(fd, "ERR unknown port %s\n", tty);
+    return;
+  }
+
+  ETX_DAEMON_JOB_ *job = NULL;
+  for (int i = 0; i < ETX_DAEMON_MAX_JOBS && job == NULL; i++) {
+    if (jobs[i].session == NULL) job = &jobs[i];
+  }
+  if (job == NULL) {
+    dprintf(fd, "ERR too many jobs\n");
+    return;
+  }
+
+  ETX_DAEMON_PORT_ *port = daemon_port_get(tty, comport_number, stream);
+  if (port == NULL) {
+    dprintf(fd, "ERR can not open port %s\n", tty);
+    return;
+  }
+  if (port->busy) {
+    dprintf(fd, "ERR port busy %s\n", tty);
+    return;
+  }
+
+  ETX_SESSION_CFG_ cfg = {0};
+  etx_rs232_transport(&cfg.transport, comport_number);
+  cfg.tx_gap_us = ETX_TX_BYTE_GAP_US;
+  cfg.stream = stream;      // unpaced, RTS/CTS holds the writes
+  cfg.start_retries = 1;    // the board is expected to be waiting already
+  if (port->have_profile) {
+    etx_link_profile_apply(&port->profile, &cfg);
+  }
+
+  RS232_flushRXTX(comport_number);
+  job->session = etx_session_start(&cfg, &cached->image, etx_time_us());
+  if (job->session == NULL) {
+    dprintf(fd, "ERR can not start session\n");
+    return;
+  }
+
+  cached->refs++;
+  port->busy = true;
+  job->cached = cached;
+  job->client_fd = fd;
+  job->comport_number = comport_number;
+  snprintf(job->tty, sizeof(job->tty), "%s", tty);
+  job->start_ms = daemon_now_ms();
+
+  printf("Job %d: flashing %s on %s\r\n", (int)(job - jobs), cached->image.hash, tty);
+}
+
+static void daemon_print_image(const ETX_CACHED_IMAGE_ *cached, void *arg)
+{
+  const ETX_IMAGE_ *image = &cached->image;
+  dprintf(*(int *)arg, "IMAGE %s %u 0x%08X %u %s\n", image->hash, image->size, image->crc, image->frame_count, cached->path);
+}
+
+static void daemon_cmd_status(int fd)
+{
+  etx_image_cache_foreach(daemon_print_image, &fd);
+
+  uint64_t now = daemon_now_ms();
+  for (int i = 0; i < ETX_DAEMON_MAX_JOBS; i++) {
+    if (jobs[i].session != NULL) {
+      dprintf(fd, "JOB %s %s %llu\n", jobs[i].tty, jobs[i].cached->image.hash, (unsigned long long)(now - jobs[i].start_ms));
+    }
+  }
+  dprintf(fd, "OK\n");
+}
+
+static void daemon_handle_line(int fd, char *line)
+{
+  char *cmd = strtok(line, " \t\r");
+  char *arg1 = strtok(NULL, " \t\r");
+  char *arg2 = strtok(NULL, " \t\r");
+  char *arg3 = strtok(NULL, " \t\r");
+
+  if (cmd == NULL) {
+    return;
+  } else if (strcmp(cmd, "LOAD") == 0 && arg1 != NULL) {
+    daemon_cmd_load(fd, arg1);
+  } else if (strcmp(cmd, "FLASH") == 0 && arg1 != NULL && arg2 != NULL &&
+             (arg3 == NULL || strcmp(arg3, "stream") == 0)) {
+    daemon_cmd_flash(fd, arg1, arg2, arg3 != NULL);
+  } else if (strcmp(cmd, "STATUS") == 0) {
+    daemon_cmd_status(fd);
+  } else if (strcmp(cmd, "SHUTDOWN") == 0) {
+    dprintf(fd, "OK\n");
+    daemon_running = 0;
+  } else {
+    dprintf(fd, "ERR bad command\n");
+  }
+}
+
+/* ***** Command Handlers - End ***** */
+
+/* ***** Event Loop - Start ***** */
+
+static void daemon_client_close(ETX_DAEMON_CLIENT_ *client)
+{
+  // results of running jobs for this client are dropped
+  for (int i = 0; i < ETX_DAEMON_MAX_JOBS; i++) {
+    if (jobs[i].session != NULL && jobs[i].client_fd == client->fd) {
+      jobs[i].client_fd = -1;
+    }
+  }
+  close(client->fd);
+  client->fd = -1;
+  client->line_len = 0;
+}
+
+static void daemon_client_read(ETX_DAEMON_CLIENT_ *client)
+{
+  ssize_t n = read(client->fd, &client->line[client->line_len], sizeof(client->line) - client->line_len - 1);
+  if (n <= 0) {
+    daemon_client_close(client);
+    return;
+  }
+  client->line_len += (size_t)n;
+  client->line[client->line_len] = '\0';
+
+  char *nl;
+  while ((nl = strchr(client->line, '\n')) != NULL) {
+    *nl = '\0';
+    size_t consumed = (size_t)(nl - client->line) + 1;
+    daemon_handle_line(client->fd, client->line);
+    memmove(client->line, &client->line[consumed], client->line_len - consumed + 1);
+    client->line_len -= consumed;
+  }
+
+  if (client->line_len >= sizeof(client->line) - 1) {
+    dprintf(client->fd, "ERR line too long\n");
+    daemon_client_close(client);
+  }
+}
+
+/* Drive every running session, report and release the finished ones */
+static bool daemon_run_jobs(void)
+{
+  bool active = false;
+
+  for (int i = 0; i < ETX_DAEMON_MAX_JOBS; i++) {
+    ETX_DAEMON_JOB_ *job = &jobs[i];
+    if (job->session == NULL) continue;
+
+    etx_session_io(job->session, ETX_IO_READ | ETX_IO_WRITE, etx_time_us());
+    if (!etx_session_done(job->session)) {
+      active = true;
+      continue;
+    }
+
+    bool ok = etx_session_result(job->session) == ETX_DL_EX_OK;
+    uint64_t elapsed = daemon_now_ms() - job->start_ms;
+    const char *hash = job->cached->image.hash;
+
+    printf("Job %d: %s on %s after %llu ms\r\n", i, ok ? "done" : "failed", job->tty, (unsigned long long)elapsed);
+    if (job->client_fd >= 0) {
+      if (ok) {
+        dprintf(job->client_fd, "OK %s %s %llu\n", job->tty, hash, (unsigned long long)elapsed);
+      } else {
+        dprintf(job->client_fd, "ERR flash failed %s %s\n", job->tty, hash);
+      }
+    }
+
+    etx_session_free(job->session);
+    job->cached->refs--;
+    daemon_port_release(job->comport_number);
+    memset(job, 0, sizeof(ETX_DAEMON_JOB_));
+  }
+
+  return active;
+}
+
+/**
+ * @brief  Run the flash service until SHUTDOWN or SIGINT/SIGTERM
+ * @param  socket_path: Unix socket to listen on
+ * @param  bdrate: baud rate used when opening ports
+ * @retval exit code
+ */
+int etx_flash_daemon(const char *socket_path, int bdrate)
+{
+  struct sockaddr_un addr;
+  struct pollfd fds[1 + ETX_DAEMON_MAX_CLIENTS];
+
+  port_bdrate = bdrate;
+  for (int i = 0; i < ETX_DAEMON_MAX_CLIENTS; i++) clients[i].fd = -1;
+  for (int i = 0; i < ETX_DAEMON_MAX_PORTS; i++) ports[i].comport_number = -1;
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+  unlink(socket_path);
+
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+    perror("bind/listen");
+    close(listen_fd);
+    return -1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, daemon_on_signal);
+  signal(SIGTERM, daemon_on_signal);
+
+  printf("Flash daemon listening on %s\r\n", socket_path);
+  fflush(stdout);
+
+  bool jobs_active = false;
+
+  while (daemon_running) {
+    int nfds = 0;
+    fds[nfds].fd = listen_fd;
+    fds[nfds++].events = POLLIN;
+    for (int i = 0; i < ETX_DAEMON_MAX_CLIENTS; i++) {
+      if (clients[i].fd >= 0) {
+        fds[nfds].fd = clients[i].fd;
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    // nothing to drive without jobs: sleep until a client or a signal wakes the loop
+    int ready = poll(fds, nfds, jobs_active ? ETX_DAEMON_JOB_POLL_MS : -1);
+
+    if (ready > 0) {
+      for (int n = 1; n < nfds; n++) {
+        if (!(fds[n].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        for (int i = 0; i < ETX_DAEMON_MAX_CLIENTS; i++) {
+          if (clients[i].fd == fds[n].fd) {
+            daemon_client_read(&clients[i]);
+            break;
+          }
+        }
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listen_fd, NULL, NULL);
+        int i;
+        for (i = 0; fd >= 0 && i < ETX_DAEMON_MAX_CLIENTS; i++) {
+          if (clients[i].fd < 0) {
+            clients[i].fd = fd;
+            clients[i].line_len = 0;
+            break;
+          }
+        }
+        if (fd >= 0 && i == ETX_DAEMON_MAX_CLIENTS) {
+          dprintf(fd, "ERR too many clients\n");
+          close(fd);
+        }
+      }
+    }
+
+    jobs_active = daemon_run_jobs();
+    fflush(stdout);
+  }
+
+  printf("Flash daemon shutting down...\r\n");
+
+  // let running jobs finish, a half written image is worse than a late exit
+  while (daemon_run_jobs()) {
+    delay(ETX_DAEMON_JOB_POLL_MS * 1000);
+  }
+  for (int i = 0; i < ETX_DAEMON_MAX_PORTS; i++) {
+    if (ports[i].comport_number >= 0) RS232_CloseComport(ports[i].comport_number);
+  }
+  for (int i = 0; i < ETX_DAEMON_MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) close(clients[i].fd);
+  }
+  close(listen_fd);
+  unlink(socket_path);
+  etx_image_cache_clear();
+
+  return 0;
+}
+
+/* ***** Event Loop - End ***** */
+
+#endif /* __linux__ */
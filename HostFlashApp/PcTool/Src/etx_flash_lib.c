@@ -0,0 +1,2345 @@
+/**
+  ******************************************************************************
+  * @file    etx_flash_lib.c
+  * @author  Shiddeshwaran-S
+  * @brief   libetxflash: reentrant, non-blocking ETX download sessions
+  ******************************************************************************/
+
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#include <time.h>
+#endif
+
+#include "etx_flash_lib.h"
+
+/*
+ * Session phase within the current frame
+ */
+typedef enum
+{
+  ETX_PHASE_TX        = 0,    // writing the frame
+  ETX_PHASE_WAIT_RSP  = 1,    // waiting for ACK/NACK
+  ETX_PHASE_STREAM    = 2,    // streaming data frames, STATUS frames come back
+  ETX_PHASE_DONE      = 3,    // session finished
+  ETX_PHASE_READ      = 4,    // read-back: READ_DATA chunks come in, ACK/NACK go out
+  ETX_PHASE_STRIPE    = 5,    // striping: a data frame in flight on each lane
+  ETX_PHASE_BCAST     = 6,    // broadcast: frames for every node, POLLs for one
+}ETX_PHASE_;
+
+/*
+ * Broadcast: what goes on the bus next
+ */
+typedef enum
+{
+  ETX_BCAST_START     = 0,    // START_BROADCAST
+  ETX_BCAST_HEADER    = 1,    // FW_INFO header
+  ETX_BCAST_READY     = 2,    // poll until every node has erased
+  ETX_BCAST_DATA      = 3,    // DATA_AT frames, all of them or the ones still missing
+  ETX_BCAST_POLL      = 4,    // collect every node's missing bitmap
+  ETX_BCAST_END       = 5,    // END
+  ETX_BCAST_FINISH    = 6,    // END is out
+}ETX_BCAST_STEP_;
+
+/*
+ * Random access: what goes out next
+ */
+typedef enum
+{
+  ETX_RANDOM_ERASE    = 0,    // ERASE for the next run of changed sectors
+  ETX_RANDOM_DATA     = 1,    // DATA_AT frames touching a changed sector
+  ETX_RANDOM_COMMIT   = 2,    // COMMIT
+}ETX_RANDOM_STEP_;
+
+#define ETX_LANE_COUNT    ( 2 )             // striping: cfg.transport + cfg.lane2
+#define ETX_LANE_IDLE     ( 0xFFFFFFFFU )   // lane has no data frame in flight
+
+/*
+ * Frame being written on one transport
+ */
+typedef struct
+{
+  const uint8_t     *wire;                              // frame being sent
+  uint32_t           len;
+  uint32_t           pos;
+  uint64_t           next_us;                           // next paced byte
+  uint64_t           progress_us;                       // last time the transport took data
+}ETX_TX_;
+
+/*
+ * Striping: one port and the data frame in flight on it
+ */
+typedef struct
+{
+  ETX_TRANSPORT_    *transport;
+  ETX_TX_            tx;
+  uint8_t            rsp[ETX_RSPF_PACKET_SIZE];
+  uint32_t           rsp_len;
+  uint64_t           rsp_deadline_us;
+  uint32_t           fragment;                          // data frame in flight, ETX_LANE_IDLE if none
+  uint32_t           retries;
+}ETX_LANE_;
+
+struct ETX_SESSION_
+{
+  ETX_SESSION_CFG_   cfg;
+  const ETX_IMAGE_  *image;
+
+  ETX_DL_STATE_      state;
+  ETX_PHASE_         phase;
+  ETX_DL_EX_         result;
+
+  uint8_t            cmd_wire[ETX_FRAME_WIRE_SIZE(ETX_READ_CMD_SIZE)]; // START / END / READ
+  ETX_TX_            tx;                                // frame being sent
+
+  uint8_t            rsp[ETX_RSPF_PACKET_SIZE];
+  uint32_t           rsp_len;
+  uint64_t           rsp_deadline_us;
+  uint32_t           rsp_bitmap;                        // bad sub-blocks of a STATUS NACK
+  bool               rsp_status;                        // STATUS frame in status_parser
+  bool               rsp_fatal;                         // STATUS NACK for ETX_STATUS_INDEX_FATAL
+
+  uint32_t           frame_index;                       // next data frame
+  uint32_t           bytes_done;
+  uint32_t           retries;
+  uint32_t           start_attempts;
+
+  uint32_t           tx_gap_saved_us;                   // pacing if streaming falls back
+  uint64_t           resume_us;                         // streaming: resend after this
+  uint32_t           nack_index;                        // streaming: fragment of the last NACK
+  ETX_FRAME_PARSER_  status_parser;                     // STATUS frames
+  bool               repairing;                         // streaming: REPAIR frame before the rest
+
+  uint8_t            repair_wire[ETX_FRAME_WIRE_SIZE(ETX_FRAME_PAYLOAD_MAX_SIZE)];
+
+  uint8_t           *read_buf;                          // read-back: destination, NULL for downloads
+  uint32_t           read_addr;
+  uint32_t           read_len;
+  uint32_t           read_done;                         // bytes received in order
+  uint8_t            reply_wire[ETX_RSPF_PACKET_SIZE];  // ACK/NACK for a READ_DATA chunk
+
+  bool               striped;                           // cfg.lane2 carries half the data frames
+  ETX_LANE_          lanes[ETX_LANE_COUNT];
+  uint32_t           frames_acked;                      // striping: data frames ACKed on any lane
+
+  bool               broadcast;                         // cfg.nodes share one bus, nothing is ACKed
+  bool               set_node;                          // SET_NODE session, nodes[0] is the address
+  ETX_BCAST_STEP_    bcast_step;
+  bool               bcast_wait;                        // POLL out, waiting for the node's answer
+  bool               bcast_repair;                      // DATA step sends only the missing fragments
+  uint8_t            nodes[ETX_BCAST_MAX_NODES];
+  uint8_t            node_result[ETX_BCAST_MAX_NODES];  // ETX_NODE_RESULT_
+  uint32_t           nodes_ready;                       // bit per node: header in, application area erased
+  uint32_t           node_index;                        // node being polled
+  uint32_t           rounds;                            // header resends, then repair rounds
+  uint64_t           ready_deadline_us;                 // nodes have to finish erasing by then
+  uint8_t            missing[ETX_MISSING_BITMAP_SIZE];  // fragments missing on any node
+
+  bool               staged;                            // START_STAGED, staged_header instead of the image's
+  uint8_t            staged_header[ETX_FRAME_WIRE_SIZE(8 + (4 * ETX_STAGED_MAX_SECTORS))];
+  uint32_t           staged_header_len;
+
+  bool               random;                            // random access: ERASE, changed DATA_AT frames, COMMIT
+  ETX_RANDOM_STEP_   random_step;
+  uint32_t           random_dirty;                      // bit per flash sector to erase and rewrite
+  uint32_t           erase_sector;                      // first sector of the ERASE in flight
+  uint32_t           erase_count;                       // sectors it covers
+
+  bool               probe;                             // PROBE frames, nothing is flashed
+  uint64_t           rsp_sent_us;                       // frame fully written, waiting since
+  ETX_SESSION_STATS_ stats;
+};
+
+/* ***** Utility Functions - Start ***** */
+
+/* Continue a CRC32 (0 to start) over more data */
+static uint32_t etx_crc32_accumulate(uint32_t init, const uint8_t * pData, uint32_t DataLength)
+{
+    uint32_t crc = ~init;
+    for(unsigned int i = 0; i < DataLength; i++)
+    {
+        crc ^= pData[i];
+        for(int j = 0; j < 8; j++)
+        {
+            if(crc & 1)
+                crc = (crc >> 1) ^ 0xEDB88320;
+            else
+                crc = crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+uint32_t CalcCRC(const uint8_t * pData, uint32_t DataLength)
+{
+    return etx_crc32_accumulate(0, pData, DataLength);
+}
+
+uint64_t etx_hash64(const uint8_t *data, uint32_t len)
+{
+  // FNV-1a, 64 bit
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (uint32_t i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+uint64_t etx_time_us(void)
+{
+#if defined(__linux__)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000ULL);
+#else
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)((count.QuadPart * 1000000ULL) / freq.QuadPart);
+#endif
+}
+
+/* ***** Utility Functions - End ***** */
+
+/* ***** Frame Functions - Start ***** */
+
+uint32_t etx_encode_frame(ETX_DL_FRAME_ *frame, uint8_t *wire)
+{
+  // calculate crc for (SOF + packet_type + payload_len + payload)
+  frame->crc = CalcCRC( (uint8_t *)&frame->sof, (frame->payload_len + 4));
+
+  // (SOF + packet_type + payload_len + payload) followed by (CRC + EOF)
+  memcpy(wire, &frame->sof, frame->payload_len + 4);
+  memcpy(&wire[frame->payload_len + 4], &frame->crc, 5);
+
+  return ETX_FRAME_WIRE_SIZE(frame->payload_len);
+}
+
+void etx_fill_cmd_frame(ETX_DL_FRAME_ *frame, ETX_DL_CMD_ cmd)
+{
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_CMD;
+  frame->payload[0] = cmd;
+  frame->payload_len = 1;
+}
+
+void etx_fill_fw_info(ETX_DL_FRAME_ *frame, uint32_t size, uint32_t crc)
+{
+  memset( frame, 0, ETX_FRAME_PACKET_MAX_SIZE );
+
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_HEADER;
+  frame->payload[0] = (size >> 24) & 0xFF;
+  frame->payload[1] = (size >> 16) & 0xFF;
+  frame->payload[2] = (size >> 8) & 0xFF;
+  frame->payload[3] = (size >> 0) & 0xFF;
+  frame->payload[4] = (crc >> 24) & 0xFF;
+  frame->payload[5] = (crc >> 16) & 0xFF;
+  frame->payload[6] = (crc >> 8) & 0xFF;
+  frame->payload[7] = (crc >> 0) & 0xFF;
+  frame->payload_len = 8;
+}
+
+void etx_fill_data_frame(ETX_DL_FRAME_ *frame, const uint8_t *data, uint16_t len)
+{
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_DATA;
+  memcpy(frame->payload, data, len);
+  frame->payload_len = len;
+}
+
+/**
+ * @brief  Fill a DATA_SB frame: CRC of every sub-block, then the data
+ * @param  frame: frame to fill
+ * @param  data: fragment data
+ * @param  len: fragment length, at most ETX_FRAME_DATA_MAX_SIZE
+ * @retval None
+ */
+void etx_fill_subblock_frame(ETX_DL_FRAME_ *frame, const uint8_t *data, uint16_t len)
+{
+  uint32_t count = (len + ETX_SUBBLOCK_SIZE - 1) / ETX_SUBBLOCK_SIZE;
+
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_DATA_SB;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t sb_len = (len - (i * ETX_SUBBLOCK_SIZE)) > ETX_SUBBLOCK_SIZE ? ETX_SUBBLOCK_SIZE : (len - (i * ETX_SUBBLOCK_SIZE));
+    uint32_t crc = CalcCRC(&data[i * ETX_SUBBLOCK_SIZE], sb_len);
+    memcpy(&frame->payload[i * 4], &crc, 4);
+  }
+  memcpy(&frame->payload[count * 4], data, len);
+  frame->payload_len = (uint16_t)((count * 4) + len);
+}
+
+/**
+ * @brief  Fill a DATA_AT frame: image offset, then the data
+ * @param  frame: frame to fill
+ * @param  offset: offset of data in the image
+ * @param  data: fragment data
+ * @param  len: fragment length, at most ETX_FRAME_DATA_MAX_SIZE
+ * @retval None
+ */
+void etx_fill_data_at_frame(ETX_DL_FRAME_ *frame, uint32_t offset, const uint8_t *data, uint16_t len)
+{
+  frame->sof = ETX_FRAME_SOF;
+  frame->eof = ETX_FRAME_EOF;
+  frame->packet_type = ETX_DL_FRAME_TYPE_DATA_AT;
+  memcpy(frame->payload, &offset, ETX_DATA_AT_HDR_SIZE);
+  memcpy(&frame->payload[ETX_DATA_AT_HDR_SIZE], data, len);
+  frame->payload_len = (uint16_t)(ETX_DATA_AT_HDR_SIZE + len);
+}
+
+void etx_fill_read_cmd(ETX_DL_FRAME_ *frame, uint32_t address, uint32_t length)
+{
+  etx_fill_cmd_frame(frame, ETX_DL_CMD_READ);
+  memcpy(&frame->payload[1], &address, 4);
+  memcpy(&frame->payload[5], &length, 4);
+  frame->payload_len = ETX_READ_CMD_SIZE;
+}
+
+void etx_fill_erase_cmd(ETX_DL_FRAME_ *frame, uint32_t offset, uint32_t length)
+{
+  etx_fill_cmd_frame(frame, ETX_DL_CMD_ERASE);
+  memcpy(&frame->payload[1], &offset, 4);
+  memcpy(&frame->payload[5], &length, 4);
+  frame->payload_len = ETX_ERASE_CMD_SIZE;
+}
+
+void etx_frame_parser_reset(ETX_FRAME_PARSER_ *parser)
+{
+  parser->pos = 0;
+}
+
+/**
+ * @brief  Feed received bytes to the frame decoder
+ * @param  parser: decoder state
+ * @param  data: received bytes
+ * @param  len: number of bytes in data
+ * @param  consumed: bytes of data used by this call
+ * @retval ETX_DL_FRAME_EX_OK when parser->frame holds a complete frame with a
+ *         valid CRC, ETX_DL_FRAME_EX_NO_DATA if more bytes are needed,
+ *         ETX_DL_FRAME_EX_ERR on a bad frame (the decoder is reset and
+ *         resynchronises on the next SOF)
+ */
+ETX_DL_FRAME_EX_ etx_frame_parse(ETX_FRAME_PARSER_ *parser, const uint8_t *data, uint32_t len, uint32_t *consumed)
+{
+  ETX_DL_FRAME_ *frame = &parser->frame;
+  uint8_t *hdr = (uint8_t *)frame;
+  uint32_t i = 0;
+
+  while (i < len) {
+    if (parser->pos == 0) {
+      // hunt for SOF
+      if (data[i++] == ETX_FRAME_SOF) {
+        frame->sof = ETX_FRAME_SOF;
+        parser->pos = 1;
+      }
+      continue;
+    }
+
+    if (parser->pos < 4) {
+      // packet_type + payload_len (little endian on the wire)
+      hdr[parser->pos++] = data[i++];
+      if (parser->pos == 4 && frame->payload_len > ETX_FRAME_PAYLOAD_MAX_SIZE) {
+        etx_frame_parser_reset(parser);
+        *consumed = i;
+        return ETX_DL_FRAME_EX_ERR;   // Invalid length
+      }
+      continue;
+    }
+
+    uint32_t payload_end = 4 + frame->payload_len;
+    uint32_t frame_end = payload_end + 5;
+    uint32_t take;
+
+    if (parser->pos < payload_end) {
+      take = payload_end - parser->pos;
+      if (take > len - i) {
+        take = len - i;
+      }
+      memcpy(&frame->payload[parser->pos - 4], &data[i], take);
+    } else {
+      take = frame_end - parser->pos;
+      if (take > len - i) {
+        take = len - i;
+      }
+      memcpy(&((uint8_t *)&frame->crc)[parser->pos - payload_end], &data[i], take);
+    }
+    parser->pos += take;
+    i += take;
+
+    if (parser->pos == frame_end) {
+      etx_frame_parser_reset(parser);
+      *consumed = i;
+
+      if (frame->eof != ETX_FRAME_EOF) {
+        return ETX_DL_FRAME_EX_ERR;   // Invalid EOF
+      }
+      if (CalcCRC((uint8_t *)&frame->sof, frame->payload_len + 4) != frame->crc) {
+        return ETX_DL_FRAME_EX_ERR;   // CRC mismatch
+      }
+      return ETX_DL_FRAME_EX_OK;
+    }
+  }
+
+  *consumed = i;
+  return ETX_DL_FRAME_EX_NO_DATA;
+}
+
+/* ***** Frame Functions - End ***** */
+
+/* ***** Image Functions - Start ***** */
+
+/**
+ * @brief  Frame an application image (header frame and all data frames)
+ * @param  image: zero-initialised image to fill
+ * @param  bin: application binary
+ * @param  size: size of bin in bytes
+ * @param  flags: ETX_IMAGE_FLAG_*
+ * @retval true on success, false if out of memory or size is invalid
+ */
+bool etx_image_build(ETX_IMAGE_ *image, const uint8_t *bin, uint32_t size, uint32_t flags)
+{
+  if (size == 0 || size > ETX_DL_MAX_FW_SIZE) {
+    return false;
+  }
+  if (((flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC) != 0) + ((flags & ETX_IMAGE_FLAG_OFFSET_ADDR) != 0)
+    + ((flags & ETX_IMAGE_FLAG_PROBE) != 0) > 1) {
+    return false;   // one data frame type per image
+  }
+
+  ETX_DL_FRAME_ *frame = malloc(ETX_FRAME_PACKET_MAX_SIZE);
+  if (frame == NULL) {
+    return false;
+  }
+
+  snprintf(image->hash, sizeof(image->hash), "%016llx", (unsigned long long)etx_hash64(bin, size));
+  image->size = size;
+  image->crc = CalcCRC(bin, size);
+  image->flags = flags;
+  image->frame_count = (size / ETX_FRAME_DATA_MAX_SIZE) + (size % ETX_FRAME_DATA_MAX_SIZE != 0);
+  image->wire_len = ETX_FRAME_WIRE_SIZE(8) + size + (image->frame_count * ETX_FRAME_DATA_OVERHEAD);
+  if (flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC) {
+    // every frame but the last is a whole number of sub-blocks
+    image->wire_len += ((size + ETX_SUBBLOCK_SIZE - 1) / ETX_SUBBLOCK_SIZE) * 4;
+  } else if (flags & ETX_IMAGE_FLAG_OFFSET_ADDR) {
+    image->wire_len += image->frame_count * ETX_DATA_AT_HDR_SIZE;
+  }
+  image->wire = malloc(image->wire_len);
+  image->frame_offset = malloc((image->frame_count + 1) * sizeof(uint32_t));
+  if (image->wire == NULL || image->frame_offset == NULL) {
+    free(frame);
+    etx_image_free(image);
+    return false;
+  }
+
+  etx_fill_fw_info(frame, image->size, image->crc);
+  image->header_len = etx_encode_frame(frame, image->wire);
+
+  uint32_t offset = image->header_len;
+  uint32_t bytes_framed = 0;
+  for (uint32_t i = 0; i < image->frame_count; i++) {
+    uint16_t chunk_size = (size - bytes_framed) > ETX_FRAME_DATA_MAX_SIZE ? ETX_FRAME_DATA_MAX_SIZE : (size - bytes_framed);
+
+    if (flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC) {
+      etx_fill_subblock_frame(frame, &bin[bytes_framed], chunk_size);
+    } else if (flags & ETX_IMAGE_FLAG_OFFSET_ADDR) {
+      etx_fill_data_at_frame(frame, bytes_framed, &bin[bytes_framed], chunk_size);
+    } else {
+      etx_fill_data_frame(frame, &bin[bytes_framed], chunk_size);
+      if (flags & ETX_IMAGE_FLAG_PROBE) {
+        frame->packet_type = ETX_DL_FRAME_TYPE_PROBE;
+      }
+    }
+    image->frame_offset[i] = offset;
+    offset += etx_encode_frame(frame, &image->wire[offset]);
+    bytes_framed += chunk_size;
+  }
+  image->frame_offset[image->frame_count] = offset;
+
+  free(frame);
+  return true;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief  Check the image header the App build stamps into its binary, the
+ *         same checks the bootloader makes before erasing: magic, header CRC,
+ *         load address and size. Either slot layout passes, the tool can not
+ *         tell which one the bootloader was built for; it refuses the other.
+ * @param  bin: application binary
+ * @param  size: its length
+ * @retval true if the bootloader will take the image
+ */
+bool etx_image_check_header(const uint8_t *bin, uint32_t size)
+{
+  const uint8_t *header = &bin[ETX_IMAGE_HEADER_OFFSET];
+
+  if (size < ETX_IMAGE_HEADER_OFFSET + ETX_IMAGE_HEADER_SIZE || get_le32(&header[0]) != ETX_IMAGE_HEADER_MAGIC) {
+    printf("No image header at 0x%X, not an application built for this bootloader\r\n", ETX_IMAGE_HEADER_OFFSET);
+    return false;
+  }
+  if (CalcCRC(header, ETX_IMAGE_HEADER_SIZE - 4) != get_le32(&header[ETX_IMAGE_HEADER_SIZE - 4])) {
+    printf("Image header CRC mismatch, was the binary stamped after the link?\r\n");
+    return false;
+  }
+  if (get_le32(&header[12]) != ETX_APP_LOAD_ADDRESS && get_le32(&header[12]) != ETX_APP_LOAD_ADDRESS_AB) {
+    printf("Image built for 0x%08X, the application slot is 0x%08X (0x%08X with A/B slots)\r\n",
+           get_le32(&header[12]), ETX_APP_LOAD_ADDRESS, ETX_APP_LOAD_ADDRESS_AB);
+    return false;
+  }
+  if (get_le32(&header[8]) != size) {
+    printf("Image header says %u bytes, the file has %u\r\n", get_le32(&header[8]), size);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * @brief  Read an application binary from disk and frame it
+ * @param  image: zero-initialised image to fill
+ * @param  file_path: application binary
+ * @param  flags: ETX_IMAGE_FLAG_*
+ * @retval true on success
+ */
+bool etx_image_load_file(ETX_IMAGE_ *image, const char *file_path, uint32_t flags)
+{
+  FILE *fp = fopen(file_path, "rb");
+  if (fp == NULL) {
+    printf("Failed to open application binary file %s\r\n", file_path);
+    return false;
+  }
+
+  uint8_t *bin = malloc(ETX_DL_MAX_FW_SIZE);
+  if (bin == NULL) {
+    fclose(fp);
+    return false;
+  }
+
+  size_t bytesRead = fread(bin, 1, ETX_DL_MAX_FW_SIZE, fp);
+  fclose(fp);
+
+  if (bytesRead == 0) {
+    printf("Failed to read application binary file %s\r\n", file_path);
+    free(bin);
+    return false;
+  }
+
+  // probes are never flashed, anything else must be an image the bootloader takes
+  if ((flags & ETX_IMAGE_FLAG_PROBE) == 0 && !etx_image_check_header(bin, (uint32_t)bytesRead)) {
+    free(bin);
+    return false;
+  }
+
+  bool ok = etx_image_build(image, bin, (uint32_t)bytesRead, flags);
+  free(bin);
+
+  if (!ok) {
+    printf("Failed to frame application binary %s\r\n", file_path);
+  }
+  return ok;
+}
+
+/* Application bytes carried by data frame index */
+uint32_t etx_image_frame_data_len(const ETX_IMAGE_ *image, uint32_t index)
+{
+  uint32_t offset = index * ETX_FRAME_DATA_MAX_SIZE;
+
+  if (offset >= image->size) {
+    return 0;
+  }
+  return (image->size - offset) > ETX_FRAME_DATA_MAX_SIZE ? ETX_FRAME_DATA_MAX_SIZE : (image->size - offset);
+}
+
+void etx_image_free(ETX_IMAGE_ *image)
+{
+  free(image->wire);
+  free(image->frame_offset);
+  memset(image, 0, sizeof(ETX_IMAGE_));
+}
+
+/* ***** Image Functions - End ***** */
+
+/* ***** Session Functions - Start ***** */
+
+static void session_finish(ETX_SESSION_ *session, ETX_DL_EX_ result)
+{
+  session->state = (result == ETX_DL_EX_OK) ? ETX_DL_STATE_SUCCESS : ETX_DL_STATE_FAILED;
+  session->phase = ETX_PHASE_DONE;
+  session->result = result;
+
+  if (session->cfg.on_complete != NULL) {
+    session->cfg.on_complete(session, result, session->cfg.user);
+  }
+}
+
+static void session_send(ETX_SESSION_ *session, const uint8_t *wire, uint32_t len)
+{
+  session->tx.wire = wire;
+  session->tx.len = len;
+  session->tx.pos = 0;
+  session->tx.progress_us = 0;
+  session->retries = 0;
+  session->phase = ETX_PHASE_TX;
+}
+
+static void session_send_cmd(ETX_SESSION_ *session, ETX_DL_CMD_ cmd)
+{
+  ETX_DL_FRAME_ frame;
+
+  if (cmd == ETX_DL_CMD_READ) {
+    etx_fill_read_cmd(&frame, session->read_addr, session->read_len);
+  } else if (cmd == ETX_DL_CMD_ERASE) {
+    etx_fill_erase_cmd(&frame, session->erase_sector * ETX_FLASH_SECTOR_SIZE, session->erase_count * ETX_FLASH_SECTOR_SIZE);
+  } else if (cmd == ETX_DL_CMD_SET_NODE) {
+    etx_fill_cmd_frame(&frame, cmd);
+    frame.payload[1] = session->nodes[0];
+    frame.payload_len = 2;
+  } else {
+    etx_fill_cmd_frame(&frame, cmd);
+  }
+  session_send(session, session->cmd_wire, etx_encode_frame(&frame, session->cmd_wire));
+}
+
+/**
+ * @brief  Staged: encode the header with the CRC of every flash sector of
+ *         the image, the leaves of the bootloader's hash tree
+ * @param  session: session handle, image framed with plain DATA frames
+ * @retval None
+ */
+static void session_staged_header(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t sector_crc[ETX_STAGED_MAX_SECTORS] = {0};
+  ETX_DL_FRAME_ frame;
+
+  for (uint32_t i = 0; i < image->frame_count; i++) {
+    const uint8_t *data = &image->wire[image->frame_offset[i] + 4];
+    uint32_t offset = i * ETX_FRAME_DATA_MAX_SIZE;
+    uint32_t end = offset + etx_image_frame_data_len(image, i);
+
+    // a frame can straddle a sector boundary
+    while (offset < end) {
+      uint32_t sector = offset / ETX_FLASH_SECTOR_SIZE;
+      uint32_t piece_end = (sector + 1) * ETX_FLASH_SECTOR_SIZE;
+
+      piece_end = (piece_end < end) ? piece_end : end;
+      sector_crc[sector] = etx_crc32_accumulate(sector_crc[sector], data, piece_end - offset);
+      data += piece_end - offset;
+      offset = piece_end;
+    }
+  }
+
+  uint32_t sectors = (image->size + ETX_FLASH_SECTOR_SIZE - 1) / ETX_FLASH_SECTOR_SIZE;
+  etx_fill_fw_info(&frame, image->size, image->crc);
+  memcpy(&frame.payload[8], sector_crc, sectors * 4);
+  frame.payload_len = (uint16_t)(8 + (sectors * 4));
+  session->staged_header_len = etx_encode_frame(&frame, session->staged_header);
+}
+
+static void session_send_data_frame(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t i = session->frame_index;
+
+  session_send(session, &image->wire[image->frame_offset[i]], image->frame_offset[i + 1] - image->frame_offset[i]);
+}
+
+/* Resend the current frame (or the given wire) without resetting the retry count */
+static void session_resend(ETX_SESSION_ *session, const uint8_t *wire, uint32_t len)
+{
+  session->tx.wire = wire;
+  session->tx.len = len;
+  session->tx.pos = 0;
+  session->tx.progress_us = 0;
+  session->phase = ETX_PHASE_TX;
+}
+
+/**
+ * @brief  Encode a REPAIR frame with the sub-blocks of one data frame
+ * @param  session: session handle
+ * @param  index: data frame
+ * @param  bitmap: sub-blocks to resend (bit n = sub-block n)
+ * @retval wire length in session->repair_wire, 0 if the bitmap does not fit the frame
+ */
+static uint32_t session_build_repair(ETX_SESSION_ *session, uint32_t index, uint32_t bitmap)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t data_len = etx_image_frame_data_len(image, index);
+  uint32_t count = (data_len + ETX_SUBBLOCK_SIZE - 1) / ETX_SUBBLOCK_SIZE;
+  const uint8_t *crc_table = &image->wire[image->frame_offset[index] + 4];
+  const uint8_t *data = &crc_table[count * 4];
+  uint8_t *wire = session->repair_wire;
+  uint32_t pos = 4;
+
+  if ((image->flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC) == 0 || bitmap == 0 || (bitmap >> count) != 0) {
+    return 0;
+  }
+
+  memcpy(&wire[pos], &index, 4);
+  memcpy(&wire[pos + 4], &bitmap, 4);
+  pos += ETX_REPAIR_HDR_SIZE;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if ((bitmap & (1UL << i)) == 0) {
+      continue;
+    }
+    uint32_t sb_len = (data_len - (i * ETX_SUBBLOCK_SIZE)) > ETX_SUBBLOCK_SIZE ? ETX_SUBBLOCK_SIZE : (data_len - (i * ETX_SUBBLOCK_SIZE));
+    memcpy(&wire[pos], &crc_table[i * 4], 4);
+    memcpy(&wire[pos + 4], &data[i * ETX_SUBBLOCK_SIZE], sb_len);
+    pos += 4 + sb_len;
+  }
+
+  uint16_t payload_len = (uint16_t)(pos - 4);
+  wire[0] = ETX_FRAME_SOF;
+  wire[1] = ETX_DL_FRAME_TYPE_REPAIR;
+  memcpy(&wire[2], &payload_len, 2);
+
+  uint32_t crc = CalcCRC(wire, pos);
+  memcpy(&wire[pos], &crc, 4);
+  wire[pos + 4] = ETX_FRAME_EOF;
+
+  return pos + 5;
+}
+
+/* Decode a STATUS frame: N/ACK, fragment index and optional sub-block bitmap */
+static bool session_decode_status(const ETX_DL_FRAME_ *frame, uint8_t *rsp, uint32_t *index, uint32_t *bitmap)
+{
+  if (frame->packet_type != ETX_DL_FRAME_TYPE_STATUS
+    || (frame->payload_len != ETX_STATUS_PAYLOAD_SIZE && frame->payload_len != ETX_STATUS_BITMAP_PAYLOAD_SIZE)) {
+    return false;
+  }
+
+  *rsp = frame->payload[0];
+  memcpy(index, &frame->payload[1], 4);
+  *bitmap = 0;
+  if (frame->payload_len == ETX_STATUS_BITMAP_PAYLOAD_SIZE) {
+    memcpy(bitmap, &frame->payload[5], 4);
+  }
+  return true;
+}
+
+/* Point the stream at data frame index and everything after it */
+static void session_stream_tail(ETX_SESSION_ *session, uint32_t index)
+{
+  const ETX_IMAGE_ *image = session->image;
+
+  session->tx.wire = &image->wire[image->frame_offset[index]];
+  session->tx.len = image->frame_offset[image->frame_count] - image->frame_offset[index];
+  session->tx.pos = 0;
+  session->tx.progress_us = 0;
+  session->frame_index = index;
+  session->bytes_done = (index < image->frame_count) ? (index * ETX_FRAME_DATA_MAX_SIZE) : image->size;
+}
+
+/* Stream every data frame from fragment index on, back to back */
+static void session_stream_from(ETX_SESSION_ *session, uint32_t index, uint64_t resume_us)
+{
+  session_stream_tail(session, index);
+  session->repairing = false;
+  session->resume_us = resume_us;
+  session->rsp_deadline_us = 0;
+  session->phase = ETX_PHASE_STREAM;
+  etx_frame_parser_reset(&session->status_parser);
+}
+
+/* Striping: (re)send the lane's data frame */
+static void lane_send(ETX_SESSION_ *session, ETX_LANE_ *lane)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t i = lane->fragment;
+
+  lane->tx.wire = &image->wire[image->frame_offset[i]];
+  lane->tx.len = image->frame_offset[i + 1] - image->frame_offset[i];
+  lane->tx.pos = 0;
+  lane->tx.progress_us = 0;
+  lane->rsp_len = 0;
+}
+
+/* Striping: header ACKed, both lanes start taking data frames */
+static void session_stripe_begin(ETX_SESSION_ *session)
+{
+  ETX_TRANSPORT_ *lane2 = &session->cfg.lane2;
+  uint8_t buf[64];
+
+  // whatever the second port picked up before the bootloader switched it over
+  while (lane2->read(lane2->ctx, buf, sizeof(buf)) > 0);
+
+  session->lanes[0].transport = &session->cfg.transport;
+  session->lanes[1].transport = lane2;
+  for (uint32_t i = 0; i < ETX_LANE_COUNT; i++) {
+    session->lanes[i].fragment = ETX_LANE_IDLE;
+    session->lanes[i].tx.next_us = session->tx.next_us;
+  }
+  session->frame_index = 0;
+  session->frames_acked = 0;
+  session->phase = ETX_PHASE_STRIPE;
+}
+
+/* Random access: image bytes of a data frame */
+static const uint8_t *session_frame_data(const ETX_SESSION_ *session, uint32_t index)
+{
+  const ETX_IMAGE_ *image = session->image;
+
+  return &image->wire[image->frame_offset[index] + 4 + ETX_DATA_AT_HDR_SIZE];
+}
+
+/**
+ * @brief  Random access: mark the flash sectors whose contents change. A
+ *         sector changes if any image byte in it differs from cfg.base or
+ *         lies past its end; the sector the image ends in also changes if
+ *         the sizes differ (the last flash word is padded with 0xFF).
+ * @param  session: session handle
+ * @retval None
+ */
+static void session_random_plan(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+  const uint8_t *base = session->cfg.base;
+  uint32_t base_size = (base != NULL) ? session->cfg.base_size : 0;
+
+  session->random_dirty = 0;
+  for (uint32_t i = 0; i < image->frame_count; i++) {
+    const uint8_t *data = session_frame_data(session, i);
+    uint32_t offset = i * ETX_FRAME_DATA_MAX_SIZE;
+    uint32_t end = offset + etx_image_frame_data_len(image, i);
+
+    // compare the frame piece by piece, a piece per sector it spans
+    while (offset < end) {
+      uint32_t sector = offset / ETX_FLASH_SECTOR_SIZE;
+      uint32_t piece_end = (sector + 1) * ETX_FLASH_SECTOR_SIZE;
+
+      piece_end = (piece_end < end) ? piece_end : end;
+      if (piece_end > base_size || memcmp(data, &base[offset], piece_end - offset) != 0) {
+        session->random_dirty |= (1UL << sector);
+      }
+      data += piece_end - offset;
+      offset = piece_end;
+    }
+  }
+  if (base_size != image->size) {
+    session->random_dirty |= (1UL << ((image->size - 1) / ETX_FLASH_SECTOR_SIZE));
+  }
+}
+
+/* Random access: does data frame index have to go out (touches a changed sector, not all 0xFF) */
+static bool session_random_wanted(const ETX_SESSION_ *session, uint32_t index)
+{
+  const uint8_t *data = session_frame_data(session, index);
+  uint32_t offset = index * ETX_FRAME_DATA_MAX_SIZE;
+  uint32_t len = etx_image_frame_data_len(session->image, index);
+  uint32_t first = offset / ETX_FLASH_SECTOR_SIZE;
+  uint32_t last = (offset + len - 1) / ETX_FLASH_SECTOR_SIZE;
+  bool dirty = false;
+
+  for (uint32_t sector = first; sector <= last; sector++) {
+    dirty |= (session->random_dirty & (1UL << sector)) != 0;
+  }
+  if (!dirty) {
+    return false;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    if (data[i] != 0xFF) {
+      return true;
+    }
+  }
+  return false;   // erased flash holds it already
+}
+
+/**
+ * @brief  Random access: send whatever comes after the last ACK, starting
+ *         at the current step: the next ERASE, the next data frame worth
+ *         sending (frames passed over count as done), then COMMIT
+ * @param  session: session handle
+ * @retval None
+ */
+static void session_random_next(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t sectors = (image->size + ETX_FLASH_SECTOR_SIZE - 1) / ETX_FLASH_SECTOR_SIZE;
+
+  if (session->random_step == ETX_RANDOM_ERASE) {
+    uint32_t sector = session->erase_sector + session->erase_count;
+
+    while (sector < sectors && (session->random_dirty & (1UL << sector)) == 0) {
+      sector++;
+    }
+    if (sector < sectors) {
+      // one ERASE for the whole run of changed sectors
+      session->erase_sector = sector;
+      session->erase_count = 0;
+      while (sector < sectors && (session->random_dirty & (1UL << sector)) != 0) {
+        session->erase_count++;
+        sector++;
+      }
+      session_send_cmd(session, ETX_DL_CMD_ERASE);
+      return;
+    }
+    session->random_step = ETX_RANDOM_DATA;
+    session->frame_index = 0;
+  }
+
+  if (session->random_step == ETX_RANDOM_DATA) {
+    bool skipped = false;
+
+    while (session->frame_index < image->frame_count && !session_random_wanted(session, session->frame_index)) {
+      session->bytes_done += etx_image_frame_data_len(image, session->frame_index);
+      session->frame_index++;
+      skipped = true;
+    }
+    if (skipped && session->cfg.on_progress != NULL) {
+      session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+    }
+    if (session->frame_index < image->frame_count) {
+      session_send_data_frame(session);
+      return;
+    }
+    session->random_step = ETX_RANDOM_COMMIT;
+  }
+
+  session_send_cmd(session, ETX_DL_CMD_COMMIT);
+}
+
+/* A data frame this close to a flash sector start may wait for the bootloader to erase it */
+static bool session_near_erase(const ETX_SESSION_ *session)
+{
+  uint32_t into_sector = (session->frame_index * ETX_FRAME_DATA_MAX_SIZE) % ETX_FLASH_SECTOR_SIZE;
+
+  return into_sector <= (2 * ETX_FRAME_DATA_MAX_SIZE)
+      || into_sector >= (ETX_FLASH_SECTOR_SIZE - (2 * ETX_FRAME_DATA_MAX_SIZE));
+}
+
+/* Wait for an ACK/NACK: data frames near a sector start also cover its erase */
+static uint64_t session_ack_timeout_us(const ETX_SESSION_ *session)
+{
+  if (session->random) {
+    // ERASE and COMMIT take their time, data frames never wait for an erase
+    return (uint64_t)((session->state == ETX_DL_STATE_DATA && session->random_step == ETX_RANDOM_DATA)
+                      ? session->cfg.ack_timeout_ms : session->cfg.rsp_timeout_ms) * 1000ULL;
+  }
+  if (session->state == ETX_DL_STATE_DATA && (session->probe || session->read_buf != NULL || !session_near_erase(session))) {
+    return (uint64_t)session->cfg.ack_timeout_ms * 1000ULL;
+  }
+  return (uint64_t)session->cfg.rsp_timeout_ms * 1000ULL;
+}
+
+/* Move on once the current frame is acknowledged (or fully sent, for END) */
+static void session_advance(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+
+  switch (session->state)
+  {
+  case ETX_DL_STATE_IDLE:
+    if (session->set_node) {
+      session_finish(session, ETX_DL_EX_OK);   // address stored
+      break;
+    }
+    if (session->read_buf != NULL) {
+      // READ accepted, chunks follow
+      session->state = ETX_DL_STATE_DATA;
+      session->phase = ETX_PHASE_READ;
+      session->tx.len = 0;
+      session->tx.pos = 0;
+      session->retries = 0;
+      session->rsp_deadline_us = 0;
+      etx_frame_parser_reset(&session->status_parser);
+      break;
+    }
+    session->state = ETX_DL_STATE_HEADER;
+    if (session->staged) {
+      session_send(session, session->staged_header, session->staged_header_len);
+    } else {
+      session_send(session, image->wire, image->header_len);
+    }
+    break;
+
+  case ETX_DL_STATE_HEADER:
+    session->state = ETX_DL_STATE_DATA;
+    session->frame_index = 0;
+    if (session->striped) {
+      session_stripe_begin(session);
+    } else if (session->random) {
+      session->random_step = ETX_RANDOM_ERASE;
+      session->erase_sector = 0;
+      session->erase_count = 0;
+      session_random_next(session);
+    } else if (session->cfg.stream) {
+      session->nack_index = ETX_STATUS_INDEX_FATAL;
+      session->retries = 0;
+      session_stream_from(session, 0, 0);
+    } else {
+      session_send_data_frame(session);
+    }
+    break;
+
+  case ETX_DL_STATE_DATA:
+    if (session->random && session->random_step == ETX_RANDOM_COMMIT) {
+      session_finish(session, ETX_DL_EX_OK);   // the bootloader checked the image in flash
+      break;
+    }
+    if (session->random && session->random_step == ETX_RANDOM_ERASE) {
+      session_random_next(session);
+      break;
+    }
+    session->bytes_done += etx_image_frame_data_len(image, session->frame_index);
+    session->frame_index++;
+    session->stats.frames++;
+    if (session->cfg.on_progress != NULL) {
+      session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+    }
+    if (session->random) {
+      session_random_next(session);
+    } else if (session->frame_index < image->frame_count) {
+      session_send_data_frame(session);
+    } else if (session->probe) {
+      session_finish(session, ETX_DL_EX_OK);   // the bootloader is still in IDLE
+    } else {
+      // the bootloader jumps to the App right after END, no ACK to wait for
+      session->state = ETX_DL_STATE_DATA_COMPLETE;
+      session_send_cmd(session, ETX_DL_CMD_END);
+    }
+    break;
+
+  case ETX_DL_STATE_DATA_COMPLETE:
+    session_finish(session, ETX_DL_EX_OK);
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* How long the transport may take nothing before the session gives up */
+static uint64_t session_stall_us(const ETX_SESSION_ *session)
+{
+  // staged: RTS stays down while the bootloader flashes a chunk
+  return (uint64_t)(session->staged ? ETX_STAGED_FLASH_MS : session->cfg.rsp_timeout_ms) * 1000ULL;
+}
+
+/* Write as much of a frame as the transport and pacing allow */
+static ETX_DL_FRAME_EX_ session_tx(ETX_SESSION_ *session, ETX_TRANSPORT_ *transport, ETX_TX_ *tx, uint64_t now_us)
+{
+  while (tx->pos < tx->len) {
+    uint32_t chunk = tx->len - tx->pos;
+
+    if (session->cfg.tx_gap_us != 0) {
+      if (now_us < tx->next_us) {
+        return ETX_DL_FRAME_EX_NO_DATA;
+      }
+      if (chunk > session->cfg.tx_chunk) {
+        chunk = session->cfg.tx_chunk;
+      }
+    }
+
+    if (tx->progress_us == 0) {
+      tx->progress_us = now_us;
+    }
+
+    int n = transport->write(transport->ctx, &tx->wire[tx->pos], chunk);
+    if (n < 0) {
+      printf("Send Err: %u/%u bytes\n", tx->pos, tx->len);
+      return ETX_DL_FRAME_EX_ERR;
+    } else if (n == 0) {
+      // tx queue full (or held off by CTS), give up if it never drains
+      if (now_us - tx->progress_us >= session_stall_us(session)) {
+        printf("Send stalled: %u/%u bytes\n", tx->pos, tx->len);
+        return ETX_DL_FRAME_EX_ERR;
+      }
+      return ETX_DL_FRAME_EX_NO_DATA;
+    }
+    tx->pos += (uint32_t)n;
+    tx->progress_us = now_us;
+
+    if (session->cfg.tx_gap_us != 0) {
+      tx->next_us = now_us + session->cfg.tx_gap_us;
+    }
+  }
+
+  return ETX_DL_FRAME_EX_OK;
+}
+
+/* Feed a STATUS frame answering the current frame, store it as a response */
+static ETX_DL_FRAME_EX_ session_rx_status(ETX_SESSION_ *session, const uint8_t *data, uint32_t len)
+{
+  ETX_DL_RSPF_ *response = (ETX_DL_RSPF_ *)session->rsp;
+  uint32_t consumed, index, bitmap;
+  uint8_t rsp;
+
+  if (etx_frame_parse(&session->status_parser, data, len, &consumed) == ETX_DL_FRAME_EX_NO_DATA) {
+    return ETX_DL_FRAME_EX_NO_DATA;
+  }
+  session->rsp_status = false;
+
+  bool decoded = session_decode_status(&session->status_parser.frame, &rsp, &index, &bitmap);
+
+  if (decoded && rsp == ETX_DL_RSP_NACK && index == ETX_STATUS_INDEX_FATAL) {
+    // bootloader gave up, e.g. a fragment it ACKed before programming failed
+    session->rsp_fatal = true;
+    bitmap = 0;
+  } else if (!decoded || index != session->frame_index || rsp != ETX_DL_RSP_NACK) {
+    // garbled, resend the whole frame
+    rsp = ETX_DL_RSP_NACK;
+    bitmap = 0;
+  }
+
+  response->sof = ETX_FRAME_SOF;
+  response->packet_type = ETX_DL_FRAME_TYPE_RESPONSE;
+  response->payload = rsp;
+  response->eof = ETX_FRAME_EOF;
+  session->rsp_bitmap = bitmap;
+  session->rsp_len = 0;
+
+  return ETX_DL_FRAME_EX_OK;
+}
+
+/* Collect a response frame, dropping noise ahead of it */
+static ETX_DL_FRAME_EX_ session_rx_response(ETX_SESSION_ *session)
+{
+  ETX_TRANSPORT_ *transport = &session->cfg.transport;
+  ETX_DL_FRAME_EX_ status;
+
+  for (;;) {
+    if (session->rsp_status) {
+      uint8_t buf[ETX_FRAME_WIRE_SIZE(ETX_STATUS_BITMAP_PAYLOAD_SIZE)];
+      int n = transport->read(transport->ctx, buf, sizeof(buf));
+      if (n < 0) {
+        return ETX_DL_FRAME_EX_ERR;
+      } else if (n == 0) {
+        return ETX_DL_FRAME_EX_NO_DATA;
+      }
+      if ((status = session_rx_status(session, buf, (uint32_t)n)) != ETX_DL_FRAME_EX_NO_DATA) {
+        return status;
+      }
+      continue;
+    }
+
+    int n = transport->read(transport->ctx, &session->rsp[session->rsp_len], ETX_RSPF_PACKET_SIZE - session->rsp_len);
+    if (n < 0) {
+      return ETX_DL_FRAME_EX_ERR;
+    } else if (n == 0) {
+      return ETX_DL_FRAME_EX_NO_DATA;
+    }
+    session->rsp_len += (uint32_t)n;
+
+    // resync on SOF
+    uint32_t skip = 0;
+    while (skip < session->rsp_len && session->rsp[skip] != ETX_FRAME_SOF) {
+      skip++;
+    }
+    if (skip != 0) {
+      memmove(session->rsp, &session->rsp[skip], session->rsp_len - skip);
+      session->rsp_len -= skip;
+    }
+
+    // sub-block NACKs come as STATUS frames, hand them to the frame parser
+    if (session->rsp_len >= 2 && session->rsp[1] == ETX_DL_FRAME_TYPE_STATUS) {
+      uint8_t head[ETX_RSPF_PACKET_SIZE];
+      uint32_t head_len = session->rsp_len;
+
+      memcpy(head, session->rsp, head_len);
+      session->rsp_len = 0;
+      session->rsp_status = true;
+      etx_frame_parser_reset(&session->status_parser);
+      if ((status = session_rx_status(session, head, head_len)) != ETX_DL_FRAME_EX_NO_DATA) {
+        return status;
+      }
+      continue;
+    }
+
+    if (session->rsp_len < ETX_RSPF_PACKET_SIZE) {
+      continue;
+    }
+
+    ETX_DL_RSPF_ *response = (ETX_DL_RSPF_ *)session->rsp;
+    if (response->eof == ETX_FRAME_EOF
+      && response->packet_type == ETX_DL_FRAME_TYPE_RESPONSE
+      && (response->payload == ETX_DL_RSP_ACK || response->payload == ETX_DL_RSP_NACK)
+    ) {
+      session->rsp_len = 0;
+      session->rsp_bitmap = 0;
+      session->rsp_fatal = false;
+      return ETX_DL_FRAME_EX_OK;
+    }
+
+    // not a response frame, look for the next SOF
+    memmove(session->rsp, &session->rsp[1], --session->rsp_len);
+  }
+}
+
+/* Handle a STATUS frame from the bootloader while streaming */
+static void session_stream_status(ETX_SESSION_ *session, const ETX_DL_FRAME_ *frame, uint64_t now_us)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t index, bitmap, repair_len;
+  uint8_t rsp;
+
+  if (!session_decode_status(frame, &rsp, &index, &bitmap)) {
+    return;   // nothing else is expected while streaming
+  }
+
+  if (rsp == ETX_DL_RSP_ACK && index == image->frame_count) {
+    // summary: every fragment is flashed
+    session->bytes_done = image->size;
+    if (session->cfg.on_progress != NULL) {
+      session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+    }
+    session->state = ETX_DL_STATE_DATA_COMPLETE;
+    session_send_cmd(session, ETX_DL_CMD_END);
+    return;
+  }
+
+  if (rsp != ETX_DL_RSP_NACK || index == ETX_STATUS_INDEX_FATAL || index >= image->frame_count) {
+    printf("STM32 aborted the stream (status %u, fragment %u)\r\n", rsp, index);
+    session_finish(session, ETX_DL_EX_ERR);
+    return;
+  }
+
+  // the bootloader only counts consecutive failures, a later fragment starts over
+  if (index != session->nack_index) {
+    session->nack_index = index;
+    session->retries = 0;
+  }
+  if (++session->retries >= session->cfg.max_retries) {
+    printf("Fragment %u failed %u times, giving up\r\n", index, session->retries);
+    session_finish(session, ETX_DL_EX_ERR);
+    return;
+  }
+
+  // let the bootloader drain what is still in flight, then resend from index
+  if (bitmap != 0 && (repair_len = session_build_repair(session, index, bitmap)) != 0) {
+    printf("STM32 NACKed sub-blocks 0x%X of fragment %u/%u, repairing... (%u/%u)\r\n", bitmap, index + 1, image->frame_count, session->retries, session->cfg.max_retries);
+    session_stream_from(session, index, now_us + (ETX_STREAM_RESUME_GAP_MS * 1000ULL));
+    session->tx.wire = session->repair_wire;
+    session->tx.len = repair_len;
+    session->repairing = true;
+    return;
+  }
+  printf("STM32 NACKed fragment %u/%u, resuming... (%u/%u)\r\n", index + 1, image->frame_count, session->retries, session->cfg.max_retries);
+  session_stream_from(session, index, now_us + (ETX_STREAM_RESUME_GAP_MS * 1000ULL));
+}
+
+/* Write the stream and collect STATUS frames, in any order */
+static void session_stream_io(ETX_SESSION_ *session, int ready, uint64_t now_us)
+{
+  const ETX_IMAGE_ *image = session->image;
+  ETX_TRANSPORT_ *transport = &session->cfg.transport;
+
+  if ((ready & ETX_IO_READ) != 0) {
+    uint8_t buf[64];
+    int n;
+
+    while ((n = transport->read(transport->ctx, buf, sizeof(buf))) > 0) {
+      uint32_t pos = 0;
+      while (pos < (uint32_t)n && session->phase == ETX_PHASE_STREAM) {
+        uint32_t consumed;
+        if (etx_frame_parse(&session->status_parser, &buf[pos], (uint32_t)n - pos, &consumed) == ETX_DL_FRAME_EX_OK) {
+          session_stream_status(session, &session->status_parser.frame, now_us);
+        }
+        pos += consumed;
+      }
+      if (session->phase != ETX_PHASE_STREAM) {
+        return;
+      }
+    }
+    if (n < 0) {
+      printf("Failed to receive status from STM32\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+  }
+
+  if (now_us < session->resume_us) {
+    return;   // waiting for the bootloader to drain
+  }
+
+  if (session->tx.pos < session->tx.len) {
+    if ((ready & ETX_IO_WRITE) == 0) {
+      return;
+    }
+
+    ETX_DL_FRAME_EX_ status = session_tx(session, &session->cfg.transport, &session->tx, now_us);
+    if (status == ETX_DL_FRAME_EX_ERR) {
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+
+    if (session->repairing) {
+      if (status == ETX_DL_FRAME_EX_NO_DATA) {
+        return;
+      }
+      // repaired fragment is out, carry on with the ones after it
+      session->repairing = false;
+      session_stream_tail(session, session->frame_index + 1);
+      if (session->cfg.on_progress != NULL) {
+        session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+      }
+      if (session->tx.pos == session->tx.len) {
+        return;   // that was the last fragment, wait for the summary
+      }
+      if ((status = session_tx(session, &session->cfg.transport, &session->tx, now_us)) == ETX_DL_FRAME_EX_ERR) {
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      }
+    }
+
+    // report whole frames handed to the transport
+    uint32_t sent = image->frame_offset[session->frame_index] + session->tx.pos;
+    bool advanced = false;
+    while (session->frame_index < image->frame_count && image->frame_offset[session->frame_index + 1] <= sent) {
+      session->bytes_done += etx_image_frame_data_len(image, session->frame_index);
+      session->frame_index++;
+      advanced = true;
+    }
+    if (advanced && session->cfg.on_progress != NULL) {
+      session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+    }
+
+    if (status == ETX_DL_FRAME_EX_NO_DATA) {
+      return;
+    }
+  }
+
+  // everything written, the summary has to arrive within the response timeout
+  if (session->rsp_deadline_us == 0) {
+    session->rsp_deadline_us = now_us + ((uint64_t)session->cfg.rsp_timeout_ms * 1000ULL);
+  } else if (now_us >= session->rsp_deadline_us) {
+    printf("No stream summary from STM32\r\n");
+    session_finish(session, ETX_DL_EX_ERR);
+  }
+}
+
+/* Striping: collect an ACK/NACK on a lane, dropping noise ahead of it */
+static ETX_DL_FRAME_EX_ lane_rx_response(ETX_LANE_ *lane)
+{
+  ETX_DL_RSPF_ *response = (ETX_DL_RSPF_ *)lane->rsp;
+
+  for (;;) {
+    int n = lane->transport->read(lane->transport->ctx, &lane->rsp[lane->rsp_len], ETX_RSPF_PACKET_SIZE - lane->rsp_len);
+    if (n < 0) {
+      return ETX_DL_FRAME_EX_ERR;
+    } else if (n == 0) {
+      return ETX_DL_FRAME_EX_NO_DATA;
+    }
+    lane->rsp_len += (uint32_t)n;
+
+    while (lane->rsp_len > 0) {
+      if (lane->rsp[0] == ETX_FRAME_SOF && lane->rsp_len < ETX_RSPF_PACKET_SIZE) {
+        break;
+      }
+      if (lane->rsp[0] == ETX_FRAME_SOF
+        && response->eof == ETX_FRAME_EOF
+        && response->packet_type == ETX_DL_FRAME_TYPE_RESPONSE
+        && (response->payload == ETX_DL_RSP_ACK || response->payload == ETX_DL_RSP_NACK)) {
+        lane->rsp_len = 0;
+        return ETX_DL_FRAME_EX_OK;
+      }
+      // not a response frame, look for the next SOF
+      memmove(lane->rsp, &lane->rsp[1], --lane->rsp_len);
+    }
+  }
+}
+
+/* Striping: hand data frames to idle lanes and collect each lane's ACK/NACK */
+static void session_stripe_io(ETX_SESSION_ *session, uint64_t now_us)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint64_t timeout_us = (uint64_t)session->cfg.rsp_timeout_ms * 1000ULL;
+
+  for (uint32_t i = 0; i < ETX_LANE_COUNT && session->phase == ETX_PHASE_STRIPE; i++) {
+    ETX_LANE_ *lane = &session->lanes[i];
+    ETX_DL_FRAME_EX_ status;
+
+    if (lane->fragment == ETX_LANE_IDLE) {
+      if (session->frame_index >= image->frame_count) {
+        continue;
+      }
+      lane->fragment = session->frame_index++;
+      lane->retries = 0;
+      lane_send(session, lane);
+    }
+
+    if (lane->tx.pos < lane->tx.len) {
+      status = session_tx(session, lane->transport, &lane->tx, now_us);
+      if (status == ETX_DL_FRAME_EX_ERR) {
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      } else if (status == ETX_DL_FRAME_EX_NO_DATA) {
+        continue;
+      }
+      lane->rsp_deadline_us = now_us + timeout_us;
+    }
+
+    status = lane_rx_response(lane);
+    if (status == ETX_DL_FRAME_EX_ERR) {
+      printf("Failed to receive response from STM32 on lane %u\r\n", i + 1);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+
+    if (status == ETX_DL_FRAME_EX_NO_DATA) {
+      if (now_us < lane->rsp_deadline_us) {
+        continue;
+      }
+      if (++lane->retries >= session->cfg.max_retries) {
+        printf("No response on lane %u for fragment %u/%u\r\n", i + 1, lane->fragment + 1, image->frame_count);
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      }
+      printf("No response on lane %u, resending fragment %u/%u... (%u/%u)\r\n", i + 1, lane->fragment + 1, image->frame_count, lane->retries, session->cfg.max_retries);
+      lane_send(session, lane);
+      continue;
+    }
+
+    if (((ETX_DL_RSPF_ *)lane->rsp)->payload == ETX_DL_RSP_ACK) {
+      session->bytes_done += etx_image_frame_data_len(image, lane->fragment);
+      session->frames_acked++;
+      lane->fragment = ETX_LANE_IDLE;
+      if (session->cfg.on_progress != NULL) {
+        session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+      }
+      if (session->frames_acked == image->frame_count) {
+        // the bootloader has put its second port back, END goes out on the first
+        session->state = ETX_DL_STATE_DATA_COMPLETE;
+        session_send_cmd(session, ETX_DL_CMD_END);
+      }
+    } else if (++lane->retries < session->cfg.max_retries) {
+      printf("STM32 NACKed fragment %u/%u on lane %u, retrying... (%u/%u)\r\n", lane->fragment + 1, image->frame_count, i + 1, lane->retries, session->cfg.max_retries);
+      lane_send(session, lane);
+    } else {
+      printf("Fragment %u failed %u times on lane %u, giving up\r\n", lane->fragment + 1, lane->retries, i + 1);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+  }
+}
+
+/* Broadcast: put a frame on the bus */
+static void bcast_send(ETX_SESSION_ *session, const uint8_t *wire, uint32_t len)
+{
+  session->tx.wire = wire;
+  session->tx.len = len;
+  session->tx.pos = 0;
+  session->tx.progress_us = 0;
+}
+
+/* Broadcast: ask the current node for its missing fragments */
+static void bcast_poll(ETX_SESSION_ *session)
+{
+  ETX_DL_FRAME_ frame;
+
+  frame.sof = ETX_FRAME_SOF;
+  frame.eof = ETX_FRAME_EOF;
+  frame.packet_type = ETX_DL_FRAME_TYPE_POLL;
+  frame.payload[0] = session->nodes[session->node_index];
+  frame.payload_len = 1;
+  bcast_send(session, session->cmd_wire, etx_encode_frame(&frame, session->cmd_wire));
+  session->bcast_wait = true;
+}
+
+/* Broadcast: first node from index on that still has to be polled this round */
+static uint32_t bcast_next_node(const ETX_SESSION_ *session, uint32_t index)
+{
+  for (; index < session->cfg.node_count; index++) {
+    if (session->node_result[index] != ETX_NODE_RESULT_PENDING) {
+      continue;
+    }
+    if (session->bcast_step == ETX_BCAST_READY && (session->nodes_ready & (1UL << index)) != 0) {
+      continue;
+    }
+    break;
+  }
+  return index;
+}
+
+/* Broadcast: a MISSING frame on the bus, taken if it answers our POLL */
+static void bcast_answer(ETX_SESSION_ *session, const ETX_DL_FRAME_ *frame)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t node = session->node_index;
+  uint16_t count;
+
+  if (!session->bcast_wait || frame->packet_type != ETX_DL_FRAME_TYPE_MISSING
+    || frame->payload_len < ETX_MISSING_HDR_SIZE || frame->payload[0] != session->nodes[node]) {
+    return;   // our own frames echoed back, or a late answer
+  }
+
+  memcpy(&count, &frame->payload[1], 2);
+  session->bcast_wait = false;
+  session->retries = 0;
+  session->node_index++;
+
+  if (count != 0 && (count != image->frame_count || frame->payload_len != ETX_MISSING_HDR_SIZE + ((count + 7U) / 8U))) {
+    printf("Node %u expects %u fragments, not %u\r\n", session->nodes[node], count, image->frame_count);
+    session->node_result[node] = ETX_NODE_RESULT_FAILED;
+    return;
+  }
+
+  if (session->bcast_step == ETX_BCAST_READY) {
+    if (count != 0) {
+      session->nodes_ready |= (1UL << node);
+    }
+    return;   // 0: header missed, sent again after this round
+  }
+
+  if (count == 0) {
+    printf("Node %u lost the download\r\n", session->nodes[node]);
+    session->node_result[node] = ETX_NODE_RESULT_FAILED;
+    return;
+  }
+
+  bool complete = true;
+  for (uint32_t i = 0; i < ((count + 7U) / 8U); i++) {
+    session->missing[i] |= frame->payload[ETX_MISSING_HDR_SIZE + i];
+    complete = complete && (frame->payload[ETX_MISSING_HDR_SIZE + i] == 0);
+  }
+  if (complete) {
+    session->node_result[node] = ETX_NODE_RESULT_OK;
+  }
+}
+
+/* Broadcast: no answer to a POLL */
+static void bcast_silent(ETX_SESSION_ *session, uint64_t now_us)
+{
+  uint32_t node = session->node_index;
+
+  session->bcast_wait = false;
+
+  if (session->bcast_step == ETX_BCAST_READY) {
+    if (now_us < session->ready_deadline_us) {
+      return;   // still erasing, poll it again
+    }
+    printf("Node %u did not get ready\r\n", session->nodes[node]);
+  } else if (++session->retries < session->cfg.max_retries) {
+    return;
+  } else {
+    printf("No answer from node %u\r\n", session->nodes[node]);
+  }
+
+  session->node_result[node] = ETX_NODE_RESULT_FAILED;
+  session->retries = 0;
+  session->node_index++;
+}
+
+/* Broadcast: every node polled, decide what the next round sends */
+static void bcast_round_done(ETX_SESSION_ *session)
+{
+  const ETX_IMAGE_ *image = session->image;
+  uint32_t pending = 0, waiting = 0, missing = 0;
+
+  for (uint32_t i = 0; i < session->cfg.node_count; i++) {
+    if (session->node_result[i] == ETX_NODE_RESULT_PENDING) {
+      pending++;
+      waiting += ((session->nodes_ready & (1UL << i)) == 0);
+    }
+  }
+  for (uint32_t i = 0; i < image->frame_count; i++) {
+    missing += ((session->missing[i / 8] & (1U << (i % 8))) != 0);
+  }
+
+  if (session->bcast_step == ETX_BCAST_READY) {
+    if (waiting != 0 && ++session->rounds < session->cfg.max_retries) {
+      printf("%u node(s) missed the header, sending it again... (%u/%u)\r\n", waiting, session->rounds, session->cfg.max_retries);
+      session->bcast_step = ETX_BCAST_START;
+      return;
+    }
+    for (uint32_t i = 0; i < session->cfg.node_count; i++) {
+      if (session->node_result[i] == ETX_NODE_RESULT_PENDING && (session->nodes_ready & (1UL << i)) == 0) {
+        printf("Node %u never got the header\r\n", session->nodes[i]);
+        session->node_result[i] = ETX_NODE_RESULT_FAILED;
+        pending--;
+      }
+    }
+    if (pending == 0) {
+      printf("No node is ready for the broadcast\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+    session->state = ETX_DL_STATE_DATA;
+    session->bcast_step = ETX_BCAST_DATA;
+    session->bcast_repair = false;
+    session->frame_index = 0;
+    session->rounds = 0;
+    return;
+  }
+
+  if (missing == 0) {
+    session->bcast_step = ETX_BCAST_END;
+  } else if (session->rounds++ < session->cfg.max_retries) {
+    printf("Resending %u fragment(s) missed by %u node(s)... (%u/%u)\r\n", missing, pending, session->rounds, session->cfg.max_retries);
+    session->bcast_step = ETX_BCAST_DATA;
+    session->bcast_repair = true;
+    session->frame_index = 0;
+  } else {
+    printf("%u node(s) still miss %u fragment(s), giving up on them\r\n", pending, missing);
+    session->bcast_step = ETX_BCAST_END;
+  }
+}
+
+/* Broadcast: queue the next frame; false once the session is done */
+static bool bcast_step(ETX_SESSION_ *session, uint64_t now_us)
+{
+  const ETX_IMAGE_ *image = session->image;
+  ETX_DL_FRAME_ frame;
+  uint32_t i, ok;
+
+  switch (session->bcast_step)
+  {
+  case ETX_BCAST_START:
+    etx_fill_cmd_frame(&frame, ETX_DL_CMD_START_BROADCAST);
+    bcast_send(session, session->cmd_wire, etx_encode_frame(&frame, session->cmd_wire));
+    session->state = ETX_DL_STATE_HEADER;
+    session->bcast_step = ETX_BCAST_HEADER;
+    break;
+
+  case ETX_BCAST_HEADER:
+    bcast_send(session, image->wire, image->header_len);
+    session->bcast_step = ETX_BCAST_READY;
+    session->node_index = 0;
+    session->retries = 0;
+    // the nodes erase the whole application area before they answer
+    session->ready_deadline_us = now_us + ((uint64_t)session->cfg.rsp_timeout_ms * 1000ULL);
+    break;
+
+  case ETX_BCAST_READY:
+  case ETX_BCAST_POLL:
+    session->node_index = bcast_next_node(session, session->node_index);
+    if (session->node_index < session->cfg.node_count) {
+      bcast_poll(session);
+    } else {
+      bcast_round_done(session);
+    }
+    break;
+
+  case ETX_BCAST_DATA:
+    i = session->frame_index;
+    while (session->bcast_repair && i < image->frame_count && (session->missing[i / 8] & (1U << (i % 8))) == 0) {
+      i++;
+    }
+    if (i < image->frame_count) {
+      bcast_send(session, &image->wire[image->frame_offset[i]], image->frame_offset[i + 1] - image->frame_offset[i]);
+      session->frame_index = i + 1;
+      if (!session->bcast_repair) {
+        session->bytes_done += etx_image_frame_data_len(image, i);
+        if (session->cfg.on_progress != NULL) {
+          session->cfg.on_progress(session, session->bytes_done, image->size, session->cfg.user);
+        }
+      }
+      break;
+    }
+    session->bcast_step = ETX_BCAST_POLL;
+    session->node_index = 0;
+    session->retries = 0;
+    memset(session->missing, 0, sizeof(session->missing));
+    break;
+
+  case ETX_BCAST_END:
+    etx_fill_cmd_frame(&frame, ETX_DL_CMD_END);
+    bcast_send(session, session->cmd_wire, etx_encode_frame(&frame, session->cmd_wire));
+    session->state = ETX_DL_STATE_DATA_COMPLETE;
+    session->bcast_step = ETX_BCAST_FINISH;
+    break;
+
+  default:
+    // a node that is not OK by now fails END on its side as well
+    ok = 0;
+    for (i = 0; i < session->cfg.node_count; i++) {
+      if (session->node_result[i] == ETX_NODE_RESULT_OK) {
+        ok++;
+      } else {
+        session->node_result[i] = ETX_NODE_RESULT_FAILED;
+      }
+    }
+    session_finish(session, (ok == session->cfg.node_count) ? ETX_DL_EX_OK : ETX_DL_EX_ERR);
+    break;
+  }
+
+  return session->phase == ETX_PHASE_BCAST;
+}
+
+/* Broadcast: write the next frame once the bus has been idle long enough, collect POLL answers */
+static void session_bcast_io(ETX_SESSION_ *session, int ready, uint64_t now_us)
+{
+  ETX_TRANSPORT_ *transport = &session->cfg.transport;
+
+  if ((ready & ETX_IO_READ) != 0) {
+    uint8_t buf[256];
+    int n;
+
+    while ((n = transport->read(transport->ctx, buf, sizeof(buf))) > 0) {
+      uint32_t pos = 0;
+      while (pos < (uint32_t)n) {
+        uint32_t consumed;
+        if (etx_frame_parse(&session->status_parser, &buf[pos], (uint32_t)n - pos, &consumed) == ETX_DL_FRAME_EX_OK) {
+          bcast_answer(session, &session->status_parser.frame);
+        }
+        pos += consumed;
+      }
+    }
+    if (n < 0) {
+      printf("Failed to receive from the bus\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+  }
+
+  for (;;) {
+    if (session->tx.pos < session->tx.len) {
+      if ((ready & ETX_IO_WRITE) == 0) {
+        return;
+      }
+      ETX_DL_FRAME_EX_ status = session_tx(session, transport, &session->tx, now_us);
+      if (status == ETX_DL_FRAME_EX_ERR) {
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      } else if (status == ETX_DL_FRAME_EX_NO_DATA) {
+        return;
+      }
+      session->resume_us = now_us + (ETX_BCAST_FRAME_GAP_MS * 1000ULL);
+      session->rsp_deadline_us = now_us + (ETX_BCAST_POLL_MS * 1000ULL);
+    }
+
+    if (session->bcast_wait) {
+      if (now_us < session->rsp_deadline_us) {
+        return;
+      }
+      bcast_silent(session, now_us);
+    }
+
+    if (now_us < session->resume_us || !bcast_step(session, now_us)) {
+      return;
+    }
+  }
+}
+
+/* Answer a READ_DATA chunk, the bootloader waits for it before the next one */
+static void session_read_reply(ETX_SESSION_ *session, ETX_DL_RSP_ rsp)
+{
+  ETX_DL_RSPF_ *reply = (ETX_DL_RSPF_ *)session->reply_wire;
+
+  if (rsp == ETX_DL_RSP_NACK) {
+    session->stats.nacks++;
+    if (++session->retries >= session->cfg.max_retries) {
+      printf("Chunk at offset %u failed %u times, giving up\r\n", session->read_done, session->retries);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+  }
+
+  reply->sof = ETX_FRAME_SOF;
+  reply->packet_type = ETX_DL_FRAME_TYPE_RESPONSE;
+  reply->payload = rsp;
+  reply->eof = ETX_FRAME_EOF;
+
+  session->tx.wire = session->reply_wire;
+  session->tx.len = ETX_RSPF_PACKET_SIZE;
+  session->tx.pos = 0;
+  session->tx.progress_us = 0;
+  etx_frame_parser_reset(&session->status_parser);
+}
+
+/* Take a READ_DATA chunk if it is the next one in order */
+static void session_read_chunk(ETX_SESSION_ *session, const ETX_DL_FRAME_ *frame)
+{
+  uint32_t offset, len;
+
+  if (frame->packet_type != ETX_DL_FRAME_TYPE_READ_DATA || frame->payload_len <= ETX_READ_HDR_SIZE) {
+    session_read_reply(session, ETX_DL_RSP_NACK);
+    return;
+  }
+
+  memcpy(&offset, frame->payload, 4);
+  len = frame->payload_len - ETX_READ_HDR_SIZE;
+
+  if (offset == session->read_done && len <= session->read_len - session->read_done) {
+    memcpy(&session->read_buf[offset], &frame->payload[ETX_READ_HDR_SIZE], len);
+    session->read_done += len;
+    session->retries = 0;
+    session->stats.frames++;
+    if (session->cfg.on_progress != NULL) {
+      session->cfg.on_progress(session, session->read_done, session->read_len, session->cfg.user);
+    }
+    session_read_reply(session, ETX_DL_RSP_ACK);
+  } else if (offset + len <= session->read_done) {
+    session_read_reply(session, ETX_DL_RSP_ACK);   // our last ACK got lost, already have it
+  } else {
+    session_read_reply(session, ETX_DL_RSP_NACK);
+  }
+}
+
+/* Read-back: collect READ_DATA chunks and answer each of them */
+static void session_read_io(ETX_SESSION_ *session, int ready, uint64_t now_us)
+{
+  ETX_TRANSPORT_ *transport = &session->cfg.transport;
+  uint64_t timeout_us = session_ack_timeout_us(session);
+
+  if (session->tx.pos == session->tx.len) {
+    if (session->rsp_deadline_us == 0) {
+      session->rsp_deadline_us = now_us + timeout_us;
+    }
+
+    if ((ready & ETX_IO_READ) != 0) {
+      uint8_t buf[256];
+      int n = 0;
+
+      while (session->tx.pos == session->tx.len && session->phase == ETX_PHASE_READ
+        && (n = transport->read(transport->ctx, buf, sizeof(buf))) > 0) {
+        uint32_t pos = 0;
+
+        // line is alive, the deadline covers one chunk at a time
+        session->rsp_deadline_us = now_us + timeout_us;
+        while (pos < (uint32_t)n && session->tx.pos == session->tx.len && session->phase == ETX_PHASE_READ) {
+          uint32_t consumed;
+          ETX_DL_FRAME_EX_ status = etx_frame_parse(&session->status_parser, &buf[pos], (uint32_t)n - pos, &consumed);
+          if (status == ETX_DL_FRAME_EX_OK) {
+            session_read_chunk(session, &session->status_parser.frame);
+          } else if (status == ETX_DL_FRAME_EX_ERR) {
+            session_read_reply(session, ETX_DL_RSP_NACK);
+          }
+          pos += consumed;
+        }
+      }
+      if (n < 0) {
+        printf("Failed to receive data from STM32\r\n");
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      }
+    }
+
+    if (session->phase != ETX_PHASE_READ) {
+      return;
+    }
+    if (session->tx.pos == session->tx.len) {
+      if (now_us < session->rsp_deadline_us) {
+        return;
+      }
+      // chunk lost or cut short, ask for it again
+      printf("No data from STM32 at offset %u, requesting it again\r\n", session->read_done);
+      session_read_reply(session, ETX_DL_RSP_NACK);
+      if (session->phase != ETX_PHASE_READ) {
+        return;
+      }
+    }
+  }
+
+  if ((ready & ETX_IO_WRITE) == 0) {
+    return;
+  }
+
+  ETX_DL_FRAME_EX_ status = session_tx(session, &session->cfg.transport, &session->tx, now_us);
+  if (status == ETX_DL_FRAME_EX_ERR) {
+    session_finish(session, ETX_DL_EX_ERR);
+  } else if (status == ETX_DL_FRAME_EX_OK) {
+    if (session->read_done == session->read_len) {
+      session_finish(session, ETX_DL_EX_OK);   // last chunk ACKed
+    } else {
+      session->rsp_deadline_us = now_us + timeout_us;
+    }
+  }
+}
+
+/* Allocate a session and apply the configuration defaults */
+static ETX_SESSION_ *session_alloc(const ETX_SESSION_CFG_ *cfg, uint64_t now_us)
+{
+  if (cfg == NULL || cfg->transport.write == NULL || cfg->transport.read == NULL) {
+    return NULL;
+  }
+
+  ETX_SESSION_ *session = calloc(1, sizeof(ETX_SESSION_));
+  if (session == NULL) {
+    return NULL;
+  }
+
+  session->cfg = *cfg;
+  if (session->cfg.rsp_timeout_ms == 0) {
+    session->cfg.rsp_timeout_ms = ETX_RSP_TIMEOUT_MS;
+  }
+  if (session->cfg.ack_timeout_ms == 0) {
+    session->cfg.ack_timeout_ms = session->cfg.rsp_timeout_ms;
+  }
+  if (session->cfg.max_retries == 0) {
+    session->cfg.max_retries = ETX_MAX_NACK_RETRIES;
+  }
+  if (session->cfg.tx_chunk == 0) {
+    session->cfg.tx_chunk = 1;
+  }
+  session->state = ETX_DL_STATE_IDLE;
+  session->result = ETX_DL_EX_ABORT;
+  session->tx.next_us = now_us;
+  session->tx_gap_saved_us = session->cfg.tx_gap_us;
+
+  return session;
+}
+
+/**
+ * @brief  Start a download session (nothing is written until etx_session_io)
+ * @param  cfg: transport, callbacks and timing, copied into the session
+ * @param  image: framed image, must stay valid until the session is freed
+ * @param  now_us: current time
+ * @retval session handle, NULL on error
+ */
+ETX_SESSION_ *etx_session_start(const ETX_SESSION_CFG_ *cfg, const ETX_IMAGE_ *image, uint64_t now_us)
+{
+  if (image == NULL || image->wire == NULL) {
+    return NULL;
+  }
+
+  ETX_SESSION_ *session = session_alloc(cfg, now_us);
+  if (session == NULL) {
+    return NULL;
+  }
+
+  session->image = image;
+  if (session->cfg.lane2.write != NULL) {
+    if (session->cfg.lane2.read == NULL || (image->flags & ETX_IMAGE_FLAG_OFFSET_ADDR) == 0) {
+      free(session);
+      return NULL;   // striping needs DATA_AT frames
+    }
+    session->striped = true;
+    session->cfg.stream = false;
+    session->cfg.tx_gap_us = 0;   // the bootloader receives both ports by interrupt
+  }
+  if (session->cfg.node_count != 0) {
+    if (session->cfg.nodes == NULL || session->cfg.node_count > ETX_BCAST_MAX_NODES
+      || session->striped || (image->flags & ETX_IMAGE_FLAG_OFFSET_ADDR) == 0) {
+      free(session);
+      return NULL;   // broadcast needs DATA_AT frames on one bus
+    }
+    for (uint32_t i = 0; i < session->cfg.node_count; i++) {
+      if (session->cfg.nodes[i] == ETX_NODE_NONE || session->cfg.nodes[i] > ETX_NODE_MAX) {
+        free(session);
+        return NULL;
+      }
+      session->nodes[i] = session->cfg.nodes[i];
+    }
+    session->cfg.nodes = session->nodes;
+    session->broadcast = true;
+    session->cfg.stream = false;
+    session->cfg.tx_gap_us = 0;   // no flow control on the bus, the gap between frames does the pacing
+  }
+  if (session->cfg.staged) {
+    if (session->striped || session->broadcast || session->cfg.random || image->flags != 0) {
+      free(session);
+      return NULL;   // staging takes plain DATA frames on one port
+    }
+    session->staged = true;
+    session->cfg.stream = true;
+    session_staged_header(session);
+  }
+  if (session->cfg.random) {
+    if (session->striped || session->broadcast || (image->flags & ETX_IMAGE_FLAG_OFFSET_ADDR) == 0) {
+      free(session);
+      return NULL;   // random access needs DATA_AT frames on one port
+    }
+    session->random = true;
+    session->cfg.stream = false;
+    session_random_plan(session);
+  }
+  if (session->cfg.stream) {
+    session->cfg.tx_gap_us = 0;   // RTS/CTS does the pacing
+  }
+
+  if (session->broadcast) {
+    session->phase = ETX_PHASE_BCAST;
+    session->bcast_step = ETX_BCAST_START;
+    etx_frame_parser_reset(&session->status_parser);
+  } else if (session->striped) {
+    session_send_cmd(session, ETX_DL_CMD_START_STRIPED);
+  } else if (session->random) {
+    session_send_cmd(session, ETX_DL_CMD_START_RANDOM);
+  } else if (session->staged) {
+    session_send_cmd(session, ETX_DL_CMD_START_STAGED);
+  } else {
+    session_send_cmd(session, session->cfg.stream ? ETX_DL_CMD_START_STREAM : ETX_DL_CMD_START);
+  }
+
+  return session;
+}
+
+/**
+ * @brief  Start a read-back session: stream a flash range from the bootloader
+ * @param  cfg: transport, callbacks and timing (stream is ignored)
+ * @param  address: first flash address to read
+ * @param  length: bytes to read
+ * @param  buf: destination, length bytes, must stay valid until the session is freed
+ * @param  now_us: current time
+ * @retval session handle, NULL on error
+ */
+ETX_SESSION_ *etx_read_start(const ETX_SESSION_CFG_ *cfg, uint32_t address, uint32_t length, uint8_t *buf, uint64_t now_us)
+{
+  if (buf == NULL || length == 0) {
+    return NULL;
+  }
+
+  ETX_SESSION_ *session = session_alloc(cfg, now_us);
+  if (session == NULL) {
+    return NULL;
+  }
+
+  session->cfg.stream = false;
+  session->read_buf = buf;
+  session->read_addr = address;
+  session->read_len = length;
+
+  session_send_cmd(session, ETX_DL_CMD_READ);
+
+  return session;
+}
+
+/**
+ * @brief  Start a session that stores the bootloader's RS-485 bus address
+ *         (point to point, before the board goes on the bus)
+ * @param  cfg: transport, callbacks and timing (stream is ignored)
+ * @param  address: 1..ETX_NODE_MAX, ETX_NODE_NONE takes the board off the bus
+ * @param  now_us: current time
+ * @retval session handle, NULL on error
+ */
+ETX_SESSION_ *etx_node_start(const ETX_SESSION_CFG_ *cfg, uint8_t address, uint64_t now_us)
+{
+  if (address > ETX_NODE_MAX) {
+    return NULL;
+  }
+
+  ETX_SESSION_ *session = session_alloc(cfg, now_us);
+  if (session == NULL) {
+    return NULL;
+  }
+
+  session->cfg.stream = false;
+  session->set_node = true;
+  session->nodes[0] = address;
+
+  session_send_cmd(session, ETX_DL_CMD_SET_NODE);
+
+  return session;
+}
+
+/**
+ * @brief  Start a probe session: send the image's PROBE frames, one ACK each,
+ *         nothing is flashed and the bootloader stays in IDLE
+ * @param  cfg: transport, callbacks and timing (stream is ignored)
+ * @param  image: image framed with ETX_IMAGE_FLAG_PROBE, must stay valid until the session is freed
+ * @param  now_us: current time
+ * @retval session handle, NULL on error
+ */
+ETX_SESSION_ *etx_probe_start(const ETX_SESSION_CFG_ *cfg, const ETX_IMAGE_ *image, uint64_t now_us)
+{
+  if (image == NULL || image->wire == NULL || (image->flags & ETX_IMAGE_FLAG_PROBE) == 0) {
+    return NULL;
+  }
+
+  ETX_SESSION_ *session = session_alloc(cfg, now_us);
+  if (session == NULL) {
+    return NULL;
+  }
+
+  session->cfg.stream = false;
+  session->image = image;
+  session->probe = true;
+  session->state = ETX_DL_STATE_DATA;
+  session->frame_index = 0;
+
+  session_send_data_frame(session);
+
+  return session;
+}
+
+/**
+ * @brief  Drive the session after its transport became ready
+ * @param  session: session handle
+ * @param  ready: ETX_IO_READ and/or ETX_IO_WRITE
+ * @param  now_us: current time, for pacing and response timeouts
+ * @retval None
+ */
+void etx_session_io(ETX_SESSION_ *session, int ready, uint64_t now_us)
+{
+  ETX_DL_FRAME_EX_ status;
+
+  while (session->phase != ETX_PHASE_DONE) {
+    if (session->phase == ETX_PHASE_STREAM) {
+      session_stream_io(session, ready, now_us);
+      if (session->phase == ETX_PHASE_STREAM || session->phase == ETX_PHASE_DONE) {
+        return;
+      }
+      continue;   // summary received, END goes out next
+    }
+
+    if (session->phase == ETX_PHASE_READ) {
+      session_read_io(session, ready, now_us);
+      return;
+    }
+
+    if (session->phase == ETX_PHASE_BCAST) {
+      session_bcast_io(session, ready, now_us);
+      return;
+    }
+
+    if (session->phase == ETX_PHASE_STRIPE) {
+      session_stripe_io(session, now_us);
+      if (session->phase == ETX_PHASE_STRIPE || session->phase == ETX_PHASE_DONE) {
+        return;
+      }
+      continue;   // all fragments ACKed, END goes out next
+    }
+
+    if (session->phase == ETX_PHASE_TX) {
+      if ((ready & ETX_IO_WRITE) == 0) {
+        return;
+      }
+
+      status = session_tx(session, &session->cfg.transport, &session->tx, now_us);
+      if (status == ETX_DL_FRAME_EX_NO_DATA) {
+        return;
+      } else if (status != ETX_DL_FRAME_EX_OK) {
+        session_finish(session, ETX_DL_EX_ERR);
+        return;
+      }
+
+      if (session->state == ETX_DL_STATE_DATA_COMPLETE) {
+        session_advance(session);   // END is not acknowledged
+      } else {
+        session->phase = ETX_PHASE_WAIT_RSP;
+        session->rsp_len = 0;
+        session->rsp_sent_us = now_us;
+        session->rsp_deadline_us = now_us + session_ack_timeout_us(session);
+      }
+      continue;
+    }
+
+    // ETX_PHASE_WAIT_RSP
+    status = ETX_DL_FRAME_EX_NO_DATA;
+    if (ready & ETX_IO_READ) {
+      status = session_rx_response(session);
+    }
+
+    if (status == ETX_DL_FRAME_EX_ERR) {
+      printf("Failed to receive response from STM32\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+
+    if (status == ETX_DL_FRAME_EX_NO_DATA) {
+      if (now_us < session->rsp_deadline_us) {
+        return;
+      }
+      if (session->state == ETX_DL_STATE_IDLE
+        && (session->cfg.start_retries == 0 || ++session->start_attempts < session->cfg.start_retries)) {
+        // bootloader may not be listening yet, keep knocking
+        session->tx.pos = 0;
+        session->phase = ETX_PHASE_TX;
+        continue;
+      }
+      printf("No response from STM32 (state %d)\r\n", session->state);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+
+    if (now_us - session->rsp_sent_us > session->stats.max_rsp_us) {
+      session->stats.max_rsp_us = now_us - session->rsp_sent_us;
+    }
+    if (((ETX_DL_RSPF_ *)session->rsp)->payload != ETX_DL_RSP_ACK) {
+      session->stats.nacks++;
+    }
+
+    if (((ETX_DL_RSPF_ *)session->rsp)->payload == ETX_DL_RSP_ACK) {
+      session_advance(session);
+    } else if (session->rsp_fatal && session->random && session->random_step == ETX_RANDOM_COMMIT) {
+      printf("STM32 rejected the image at COMMIT, the flash does not hold it\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->rsp_fatal) {
+      printf("STM32 aborted the download (fragment %u/%u or one before it failed)\r\n",
+             session->frame_index + 1, session->image->frame_count);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_IDLE && session->read_buf != NULL) {
+      printf("STM32 rejected the read of %u bytes at 0x%08X\r\n", session->read_len, session->read_addr);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_IDLE && session->set_node) {
+      printf("STM32 rejected bus address %u\r\n", session->nodes[0]);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_IDLE && session->striped) {
+      printf("STM32 does not support striping\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_HEADER && session->striped) {
+      printf("STM32 could not start the striped download\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_IDLE && session->random) {
+      printf("STM32 does not support random access\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_HEADER && session->random) {
+      printf("STM32 could not start the random access download\r\n");
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    } else if (session->state == ETX_DL_STATE_IDLE && session->staged) {
+      // bootloader without staging, stream straight to flash
+      printf("STM32 does not stage in RAM, streaming instead\r\n");
+      session->staged = false;
+      session_send_cmd(session, ETX_DL_CMD_START_STREAM);
+    } else if (session->state == ETX_DL_STATE_IDLE && session->cfg.stream) {
+      // bootloader without streaming support, fall back to one ACK per frame
+      printf("STM32 does not stream, falling back to ACK per frame\r\n");
+      session->cfg.stream = false;
+      session->cfg.tx_gap_us = session->tx_gap_saved_us;
+      session_send_cmd(session, ETX_DL_CMD_START);
+    } else if (++session->retries < session->cfg.max_retries) {
+      uint32_t repair_len;
+
+      if (session->state == ETX_DL_STATE_DATA && session->rsp_bitmap != 0
+        && (repair_len = session_build_repair(session, session->frame_index, session->rsp_bitmap)) != 0) {
+        printf("STM32 NACKed sub-blocks 0x%X, repairing... (%u/%u)\r\n", session->rsp_bitmap, session->retries, session->cfg.max_retries);
+        session_resend(session, session->repair_wire, repair_len);
+      } else {
+        printf("Host NACK received, retrying... (%u/%u)\r\n", session->retries, session->cfg.max_retries);
+        if (session->state == ETX_DL_STATE_DATA && session->tx.wire != session->cmd_wire) {
+          // whole frame again, even if the last attempt was a repair
+          const ETX_IMAGE_ *image = session->image;
+          uint32_t i = session->frame_index;
+          session_resend(session, &image->wire[image->frame_offset[i]], image->frame_offset[i + 1] - image->frame_offset[i]);
+        } else {
+          session_resend(session, session->tx.wire, session->tx.len);
+        }
+      }
+    } else {
+      printf("No ACK after %u retries\r\n", session->cfg.max_retries);
+      session_finish(session, ETX_DL_EX_ERR);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief  I/O readiness the session is waiting for
+ * @retval ETX_IO_READ / ETX_IO_WRITE mask, 0 once done
+ */
+int etx_session_io_wanted(const ETX_SESSION_ *session)
+{
+  switch (session->phase)
+  {
+  case ETX_PHASE_TX:        return ETX_IO_WRITE;
+  case ETX_PHASE_WAIT_RSP:  return ETX_IO_READ;
+  case ETX_PHASE_STREAM:    return (session->tx.pos < session->tx.len) ? (ETX_IO_READ | ETX_IO_WRITE) : ETX_IO_READ;
+  case ETX_PHASE_READ:      return (session->tx.pos < session->tx.len) ? ETX_IO_WRITE : ETX_IO_READ;
+  case ETX_PHASE_STRIPE:    return ETX_IO_READ | ETX_IO_WRITE;
+  case ETX_PHASE_BCAST:     return (session->tx.pos < session->tx.len) ? (ETX_IO_READ | ETX_IO_WRITE) : ETX_IO_READ;
+  default:                  return 0;
+  }
+}
+
+/**
+ * @brief  Time until the session needs etx_session_io again without any I/O
+ *         (next paced byte or response timeout)
+ * @retval microseconds, 0 if it should be called right away
+ */
+uint64_t etx_session_timeout_us(const ETX_SESSION_ *session, uint64_t now_us)
+{
+  uint64_t due;
+
+  switch (session->phase)
+  {
+  case ETX_PHASE_TX:
+    due = (session->cfg.tx_gap_us != 0) ? session->tx.next_us : now_us;
+    break;
+  case ETX_PHASE_WAIT_RSP:
+    due = session->rsp_deadline_us;
+    break;
+  case ETX_PHASE_STREAM:
+    if (now_us < session->resume_us) {
+      due = session->resume_us;
+    } else if (session->tx.pos < session->tx.len) {
+      due = session->tx.progress_us + session_stall_us(session);
+    } else {
+      due = (session->rsp_deadline_us != 0) ? session->rsp_deadline_us : now_us;
+    }
+    break;
+  case ETX_PHASE_READ:
+    if (session->tx.pos < session->tx.len) {
+      due = (session->cfg.tx_gap_us != 0) ? session->tx.next_us : now_us;
+    } else {
+      due = (session->rsp_deadline_us != 0) ? session->rsp_deadline_us : now_us;
+    }
+    break;
+  case ETX_PHASE_STRIPE:
+    due = UINT64_MAX;
+    for (uint32_t i = 0; i < ETX_LANE_COUNT; i++) {
+      const ETX_LANE_ *lane = &session->lanes[i];
+      uint64_t lane_due;
+
+      if (lane->fragment == ETX_LANE_IDLE) {
+        lane_due = (session->frame_index < session->image->frame_count) ? now_us : UINT64_MAX;
+      } else if (lane->tx.pos < lane->tx.len) {
+        lane_due = now_us;
+      } else {
+        lane_due = lane->rsp_deadline_us;
+      }
+      due = (lane_due < due) ? lane_due : due;
+    }
+    break;
+  case ETX_PHASE_BCAST:
+    if (session->tx.pos < session->tx.len) {
+      due = now_us;
+    } else if (session->bcast_wait) {
+      due = session->rsp_deadline_us;
+    } else {
+      due = session->resume_us;
+    }
+    break;
+  default:
+    return 0;
+  }
+
+  return (due > now_us) ? (due - now_us) : 0;
+}
+
+bool etx_session_done(const ETX_SESSION_ *session)
+{
+  return session->phase == ETX_PHASE_DONE;
+}
+
+ETX_DL_EX_ etx_session_result(const ETX_SESSION_ *session)
+{
+  return session->result;
+}
+
+ETX_DL_STATE_ etx_session_state(const ETX_SESSION_ *session)
+{
+  return session->state;
+}
+
+const ETX_IMAGE_ *etx_session_image(const ETX_SESSION_ *session)
+{
+  return session->image;
+}
+
+ETX_NODE_RESULT_ etx_session_node_result(const ETX_SESSION_ *session, uint32_t index)
+{
+  if (!session->broadcast || index >= session->cfg.node_count) {
+    return ETX_NODE_RESULT_FAILED;
+  }
+  return (ETX_NODE_RESULT_)session->node_result[index];
+}
+
+void etx_session_stats(const ETX_SESSION_ *session, ETX_SESSION_STATS_ *stats)
+{
+  *stats = session->stats;
+}
+
+void etx_session_free(ETX_SESSION_ *session)
+{
+  free(session);
+}
+
+/* ***** Session Functions - End ***** */
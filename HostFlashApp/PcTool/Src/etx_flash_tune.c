@@ -0,0 +1,256 @@
+/**
+  ******************************************************************************
+  * @file    etx_flash_tune.c
+  * @author  Shiddeshwaran-S
+  * @brief   Link tuner: find the fastest reliable settings for one adapter
+  *          (Linux only).
+  *
+  *          With the board waiting in download mode, every combination of
+  *          baud rate, write size and inter-write gap is tried: PROBE frames
+  *          (ACKed, nothing flashed) towards the board, a READ of the
+  *          application area back. Goodput and NACKs are measured per trial,
+  *          the fastest trial with few enough errors is stored as the
+  *          adapter's link profile and used by later runs on that adapter.
+  ******************************************************************************/
+
+#if defined(__linux__)
+
+#define _DEFAULT_SOURCE
+
+#include "etx_flash_update.h"
+#include "etx_link_profile.h"
+#include "etx_rs232_transport.h"
+
+#define ETX_TUNE_PROBE_FRAMES     ( 4 )             // PROBE frames per trial
+#define ETX_TUNE_READ_LEN         ( 32 * 1024 )
+#define ETX_TUNE_RSP_TIMEOUT_MS   ( 2000 )          // per frame while tuning
+#define ETX_TUNE_MAX_FRAME_MS     ( 2000 )          // slower pacing is not worth trying
+#define ETX_TUNE_MAX_ERROR_PCT    ( 5 )             // NACKs per frame a profile may cost
+#define ETX_TUNE_MIN_ACK_MS       ( 500 )
+#define ETX_TUNE_ACK_MARGIN       ( 4 )             // ACK timeout = margin x slowest answer
+#define ETX_TUNE_RECOVER_MS       ( 200 )           // board drains the line after a failed trial
+
+static const uint32_t tune_gaps_us[] = { 0, 20, 100, 500 };
+static const uint32_t tune_chunks[] = { 1, 8, 64, 512 };
+
+/*
+ * One trial and what it measured
+ */
+typedef struct
+{
+  bool      ok;
+  uint32_t  goodput;              // bytes/s both ways
+  uint32_t  frames;
+  uint32_t  nacks;
+  uint64_t  max_rsp_us;
+}ETX_TUNE_RESULT_;
+
+/* ***** Utility Functions - Start ***** */
+
+/* Drive a session until it is done, polling like the command line tool */
+static ETX_DL_EX_ tune_run(ETX_SESSION_ *session)
+{
+  while (!etx_session_done(session)) {
+    etx_session_io(session, ETX_IO_READ | ETX_IO_WRITE, etx_time_us());
+
+    uint64_t wait = etx_session_timeout_us(session, etx_time_us());
+    if (!etx_session_done(session) && wait != 0) {
+      delay((wait > 1000) ? 1000 : (uint32_t)wait);
+    }
+  }
+  return etx_session_result(session);
+}
+
+static void tune_add_stats(ETX_SESSION_ *session, ETX_TUNE_RESULT_ *result)
+{
+  ETX_SESSION_STATS_ stats;
+
+  etx_session_stats(session, &stats);
+  result->frames += stats.frames;
+  result->nacks += stats.nacks;
+  if (stats.max_rsp_us > result->max_rsp_us) {
+    result->max_rsp_us = stats.max_rsp_us;
+  }
+}
+
+/* Complete whatever frame the board is stuck in with filler (never SOF), then drop its answer */
+static void tune_recover(int comport_number)
+{
+  static uint8_t filler[ETX_FRAME_WIRE_SIZE(ETX_FRAME_PAYLOAD_MAX_SIZE)];
+  uint32_t sent = 0;
+  uint64_t start = etx_time_us();
+
+  while (sent < sizeof(filler) && etx_time_us() - start < (ETX_TUNE_RSP_TIMEOUT_MS * 1000ULL)) {
+    int n = RS232_SendBuf(comport_number, &filler[sent], (int)(sizeof(filler) - sent));
+    if (n < 0) {
+      break;
+    }
+    sent += (uint32_t)n;
+    if (n == 0) {
+      delay(1000);
+    }
+  }
+  delay(ETX_TUNE_RECOVER_MS * 1000);
+  RS232_flushRXTX(comport_number);
+}
+
+/* ***** Utility Functions - End ***** */
+
+/* Send the probe frames and read the application area back with one setting */
+static void tune_trial(int comport_number, const ETX_IMAGE_ *probe, uint32_t read_addr, uint8_t *read_buf,
+                       uint32_t tx_chunk, uint32_t tx_gap_us, ETX_TUNE_RESULT_ *result)
+{
+  ETX_SESSION_CFG_ cfg = {0};
+  ETX_SESSION_ *session;
+  uint64_t start = etx_time_us();
+
+  memset(result, 0, sizeof(ETX_TUNE_RESULT_));
+
+  etx_rs232_transport(&cfg.transport, comport_number);
+  cfg.tx_gap_us = tx_gap_us;
+  cfg.tx_chunk = tx_chunk;
+  cfg.rsp_timeout_ms = ETX_TUNE_RSP_TIMEOUT_MS;
+  cfg.start_retries = 1;    // a second READ would start a second stream
+
+  RS232_flushRXTX(comport_number);
+
+  session = etx_probe_start(&cfg, probe, etx_time_us());
+  if (session == NULL) {
+    return;
+  }
+  result->ok = (tune_run(session) == ETX_DL_EX_OK);
+  tune_add_stats(session, result);
+  etx_session_free(session);
+
+  if (result->ok) {
+    session = etx_read_start(&cfg, read_addr, ETX_TUNE_READ_LEN, read_buf, etx_time_us());
+    if (session == NULL) {
+      return;
+    }
+    result->ok = (tune_run(session) == ETX_DL_EX_OK);
+    tune_add_stats(session, result);
+    etx_session_free(session);
+  }
+
+  if (!result->ok) {
+    tune_recover(comport_number);
+    return;
+  }
+
+  uint64_t elapsed_us = etx_time_us() - start;
+  result->goodput = (uint32_t)(((uint64_t)(probe->size + ETX_TUNE_READ_LEN) * 1000000ULL) / (elapsed_us ? elapsed_us : 1));
+}
+
+/**
+ * @brief  tune <port> [--baud a,b,c] [--ab]: measure the link to a board waiting in
+ *         download mode and store the best settings for the adapter
+ * @param  port: port as RS232 knows it, e.g. ttyUSB0
+ * @param  bdrates: baud rates to try (the bootloader runs one fixed rate)
+ * @param  bdrate_count: entries in bdrates
+ * @param  read_addr: application area to read back, ETX_APP_LOAD_ADDRESS
+ *         or ETX_APP_LOAD_ADDRESS_AB with an A/B slot bootloader
+ * @retval 0 if a profile was stored, -1 otherwise
+ */
+int etx_flash_tune(const char *port, const int *bdrates, uint32_t bdrate_count, uint32_t read_addr)
+{
+  char mode[] = {'8','N','1',0};
+  ETX_LINK_PROFILE_ best = {0};
+  ETX_IMAGE_ probe = {0};
+  uint8_t *pattern = NULL;
+  uint8_t *read_buf = NULL;
+  uint32_t pattern_len = ETX_TUNE_PROBE_FRAMES * ETX_FRAME_DATA_MAX_SIZE;
+  uint32_t seed = 0x2545F491U;
+  int exit_code = -1;
+
+  int comport_number = RS232_GetPortnr(port);
+  if (comport_number < 0) {
+    printf("Can not find comport\n");
+    return -1;
+  }
+  if (!etx_link_profile_id(port, best.id, sizeof(best.id))) {
+    printf("%s has no link in %s, nothing to key a profile on\r\n", port, ETX_WATCH_DIR);
+    return -1;
+  }
+
+  pattern = malloc(pattern_len);
+  read_buf = malloc(ETX_TUNE_READ_LEN);
+  if (pattern == NULL || read_buf == NULL) {
+    free(pattern);
+    free(read_buf);
+    return -1;
+  }
+
+  // random data: SOF/EOF bytes and long runs land wherever they happen to
+  for (uint32_t i = 0; i < pattern_len; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    pattern[i] = (uint8_t)seed;
+  }
+  if (!etx_image_build(&probe, pattern, pattern_len, ETX_IMAGE_FLAG_PROBE)) {
+    free(pattern);
+    free(read_buf);
+    return -1;
+  }
+  free(pattern);
+
+  printf("Tuning %s (%s)\r\n", port, best.id);
+  printf("%8s %6s %6s %10s %6s %6s %8s\r\n", "baud", "gap_us", "chunk", "bytes/s", "frames", "nacks", "rsp_ms");
+
+  for (uint32_t b = 0; b < bdrate_count; b++) {
+    if (RS232_OpenComport(comport_number, bdrates[b], mode, 0)) {
+      printf("%8d can not open the port at this rate\r\n", bdrates[b]);
+      continue;
+    }
+
+    for (uint32_t g = 0; g < sizeof(tune_gaps_us) / sizeof(tune_gaps_us[0]); g++) {
+      for (uint32_t c = 0; c < sizeof(tune_chunks) / sizeof(tune_chunks[0]); c++) {
+        uint32_t gap = tune_gaps_us[g];
+        uint32_t chunk = tune_chunks[c];
+        ETX_TUNE_RESULT_ result;
+
+        if (gap == 0 && c != 0) {
+          break;    // unpaced: one write per frame, the chunk size does not matter
+        }
+        if (gap != 0 && ((uint64_t)ETX_FRAME_WIRE_SIZE(ETX_FRAME_DATA_MAX_SIZE) / chunk) * gap > ETX_TUNE_MAX_FRAME_MS * 1000ULL) {
+          continue;
+        }
+
+        tune_trial(comport_number, &probe, read_addr, read_buf, (gap == 0) ? 0 : chunk, gap, &result);
+
+        printf("%8d %6u %6u %10u %6u %6u %8llu %s\r\n", bdrates[b], gap, (gap == 0) ? 0 : chunk,
+               result.goodput, result.frames, result.nacks,
+               (unsigned long long)(result.max_rsp_us / 1000ULL), result.ok ? "" : "FAILED");
+
+        if (!result.ok || result.nacks * 100U > (result.frames + result.nacks) * ETX_TUNE_MAX_ERROR_PCT
+          || result.goodput <= best.goodput) {
+          continue;
+        }
+
+        uint64_t ack_ms = (result.max_rsp_us * ETX_TUNE_ACK_MARGIN) / 1000ULL;
+        best.bdrate = bdrates[b];
+        best.tx_chunk = (gap == 0) ? 0 : chunk;
+        best.tx_gap_us = gap;
+        best.ack_timeout_ms = (ack_ms < ETX_TUNE_MIN_ACK_MS) ? ETX_TUNE_MIN_ACK_MS : (uint32_t)ack_ms;
+        best.goodput = result.goodput;
+      }
+    }
+
+    RS232_CloseComport(comport_number);
+  }
+
+  if (best.goodput == 0) {
+    printf("No setting got through reliably, nothing stored\r\n");
+  } else if (etx_link_profile_save(&best)) {
+    printf("Stored: %d baud, %u byte writes, %u us gap, %u ms ACK timeout (%u bytes/s)\r\n",
+           best.bdrate, best.tx_chunk, best.tx_gap_us, best.ack_timeout_ms, best.goodput);
+    exit_code = 0;
+  }
+
+  etx_image_free(&probe);
+  free(read_buf);
+
+  return exit_code;
+}
+
+#endif /* __linux__ */
@@ -2,10 +2,12 @@
   ******************************************************************************
   * @file    etx_flash_update.c
   * @author  Shiddeshwaran-S
-  * @brief   This file provides set of firmware functions to manage etx flash update
+  * @brief   Command line front end of libetxflash
   ******************************************************************************/
 
 #include "etx_flash_update.h"
+#include "etx_rs232_transport.h"
+#include "etx_link_profile.h"
 
 /* Host Flash Version Info start */
 #define Major_VERSION  2
@@ -18,35 +20,8 @@
 #define HF_VER_STRING "Host Flash Version " HF_VERSION " stable release"
 /* Host Flash Version Info end */
 
-uint8_t DATA_BUF[ETX_FRAME_PACKET_MAX_SIZE];
-uint8_t RSP_BUF[ETX_RSPF_PACKET_SIZE];
-uint8_t APP_BIN[ETX_DL_MAX_FW_SIZE];
-
-uint32_t app_bin_size = 0;
-uint32_t app_crc = 0;
-
-uint32_t total_data_fragments = 0;
-uint32_t sent_data_fragments = 0;
-
 /* ***** Utility Functions - Start ***** */
 
-uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength)
-{
-    uint32_t crc = 0xFFFFFFFF;
-    for(unsigned int i = 0; i < DataLength; i++)
-    {
-        crc ^= pData[i];
-        for(int j = 0; j < 8; j++)
-        {
-            if(crc & 1)
-                crc = (crc >> 1) ^ 0xEDB88320;
-            else
-                crc = crc >> 1;
-        }
-    }
-    return ~crc;
-}
-
 void delay(uint32_t us)
 {
 #if defined(__linux__)
@@ -64,443 +39,453 @@ void delay(uint32_t us)
 #endif
 }
 
-bool load_application_bin(char *file_path) {
-  FILE *fp = fopen(file_path, "rb");
-  if (fp == NULL) {
-    printf("Failed to open application binary file\r\n");
-    return false;
-  }
-
-  size_t bytesRead = fread(APP_BIN, 1, ETX_DL_MAX_FW_SIZE, fp);
-  fclose(fp);
-
-  if (bytesRead == 0) {
-    printf("Failed to read application binary file\r\n");
-    return false;
-  }
-
-  app_bin_size = bytesRead;
-  app_crc = CalcCRC(APP_BIN, app_bin_size);
-
-  printf("Loaded application binary, size: %u bytes, CRC: 0x%08X\r\n", app_bin_size, app_crc);
-  
-  return true;
-}
-
 /* ***** Utility Functions - End ***** */
 
-/* ***** Test Functions - Start ***** */
+/* ***** Callback Functions - Start ***** */
 
-void test_frame_transmission(int comport_number)
+static void cli_on_progress(ETX_SESSION_ *session, uint32_t bytes_done, uint32_t bytes_total, void *user)
 {
-  printf("=== TEST SEQUENCE START ===\r\n");
-  
-  // First, test the CRC calculation
-  uint8_t test_data[] = {0xAA, 0x01, 0x00, 0x01, 0x01}; // SOF + Type + Len + Payload
-  uint32_t calculated_crc = CalcCRC(test_data, 5);
-  printf("CRC for test data: 0x%08X\r\n", calculated_crc);
-  
-  // Send raw test bytes to see what bootloader receives
-  uint8_t test_frame[] = {
-    0xAA,  // SOF
-    0x01,  // packet_type (CMD)
-    0x00,  // payload_len high byte
-    0x01,  // payload_len low byte  
-    0x01,  // payload[0] (START command)
-    (calculated_crc >> 0) & 0xFF,   // CRC byte 0 (LSB)
-    (calculated_crc >> 8) & 0xFF,   // CRC byte 1
-    (calculated_crc >> 16) & 0xFF,  // CRC byte 2
-    (calculated_crc >> 24) & 0xFF,  // CRC byte 3 (MSB)
-    0xBB   // EOF
-  };
-  
-  printf("Sending test frame (10 bytes):\r\n");
-  for(int i = 0; i < 10; i++) {
-    printf("  Byte[%d]: 0x%02X\r\n", i, test_frame[i]);
-    
-    if( RS232_SendByte(comport_number, test_frame[i]) ) {
-      printf("Failed to send test byte %d\r\n", i);
-      return;
-    }
-    delay(10000); // 10ms delay between bytes
-  }
-  
-  printf("=== TEST SEQUENCE COMPLETE ===\r\n");
-  printf("Check bootloader output now...\r\n");
+  (void)session; (void)user;
+  printf("Sent %u/%u bytes\r\n", bytes_done, bytes_total);
 }
 
-/* ***** Test Functions - End ***** */
-
-/* ***** IO Functions - Start ***** */
-
-ETX_DL_FRAME_EX_ etx_tx_data(int comport_number, ETX_DL_FRAME_ *buffer)
+static void cli_on_complete(ETX_SESSION_ *session, ETX_DL_EX_ result, void *user)
 {
-  if (buffer == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
+  (void)user;
+  if (result == ETX_DL_EX_OK) {
+    printf("ETX DL Success...\r\n");
+  } else {
+    printf("ETX DL failed in state %d...\r\n", etx_session_state(session));
   }
+}
 
-  // calculate crc for (SOF + packet_type + payload_len + payload)
-  buffer->crc = CalcCRC( (uint8_t *)&buffer->sof, (buffer->payload_len + 4)); 
-
-  printf("Sending packet type: %d, length: %d\r\n", buffer->packet_type, buffer->payload_len);
-
-  // send (SOF + packet_type + payload_len + payload)
-  for(int i = 0; i < (buffer->payload_len + 4); i++) {
-    if( RS232_SendByte(comport_number, ((uint8_t *)&buffer->sof)[i]) ) {
-      //some data missed.
-      printf("Send Err: %d\n", buffer->packet_type);
-      return ETX_DL_FRAME_EX_ERR;
-    }
-    delay(1500);
-  }
+static void cli_on_read_progress(ETX_SESSION_ *session, uint32_t bytes_done, uint32_t bytes_total, void *user)
+{
+  (void)session; (void)user;
+  printf("Read %u/%u bytes\r\n", bytes_done, bytes_total);
+}
 
-  // send (CRC + EOF)
-  for(int i = 0; i < 5; i++) {
-    if( RS232_SendByte(comport_number, ((uint8_t *)&buffer->crc)[i]) ) {
-      //some data missed.
-      printf("Send Err: %d\n", buffer->packet_type);
-      return ETX_DL_FRAME_EX_ERR;
-    }
-    delay(1500);
-  }
+/* ***** Callback Functions - End ***** */
 
-  return ETX_DL_FRAME_EX_OK;
-}
+/* ***** Command Functions - Start ***** */
 
-ETX_DL_FRAME_EX_ etx_tx_response(int comport_number, ETX_DL_RSPF_ *response)
+/* Drive a session until it is done, sleeping until its next deadline (at most 1 ms) */
+static ETX_DL_EX_ cli_run_session(ETX_SESSION_ *session)
 {
-  if (response == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
-  }
+  // the serial port has no readiness events here, so just poll
+  while( !etx_session_done(session) )
+  {
+    etx_session_io(session, ETX_IO_READ | ETX_IO_WRITE, etx_time_us());
 
-  // send (SOF + packet_type + payload + EOF)
-  for(uint32_t i = 0; i < sizeof(ETX_DL_RSPF_); i++) {
-    delay(1);
-    if( RS232_SendByte(comport_number, ((uint8_t *)response)[i]) ) {
-      //some data missed.
-      printf("Send Err: %d\n", response->packet_type);
-      return ETX_DL_FRAME_EX_ERR;
+    uint64_t wait = etx_session_timeout_us(session, etx_time_us());
+    if( !etx_session_done(session) && wait != 0 )
+    {
+      delay((wait > 1000) ? 1000 : (uint32_t)wait);
     }
   }
 
-  return ETX_DL_FRAME_EX_OK;
+  return etx_session_result(session);
 }
 
-ETX_DL_FRAME_EX_ etx_rx_data(int comport_number, ETX_DL_FRAME_ *buffer)
+/**
+ * @brief  --break-in: send the break-in magic until the bootloader, listening
+ *         for a few ms after reset, ACKs it and stays in Download mode
+ * @retval true if the ACK arrived
+ */
+static bool cli_break_in(int comport_number)
 {
-  if (buffer == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
-  }
+  static const uint8_t ack[] = { ETX_FRAME_SOF, ETX_DL_FRAME_TYPE_RESPONSE, ETX_DL_RSP_ACK, ETX_FRAME_EOF };
+  uint8_t rx[64];
+  uint32_t matched = 0;
+  uint64_t start = etx_time_us();
 
-  uint16_t index = 0;
-  int status;
+  printf("Reset the board to break in...\r\n");
 
-  // Receive SOF
-  while( (status = RS232_PollComport(comport_number, &((uint8_t *)buffer)[index], 1)) == 0 );
-  if (status < 0) {
-    return ETX_DL_FRAME_EX_ERR;
-  } else if ( ((uint8_t *)buffer)[index] != ETX_FRAME_SOF) {
-    return ETX_DL_FRAME_EX_ERR; // Invalid SOF
-  }
+  while( etx_time_us() - start < (ETX_BREAKIN_TIMEOUT_MS * 1000ULL) )
+  {
+    RS232_SendBuf(comport_number, (unsigned char *)ETX_BREAKIN_MAGIC, (int)strlen(ETX_BREAKIN_MAGIC));
+    delay(ETX_BREAKIN_PERIOD_MS * 1000);
 
-  // check for payload type and length
-  index++;
-  while( (status = RS232_PollComport(comport_number, &((uint8_t *)buffer)[index], 3)) == 0 );
-  if (status < 0) {
-    return ETX_DL_FRAME_EX_ERR;
+    // the log of an earlier boot may be ahead of the ACK
+    int n = RS232_PollComport(comport_number, rx, sizeof(rx));
+    for( int i = 0; i < n; i++ )
+    {
+      if( rx[i] == ack[matched] )
+      {
+        matched++;
+      }
+      else
+      {
+        matched = (rx[i] == ack[0]) ? 1 : 0;
+      }
+      if( matched == sizeof(ack) )
+      {
+        printf("Bootloader in Download mode\r\n");
+        delay(ETX_BREAKIN_PERIOD_MS * 1000);
+        RS232_flushRXTX(comport_number);
+        return true;
+      }
+    }
   }
 
-  // check for valid payload length
-  uint16_t payload_len = (((uint8_t *)buffer)[2] << 8) | ((uint8_t *)buffer)[3];
-  if (payload_len > ETX_FRAME_DATA_MAX_SIZE) {
-    return ETX_DL_FRAME_EX_ERR; // Invalid length
-  }
+  return false;
+}
 
-  // receive payload
-  index += 3;
-  while( (status = RS232_PollComport(comport_number, &((uint8_t *)buffer)[index], payload_len)) == 0 );
-  if (status < 0) {
-    return ETX_DL_FRAME_EX_ERR;
+/**
+ * @brief  --patch: read the image the board holds now
+ * @param  file_path: binary last flashed to the board
+ * @param  size: set to its length
+ * @retval the bytes (free them), NULL on error
+ */
+static uint8_t *cli_load_base(const char *file_path, uint32_t *size)
+{
+  FILE *fp = fopen(file_path, "rb");
+  if( fp == NULL )
+  {
+    printf("Failed to open base binary file %s\r\n", file_path);
+    return NULL;
   }
 
-  // receive CRC + EOF
-  index += ETX_FRAME_DATA_MAX_SIZE;
-  while( (status = RS232_PollComport(comport_number, &((uint8_t *)buffer)[index], 5)) == 0 );
-  if (status < 0) {
-    return ETX_DL_FRAME_EX_ERR;
-  }
+  uint8_t *bin = malloc(ETX_DL_MAX_FW_SIZE);
+  size_t bytesRead = (bin != NULL) ? fread(bin, 1, ETX_DL_MAX_FW_SIZE, fp) : 0;
+  fclose(fp);
 
-  // verify EOF
-  if ( ((uint8_t *)buffer)[index + 4] != ETX_FRAME_EOF) {
-    return ETX_DL_FRAME_EX_ERR; // Invalid EOF
+  if( bytesRead == 0 )
+  {
+    printf("Failed to read base binary file %s\r\n", file_path);
+    free(bin);
+    return NULL;
   }
 
-  return ETX_DL_FRAME_EX_OK;
+  *size = (uint32_t)bytesRead;
+  return bin;
 }
 
-ETX_DL_FRAME_EX_ etx_rx_response(int comport_number, ETX_DL_RSPF_ *buffer)
+/**
+ * @brief  dump <port> <address> <length> <file>: read a flash range back
+ *         through the bootloader and write it to a file
+ * @retval 0 on success, -1 on error
+ */
+static int cli_dump(int argc, char *argv[], int bdrate, char *mode)
 {
-  if (buffer == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
+  ETX_SESSION_CFG_ cfg = {0};
+  ETX_SESSION_ *session = NULL;
+  uint8_t *buf = NULL;
+  int exit_code = -1;
+
+  if( argc < 6 )
+  {
+    printf("Usage: dump <port> <address> <length> <file>\n");
+    printf("Example: dump ttyUSB0 0x080C0000 0x20000 calib.bin\n");
+    return -1;
   }
 
-  int status;
-
-  printf("Starting to poll for response...\r\n");
-
-  // Receive (SOF + packet_type + payload + EOF)
-  while( (status = RS232_PollComport(comport_number, (uint8_t *)buffer, ETX_RSPF_PACKET_SIZE)) == 0 );
-  if (status < 0) {
-    return ETX_DL_FRAME_EX_ERR;
+  char *end_addr, *end_len;
+  unsigned long address = strtoul(argv[3], &end_addr, 0);
+  unsigned long length = strtoul(argv[4], &end_len, 0);
+  if( *end_addr != '\0' || *end_len != '\0' || length == 0 || length > 0xFFFFFFFFUL || address > 0xFFFFFFFFUL )
+  {
+    printf("Invalid address/length: %s %s\n", argv[3], argv[4]);
+    return -1;
   }
 
-  // verify SOF and EOF
-  if (buffer->sof != ETX_FRAME_SOF 
-    || buffer->eof != ETX_FRAME_EOF 
-    || buffer->packet_type != ETX_DL_FRAME_TYPE_RESPONSE
-    || (buffer->payload != ETX_DL_RSP_ACK && buffer->payload != ETX_DL_RSP_NACK)
-  ) {
-    return ETX_DL_FRAME_EX_ERR; // Invalid Response frame
+  int comport_number = RS232_GetPortnr(argv[2]);
+  if( comport_number < 0 )
+  {
+    printf("Can not find comport\n");
+    return -1;
   }
 
-  return ETX_DL_FRAME_EX_OK;
-}
-
-/* ***** IO Functions - End ***** */
-
-/* ***** COM Functions - Start ***** */
-
-ETX_DL_FRAME_EX_ etx_send_data(int comport_number, ETX_DL_FRAME_ *data_frame, bool skip_ack_check)
-{
-  if (data_frame == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
+  buf = malloc(length);
+  if( buf == NULL )
+  {
+    printf("Out of memory for %lu bytes\n", length);
+    return -1;
   }
 
-  ETX_DL_FRAME_EX_ status;
-
-  status = etx_tx_data(comport_number, data_frame);
-  if (status != ETX_DL_FRAME_EX_OK) {
-    printf("Failed to send data frame\r\n");
-    return status;
+  ETX_LINK_PROFILE_ profile;
+  bool have_profile = etx_link_profile_for_port(argv[2], &profile);
+  if( have_profile )
+  {
+    bdrate = profile.bdrate;
   }
 
-  // Wait for ACK/NACK (retransmit if NACK max 3 times)
-  ETX_DL_RSPF_ response;
-  int nack_received_count = 0;
-  const int max_nack_retries = 3;
-
-  if (skip_ack_check) {
-    printf("Ack check not required...\r\n");
-    return ETX_DL_FRAME_EX_OK;
+  if( RS232_OpenComport(comport_number, bdrate, mode, 0) )
+  {
+    printf("Can not open comport\n");
+    free(buf);
+    return -1;
   }
 
-  printf("Waiting for ACK/NACK...\r\n");
-
   do {
-    status = etx_rx_response(comport_number, &response);
-    if (status != ETX_DL_FRAME_EX_OK) {
-      printf("Failed to receive response from STM32\r\n");
-      return status;
+    etx_rs232_transport(&cfg.transport, comport_number);
+    cfg.on_progress = cli_on_read_progress;
+    cfg.tx_gap_us = ETX_TX_BYTE_GAP_US;
+    if( have_profile )
+    {
+      etx_link_profile_apply(&profile, &cfg);
     }
 
-    if (response.payload == ETX_DL_RSP_ACK) {
-      return ETX_DL_FRAME_EX_OK; // Acknowledged
-    } else if (response.payload == ETX_DL_RSP_NACK) {
-      nack_received_count++;
-      printf("Host NACK received, retrying... (%d/%d)\r\n", nack_received_count, max_nack_retries);
-      status = etx_tx_data(comport_number, data_frame); // Resend data frame
-      if (status != ETX_DL_FRAME_EX_OK) {
-        printf("Failed to resend data frame\r\n");
-        return status;
-      }
-    }
-  } while (nack_received_count < max_nack_retries);
+    printf("Reading %lu bytes from 0x%08lX...\r\n", length, address);
 
-  return ETX_DL_FRAME_EX_OK;
-}
+    session = etx_read_start(&cfg, (uint32_t)address, (uint32_t)length, buf, etx_time_us());
+    if( session == NULL || cli_run_session(session) != ETX_DL_EX_OK )
+    {
+      printf("Read-back failed...\r\n");
+      break;
+    }
 
-ETX_DL_FRAME_EX_ etx_send_response(int comport_number, ETX_DL_RSP_ rsp)
-{
-  //clear the buffer
-  memset( RSP_BUF, 0, ETX_RSPF_PACKET_SIZE );
+    FILE *fp = fopen(argv[5], "wb");
+    if( fp == NULL || fwrite(buf, 1, length, fp) != length )
+    {
+      printf("Failed to write %s\r\n", argv[5]);
+      if( fp ) fclose(fp);
+      break;
+    }
+    fclose(fp);
 
-  ETX_DL_RSPF_ *response_frame = (ETX_DL_RSPF_ *)RSP_BUF;
+    printf("Wrote %lu bytes to %s, CRC: 0x%08X\r\n", length, argv[5], CalcCRC(buf, (uint32_t)length));
+    exit_code = 0;
+  } while (0);
 
-  response_frame->sof = ETX_FRAME_SOF;
-  response_frame->eof = ETX_FRAME_EOF;
-  response_frame->packet_type = ETX_DL_FRAME_TYPE_RESPONSE;
-  response_frame->payload = rsp;
+  etx_session_free(session);
+  RS232_CloseComport(comport_number);
+  free(buf);
 
-  return etx_tx_response(comport_number, response_frame);
+  return exit_code;
 }
 
-ETX_DL_FRAME_EX_ etx_receive_data(int comport_number, ETX_DL_FRAME_ *data_frame)
+/**
+ * @brief  setnode <port> <address>: store the bootloader's RS-485 bus address,
+ *         0 takes it off the bus again (point to point)
+ * @retval 0 on success, -1 on error
+ */
+static int cli_setnode(int argc, char *argv[], int bdrate, char *mode)
 {
-  if (data_frame == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
+  ETX_SESSION_CFG_ cfg = {0};
+  ETX_SESSION_ *session = NULL;
+  int exit_code = -1;
+
+  if( argc < 4 )
+  {
+    printf("Usage: setnode <port> <address 0..%u>\n", ETX_NODE_MAX);
+    return -1;
   }
 
-  memset( data_frame, 0, ETX_FRAME_PACKET_MAX_SIZE );
-
-  ETX_DL_FRAME_EX_ status;
-
-  status = etx_rx_data(comport_number, data_frame);
-  if (status != ETX_DL_FRAME_EX_OK) {
-    return status;
+  char *end;
+  unsigned long address = strtoul(argv[3], &end, 0);
+  if( *end != '\0' || address > ETX_NODE_MAX )
+  {
+    printf("Invalid bus address: %s\n", argv[3]);
+    return -1;
   }
 
-  // verify CRC
-  uint32_t calculated_crc = CalcCRC( (uint8_t *)&data_frame->sof, (data_frame->payload_len + 4));
-  if (calculated_crc != data_frame->crc) {
-    printf("CRC mismatch: Calculated=0x%08X, Received=0x%08X\r\n", calculated_crc, data_frame->crc);
-    return ETX_DL_FRAME_EX_ERR; // CRC mismatch
+  int comport_number = RS232_GetPortnr(argv[2]);
+  if( comport_number < 0 || RS232_OpenComport(comport_number, bdrate, mode, 0) )
+  {
+    printf("Can not open comport\n");
+    return -1;
   }
 
-  return ETX_DL_FRAME_EX_OK;
-}
+  etx_rs232_transport(&cfg.transport, comport_number);
+  cfg.tx_gap_us = ETX_TX_BYTE_GAP_US;
 
-ETX_DL_FRAME_EX_ etx_receive_response(int comport_number, ETX_DL_RSPF_ *rsp_frame)
-{
-  if (rsp_frame == NULL) {
-    return ETX_DL_FRAME_EX_ERR;
+  session = etx_node_start(&cfg, (uint8_t)address, etx_time_us());
+  if( session != NULL && cli_run_session(session) == ETX_DL_EX_OK )
+  {
+    printf("Bus address %lu stored, used from the next download on\r\n", address);
+    exit_code = 0;
   }
 
-  ETX_DL_FRAME_EX_ status;
-
-  status = etx_rx_response(comport_number, rsp_frame);
-  if (status != ETX_DL_FRAME_EX_OK) {
-    printf("Failed to receive response from STM32\r\n");
-    return status;
-  }
+  etx_session_free(session);
+  RS232_CloseComport(comport_number);
 
-  return ETX_DL_FRAME_EX_OK;
+  return exit_code;
 }
 
-/* ***** COM Functions - End ***** */
-
-/* ***** Payload Functions - Start ***** */
-
-ETX_DL_EX_ etx_send_start_cmd(int comport_number)
+/**
+ * @brief  broadcast <port> <image> <node>[,<node>...]: flash every listed
+ *         bootloader on a shared RS-485 bus with one transfer of the image
+ * @retval 0 if every node got the image, -1 otherwise
+ */
+static int cli_broadcast(int argc, char *argv[], int bdrate, char *mode)
 {
-  //clear the buffer
-  memset( DATA_BUF, 0, ETX_FRAME_PACKET_MAX_SIZE );
-
-  ETX_DL_FRAME_ *cmd_frame = (ETX_DL_FRAME_ *)DATA_BUF;
-
-  cmd_frame->sof = ETX_FRAME_SOF;
-  cmd_frame->eof = ETX_FRAME_EOF;
-  cmd_frame->packet_type = ETX_DL_FRAME_TYPE_CMD;
-  cmd_frame->payload[0] = ETX_DL_CMD_START;
-  cmd_frame->payload_len = 1;
-
-  if (etx_send_data(comport_number, cmd_frame, false) != ETX_DL_FRAME_EX_OK) {
-    printf("Failed to send START command\r\n");
-    return ETX_DL_EX_ERR;
+  ETX_SESSION_CFG_ cfg = {0};
+  ETX_SESSION_ *session = NULL;
+  ETX_IMAGE_ image = {0};
+  uint8_t nodes[ETX_BCAST_MAX_NODES];
+  uint32_t node_count = 0;
+  int exit_code = -1;
+
+  if( argc < 5 )
+  {
+    printf("Usage: broadcast <port> <image> <node>[,<node>...]\n");
+    printf("Example: broadcast ttyUSB0 Blinky.bin 1,2,3,4\n");
+    return -1;
   }
 
-  return ETX_DL_EX_OK;
-}
-
-ETX_DL_EX_ etx_send_fw_info(int comport_number)
-{
-  //clear the buffer
-  memset( DATA_BUF, 0, ETX_FRAME_PACKET_MAX_SIZE );
-
-  ETX_DL_FRAME_ *cmd_frame = (ETX_DL_FRAME_ *)DATA_BUF;
-
-  cmd_frame->sof = ETX_FRAME_SOF;
-  cmd_frame->eof = ETX_FRAME_EOF;
-  cmd_frame->packet_type = ETX_DL_FRAME_TYPE_HEADER;
-  cmd_frame->payload[0] = (app_bin_size >> 24) & 0xFF;
-  cmd_frame->payload[1] = (app_bin_size >> 16) & 0xFF;
-  cmd_frame->payload[2] = (app_bin_size >> 8) & 0xFF;
-  cmd_frame->payload[3] = (app_bin_size >> 0) & 0xFF;
-  cmd_frame->payload[4] = (app_crc >> 24) & 0xFF;
-  cmd_frame->payload[5] = (app_crc >> 16) & 0xFF;
-  cmd_frame->payload[6] = (app_crc >> 8) & 0xFF;
-  cmd_frame->payload[7] = (app_crc >> 0) & 0xFF;
-  cmd_frame->payload_len = 8;
-
-  if (etx_send_data(comport_number, cmd_frame, false) != ETX_DL_FRAME_EX_OK) {
-    printf("Failed to send FW_INFO command\r\n");
-    return ETX_DL_EX_ERR;
+  for( char *tok = strtok(argv[4], ","); tok != NULL; tok = strtok(NULL, ",") )
+  {
+    char *end;
+    unsigned long address = strtoul(tok, &end, 0);
+    if( *end != '\0' || address == ETX_NODE_NONE || address > ETX_NODE_MAX || node_count == ETX_BCAST_MAX_NODES )
+    {
+      printf("Invalid node list (1..%u, at most %u nodes)\n", ETX_NODE_MAX, ETX_BCAST_MAX_NODES);
+      return -1;
+    }
+    nodes[node_count++] = (uint8_t)address;
   }
 
-  return ETX_DL_EX_OK;
-}
-
-ETX_DL_EX_ etx_send_fw_data(int comport_number)
-{
-  total_data_fragments = (app_bin_size / ETX_FRAME_DATA_MAX_SIZE) + (app_bin_size % ETX_FRAME_DATA_MAX_SIZE != 0);
-  sent_data_fragments = 0;
-
-  uint32_t bytes_sent = 0;
-  uint16_t chunk_size = 0;
-  ETX_DL_FRAME_EX_ status;
-
-  while (sent_data_fragments < total_data_fragments) {
-    //clear the buffer
-    memset( DATA_BUF, 0, ETX_FRAME_PACKET_MAX_SIZE );
-
-    ETX_DL_FRAME_ *data_frame = (ETX_DL_FRAME_ *)DATA_BUF;
+  if( !etx_image_load_file(&image, argv[3], ETX_IMAGE_FLAG_OFFSET_ADDR) )
+  {
+    return -1;
+  }
+  printf("Loaded application binary, size: %u bytes, CRC: 0x%08X\r\n", image.size, image.crc);
+
+  int comport_number = RS232_GetPortnr(argv[2]);
+  if( comport_number < 0 || RS232_OpenComport(comport_number, bdrate, mode, 0) )
+  {
+    printf("Can not open comport\n");
+    etx_image_free(&image);
+    return -1;
+  }
 
-    chunk_size = (app_bin_size - bytes_sent) > ETX_FRAME_DATA_MAX_SIZE ? ETX_FRAME_DATA_MAX_SIZE : (app_bin_size - bytes_sent);
+  etx_rs232_transport(&cfg.transport, comport_number);
+  cfg.on_progress = cli_on_progress;
+  cfg.on_complete = cli_on_complete;
+  cfg.nodes = nodes;
+  cfg.node_count = node_count;
 
-    data_frame->sof = ETX_FRAME_SOF;
-    data_frame->eof = ETX_FRAME_EOF;
-    data_frame->packet_type = ETX_DL_FRAME_TYPE_DATA;
-    memcpy(data_frame->payload, &APP_BIN[bytes_sent], chunk_size);
-    data_frame->payload_len = chunk_size;
+  printf("Broadcasting to %u node(s)...\r\n", node_count);
 
-    status = etx_send_data(comport_number, data_frame, false);
-    if (status != ETX_DL_FRAME_EX_OK) {
-      printf("Failed to send firmware data chunk\r\n");
-      return ETX_DL_EX_ERR;
+  session = etx_session_start(&cfg, &image, etx_time_us());
+  if( session != NULL )
+  {
+    exit_code = (cli_run_session(session) == ETX_DL_EX_OK) ? 0 : -1;
+    for( uint32_t i = 0; i < node_count; i++ )
+    {
+      printf("Node %u: %s\r\n", nodes[i], (etx_session_node_result(session, i) == ETX_NODE_RESULT_OK) ? "OK" : "FAILED");
     }
-
-    bytes_sent += chunk_size;
-    sent_data_fragments++;
-    printf("Sent %u/%u bytes\r\n", bytes_sent, app_bin_size);
   }
 
-  return ETX_DL_EX_OK;
+  etx_session_free(session);
+  RS232_CloseComport(comport_number);
+  etx_image_free(&image);
+
+  return exit_code;
 }
 
-ETX_DL_EX_ etx_send_end_cmd(int comport_number)
+#if defined(__linux__)
+/**
+ * @brief  tune <port> [--baud <rate>[,<rate>...]] [--ab]: find the fastest
+ *         reliable link settings for the adapter on port and store them
+ * @retval 0 if a profile was stored, -1 otherwise
+ */
+static int cli_tune(int argc, char *argv[], int bdrate)
 {
-  //clear the buffer
-  memset( DATA_BUF, 0, ETX_FRAME_PACKET_MAX_SIZE );
-
-  ETX_DL_FRAME_ *cmd_frame = (ETX_DL_FRAME_ *)DATA_BUF;
-
-  cmd_frame->sof = ETX_FRAME_SOF;
-  cmd_frame->eof = ETX_FRAME_EOF;
-  cmd_frame->packet_type = ETX_DL_FRAME_TYPE_CMD;
-  cmd_frame->payload[0] = ETX_DL_CMD_END;
-  cmd_frame->payload_len = 1;
+  int bdrates[8];
+  uint32_t bdrate_count = 0;
+  uint32_t read_addr = ETX_APP_LOAD_ADDRESS;
+
+  if( argc < 3 )
+  {
+    printf("Usage: tune <port> [--baud <rate>[,<rate>...]] [--ab]\n");
+    return -1;
+  }
 
-  if (etx_send_data(comport_number, cmd_frame, true) != ETX_DL_FRAME_EX_OK) {
-    printf("Failed to send END command\r\n");
-    return ETX_DL_EX_ERR;
+  for( int i = 3; i < argc; i++ )
+  {
+    if( strcmp(argv[i], "--baud") == 0 && i + 1 < argc )
+    {
+      for( char *tok = strtok(argv[++i], ","); tok != NULL; tok = strtok(NULL, ",") )
+      {
+        char *end;
+        long rate = strtol(tok, &end, 10);
+        if( *end != '\0' || rate <= 0 || bdrate_count == sizeof(bdrates) / sizeof(bdrates[0]) )
+        {
+          printf("Invalid baud list (at most %u rates)\n", (unsigned)(sizeof(bdrates) / sizeof(bdrates[0])));
+          return -1;
+        }
+        bdrates[bdrate_count++] = (int)rate;
+      }
+    }
+    else if( strcmp(argv[i], "--ab") == 0 )
+    {
+      // A/B slot bootloader: the application area it reads back starts lower
+      read_addr = ETX_APP_LOAD_ADDRESS_AB;
+    }
+    else
+    {
+      printf("Unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  if( bdrate_count == 0 )
+  {
+    bdrates[bdrate_count++] = bdrate;   // the bootloader's USART2 rate is fixed at build time
   }
 
-  return ETX_DL_EX_OK;
+  return etx_flash_tune(argv[2], bdrates, bdrate_count, read_addr);
 }
+#endif
 
-/* ***** Payload Functions - End ***** */
+/* ***** Command Functions - End ***** */
 
 /* ***** Main Function ***** */
 int main(int argc, char *argv[])
 {
   char *comport = NULL;
+  char *lane2_port = NULL;
+  char *base_path = NULL;
+  uint8_t *base = NULL;
   static int comport_number = -1;
-  char bin_name[1024];
+  int lane2_number = -1;
 
   int bdrate  = 921600;       /* Increased baud rate for faster transfer */
   char mode[] = {'8','N','1',0}; /* *-bits, No parity, 1 stop bit */
   
   int exit_code = 0;
-  ETX_DL_STATE_ dl_state;
+  bool stream = false;
+  bool staged = false;
+  bool break_in = false;
+  uint32_t image_flags = 0;
+  ETX_IMAGE_ image = {0};
+  ETX_SESSION_CFG_ cfg = {0};
+  ETX_SESSION_ *session = NULL;
+  ETX_LINK_PROFILE_ profile;
+  bool have_profile = false;
+
+  if( argc >= 2 && strcmp(argv[1], "dump") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return cli_dump(argc, argv, bdrate, mode);
+  }
+
+  if( argc >= 2 && strcmp(argv[1], "setnode") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return cli_setnode(argc, argv, bdrate, mode);
+  }
+
+  if( argc >= 2 && strcmp(argv[1], "broadcast") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return cli_broadcast(argc, argv, bdrate, mode);
+  }
+
+#if defined(__linux__)
+  if( argc >= 2 && strcmp(argv[1], "daemon") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return etx_flash_daemon((argc > 2) ? argv[2] : ETX_DAEMON_SOCKET_PATH, bdrate);
+  }
+
+  if( argc >= 3 && strcmp(argv[1], "watch") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return etx_flash_watch(argv[2], (argc > 3) ? argv[3] : ETX_WATCH_DIR, bdrate);
+  }
+
+  if( argc >= 2 && strcmp(argv[1], "tune") == 0 ) {
+    printf("%s\r\n", HF_VER_STRING);
+    return cli_tune(argc, argv, bdrate);
+  }
+#endif
 
   do {
     if( argc <= 2 ) {
@@ -509,7 +494,13 @@ int main(int argc, char *argv[])
       printf("Example: .\\etx_ota_app.exe COM3 ..\\..\\Application\\Debug\\Blinky.bin");
       #else
       printf("Please feed the TTY PORT number and the Application Image....!!!\n");
-      printf("Example: ./etx_ota_app /dev/ttyUSB0 ../../Application/Debug/Blinky.bin");
+      printf("Example: ./etx_ota_app /dev/ttyUSB0 ../../Application/Debug/Blinky.bin [--stream] [--staged] [--subblock] [--lane2 ttyUSB1] [--patch base.bin] [--break-in]\n");
+      printf("         ./etx_ota_app dump ttyUSB0 <address> <length> <file>\n");
+      printf("         ./etx_ota_app setnode ttyUSB0 <address>\n");
+      printf("         ./etx_ota_app broadcast ttyUSB0 ../../Application/Debug/Blinky.bin <node>[,<node>...]\n");
+      printf("         ./etx_ota_app daemon [%s]\n", ETX_DAEMON_SOCKET_PATH);
+      printf("         ./etx_ota_app watch ../../Application/Debug/Blinky.bin [%s]\n", ETX_WATCH_DIR);
+      printf("         ./etx_ota_app tune ttyUSB0 [--baud <rate>[,<rate>...]] [--ab]");
       #endif
       exit_code = -1;
       break;
@@ -519,7 +510,86 @@ int main(int argc, char *argv[])
 
     //get the COM port
     comport = argv[1];
-    strcpy(bin_name, argv[2]);
+
+    for( int i = 3; i < argc; i++ )
+    {
+      if( strcmp(argv[i], "--stream") == 0 )
+      {
+        // frames back to back, paced by RTS/CTS instead of per-frame ACKs
+        stream = true;
+      }
+      else if( strcmp(argv[i], "--staged") == 0 )
+      {
+        // streamed into the bootloader's RAM, flashed once each chunk checks out
+        staged = true;
+      }
+      else if( strcmp(argv[i], "--subblock") == 0 )
+      {
+        // per sub-block CRCs, only damaged sub-blocks are resent
+        image_flags |= ETX_IMAGE_FLAG_SUBBLOCK_CRC;
+      }
+      else if( strcmp(argv[i], "--lane2") == 0 && i + 1 < argc )
+      {
+        // stripe data frames over a second port (bootloader USART3)
+        lane2_port = argv[++i];
+        image_flags |= ETX_IMAGE_FLAG_OFFSET_ADDR;
+      }
+      else if( strcmp(argv[i], "--patch") == 0 && i + 1 < argc )
+      {
+        // random access: only the sectors that differ from the image on the board
+        base_path = argv[++i];
+        image_flags |= ETX_IMAGE_FLAG_OFFSET_ADDR;
+      }
+      else if( strcmp(argv[i], "--break-in") == 0 )
+      {
+        // catch the bootloader at reset instead of needing the button
+        break_in = true;
+      }
+      else
+      {
+        printf("Unknown option %s\n", argv[i]);
+        exit_code = -1;
+      }
+    }
+    if( lane2_port != NULL && (stream || (image_flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC)) )
+    {
+      printf("--lane2 can not be combined with --stream or --subblock\n");
+      exit_code = -1;
+    }
+    if( staged && (lane2_port != NULL || base_path != NULL || (image_flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC)) )
+    {
+      printf("--staged can not be combined with --subblock, --lane2 or --patch\n");
+      exit_code = -1;
+    }
+    if( base_path != NULL && (stream || lane2_port != NULL || (image_flags & ETX_IMAGE_FLAG_SUBBLOCK_CRC)) )
+    {
+      printf("--patch can not be combined with --stream, --subblock or --lane2\n");
+      exit_code = -1;
+    }
+    if( exit_code != 0 )
+    {
+      break;
+    }
+
+    if( !etx_image_load_file(&image, argv[2], image_flags) )
+    {
+      exit_code = -1;
+      break;
+    }
+    printf("Loaded application binary, size: %u bytes, CRC: 0x%08X\r\n", image.size, image.crc);
+
+    if( base_path != NULL )
+    {
+      base = cli_load_base(base_path, &cfg.base_size);
+      if( base == NULL )
+      {
+        exit_code = -1;
+        break;
+      }
+      cfg.random = true;
+      cfg.base = base;
+      printf("Patching over %s, size: %u bytes\r\n", base_path, cfg.base_size);
+    }
 
     printf("Opening %s...\n", comport);
 
@@ -531,75 +601,72 @@ int main(int argc, char *argv[])
       break;
     }
 
-    if( RS232_OpenComport(comport_number, bdrate, mode, 0) )
+    // settings stored by tune for this adapter
+    have_profile = etx_link_profile_for_port(comport, &profile);
+    if( have_profile )
+    {
+      bdrate = profile.bdrate;
+    }
+
+    if( RS232_OpenComport(comport_number, bdrate, mode, (stream || staged) ? 1 : 0) )
     {
       printf("Can not open comport\n");
       exit_code = -1;
       break;
     }
 
-    dl_state = ETX_DL_STATE_IDLE;
-
-    printf("Sending DL Start cmd...\r\n");
+    if( lane2_port != NULL )
+    {
+      printf("Opening %s...\n", lane2_port);
 
-    do {
-      switch (dl_state)
+      lane2_number = RS232_GetPortnr(lane2_port);
+      if( lane2_number < 0 || RS232_OpenComport(lane2_number, bdrate, mode, 0) )
       {
-      case ETX_DL_STATE_IDLE:
-        if(etx_send_start_cmd(comport_number) != ETX_DL_EX_OK){
-          printf("STM32 did not respond to start cmd...\r\n");
-        } else {
-          printf("STM32 Acknowledged the start cmd. Sending Header now...\r\n");
-          load_application_bin(bin_name);
-          dl_state = ETX_DL_STATE_HEADER;
-        }
-        break;
-      
-      case ETX_DL_STATE_HEADER:
-        if(etx_send_fw_info(comport_number) != ETX_DL_EX_OK){
-          printf("STM32 did not respond to header message...\r\n");
-          dl_state = ETX_DL_STATE_FAILED;
-        } else {
-          printf("STM32 Acknowledged the header message. Sending Data now...\r\n");
-          dl_state = ETX_DL_STATE_DATA;
-        }
+        printf("Can not open comport %s\n", lane2_port);
+        lane2_number = -1;
+        exit_code = -1;
         break;
+      }
+      etx_rs232_transport(&cfg.lane2, lane2_number);
+    }
 
-      case ETX_DL_STATE_DATA:
-        if(etx_send_fw_data(comport_number) != ETX_DL_EX_OK){
-          printf("STM32 did not respond to data message...\r\n");
-          dl_state = ETX_DL_STATE_FAILED;
-        } else {
-          printf("STM32 Acknowledged the data message. Sending END command now...\r\n");
-          dl_state = ETX_DL_STATE_DATA_COMPLETE;
-        }
-        break;
-      
-      case ETX_DL_STATE_DATA_COMPLETE:
-        if(etx_send_end_cmd(comport_number) != ETX_DL_EX_OK){
-          printf("STM32 did not respond to end message...\r\n");
-          dl_state = ETX_DL_STATE_FAILED;
-        } else {
-          printf("STM32 Acknowledged the end message...\r\n");
-          dl_state = ETX_DL_STATE_SUCCESS;
-        }
-        break;
+    if( break_in && !cli_break_in(comport_number) )
+    {
+      // a bootloader already in Download mode does not listen for it
+      printf("No answer to the break-in, sending DL Start anyway\r\n");
+    }
 
-      case ETX_DL_STATE_FAILED:
-        printf("ETX DL failed...");
-        return -1;
+    etx_rs232_transport(&cfg.transport, comport_number);
+    cfg.on_progress = cli_on_progress;
+    cfg.on_complete = cli_on_complete;
+    cfg.tx_gap_us = ETX_TX_BYTE_GAP_US;
+    cfg.stream = stream;
+    cfg.staged = staged;
+    if( have_profile )
+    {
+      etx_link_profile_apply(&profile, &cfg);
+    }
 
-      case ETX_DL_STATE_SUCCESS:
-        printf("ETX DL Success...\r\n");
-        return 0;
+    printf("Sending DL Start cmd%s...\r\n", staged ? " (staged in RAM)" : stream ? " (streaming)" : (lane2_port != NULL ? " (striped)" : (base != NULL ? " (random access)" : "")));
 
-      default:
-        break;
-      }
+    session = etx_session_start(&cfg, &image, etx_time_us());
+    if( session == NULL )
+    {
+      exit_code = -1;
+      break;
+    }
 
-    } while(true);
+    exit_code = (cli_run_session(session) == ETX_DL_EX_OK) ? 0 : -1;
 
   } while (0);
 
+  etx_session_free(session);
+  etx_image_free(&image);
+  free(base);
+  if( lane2_number >= 0 )
+  {
+    RS232_CloseComport(lane2_number);
+  }
+
   return exit_code;
 }
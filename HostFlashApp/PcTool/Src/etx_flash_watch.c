@@ -0,0 +1,404 @@
+/**
+  ******************************************************************************
+  * @file    etx_flash_watch.c
+  * @author  Shiddeshwaran-S
+  * @brief   Hotplug flashing: flash every board that shows up (Linux only).
+  *
+  *          Watches /dev/serial/by-id with inotify and starts a libetxflash
+  *          session as soon as a new link appears, so the bootloader's
+  *          download window is hit without anyone starting the tool.
+  *
+  *          Boards are keyed by their by-id name (adapter serial number),
+  *          which stays the same across re-enumerations:
+  *            - a link that appears again while its session runs is ignored
+  *            - a board that comes back within ETX_WATCH_HOLDOFF_MS of being
+  *              flashed (reset into the App, cable bounce) is not flashed
+  *              again
+  *          Boards already connected when the watch starts are left alone.
+  ******************************************************************************/
+
+#if defined(__linux__)
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+#include "etx_flash_update.h"
+#include "etx_rs232_transport.h"
+#include "etx_link_profile.h"
+
+#define ETX_WATCH_MAX_BOARDS      ( 32 )
+#define ETX_WATCH_HOLDOFF_MS      ( 10000 )   // ignore a flashed board coming back this soon
+#define ETX_WATCH_OPEN_RETRY_MS   ( 2000 )    // udev may still be fixing up permissions
+#define ETX_WATCH_OPEN_STEP_MS    ( 50 )
+#define ETX_WATCH_POLL_MS         ( 1000 )
+#define ETX_WATCH_JOB_POLL_MS     ( 1 )       // while sessions are running
+
+/*
+ * Board state
+ */
+typedef enum
+{
+  ETX_WATCH_BOARD_FREE      = 0,    // slot unused
+  ETX_WATCH_BOARD_OPENING   = 1,    // link seen, port not opened yet
+  ETX_WATCH_BOARD_FLASHING  = 2,    // session running
+  ETX_WATCH_BOARD_DONE      = 3,    // finished, kept for de-duplication
+}ETX_WATCH_BOARD_STATE_;
+
+/*
+ * Board seen under the watched directory
+ */
+typedef struct
+{
+  ETX_WATCH_BOARD_STATE_  state;
+  char                    id[NAME_MAX + 1];     // by-id link name
+  char                    tty[NAME_MAX + 1];    // resolved device, e.g. ttyUSB0
+  int                     comport_number;
+  ETX_SESSION_           *session;
+  bool                    present;              // link currently exists
+  bool                    success;              // result of the last session
+  uint64_t                appeared_ms;
+  uint64_t                next_open_ms;
+  uint64_t                finished_ms;
+}ETX_WATCH_BOARD_;
+
+static ETX_WATCH_BOARD_ boards[ETX_WATCH_MAX_BOARDS];
+static ETX_IMAGE_ watch_image;
+static const char *watch_dir = NULL;
+static int watch_bdrate = 0;
+static uint32_t flashed_ok = 0;
+static uint32_t flashed_failed = 0;
+static volatile sig_atomic_t watch_running = 1;
+
+/* ***** Utility Functions - Start ***** */
+
+static uint64_t watch_now_ms(void)
+{
+  return etx_time_us() / 1000ULL;
+}
+
+static void watch_on_signal(int sig)
+{
+  (void)sig;
+  watch_running = 0;
+}
+
+static ETX_WATCH_BOARD_ *watch_board_find(const char *id)
+{
+  for (int i = 0; i < ETX_WATCH_MAX_BOARDS; i++) {
+    if (boards[i].state != ETX_WATCH_BOARD_FREE && strcmp(boards[i].id, id) == 0) {
+      return &boards[i];
+    }
+  }
+  return NULL;
+}
+
+static ETX_WATCH_BOARD_ *watch_board_alloc(void)
+{
+  ETX_WATCH_BOARD_ *oldest = NULL;
+
+  for (int i = 0; i < ETX_WATCH_MAX_BOARDS; i++) {
+    if (boards[i].state == ETX_WATCH_BOARD_FREE) {
+      return &boards[i];
+    }
+    // recycle the longest finished board that is gone
+    if (boards[i].state == ETX_WATCH_BOARD_DONE && !boards[i].present
+      && (oldest == NULL || boards[i].finished_ms < oldest->finished_ms)) {
+      oldest = &boards[i];
+    }
+  }
+
+  if (oldest != NULL) {
+    memset(oldest, 0, sizeof(ETX_WATCH_BOARD_));
+  }
+  return oldest;
+}
+
+/* Resolve a by-id link to the RS232 port table (it only knows "ttyUSB0" style names) */
+static int watch_resolve_port(const char *id, char *tty, size_t tty_len)
+{
+  char link[PATH_MAX];
+  char target[PATH_MAX];
+
+  snprintf(link, sizeof(link), "%s/%s", watch_dir, id);
+  if (realpath(link, target) == NULL) {
+    return -1;
+  }
+
+  const char *name = strrchr(target, '/');
+  name = (name != NULL) ? name + 1 : target;
+  if (strlen(name) >= tty_len) {
+    return -1;
+  }
+  memcpy(tty, name, strlen(name) + 1);
+
+  return RS232_GetPortnr(tty);
+}
+
+static bool watch_port_in_use(int comport_number)
+{
+  for (int i = 0; i < ETX_WATCH_MAX_BOARDS; i++) {
+    if (boards[i].state == ETX_WATCH_BOARD_FLASHING && boards[i].comport_number == comport_number) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* ***** Utility Functions - End ***** */
+
+/* ***** Board Functions - Start ***** */
+
+static void watch_board_finish(ETX_WATCH_BOARD_ *board, bool ok, const char *why)
+{
+  uint64_t now = watch_now_ms();
+
+  if (board->session != NULL) {
+    etx_session_free(board->session);
+    board->session = NULL;
+    RS232_CloseComport(board->comport_number);
+  }
+
+  board->state = ETX_WATCH_BOARD_DONE;
+  board->success = ok;
+  board->finished_ms = now;
+
+  if (ok) {
+    flashed_ok++;
+  } else {
+    flashed_failed++;
+  }
+
+  printf("[%s] %s on %s after %llu ms%s%s (ok: %u, failed: %u)\r\n",
+         board->id, ok ? "flashed" : "FAILED", board->tty,
+         (unsigned long long)(now - board->appeared_ms),
+         (why != NULL) ? ", " : "", (why != NULL) ? why : "",
+         flashed_ok, flashed_failed);
+}
+
+static void watch_board_open(ETX_WATCH_BOARD_ *board)
+{
+  char mode[] = {'8','N','1',0};
+  uint64_t now = watch_now_ms();
+  ETX_LINK_PROFILE_ profile;
+  bool have_profile = etx_link_profile_load(board->id, &profile);   // tuned adapter
+
+  board->comport_number = watch_resolve_port(board->id, board->tty, sizeof(board->tty));
+  if (board->comport_number >= 0 && !watch_port_in_use(board->comport_number)
+    && RS232_OpenComport(board->comport_number, have_profile ? profile.bdrate : watch_bdrate, mode, 0) == 0) {
+
+    ETX_SESSION_CFG_ cfg = {0};
+    etx_rs232_transport(&cfg.transport, board->comport_number);
+    cfg.tx_gap_us = ETX_TX_BYTE_GAP_US;
+    cfg.start_retries = 1;    // a second START would be taken as a bad frame
+    if (have_profile) {
+      etx_link_profile_apply(&profile, &cfg);
+    }
+
+    RS232_flushRXTX(board->comport_number);
+    board->session = etx_session_start(&cfg, &watch_image, etx_time_us());
+    if (board->session == NULL) {
+      RS232_CloseComport(board->comport_number);
+      watch_board_finish(board, false, "can not start session");
+      return;
+    }
+
+    board->state = ETX_WATCH_BOARD_FLASHING;
+    printf("[%s] appeared on %s, flashing %s...\r\n", board->id, board->tty, watch_image.hash);
+    return;
+  }
+
+  if (now - board->appeared_ms >= ETX_WATCH_OPEN_RETRY_MS) {
+    watch_board_finish(board, false, "can not open port");
+    return;
+  }
+  board->next_open_ms = now + ETX_WATCH_OPEN_STEP_MS;
+}
+
+static void watch_on_appear(const char *id)
+{
+  uint64_t now = watch_now_ms();
+  ETX_WATCH_BOARD_ *board = watch_board_find(id);
+
+  if (board != NULL) {
+    board->present = true;
+
+    if (board->state != ETX_WATCH_BOARD_DONE) {
+      return;   // duplicate event for a board we are already handling
+    }
+    if (board->success && (now - board->finished_ms) < ETX_WATCH_HOLDOFF_MS) {
+      printf("[%s] re-enumerated after flashing, skipped\r\n", id);
+      return;
+    }
+  } else {
+    board = watch_board_alloc();
+    if (board == NULL) {
+      printf("[%s] too many boards, ignored\r\n", id);
+      return;
+    }
+    snprintf(board->id, sizeof(board->id), "%s", id);
+    board->present = true;
+  }
+
+  board->state = ETX_WATCH_BOARD_OPENING;
+  board->appeared_ms = now;
+  board->next_open_ms = now;
+  board->comport_number = -1;
+  board->tty[0] = '\0';
+}
+
+static void watch_on_remove(const char *id)
+{
+  ETX_WATCH_BOARD_ *board = watch_board_find(id);
+  if (board == NULL) {
+    return;
+  }
+
+  board->present = false;
+  if (board->state == ETX_WATCH_BOARD_OPENING) {
+    memset(board, 0, sizeof(ETX_WATCH_BOARD_));   // gone before anything was sent
+  } else if (board->state == ETX_WATCH_BOARD_FLASHING) {
+    watch_board_finish(board, false, "unplugged");
+  }
+}
+
+/* Open pending ports and drive running sessions; true while any work is left */
+static bool watch_run_boards(void)
+{
+  bool active = false;
+  uint64_t now = watch_now_ms();
+
+  for (int i = 0; i < ETX_WATCH_MAX_BOARDS; i++) {
+    ETX_WATCH_BOARD_ *board = &boards[i];
+
+    if (board->state == ETX_WATCH_BOARD_OPENING && now >= board->next_open_ms) {
+      watch_board_open(board);
+    }
+
+    if (board->state == ETX_WATCH_BOARD_FLASHING) {
+      etx_session_io(board->session, ETX_IO_READ | ETX_IO_WRITE, etx_time_us());
+      if (etx_session_done(board->session)) {
+        watch_board_finish(board, etx_session_result(board->session) == ETX_DL_EX_OK, NULL);
+      }
+    }
+
+    if (board->state == ETX_WATCH_BOARD_OPENING || board->state == ETX_WATCH_BOARD_FLASHING) {
+      active = true;
+    }
+  }
+
+  return active;
+}
+
+/* Pick up links created before the watch was (re)established */
+static void watch_scan_dir(void)
+{
+  DIR *d = opendir(watch_dir);
+  if (d == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      watch_on_appear(entry->d_name);
+    }
+  }
+  closedir(d);
+}
+
+/* ***** Board Functions - End ***** */
+
+/**
+ * @brief  Flash every board that appears under dir until SIGINT/SIGTERM
+ * @param  image_path: application binary, framed once up front
+ * @param  dir: directory to watch (ETX_WATCH_DIR)
+ * @param  bdrate: baud rate used when opening ports
+ * @retval exit code
+ */
+int etx_flash_watch(const char *image_path, const char *dir, int bdrate)
+{
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int wd = -1;
+
+  watch_dir = dir;
+  watch_bdrate = bdrate;
+
+  if (!etx_image_load_file(&watch_image, image_path, 0)) {
+    return -1;
+  }
+  printf("Loaded application binary, size: %u bytes, CRC: 0x%08X\r\n", watch_image.size, watch_image.crc);
+
+  int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ifd < 0) {
+    perror("inotify_init1");
+    etx_image_free(&watch_image);
+    return -1;
+  }
+
+  signal(SIGINT, watch_on_signal);
+  signal(SIGTERM, watch_on_signal);
+
+  printf("Watching %s for boards, Ctrl+C to stop\r\n", watch_dir);
+  fflush(stdout);
+
+  bool active = false;
+  bool startup = true;
+
+  while (watch_running) {
+    // the directory only exists while a serial device is plugged in
+    if (wd < 0) {
+      wd = inotify_add_watch(ifd, watch_dir, IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF);
+      if (wd >= 0 && !startup) {
+        watch_scan_dir();
+      }
+    }
+    startup = false;
+
+    struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+    int ready = poll(&pfd, 1, active ? ETX_WATCH_JOB_POLL_MS : ETX_WATCH_POLL_MS);
+
+    if (ready > 0) {
+      ssize_t len;
+      while ((len = read(ifd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len; ) {
+          const struct inotify_event *ev = (const struct inotify_event *)p;
+          p += sizeof(struct inotify_event) + ev->len;
+
+          if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+            wd = -1;    // last device gone, udev removed the directory
+          } else if (ev->len == 0 || ev->name[0] == '.') {
+            continue;   // udev stages links under hidden names
+          } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_on_appear(ev->name);
+          } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            watch_on_remove(ev->name);
+          }
+        }
+      }
+    }
+
+    active = watch_run_boards();
+    fflush(stdout);
+  }
+
+  printf("Stopping watch...\r\n");
+
+  // let running sessions finish, a half written image is worse than a late exit
+  while (watch_run_boards()) {
+    delay(ETX_WATCH_JOB_POLL_MS * 1000);
+  }
+
+  printf("Flashed %u board(s), %u failed\r\n", flashed_ok, flashed_failed);
+
+  close(ifd);
+  etx_image_free(&watch_image);
+
+  return (flashed_failed == 0) ? 0 : 1;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file    etx_image_cache.c
+  * @author  Shiddeshwaran-S
+  * @brief   In-memory cache of application images with pre-encoded frames
+  ******************************************************************************/
+
+#include "etx_image_cache.h"
+
+static ETX_CACHED_IMAGE_ image_cache[ETX_IMAGE_CACHE_SIZE];
+static uint64_t cache_clock = 0;
+
+/* ***** Utility Functions - Start ***** */
+
+static void image_release(ETX_CACHED_IMAGE_ *cached)
+{
+  etx_image_free(&cached->image);
+  memset(cached, 0, sizeof(ETX_CACHED_IMAGE_));
+}
+
+static ETX_CACHED_IMAGE_ *image_slot_get(void)
+{
+  ETX_CACHED_IMAGE_ *victim = NULL;
+
+  for (int i = 0; i < ETX_IMAGE_CACHE_SIZE; i++) {
+    if (image_cache[i].image.wire == NULL) {
+      return &image_cache[i];
+    }
+    if (image_cache[i].refs == 0 && (victim == NULL || image_cache[i].last_used < victim->last_used)) {
+      victim = &image_cache[i];
+    }
+  }
+
+  if (victim == NULL) {
+    printf("Image cache full, all images in use\r\n");
+    return NULL;
+  }
+
+  printf("Image cache full, evicting %s (%s)\r\n", victim->image.hash, victim->path);
+  image_release(victim);
+
+  return victim;
+}
+
+/* ***** Utility Functions - End ***** */
+
+/**
+ * @brief  Load an image into the cache (or refresh it if already cached)
+ * @param  file_path: application binary
+ * @retval cached image, NULL on error
+ */
+ETX_CACHED_IMAGE_ *etx_image_cache_load(const char *file_path)
+{
+  ETX_IMAGE_ image = {0};
+
+  if (!etx_image_load_file(&image, file_path, 0)) {
+    return NULL;
+  }
+
+  ETX_CACHED_IMAGE_ *cached = etx_image_cache_find(image.hash);
+  if (cached != NULL) {
+    // same content, frames are still valid
+    etx_image_free(&image);
+    return cached;
+  }
+
+  cached = image_slot_get();
+  if (cached == NULL) {
+    etx_image_free(&image);
+    return NULL;
+  }
+  cached->image = image;
+  snprintf(cached->path, sizeof(cached->path), "%s", file_path);
+  cached->last_used = ++cache_clock;
+
+  printf("Cached image %s: %s, size: %u bytes, CRC: 0x%08X, %u frames\r\n",
+         image.hash, cached->path, image.size, image.crc, image.frame_count);
+
+  return cached;
+}
+
+/**
+ * @brief  Look up a cached image by hash
+ * @param  hash: hex string as returned in ETX_IMAGE_.hash
+ * @retval cached image, NULL if not cached
+ */
+ETX_CACHED_IMAGE_ *etx_image_cache_find(const char *hash)
+{
+  for (int i = 0; i < ETX_IMAGE_CACHE_SIZE; i++) {
+    if (image_cache[i].image.wire != NULL && strcmp(image_cache[i].image.hash, hash) == 0) {
+      image_cache[i].last_used = ++cache_clock;
+      return &image_cache[i];
+    }
+  }
+  return NULL;
+}
+
+void etx_image_cache_foreach(void (*fn)(const ETX_CACHED_IMAGE_ *cached, void *arg), void *arg)
+{
+  for (int i = 0; i < ETX_IMAGE_CACHE_SIZE; i++) {
+    if (image_cache[i].image.wire != NULL) {
+      fn(&image_cache[i], arg);
+    }
+  }
+}
+
+void etx_image_cache_clear(void)
+{
+  for (int i = 0; i < ETX_IMAGE_CACHE_SIZE; i++) {
+    if (image_cache[i].image.wire != NULL) {
+      image_release(&image_cache[i]);
+    }
+  }
+}
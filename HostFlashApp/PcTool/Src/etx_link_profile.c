@@ -0,0 +1,206 @@
+/**
+  ******************************************************************************
+  * @file    etx_link_profile.c
+  * @author  Shiddeshwaran-S
+  * @brief   Per-adapter link profiles written by tune, loaded on later runs
+  *
+  *          $HOME/.etx_flash_profiles, one adapter per line:
+  *            <by-id name> <baud> <tx_chunk> <tx_gap_us> <ack_timeout_ms> <goodput>
+  ******************************************************************************/
+
+#if defined(__linux__)
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#endif
+
+#include "etx_link_profile.h"
+
+#define ETX_LINK_LINE_LEN   ( ETX_LINK_ID_LEN + 64 )
+
+/* ***** Utility Functions - Start ***** */
+
+static bool profile_path(char *path, size_t len)
+{
+#if defined(__linux__)
+  const char *home = getenv("HOME");
+#else
+  const char *home = getenv("USERPROFILE");
+#endif
+
+  if (home == NULL || home[0] == '\0') {
+    return false;
+  }
+  return snprintf(path, len, "%s/%s", home, ETX_LINK_PROFILE_FILE) < (int)len;
+}
+
+static bool profile_parse(const char *line, ETX_LINK_PROFILE_ *profile)
+{
+  char id[ETX_LINK_ID_LEN];
+  unsigned int chunk, gap, timeout, goodput;
+  int bdrate;
+
+  if (sscanf(line, "%255s %d %u %u %u %u", id, &bdrate, &chunk, &gap, &timeout, &goodput) != 6 || bdrate <= 0) {
+    return false;
+  }
+  memcpy(profile->id, id, strlen(id) + 1);
+  profile->bdrate = bdrate;
+  profile->tx_chunk = chunk;
+  profile->tx_gap_us = gap;
+  profile->ack_timeout_ms = timeout;
+  profile->goodput = goodput;
+  return true;
+}
+
+/* ***** Utility Functions - End ***** */
+
+/**
+ * @brief  Find the /dev/serial/by-id name of a port
+ * @param  tty: port as RS232 knows it, e.g. ttyUSB0
+ * @param  id: by-id link name pointing at it
+ * @param  id_len: size of id
+ * @retval true if a link was found (Linux only, adapters without a serial
+ *         number have none)
+ */
+bool etx_link_profile_id(const char *tty, char *id, size_t id_len)
+{
+#if defined(__linux__)
+  char dev[PATH_MAX], link[PATH_MAX], target[PATH_MAX];
+  struct dirent *entry;
+  bool found = false;
+
+  snprintf(dev, sizeof(dev), "/dev/%s", tty);
+  if (realpath(dev, target) == NULL) {
+    return false;
+  }
+  memcpy(dev, target, strlen(target) + 1);
+
+  DIR *dir = opendir(ETX_WATCH_DIR);
+  if (dir == NULL) {
+    return false;
+  }
+  while (!found && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(link, sizeof(link), "%s/%s", ETX_WATCH_DIR, entry->d_name);
+    if (realpath(link, target) != NULL && strcmp(target, dev) == 0 && strlen(entry->d_name) < id_len) {
+      memcpy(id, entry->d_name, strlen(entry->d_name) + 1);
+      found = true;
+    }
+  }
+  closedir(dir);
+
+  return found;
+#else
+  (void)tty; (void)id; (void)id_len;
+  return false;
+#endif
+}
+
+/**
+ * @brief  Look up the stored profile of an adapter
+ * @param  id: by-id link name
+ * @param  profile: filled in if found
+ * @retval true if the adapter has a profile
+ */
+bool etx_link_profile_load(const char *id, ETX_LINK_PROFILE_ *profile)
+{
+  char path[1024], line[ETX_LINK_LINE_LEN];
+  ETX_LINK_PROFILE_ entry;
+  bool found = false;
+
+  if (!profile_path(path, sizeof(path))) {
+    return false;
+  }
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+  while (!found && fgets(line, sizeof(line), fp) != NULL) {
+    found = profile_parse(line, &entry) && strcmp(entry.id, id) == 0;
+  }
+  fclose(fp);
+
+  if (found) {
+    *profile = entry;
+  }
+
+  return found;
+}
+
+/**
+ * @brief  Store a profile, replacing the adapter's previous one
+ * @param  profile: profile to store
+ * @retval true on success
+ */
+bool etx_link_profile_save(const ETX_LINK_PROFILE_ *profile)
+{
+  char path[1024], tmp_path[1040], line[ETX_LINK_LINE_LEN];
+  ETX_LINK_PROFILE_ other;
+
+  if (!profile_path(path, sizeof(path))) {
+    printf("No home directory to keep link profiles in\r\n");
+    return false;
+  }
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *out = fopen(tmp_path, "w");
+  if (out == NULL) {
+    printf("Failed to write %s\r\n", tmp_path);
+    return false;
+  }
+
+  // keep every other adapter's line as it was
+  FILE *in = fopen(path, "r");
+  if (in != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (profile_parse(line, &other) && strcmp(other.id, profile->id) != 0) {
+        fputs(line, out);
+      }
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %d %u %u %u %u\n", profile->id, profile->bdrate, profile->tx_chunk,
+          profile->tx_gap_us, profile->ack_timeout_ms, profile->goodput);
+
+  if (fclose(out) != 0 || rename(tmp_path, path) != 0) {
+    printf("Failed to write %s\r\n", path);
+    remove(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief  Load the profile of the adapter behind a port, if it was tuned
+ * @param  tty: port as RS232 knows it, e.g. ttyUSB0
+ * @param  profile: filled in if found
+ * @retval true if a profile applies
+ */
+bool etx_link_profile_for_port(const char *tty, ETX_LINK_PROFILE_ *profile)
+{
+  char id[ETX_LINK_ID_LEN];
+
+  if (!etx_link_profile_id(tty, id, sizeof(id)) || !etx_link_profile_load(id, profile)) {
+    return false;
+  }
+  printf("Link profile for %s: %d baud, %u byte writes, %u us gap, %u ms ACK timeout\r\n",
+         profile->id, profile->bdrate, profile->tx_chunk, profile->tx_gap_us, profile->ack_timeout_ms);
+  return true;
+}
+
+/**
+ * @brief  Use a profile's pacing and timeout for a session (the baud rate is
+ *         the caller's, it opens the port)
+ * @param  profile: tuned profile
+ * @param  cfg: session configuration to update
+ * @retval None
+ */
+void etx_link_profile_apply(const ETX_LINK_PROFILE_ *profile, ETX_SESSION_CFG_ *cfg)
+{
+  cfg->tx_gap_us = profile->tx_gap_us;
+  cfg->tx_chunk = profile->tx_chunk;
+  cfg->ack_timeout_ms = profile->ack_timeout_ms;
+}
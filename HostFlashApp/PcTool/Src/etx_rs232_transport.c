@@ -0,0 +1,31 @@
+/**
+  ******************************************************************************
+  * @file    etx_rs232_transport.c
+  * @author  Shiddeshwaran-S
+  * @brief   libetxflash transport over an opened RS232 port
+  ******************************************************************************/
+
+#include "etx_rs232_transport.h"
+
+static int rs232_write(void *ctx, const uint8_t *buf, uint32_t len)
+{
+  return RS232_SendBuf((int)(intptr_t)ctx, (unsigned char *)buf, (int)len);
+}
+
+static int rs232_read(void *ctx, uint8_t *buf, uint32_t len)
+{
+  return RS232_PollComport((int)(intptr_t)ctx, buf, (int)len);
+}
+
+/**
+ * @brief  Bind a session transport to an RS232 port
+ * @param  transport: transport to fill
+ * @param  comport_number: port opened with RS232_OpenComport (non-blocking)
+ * @retval None
+ */
+void etx_rs232_transport(ETX_TRANSPORT_ *transport, int comport_number)
+{
+  transport->write = rs232_write;
+  transport->read = rs232_read;
+  transport->ctx = (void *)(intptr_t)comport_number;
+}